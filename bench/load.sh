@@ -0,0 +1,93 @@
+#!/bin/sh
+#
+# load.sh - Run the end-to-end load benchmarks against a scratch server
+#
+# Starts bin/cyllenian with its own certificate, website and configuration
+# under a temporary $HOME, runs bin/load_bench against it once per scenario,
+# and writes one JSON line per scenario to the given file (or stdout).
+#
+# Usage: bench/load.sh [output file]
+#
+# Settings, from the environment:
+#   BENCH_PORT      Port to run the server on (default 8543)
+#   BENCH_CLIENTS   Clients per scenario (default 8)
+#   BENCH_SECONDS   Seconds per scenario (default 5)
+#   BENCH_CONFIG    File with extra directives for the server, e.g. to
+#                   compare io_uring on and off
+#
+# Run it from the top of the tree, after "make" and "make bin/load_bench"
+# ("make bench" and "make loadbench" do all three).
+
+set -eu
+
+out=${1:-/dev/stdout}
+port=${BENCH_PORT:-8543}
+clients=${BENCH_CLIENTS:-8}
+seconds=${BENCH_SECONDS:-5}
+
+home=$(mktemp -d /tmp/cyllenian-load-XXXXXX)
+server_pid=
+
+cleanup() {
+	if [ -n "$server_pid" ]; then
+		kill -INT "$server_pid" 2>/dev/null || true
+		wait "$server_pid" 2>/dev/null || true
+	fi
+	rm -rf "$home"
+}
+trap cleanup EXIT INT TERM
+
+data="$home/.local/share/cyllenian"
+mkdir -p "$data/website" "$home/.config/cyllenian"
+cp config/website/* "$data/website/"
+
+# A large file, over the default 1MB cache_max_file_size so that it's
+# streamed rather than served from the cache.
+dd if=/dev/urandom of="$data/website/large.bin" bs=1048576 count=4 \
+	2>/dev/null
+
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes \
+	-keyout "$data/key" -out "$data/cert" -days 1 -subj /CN=localhost \
+	2>/dev/null
+
+# keepalive_requests is raised so the keep-alive scenarios measure requests
+# on open connections, rather than having a reconnect every 1000 requests.
+{
+	echo "port $port"
+	echo "keepalive_requests 1000000"
+	if [ -n "${BENCH_CONFIG:-}" ]; then
+		cat "$BENCH_CONFIG"
+	fi
+} > "$home/.config/cyllenian/cyllenian.conf"
+
+HOME="$home" ./bin/cyllenian > "$home/server.log" 2>&1 &
+server_pid=$!
+
+# The warm-up run doubles as waiting for the server to start listening, and
+# fills the cache so the first scenario doesn't pay for it.
+tries=0
+until ./bin/load_bench -p "$port" -P /index.html -c 1 -t 1 -k > /dev/null; do
+	tries=$((tries + 1))
+	if [ "$tries" -ge 10 ]; then
+		echo "Server didn't start, its log follows:" >&2
+		cat "$home/server.log" >&2
+		exit 1
+	fi
+	sleep 1
+done
+
+run() {
+	name=$1
+	shift
+	./bin/load_bench -n "$name" -p "$port" -c "$clients" -t "$seconds" \
+		-s "$server_pid" "$@"
+}
+
+{
+	run keepalive_small -k -P /index.html
+	run new_conn_small -P /index.html
+	run new_conn_resumed -r -P /index.html
+	run keepalive_large -k -P /large.bin
+	run new_conn_large -P /large.bin
+	run not_found_flood -k -P /missing.html
+} > "$out"
@@ -0,0 +1,603 @@
+/**
+ * load_bench.c
+ *
+ * End-to-end TLS load generator.
+ *
+ * OVERVIEW:
+ * Runs a number of clients against a server for a fixed time, each sending
+ * one request at a time for the same path and waiting for the full response
+ * before sending the next. Clients either keep their connection open for
+ * every request, or make a new connection (with a full handshake, or
+ * resuming the previous session) for each one.
+ *
+ * Each client is a process of its own, so the clients don't share a CPU any
+ * more than the machine makes them. They record every request's latency in
+ * memory shared with the parent, which adds them up once they're done.
+ *
+ * LATENCY:
+ * With keep-alive, a request's latency runs from sending it to reading the
+ * last of its response. With a new connection per request, it also includes
+ * connecting and the handshake, since that's what the client waits for.
+ *
+ * OUTPUT:
+ * A single JSON object on one line on stdout, with the requests per second,
+ * latency percentiles in microseconds, and, if given the server's PID, the
+ * memory its processes are using (the resident set size, or RSS):
+ *
+ *   {"scenario":"keepalive_small","clients":8,...,"p99_us":...}
+ *
+ * Run it through bench/load.sh ("make loadbench"), which starts a server to
+ * run it against.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Most latencies recorded per client. Anything past this is counted but not
+ * included in the percentiles. The memory is only touched as it's used, so
+ * this is cheap to make generous.
+ */
+#define MAX_SAMPLES (1 << 22)
+
+/**
+ * Size of the buffer responses are read into, which is also the most header
+ * we'll read.
+ */
+#define RESPONSE_BUFFER_SIZE 16384
+
+/**
+ * Most clients we'll run.
+ */
+#define MAX_CLIENTS 1024
+
+/**
+ * struct options - What to run
+ * @scenario: Name to report the results under
+ * @host: Server to connect to
+ * @port: Port to connect to, as text for getaddrinfo()
+ * @path: Path to request
+ * @clients: Number of clients
+ * @seconds: How long to run for
+ * @keep_alive: Whether to send every request on the same connection
+ * @resume: Whether new connections resume the previous session
+ * @server_pid: Server's PID, to measure its memory use, or 0
+ */
+struct options {
+  const char *scenario;
+  const char *host;
+  const char *port;
+  const char *path;
+  int clients;
+  int seconds;
+  bool keep_alive;
+  bool resume;
+  pid_t server_pid;
+};
+
+/**
+ * struct client_result - What one client did, in shared memory
+ * @requests: Requests answered in full
+ * @errors: Requests that failed, including failed connections
+ * @bytes: Bytes of responses read, headers included
+ * @num_samples: Number of latencies in samples
+ * @samples: Latency of each request in nanoseconds
+ */
+struct client_result {
+  uint64_t requests;
+  uint64_t errors;
+  uint64_t bytes;
+  size_t num_samples;
+  uint64_t samples[MAX_SAMPLES];
+};
+
+/**
+ * struct client - A connection to the server and what it needs to go on
+ * @ctx: Shared SSL context
+ * @address: Address to connect to
+ * @fd: Socket, or -1 while not connected
+ * @ssl: SSL structure, or NULL while not connected
+ * @session: Session to resume the next connection with, or NULL
+ */
+struct client {
+  SSL_CTX *ctx;
+  const struct addrinfo *address;
+  int fd;
+  SSL *ssl;
+  SSL_SESSION *session;
+};
+
+/**
+ * now_ns - Read the monotonic clock
+ *
+ * Return: Nanoseconds since some fixed point
+ */
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * disconnect - Close the client's connection
+ * @client: Client to disconnect
+ * @resume: Whether to keep the session to resume the next connection with
+ *
+ * Sends close_notify first, as a browser would, but doesn't wait for the
+ * server's.
+ */
+static void disconnect(struct client *client, bool resume) {
+  if (client->ssl) {
+    if (resume) {
+      SSL_SESSION *session = SSL_get1_session(client->ssl);
+      if (session) {
+        SSL_SESSION_free(client->session);
+        client->session = session;
+      }
+    }
+    SSL_shutdown(client->ssl);
+    SSL_free(client->ssl);
+    client->ssl = NULL;
+  }
+  if (client->fd != -1) {
+    close(client->fd);
+    client->fd = -1;
+  }
+}
+
+/**
+ * connect_client - Connect and complete the TLS handshake
+ * @client: Client to connect
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int connect_client(struct client *client) {
+  const struct addrinfo *address = client->address;
+  client->fd =
+      socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+  if (client->fd == -1) {
+    return -1;
+  }
+
+  int nodelay = 1;
+  setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  if (connect(client->fd, address->ai_addr, address->ai_addrlen) == -1) {
+    disconnect(client, false);
+    return -1;
+  }
+
+  client->ssl = SSL_new(client->ctx);
+  if (!client->ssl || !SSL_set_fd(client->ssl, client->fd)) {
+    disconnect(client, false);
+    return -1;
+  }
+  if (client->session) {
+    SSL_set_session(client->ssl, client->session);
+  }
+  if (SSL_connect(client->ssl) != 1) {
+    disconnect(client, false);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * find_header - Find a header's value in a response head
+ * @head: Response head, null terminated
+ * @name: Header name followed by a colon, e.g. "Content-Length:"
+ *
+ * Return: Start of the value, or NULL if there's no such header
+ */
+static const char *find_header(const char *head, const char *name) {
+  size_t name_length = strlen(name);
+  for (const char *line = strstr(head, "\r\n"); line;
+       line = strstr(line, "\r\n")) {
+    line += 2;
+    if (strncasecmp(line, name, name_length) == 0) {
+      return line + name_length + strspn(line + name_length, " \t");
+    }
+  }
+  return NULL;
+}
+
+/**
+ * read_response - Read a whole response and throw it away
+ * @client: Connected client that has sent a request
+ * @bytes: Output parameter for the size of the response
+ * @server_closing: Output parameter, whether the server will close the
+ *                  connection after this response
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int read_response(struct client *client, uint64_t *bytes,
+                         bool *server_closing) {
+  char buffer[RESPONSE_BUFFER_SIZE];
+  size_t length = 0;
+  char *head_end = NULL;
+
+  while (!head_end) {
+    if (length == sizeof(buffer) - 1) {
+      return -1;
+    }
+    int result = SSL_read(client->ssl, buffer + length,
+                          (int)(sizeof(buffer) - 1 - length));
+    if (result <= 0) {
+      return -1;
+    }
+    length += (size_t)result;
+    buffer[length] = '\0';
+    head_end = strstr(buffer, "\r\n\r\n");
+  }
+
+  size_t head_length = (size_t)(head_end + 4 - buffer);
+  *head_end = '\0';
+
+  const char *content_length = find_header(buffer, "Content-Length:");
+  size_t body_length = content_length ? strtoull(content_length, NULL, 10) : 0;
+  const char *connection = find_header(buffer, "Connection:");
+  *server_closing =
+      connection && strncasecmp(connection, "close", strlen("close")) == 0;
+
+  size_t body_read = length - head_length;
+  while (body_read < body_length) {
+    size_t wanted = body_length - body_read;
+    int result = SSL_read(client->ssl, buffer,
+                          (int)(wanted < sizeof(buffer) ? wanted
+                                                        : sizeof(buffer)));
+    if (result <= 0) {
+      return -1;
+    }
+    body_read += (size_t)result;
+  }
+
+  *bytes = head_length + body_length;
+  return 0;
+}
+
+/**
+ * run_client - Send requests until time is up
+ * @options: What to run
+ * @ctx: SSL context to connect with
+ * @address: Address to connect to
+ * @result: Where to record what happened
+ */
+static void run_client(const struct options *options, SSL_CTX *ctx,
+                       const struct addrinfo *address,
+                       struct client_result *result) {
+  char request[1024];
+  int request_length = snprintf(
+      request, sizeof(request),
+      "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: load_bench\r\n%s\r\n",
+      options->path, options->host,
+      options->keep_alive ? "" : "Connection: close\r\n");
+
+  struct client client = {ctx, address, -1, NULL, NULL};
+  uint64_t deadline = now_ns() + (uint64_t)options->seconds * 1000000000;
+
+  while (now_ns() < deadline) {
+    if (!client.ssl && options->keep_alive && connect_client(&client) == -1) {
+      result->errors++;
+      continue;
+    }
+
+    uint64_t start = now_ns();
+    if (!client.ssl && connect_client(&client) == -1) {
+      result->errors++;
+      continue;
+    }
+
+    uint64_t bytes = 0;
+    bool server_closing = false;
+    if (SSL_write(client.ssl, request, request_length) != request_length ||
+        read_response(&client, &bytes, &server_closing) == -1) {
+      result->errors++;
+      disconnect(&client, false);
+      continue;
+    }
+
+    uint64_t latency = now_ns() - start;
+    if (result->num_samples < MAX_SAMPLES) {
+      result->samples[result->num_samples++] = latency;
+    }
+    result->requests++;
+    result->bytes += bytes;
+
+    if (!options->keep_alive || server_closing) {
+      disconnect(&client, options->resume);
+    }
+  }
+
+  disconnect(&client, false);
+  SSL_SESSION_free(client.session);
+}
+
+/**
+ * compare_samples - qsort() comparison for latencies
+ */
+static int compare_samples(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * percentile_us - Look up a percentile in sorted latencies
+ * @samples: Latencies in nanoseconds, sorted
+ * @count: Number of latencies
+ * @fraction: Which percentile, e.g. 0.99
+ *
+ * Uses the nearest-rank method: the smallest latency at least fraction of
+ * the latencies are no greater than.
+ *
+ * Return: The percentile in microseconds, or 0 if there are no latencies
+ */
+static double percentile_us(const uint64_t *samples, size_t count,
+                            double fraction) {
+  if (count == 0) {
+    return 0;
+  }
+  size_t rank = (size_t)(fraction * (double)count + 0.999999);
+  if (rank == 0) {
+    rank = 1;
+  }
+  if (rank > count) {
+    rank = count;
+  }
+  return (double)samples[rank - 1] / 1000.0;
+}
+
+/**
+ * read_status_kb - Read a memory figure from /proc/<pid>/status
+ * @pid: Process to read
+ * @field: Field name with its colon, e.g. "VmRSS:"
+ *
+ * Return: The figure in kilobytes, or 0 if it couldn't be read
+ */
+static long read_status_kb(pid_t pid, const char *field) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return 0;
+  }
+
+  long kb = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), file)) {
+    if (strncmp(line, field, strlen(field)) == 0) {
+      kb = strtol(line + strlen(field), NULL, 10);
+      break;
+    }
+  }
+  fclose(file);
+  return kb;
+}
+
+/**
+ * server_memory_kb - Add up a figure over the server and its workers
+ * @pid: The server's PID
+ * @field: Field name with its colon, e.g. "VmRSS:"
+ *
+ * Pages shared between the processes (e.g., the session cache) are counted
+ * once for each process using them, so this is an upper bound.
+ *
+ * Return: The total in kilobytes
+ */
+static long server_memory_kb(pid_t pid, const char *field) {
+  long total = read_status_kb(pid, field);
+
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)pid,
+           (int)pid);
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return total;
+  }
+  int child;
+  while (fscanf(file, "%d", &child) == 1) {
+    total += read_status_kb(child, field);
+  }
+  fclose(file);
+  return total;
+}
+
+/**
+ * usage - Print how to run us and exit
+ * @name: Name we were run as
+ */
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-n scenario] [-H host] [-p port] [-P path] [-c clients]"
+          " [-t seconds] [-k] [-r] [-s server_pid]\n"
+          "  -k  Keep each client's connection open between requests\n"
+          "  -r  Resume the previous session on each new connection\n",
+          name);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * parse_options - Read the command line
+ * @argc: Number of arguments
+ * @argv: Arguments
+ * @options: Options to fill in
+ */
+static void parse_options(int argc, char *argv[], struct options *options) {
+  *options = (struct options){"load", "localhost", "8443", "/", 8, 5, false,
+                              false, 0};
+
+  int option;
+  while ((option = getopt(argc, argv, "n:H:p:P:c:t:krs:")) != -1) {
+    switch (option) {
+    case 'n':
+      options->scenario = optarg;
+      break;
+    case 'H':
+      options->host = optarg;
+      break;
+    case 'p':
+      options->port = optarg;
+      break;
+    case 'P':
+      options->path = optarg;
+      break;
+    case 'c':
+      options->clients = atoi(optarg);
+      break;
+    case 't':
+      options->seconds = atoi(optarg);
+      break;
+    case 'k':
+      options->keep_alive = true;
+      break;
+    case 'r':
+      options->resume = true;
+      break;
+    case 's':
+      options->server_pid = (pid_t)atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (options->clients < 1 || options->clients > MAX_CLIENTS ||
+      options->seconds < 1 || options->path[0] != '/' ||
+      strlen(options->path) > 512 || strlen(options->host) > 256) {
+    usage(argv[0]);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  struct options options;
+  parse_options(argc, argv, &options);
+
+  /*
+   * Writing to a connection the server has closed would otherwise kill the
+   * client, rather than be counted as an error.
+   */
+  signal(SIGPIPE, SIG_IGN);
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *address = NULL;
+  int gai_result = getaddrinfo(options.host, options.port, &hints, &address);
+  if (gai_result != 0) {
+    fprintf(stderr, "Failed to resolve %s: %s\n", options.host,
+            gai_strerror(gai_result));
+    return EXIT_FAILURE;
+  }
+
+  /*
+   * We're measuring the server, not checking who it is, so the certificate
+   * isn't verified. Each client makes its own SSL structures from this
+   * context after forking.
+   */
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  if (!ctx) {
+    fprintf(stderr, "Failed to create SSL context.\n");
+    return EXIT_FAILURE;
+  }
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+
+  size_t results_size = (size_t)options.clients * sizeof(struct client_result);
+  struct client_result *results =
+      mmap(NULL, results_size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (results == MAP_FAILED) {
+    fprintf(stderr, "Failed to map results: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < options.clients; i++) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      fprintf(stderr, "Failed to fork client: %s\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+    if (pid == 0) {
+      run_client(&options, ctx, address, &results[i]);
+      _exit(EXIT_SUCCESS);
+    }
+  }
+  while (wait(NULL) > 0 || errno == EINTR) {
+  }
+  double seconds = (double)(now_ns() - start) / 1e9;
+
+  /*
+   * Measured straight after the run, while the server still holds whatever
+   * the clients made it allocate.
+   */
+  long rss_kb = 0;
+  long peak_rss_kb = 0;
+  if (options.server_pid > 0) {
+    rss_kb = server_memory_kb(options.server_pid, "VmRSS:");
+    peak_rss_kb = server_memory_kb(options.server_pid, "VmHWM:");
+  }
+
+  uint64_t requests = 0;
+  uint64_t errors = 0;
+  uint64_t bytes = 0;
+  size_t num_samples = 0;
+  for (int i = 0; i < options.clients; i++) {
+    requests += results[i].requests;
+    errors += results[i].errors;
+    bytes += results[i].bytes;
+    num_samples += results[i].num_samples;
+  }
+
+  uint64_t *samples =
+      malloc((num_samples ? num_samples : 1) * sizeof(*samples));
+  if (!samples) {
+    fprintf(stderr, "Failed to allocate memory for latencies.\n");
+    return EXIT_FAILURE;
+  }
+  size_t offset = 0;
+  for (int i = 0; i < options.clients; i++) {
+    memcpy(samples + offset, results[i].samples,
+           results[i].num_samples * sizeof(*samples));
+    offset += results[i].num_samples;
+  }
+  qsort(samples, num_samples, sizeof(*samples), compare_samples);
+
+  printf("{\"scenario\":\"%s\",\"path\":\"%s\",\"clients\":%d,"
+         "\"keep_alive\":%s,\"resume\":%s,\"seconds\":%.3f,"
+         "\"requests\":%llu,\"errors\":%llu,\"requests_per_sec\":%.1f,"
+         "\"mb_per_sec\":%.2f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+         "\"p999_us\":%.1f,\"max_us\":%.1f,\"rss_kb\":%ld,"
+         "\"peak_rss_kb\":%ld}\n",
+         options.scenario, options.path, options.clients,
+         options.keep_alive ? "true" : "false",
+         options.resume ? "true" : "false", seconds,
+         (unsigned long long)requests, (unsigned long long)errors,
+         (double)requests / seconds, (double)bytes / seconds / 1e6,
+         percentile_us(samples, num_samples, 0.50),
+         percentile_us(samples, num_samples, 0.99),
+         percentile_us(samples, num_samples, 0.999),
+         num_samples ? (double)samples[num_samples - 1] / 1000.0 : 0.0,
+         rss_kb, peak_rss_kb);
+
+  free(samples);
+  munmap(results, results_size);
+  SSL_CTX_free(ctx);
+  freeaddrinfo(address);
+  return requests > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,400 @@
+/**
+ * micro_bench.c
+ *
+ * Microbenchmarks for the functions every request goes through.
+ *
+ * OVERVIEW:
+ * Times MIME type lookup, path sanitizing, request parsing, path resolution,
+ * header building and the file cache (both serving a cached file and reading
+ * one in, which replaced reading every file from disk per request). Each
+ * case is run with the server's own code, linked in from src/.
+ *
+ * The cache and path resolution need a website directory, so we make a
+ * scratch one under a temporary $HOME and remove it when we're done.
+ *
+ * OUTPUT:
+ * One JSON object per line for each case, on stdout (or in the file given as
+ * the only argument), so results can be kept and compared between releases:
+ *
+ *   {"benchmark":"mime_lookup","case":"html","iterations":...,"ns_per_op":...}
+ *
+ * METHOD:
+ * Each case is run with twice as many iterations each time until a run
+ * takes at least BENCH_MIN_NS, and the fastest of BENCH_REPEATS such runs is
+ * reported. The fastest run is the one least disturbed by everything else
+ * the machine was doing, which makes it the most repeatable.
+ *
+ * Build and run it with "make bench". It's built with optimizations on, as
+ * the server would be in production.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "config.h"
+#include "log.h"
+#include "mime.h"
+#include "paths_security.h"
+#include "request.h"
+#include "response.h"
+#include "vhost.h"
+
+/**
+ * Shortest a timed run may take, in nanoseconds.
+ */
+#define BENCH_MIN_NS 200000000.0
+
+/**
+ * Number of timed runs of each case, of which the fastest is reported.
+ */
+#define BENCH_REPEATS 3
+
+/**
+ * Sizes of the files in the scratch website directory. The large one is
+ * still small enough to be cached.
+ */
+#define SMALL_FILE_SIZE 1024
+#define LARGE_FILE_SIZE 65536
+
+/*
+ * volatile so the compiler can't decide the results aren't used and skip
+ * the work.
+ */
+static volatile size_t sink = 0;
+
+/*
+ * Scratch $HOME holding the website directory.
+ */
+static char scratch_home[] = "/tmp/cyllenian-bench-XXXXXX";
+
+/**
+ * A request head like a browser sends, and one like curl sends.
+ */
+static const char browser_request[] =
+    "GET /assets/css/site.min.css?v=20240101 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 "
+    "Firefox/128.0\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Language: en-GB,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "Connection: keep-alive\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "If-None-Match: \"5f3a-1a2b3c4d\"\r\n"
+    "If-Modified-Since: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+    "\r\n";
+static const char curl_request[] = "GET / HTTP/1.1\r\n"
+                                   "Host: localhost\r\n"
+                                   "User-Agent: curl/8.5.0\r\n"
+                                   "Accept: */*\r\n"
+                                   "\r\n";
+
+/**
+ * elapsed_ns - Get the time between two readings of the clock
+ * @start: Earlier reading
+ * @end: Later reading
+ *
+ * Return: Nanoseconds from start to end
+ */
+static double elapsed_ns(struct timespec start, struct timespec end) {
+  return (double)(end.tv_sec - start.tv_sec) * 1e9 +
+         (double)(end.tv_nsec - start.tv_nsec);
+}
+
+/**
+ * run_case - Time a case and print the result
+ * @out: Where to print the result
+ * @benchmark: Name of what's being timed
+ * @name: Name of the case
+ * @run: Runs the case the given number of times
+ * @arg: Passed to run
+ *
+ * run loops over the iterations itself, so we don't time an indirect call
+ * per iteration.
+ */
+static void run_case(FILE *out, const char *benchmark, const char *name,
+                     void (*run)(const void *arg, long iterations),
+                     const void *arg) {
+  double best_ns = 0;
+  long best_iterations = 0;
+
+  for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+    for (long iterations = 1;; iterations *= 2) {
+      struct timespec start;
+      struct timespec end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      run(arg, iterations);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+
+      double ns = elapsed_ns(start, end);
+      if (ns >= BENCH_MIN_NS) {
+        double per_op = ns / (double)iterations;
+        if (best_iterations == 0 || per_op < best_ns) {
+          best_ns = per_op;
+          best_iterations = iterations;
+        }
+        break;
+      }
+    }
+  }
+
+  fprintf(out,
+          "{\"benchmark\":\"%s\",\"case\":\"%s\",\"iterations\":%ld,"
+          "\"ns_per_op\":%.2f}\n",
+          benchmark, name, best_iterations, best_ns);
+  fflush(out);
+}
+
+static void run_mime_lookup(const void *arg, long iterations) {
+  for (long i = 0; i < iterations; i++) {
+    sink += (size_t)mime_lookup(arg)->header[0];
+  }
+}
+
+static void run_sanitize(const void *arg, long iterations) {
+  const char *path = arg;
+  size_t length = strlen(path);
+  char buffer[PATH_MAX];
+  for (long i = 0; i < iterations; i++) {
+    size_t sanitized_length = 0;
+    sink += (size_t)sanitize_request_path(buffer, sizeof(buffer), path, length,
+                                          &sanitized_length);
+    sink += sanitized_length;
+  }
+}
+
+static void run_request_parse(const void *arg, long iterations) {
+  const char *head = arg;
+  size_t length = strlen(head);
+  struct http_request request;
+  for (long i = 0; i < iterations; i++) {
+    request_reset(&request);
+    sink += (size_t)request_parse(&request, head, length);
+    sink += request.head_length;
+  }
+}
+
+/**
+ * parse_or_exit - Parse a request head the benchmarks need
+ * @request: Request to fill in
+ * @head: Complete request head
+ */
+static void parse_or_exit(struct http_request *request, const char *head) {
+  request_reset(request);
+  if (request_parse(request, head, strlen(head)) != PARSE_COMPLETE) {
+    fprintf(stderr, "Benchmark request failed to parse.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void run_resolve(const void *arg, long iterations) {
+  struct http_request request;
+  parse_or_exit(&request, arg);
+
+  char path_storage[PATH_MAX];
+  for (long i = 0; i < iterations; i++) {
+    char *path_buffer = path_storage;
+    enum path_result path_result = PATH_OK;
+    int response_code = 0;
+    get_requested_file_path(&path_buffer, &request,
+                            vhost_website_path(&request, NULL), &path_result);
+    determine_response_code(&request, PARSE_COMPLETE, path_result,
+                            path_buffer, &response_code);
+    sink += (size_t)response_code;
+  }
+}
+
+static void run_format_header(const void *arg, long iterations) {
+  const char *extra_headers = arg;
+  int response_code = extra_headers ? 206 : 200;
+  char header[MAX_HEADER];
+  for (long i = 0; i < iterations; i++) {
+    sink += (size_t)format_header(header, response_code, "/index.html",
+                                  SMALL_FILE_SIZE, true, extra_headers);
+    sink += (size_t)header[0];
+  }
+}
+
+static void run_cache_hit(const void *arg, long iterations) {
+  for (long i = 0; i < iterations; i++) {
+    struct cache_entry *entry = cache_get(arg, 200, VARIANT_IDENTITY);
+    sink += entry ? entry->size : 0;
+    cache_release(entry);
+  }
+}
+
+static void run_cache_miss(const void *arg, long iterations) {
+  for (long i = 0; i < iterations; i++) {
+    cache_clear();
+    struct cache_entry *entry = cache_get(arg, 200, VARIANT_IDENTITY);
+    sink += entry ? entry->size : 0;
+    cache_release(entry);
+  }
+}
+
+/**
+ * write_file - Create a file full of one byte
+ * @path: Path of the file
+ * @size: Size of the file
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int write_file(const char *path, size_t size) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    return -1;
+  }
+  for (size_t i = 0; i < size; i++) {
+    fputc('a' + (int)(i % 26), file);
+  }
+  return fclose(file);
+}
+
+/**
+ * scratch_path - Build a path inside the scratch $HOME
+ * @buffer: Output buffer of PATH_MAX bytes
+ * @relative: Path relative to the scratch $HOME
+ *
+ * Return: buffer
+ */
+static char *scratch_path(char buffer[PATH_MAX], const char *relative) {
+  snprintf(buffer, PATH_MAX, "%s/%s", scratch_home, relative);
+  return buffer;
+}
+
+/*
+ * Directories of the scratch website, parents first, and the files in it.
+ */
+static const char *scratch_dirs[] = {".local", ".local/share",
+                                     ".local/share/cyllenian",
+                                     ".local/share/cyllenian/website"};
+static const char *small_file = ".local/share/cyllenian/website/index.html";
+static const char *large_file = ".local/share/cyllenian/website/large.html";
+
+/**
+ * setup_website - Make a scratch website and point the server's paths at it
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int setup_website(void) {
+  if (!mkdtemp(scratch_home) || setenv("HOME", scratch_home, 1) == -1) {
+    return -1;
+  }
+
+  char path[PATH_MAX];
+  for (size_t i = 0; i < sizeof(scratch_dirs) / sizeof(scratch_dirs[0]);
+       i++) {
+    if (mkdir(scratch_path(path, scratch_dirs[i]), 0700) == -1) {
+      return -1;
+    }
+  }
+  if (write_file(scratch_path(path, small_file), SMALL_FILE_SIZE) == -1 ||
+      write_file(scratch_path(path, large_file), LARGE_FILE_SIZE) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * remove_website - Remove the scratch website, children first
+ */
+static void remove_website(void) {
+  char path[PATH_MAX];
+  unlink(scratch_path(path, small_file));
+  unlink(scratch_path(path, large_file));
+  for (size_t i = sizeof(scratch_dirs) / sizeof(scratch_dirs[0]); i > 0;
+       i--) {
+    rmdir(scratch_path(path, scratch_dirs[i - 1]));
+  }
+  rmdir(scratch_home);
+}
+
+int main(int argc, char *argv[]) {
+  FILE *out = stdout;
+  if (argc > 1) {
+    out = fopen(argv[1], "w");
+    if (!out) {
+      fprintf(stderr, "Failed to open %s: %s\n", argv[1], strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  /*
+   * The server's own log lines (e.g., from mime_init()) are held in memory
+   * rather than being mixed into our results.
+   */
+  log_start_batching();
+
+  if (setup_website() == -1) {
+    fprintf(stderr, "Failed to create scratch website: %s\n",
+            strerror(errno));
+    remove_website();
+    return EXIT_FAILURE;
+  }
+  if (config_init() == -1 || mime_init() == -1) {
+    remove_website();
+    return EXIT_FAILURE;
+  }
+
+  run_case(out, "mime_lookup", "html", run_mime_lookup, "/index.html");
+  run_case(out, "mime_lookup", "nested_js", run_mime_lookup,
+           "/assets/js/vendor/app.min.js");
+  run_case(out, "mime_lookup", "uppercase", run_mime_lookup,
+           "/photos/IMG_0001.JPEG");
+  run_case(out, "mime_lookup", "no_extension", run_mime_lookup, "/LICENSE");
+
+  run_case(out, "sanitize_request_path", "short", run_sanitize,
+           "/index.html");
+  run_case(out, "sanitize_request_path", "long", run_sanitize,
+           "/docs/reference/api/v2/endpoints/authentication/"
+           "oauth2-refresh.html");
+  run_case(out, "sanitize_request_path", "escaped", run_sanitize,
+           "/files/My%20Documents/Quarterly%20Report%20%28Final%29.pdf");
+  run_case(out, "sanitize_request_path", "traversal", run_sanitize,
+           "/static/..%2f..%2f..%2fetc/passwd");
+
+  run_case(out, "request_parse", "curl", run_request_parse, curl_request);
+  run_case(out, "request_parse", "browser", run_request_parse,
+           browser_request);
+
+  run_case(out, "resolve", "found", run_resolve,
+           "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n");
+  run_case(out, "resolve", "not_found", run_resolve,
+           "GET /missing.html HTTP/1.1\r\nHost: localhost\r\n\r\n");
+
+  run_case(out, "format_header", "full", run_format_header, NULL);
+  run_case(out, "format_header", "range", run_format_header,
+           "Content-Range: bytes 0-511/1024\r\n");
+
+  /*
+   * The cache keys files by their full path, the same as the server
+   * resolves them to.
+   */
+  char small_path[PATH_MAX];
+  char large_path[PATH_MAX];
+  scratch_path(small_path, small_file);
+  scratch_path(large_path, large_file);
+  run_case(out, "cache_get", "hit_small", run_cache_hit, small_path);
+  run_case(out, "cache_get", "hit_large", run_cache_hit, large_path);
+  run_case(out, "cache_get", "miss_small", run_cache_miss, small_path);
+  run_case(out, "cache_get", "miss_large", run_cache_miss, large_path);
+
+  cache_clear();
+  remove_website();
+  config_cleanup();
+  if (out != stdout) {
+    fclose(out);
+  }
+  return sink == 0;
+}
@@ -0,0 +1,183 @@
+/**
+ * cache.h
+ *
+ * In-memory cache of the files we serve, along with their response headers.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "fd_cache.h"
+#include "response.h"
+
+/**
+ * How often, in seconds, a cached file is checked against the filesystem.
+ * Between checks a cache hit doesn't touch the filesystem at all, so a file
+ * that changes on disk may be served stale for up to this long.
+ */
+#define CACHE_REVALIDATE_INTERVAL 1
+
+/**
+ * Number of hash table buckets we start with, this must be a power of two.
+ * The table doubles in size whenever it holds more entries than buckets.
+ */
+#define CACHE_INITIAL_BUCKETS 256
+
+/**
+ * Buffer size for an ETag, which is three hexadecimal numbers in quotes.
+ */
+#define MAX_ETAG 64
+
+/**
+ * The versions of a file we can send, each of which is cached separately.
+ *
+ * VARIANT_IDENTITY: The file as it is
+ * VARIANT_BROTLI: The file's precompressed .br sibling
+ * VARIANT_GZIP: The file's precompressed .gz sibling
+ * VARIANT_GZIP_GENERATED: The file compressed with gzip when it was loaded
+ */
+enum cache_variant {
+  VARIANT_IDENTITY,
+  VARIANT_BROTLI,
+  VARIANT_GZIP,
+  VARIANT_GZIP_GENERATED
+};
+
+/**
+ * struct prebuilt_header - A complete response header built ahead of time
+ * @text: The header, ending with the blank line
+ * @length: Length of text
+ */
+struct prebuilt_header {
+  char *text;
+  size_t length;
+};
+
+/**
+ * struct cache_entry - A file's contents and everything needed to send it
+ *
+ * Entries are reference counted, since a connection may still be sending an
+ * entry when it is evicted or replaced by a newer version of the file. An
+ * entry that's no longer in the cache is freed when its last user releases
+ * it.
+ *
+ * Files too large to cache still get an entry, it just never goes into the
+ * cache and is freed as soon as the response has been sent. Such an entry
+ * holds the open file instead of its contents, and the body is read from it
+ * as it's sent (or sent with SSL_sendfile() if the kernel is doing the
+ * encryption).
+ */
+struct cache_entry {
+  char *path;
+  int response_code;
+  enum cache_variant variant;
+  uint32_t hash;
+
+  /*
+   * The file the contents come from, which is the .br or .gz sibling of path
+   * for the precompressed variants and path itself otherwise.
+   */
+  char *source_path;
+
+  unsigned char *data;
+  size_t size;
+
+  /*
+   * Open file to send the body from when data is NULL, held from the open
+   * file cache, and its descriptor (-1 when the body is in data).
+   */
+  struct open_file *file;
+  int fd;
+
+  /*
+   * Complete response headers for this file and response code, indexed by
+   * whether the connection is being kept alive, so serving a hit doesn't build
+   * anything. not_modified holds the 304 headers for files served with 200,
+   * for clients that already have the current version.
+   */
+  struct prebuilt_header headers[2];
+  struct prebuilt_header not_modified[2];
+
+  /*
+   * Validators that let clients check whether their copy is current, and the
+   * header lines carrying them (along with Cache-Control) which partial
+   * responses have to include too. These are only set for files served with
+   * 200, there's no point in clients caching our error pages.
+   */
+  char last_modified[HTTP_DATE_MAX];
+  char etag[MAX_ETAG];
+  char *validator_lines;
+
+  /*
+   * What the file looked like when we read it, and when we last checked that
+   * it still looks that way.
+   */
+  struct timespec mtime;
+  off_t file_size;
+  dev_t dev;
+  ino_t ino;
+  time_t validated;
+
+  /*
+   * For the identity variant of a file served with 200, whether it has
+   * precompressed siblings and whether it's worth compressing ourselves.
+   * The siblings are checked for whenever the file is revalidated.
+   */
+  bool has_brotli;
+  bool has_gzip;
+  bool compressible;
+
+  int refs;
+  bool cached;
+
+  /*
+   * Next entry in the same hash bucket, and neighbours in the least recently
+   * used list.
+   */
+  struct cache_entry *bucket_next;
+  struct cache_entry *lru_prev;
+  struct cache_entry *lru_next;
+};
+
+/**
+ * Returns the given variant of file_path served with response_code, reading
+ * the file into the cache first if it isn't already there or has changed on
+ * disk. The caller holds a reference to the entry until it calls
+ * cache_release().
+ *
+ * If the file is too large to cache, the entry holds the open file in fd
+ * rather than reading it into data.
+ *
+ * Return: Pointer to the entry, or NULL if the file couldn't be read
+ */
+struct cache_entry *cache_get(const char *file_path, int response_code,
+                              enum cache_variant variant);
+
+/**
+ * Drops a reference obtained from cache_get(). Passing NULL does nothing.
+ */
+void cache_release(struct cache_entry *entry);
+
+/**
+ * Empties the cache, so that every file is read again (and its headers built
+ * again) the next time it's served. Entries still being sent are freed once
+ * they've been released.
+ */
+void cache_clear(void);
+
+/**
+ * Checks whether file_path is cached with response_code and was found on disk
+ * within the last CACHE_REVALIDATE_INTERVAL seconds, in which case there's no
+ * need to check that it exists.
+ *
+ * Return: true if the file is known to exist
+ */
+bool cache_is_fresh(const char *file_path, int response_code);
+
+#endif
@@ -8,8 +8,9 @@
  * server settings.
  *
  * CONFIGURATION STRUCTURE:
- * Contains all runtime settings that can be configured via command-line
- * arguments or defaults.
+ * Contains all runtime settings that can be configured via the configuration
+ * file, command-line arguments or defaults. Command-line arguments take
+ * precedence over the file, which takes precedence over the defaults.
  *
  * Our server_config instance is a singleton. If functions in other files need
  * to access it, they get a pointer to it with config_get_ctx: this is a cleaner
@@ -22,6 +23,59 @@
 
 #include <stdbool.h>
 
+/**
+ * Longest line we accept in the configuration file.
+ */
+#define CONFIG_LINE_MAX 1024
+
+/**
+ * Longest file extension a cache_control directive can name.
+ */
+#define MAX_CACHE_CONTROL_EXTENSION 16
+
+/**
+ * struct cache_control_rule - Cache-Control value for files of one type
+ * @extension: File extension without the dot, or "*" for every other file
+ * @value: Value of the Cache-Control header, e.g. "max-age=86400"
+ */
+struct cache_control_rule {
+  char extension[MAX_CACHE_CONTROL_EXTENSION];
+  char *value;
+};
+
+/**
+ * Longest server name a vhost directive can give, which is the longest name
+ * DNS allows.
+ */
+#define MAX_VHOST_NAME 253
+
+/**
+ * Most vhost directives we accept.
+ */
+#define MAX_VHOSTS 1024
+
+/**
+ * struct vhost_config - A website served for one server name
+ * @name: Server name in lowercase, e.g. "example.com"
+ * @root: Absolute path of the website directory, with a trailing slash
+ * @cert_path: Certificate chain for the name, or NULL to use cert
+ * @key_path: Private key for cert_path, or NULL
+ */
+struct vhost_config {
+  char *name;
+  char *root;
+  char *cert_path;
+  char *key_path;
+};
+
+/**
+ * How requests are written to the log.
+ *
+ * LOG_FORMAT_DEFAULT: Our own format, like every other log line
+ * LOG_FORMAT_COMBINED: The Combined Log Format used by Apache and nginx
+ */
+enum log_format { LOG_FORMAT_DEFAULT, LOG_FORMAT_COMBINED };
+
 /**
  * This structure holds all configurable server settings. Default values for
  * each field are set in config_init.
@@ -29,16 +83,204 @@
 struct server_config {
   char *cert_path;
   char *key_path;
+
+  /*
+   * An ECDSA certificate and key to offer alongside the one above (usually
+   * RSA), or NULL. Clients that support ECDSA get it, since its handshake is
+   * much cheaper for us, and older clients still get the other one.
+   */
+  char *ecdsa_cert_path;
+  char *ecdsa_key_path;
+
+  /*
+   * DER-encoded OCSP responses to staple to the handshakes for the
+   * certificates above, or NULL to not staple one. Each is checked for
+   * changes every OCSP_CHECK_INTERVAL seconds, so refreshing the file is
+   * enough to start stapling the new response.
+   */
+  char *ocsp_response;
+  char *ecdsa_ocsp_response;
+
+  /*
+   * OpenSSL lists of the TLS 1.3 ciphersuites, TLS 1.2 ciphers and key
+   * exchange groups to offer, most preferred first, or NULL to choose them
+   * for this machine's CPU.
+   */
+  char *tls_ciphersuites;
+  char *tls_ciphers;
+  char *tls_groups;
+
+  /*
+   * OpenSSL provider to load and prefer for cryptography, e.g. one driving
+   * a hardware accelerator, or NULL for OpenSSL's own. tls_async lets a
+   * handshake wait for the provider's work to finish without holding up the
+   * worker's other connections (SSL_MODE_ASYNC).
+   */
+  char *tls_provider;
+  bool tls_async;
   int port;
+  int workers;
+
+  /*
+   * Address to listen on, or NULL for every IPv6 and IPv4 address, and the
+   * length of the queue of connections waiting to be accepted.
+   *
+   * reuseport gives each worker a listening socket of its own, so workers
+   * don't contend for one accept queue, and cpu_affinity pins each worker to
+   * a CPU of its own (and steers connections to the worker on the CPU that
+   * received them).
+   *
+   * defer_accept is how many seconds the kernel may wait for the client's
+   * first data before handing us the connection (TCP_DEFER_ACCEPT), and
+   * fastopen how many TCP Fast Open requests may be pending (TCP_FASTOPEN).
+   * 0 turns either off.
+   */
+  char *listen_address;
+  int backlog;
+  bool reuseport;
+  bool cpu_affinity;
+  int defer_accept;
+  int fastopen;
+
+  /*
+   * Whether workers wait for events with io_uring rather than epoll. Workers
+   * fall back to epoll if io_uring can't be used.
+   */
+  bool io_uring;
+
   bool log_to_file;
+  enum log_format log_format;
+
+  /*
+   * Seconds a connection may sit idle before we close it, and the most
+   * requests we'll serve on one connection before closing it.
+   */
+  int keepalive_timeout;
+  int keepalive_requests;
+
+  /*
+   * Seconds a worker shutting down gracefully (on SIGQUIT) waits for its open
+   * requests to finish before it gives up on them.
+   */
+  int drain_timeout;
+
+  /*
+   * Seconds a client may take over its TLS handshake, and over sending the
+   * headers of a request once it's started, before we close the connection.
+   */
+  int handshake_timeout;
+  int header_timeout;
+
+  /*
+   * Most connections one client address (or IPv6 /64) may have open across
+   * all workers, and the requests per second it may make with bursts of up
+   * to request_burst. 0 turns either limit off.
+   */
+  int max_connections_per_ip;
+  int request_rate;
+  int request_burst;
+
+  /*
+   * Memory each worker may use for cached files in megabytes, and the largest
+   * file we'll cache in kilobytes. A cache_size of 0 disables the cache.
+   */
+  int cache_size;
+  int cache_max_file_size;
+
+  /*
+   * Whether to have the kernel encrypt responses (kTLS) so that files can be
+   * sent with sendfile().
+   */
+  bool ktls;
+
+  /*
+   * Whether to send the precompressed .br and .gz siblings of files to
+   * clients that accept them, whether to gzip other text files ourselves when
+   * there's no sibling, and the zlib compression level (1-9) to do it with.
+   */
+  bool precompressed;
+  bool gzip;
+  int gzip_level;
+
+  /*
+   * Whether each worker indexes the website directory when it starts, so
+   * that finding files and checking cached ones doesn't touch the filesystem.
+   */
+  bool route_index;
+
+  /*
+   * Number of open file descriptors each worker keeps for files it has
+   * served, so that finding and opening a file again is one lookup. 0 opens
+   * every file afresh.
+   */
+  int open_file_cache;
+
+  /*
+   * mime.types file with types to add to the built-in ones, or NULL.
+   */
+  char *mime_types;
+
+  /*
+   * Number of TLS sessions kept in the cache the workers share (0 disables
+   * it), how many seconds a session can be resumed for, and whether to hand
+   * out session tickets. The ticket key is also replaced every
+   * session_timeout seconds.
+   */
+  int session_cache;
+  int session_timeout;
+  bool session_tickets;
+
+  /*
+   * Path at which workers serve their metrics to clients connecting from a
+   * loopback address, or NULL to not collect metrics at all.
+   */
+  char *metrics_path;
+
+  /*
+   * Cache-Control headers to send, set with one cache_control directive per
+   * extension.
+   */
+  struct cache_control_rule *cache_control_rules;
+  int num_cache_control_rules;
+
+  /*
+   * Websites served for other server names than the default website, set
+   * with one vhost directive each.
+   */
+  struct vhost_config *vhosts;
+  int num_vhosts;
 };
 
 // Get pointer to global configuration
 struct server_config *config_get_ctx(void);
 
-// Frees the memory allocated for cert_path and key_path
+// Frees the memory allocated for the paths, lists, cache_control_rules and
+// vhosts
 void config_cleanup(void);
 
+/**
+ * config_reload - Read the configuration file again
+ *
+ * Settings that are used as requests are served (keep-alive and cache limits,
+ * compression, Cache-Control, log_format) take the values now in the file.
+ * Everything else, and anything given on the command line, only takes effect
+ * at startup and keeps its current value. If the file can't be read or is
+ * invalid, the current configuration is kept as it is.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int config_reload(void);
+
+/**
+ * config_get_cache_control - Look up the Cache-Control value for a file
+ *
+ * Uses the rule for the file's extension (compared case-insensitively), or
+ * the "*" rule if there's no rule for it.
+ *
+ * Return: Header value, or NULL if no Cache-Control header should be sent
+ */
+const char *config_get_cache_control(const char *file_path);
+
 /**
  * config_init - Initialize server_config instance with defaults
  *
@@ -49,4 +291,16 @@ void config_cleanup(void);
  */
 int config_init(void);
 
+/**
+ * config_load_file - Apply settings from the configuration file
+ *
+ * Reads ~/.config/cyllenian/cyllenian.conf, or /etc/cyllenian/cyllenian.conf
+ * if the user doesn't have one. Each line holds a directive name and its
+ * value separated by whitespace, and lines starting with '#' are comments. A
+ * missing file is not an error, as every setting has a default.
+ *
+ * Return: 0 on success, -1 if the file contains an invalid directive
+ */
+int config_load_file(void);
+
 #endif
@@ -0,0 +1,221 @@
+/**
+ * connection.h
+ *
+ * Per-connection state for clients being served by the event loop.
+ */
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "cache.h"
+#include "error_page.h"
+#include "request.h"
+
+/**
+ * The most data a single TLS record can hold.
+ */
+#define TLS_RECORD_SIZE 16384
+
+/**
+ * Size of the chunks we read files too large to cache in, which is one full
+ * TLS record per chunk. The chunk buffer is also where the header and the
+ * start of the body are put together to go out as the first record.
+ */
+#define STREAM_CHUNK_SIZE TLS_RECORD_SIZE
+
+/**
+ * Size of the request buffer each connection starts with, which is enough for
+ * all but the largest requests. Buffers grow up to REQUEST_HEAD_MAX for
+ * requests that don't fit.
+ */
+#define REQUEST_BUFFER_SIZE 8192
+
+/**
+ * Stages a connection moves through. The event loop calls handle_client()
+ * whenever the socket becomes ready, and it picks up from whichever stage the
+ * connection was left in when it last had to wait for the client.
+ */
+enum connection_state {
+  CONN_HANDSHAKE,
+  CONN_READING,
+  CONN_WRITING,
+  CONN_SHUTDOWN
+};
+
+/**
+ * Deadlines a connection can be under, for stages a client could otherwise
+ * drag out to hold the connection open: finishing the handshake, and sending
+ * the rest of a request's headers once it's started.
+ */
+enum connection_deadline {
+  DEADLINE_NONE,
+  DEADLINE_HANDSHAKE,
+  DEADLINE_HEADER
+};
+
+/**
+ * struct connection - Everything we need to resume serving a client
+ *
+ * With non-blocking sockets, any read or write can stop partway through
+ * because the client isn't ready yet. Anything that used to live on the stack
+ * in handle_client() has to survive until the socket is ready again, so it
+ * lives here instead.
+ */
+struct connection {
+  int fd;
+  SSL *ssl;
+  enum connection_state state;
+
+  /*
+   * The client's IP address as text, for the access log, and whether it's a
+   * loopback address, which is the only kind allowed to read our metrics.
+   */
+  char client_address[INET6_ADDRSTRLEN];
+  bool loopback;
+
+  /*
+   * The request read so far, and what the parser has made of it. The parsed
+   * request points into request_buffer, which holds request_capacity bytes
+   * and is NULL while no request is arriving.
+   *
+   * Clients may send their next request before we've answered the current
+   * one (pipelining), so the buffer can hold more than one request. The
+   * current one is the first request.head_length bytes.
+   */
+  char *request_buffer;
+  size_t request_capacity;
+  size_t request_length;
+  struct http_request request;
+  enum parse_result parse_result;
+
+  /*
+   * Whether to wait for another request once this response is sent, and how
+   * many responses we've sent on this connection so far.
+   */
+  bool keep_alive;
+  int requests_served;
+
+  /*
+   * The response being sent, and how much of each part has been written. The
+   * header and body point into the cache entry, which we hold a reference to
+   * until the response has been sent.
+   *
+   * Headers that only apply to this response (e.g. for part of a file) are
+   * built in header_buffer instead, a MAX_HEADER byte buffer which we own.
+   * body_offset is where in the file the body starts, which is only non-zero
+   * for part of a file.
+   *
+   * Errors are sent from error_response instead of a cache entry, as a header
+   * that the whole response is in, with no body.
+   */
+  struct cache_entry *entry;
+  struct error_response *error_response;
+  char *header_buffer;
+  const char *header;
+  size_t header_length;
+  size_t header_sent;
+  const unsigned char *body;
+  size_t body_offset;
+  size_t body_length;
+  size_t body_sent;
+  int response_code;
+
+  /*
+   * Size of the whole response as the log reports it, and whether we've
+   * corked the socket for a response that takes more than one write.
+   */
+  size_t response_size;
+  bool corked;
+
+  /*
+   * The metrics text, for a request for the metrics endpoint. The body
+   * points into it.
+   */
+  char *metrics_body;
+
+  /*
+   * When the handshake and the current response's sending started, and the
+   * time spent parsing the current request so far, all from metrics_clock()
+   * (and so all 0 if metrics are disabled).
+   */
+  uint64_t handshake_start;
+  uint64_t send_start;
+  uint64_t parse_time;
+
+  /*
+   * Buffer for streaming files that aren't cached, and for the first record
+   * of any response with a body, got the first time a response needs it and
+   * given back once the response has been sent. chunk_length is how much of
+   * the file is in it, and chunk_sent how much of that has been written.
+   */
+  unsigned char *chunk_buffer;
+  size_t chunk_length;
+  size_t chunk_sent;
+
+  /*
+   * When the connection last made progress, and its neighbours in the event
+   * loop's list of connections ordered by that time. Used to close
+   * connections that have been idle for too long.
+   */
+  time_t last_active;
+  struct connection *prev;
+  struct connection *next;
+
+  /*
+   * The deadline the connection is under, when it passes, which request it
+   * was set for, and its neighbours in the event loop's list of connections
+   * under the same deadline.
+   */
+  enum connection_deadline deadline;
+  time_t deadline_at;
+  int deadline_request;
+  struct connection *deadline_prev;
+  struct connection *deadline_next;
+
+  /*
+   * The connection's slot in the table of per-client limits, which it's
+   * counted in until it's freed.
+   */
+  int limit_slot;
+
+  /*
+   * With io_uring, whether the connection's multishot poll is armed, and
+   * whether the connection has been closed and is only waiting for the
+   * poll's cancellation to complete before being freed.
+   */
+  bool polling;
+  bool closing;
+
+  /*
+   * With tls_async, whether any descriptors of the connection's async jobs
+   * have been registered with epoll.
+   */
+  bool watching_async;
+};
+
+/**
+ * Allocates a connection for a freshly accepted client socket and creates its
+ * SSL structure. The connection starts in CONN_HANDSHAKE. address is the
+ * client's address as returned by accept4(). Clients over their limits are
+ * turned away here, before any work has been done for the connection.
+ *
+ * Return: Pointer to the new connection, or NULL on error or if the client
+ * was turned away (clientfd is closed)
+ */
+struct connection *connection_new(int clientfd,
+                                  const struct sockaddr_storage *address);
+
+/**
+ * Frees the connection's SSL structure and buffers, then closes its socket.
+ */
+void connection_free(struct connection *conn);
+
+#endif
@@ -0,0 +1,64 @@
+/**
+ * error_page.h
+ *
+ * Error responses rendered once and kept in memory.
+ */
+
+#ifndef ERROR_PAGE_H
+#define ERROR_PAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Largest error page we keep in memory. Error pages are meant to be small,
+ * and this one is kept by every worker for every error it's used for.
+ * Larger pages are replaced with a minimal built-in one.
+ */
+#define ERROR_PAGE_MAX_SIZE 65536
+
+/**
+ * struct error_response - A complete error response, ready to send
+ * @refs: Number of holders, the table of current responses included
+ * @length: Length of the whole response, header and body
+ * @header_length: Length of the header alone, which is all HEAD requests get
+ * @data: The response text
+ *
+ * Reloading the error pages replaces the table's responses while
+ * connections may still be sending the old ones, so each connection holds a
+ * reference to the response it's sending.
+ */
+struct error_response {
+  int refs;
+  size_t length;
+  size_t header_length;
+  char data[];
+};
+
+/**
+ * Finds the page for every error we send, in the website directory or else
+ * in /etc/cyllenian/website, and renders the full response for each. A page
+ * that can't be read is replaced with a minimal built-in one. Called by the
+ * parent before the workers are forked, so that they inherit the responses,
+ * and again by every process on SIGHUP. If reloading fails, the responses
+ * already loaded stay in use.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int error_pages_load(void);
+
+/**
+ * Gets the response for an error code, with or without keep-alive. The
+ * caller holds a reference until it calls error_response_release().
+ *
+ * Return: Response, or NULL if there is no page for the code
+ */
+struct error_response *error_response_get(int response_code, bool keep_alive);
+
+/**
+ * Drops a reference obtained from error_response_get(). Passing NULL does
+ * nothing.
+ */
+void error_response_release(struct error_response *response);
+
+#endif
@@ -0,0 +1,36 @@
+/**
+ * event.h
+ *
+ * epoll-based event loop that drives every connection in a worker.
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdbool.h>
+
+/**
+ * Maximum number of ready events we collect from a single epoll_wait() call.
+ * More than this many ready connections is fine, the rest are reported on the
+ * next call.
+ */
+#define MAX_EVENTS 256
+
+/**
+ * Accepts connections on listenfd and serves them until an unrecoverable
+ * error occurs. Each worker runs one of these, so one loop per core when the
+ * worker count matches the CPU count.
+ *
+ * listenfd must be non-blocking.
+ */
+void event_loop_run(int listenfd);
+
+/**
+ * Checks whether this worker has been asked to shut down gracefully, in
+ * which case every response should close its connection.
+ *
+ * Return: true while draining
+ */
+bool event_loop_draining(void);
+
+#endif
@@ -0,0 +1,70 @@
+/**
+ * fd_cache.h
+ *
+ * Cache of open file descriptors for the files we serve.
+ */
+
+#ifndef FD_CACHE_H
+#define FD_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/**
+ * How often, in seconds, a cached descriptor is checked against the file its
+ * path now names, the same interval the content cache uses.
+ */
+#define FD_CACHE_REVALIDATE_INTERVAL 1
+
+/**
+ * struct open_file - An open file and what it looked like when opened
+ * @path: Full path the file was opened by
+ * @hash: Hash of path
+ * @fd: Descriptor open for reading, shared by everyone using the file
+ * @file_stat: fstat() of fd, taken when it was opened
+ * @validated: When we last checked that path still names this file
+ * @refs: Number of users holding the file
+ * @cached: Whether the file is in the cache, rather than only held by users
+ *
+ * Everyone reading from fd gives the offset explicitly (with pread() or
+ * SSL_sendfile()), so one descriptor can serve any number of connections.
+ */
+struct open_file {
+  char *path;
+  uint32_t hash;
+  int fd;
+  struct stat file_stat;
+  time_t validated;
+  int refs;
+  bool cached;
+
+  /*
+   * Next file in the same hash bucket, and neighbours in the least recently
+   * used list.
+   */
+  struct open_file *bucket_next;
+  struct open_file *lru_prev;
+  struct open_file *lru_next;
+};
+
+/**
+ * Gets an open descriptor for the regular file at file_path, opening it if it
+ * isn't cached or the path now names a different file. Files in the website
+ * directory are opened relative to a descriptor for the directory, and the
+ * kernel refuses to resolve them to anywhere outside it. The caller holds a
+ * reference until it calls fd_cache_release().
+ *
+ * Return: Pointer to the open file, or NULL with errno set on failure. errno
+ * is EXDEV if the path leads outside the website directory (e.g. through a
+ * symbolic link), and EISDIR if it isn't a regular file.
+ */
+struct open_file *fd_cache_open(const char *file_path);
+
+/**
+ * Drops a reference obtained from fd_cache_open(). Passing NULL does nothing.
+ */
+void fd_cache_release(struct open_file *file);
+
+#endif
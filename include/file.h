@@ -31,14 +31,4 @@ bool file_exists(const char *filename);
  */
 char *get_file_extension(const char *file_path);
 
-/**
- * Reads complete file contents into dynamically allocated buffer. We use
- * unsigned char for binary data (e.g., images) because the range of a byte is
- * 0-255. Using a signed type would restrict us to the range -128–127, which would cause higher
- * values to be misinterpreted as negative numbers and thus corrupt the data.
- * 
- * Return: Pointer to allocated buffer containing file, or NULL on error
- */
-unsigned char *read_file(const char *file_path, size_t *file_size);
-
 #endif
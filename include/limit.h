@@ -0,0 +1,86 @@
+/**
+ * limit.h
+ *
+ * Per-client connection and request rate limits shared between workers.
+ */
+
+#ifndef LIMIT_H
+#define LIMIT_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+/**
+ * Number of shards in the table of clients, and slots in each shard. A
+ * client only ever occupies a slot in the shard its address hashes to, so
+ * looking one up touches a couple of cache lines at most. Between them they
+ * track up to 16384 clients with open connections or spent requests.
+ */
+#define LIMIT_SHARDS 2048
+#define LIMIT_SHARD_SLOTS 8
+
+/**
+ * Most connections one client can be counted as having open, which is as
+ * high as max_connections_per_ip can go.
+ */
+#define LIMIT_MAX_CONNECTIONS 65535
+
+/**
+ * Slot of a connection whose client isn't being tracked, because limits are
+ * off or there was no room for it.
+ */
+#define LIMIT_NONE -1
+
+/**
+ * Maps the table of clients that every worker shares. Must be called in the
+ * parent before the workers are forked, so that they inherit the mapping.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int limit_init(void);
+
+/**
+ * Unmaps the table. Safe to call if limit_init() was never called or failed.
+ */
+void limit_cleanup(void);
+
+/**
+ * Sets which worker slot this process keeps its connections under, so that
+ * they can be released by limit_reclaim() if it dies. Must be called by
+ * each worker when it starts.
+ */
+void limit_set_worker(int worker);
+
+/**
+ * Releases every connection the worker in slot worker still had counted.
+ * Called by the parent once it has reaped the worker, and before starting a
+ * replacement in the same slot.
+ */
+void limit_reclaim(int worker);
+
+/**
+ * Checks whether a newly accepted client at address may have another
+ * connection, and if so counts it. The connection takes one of the client's
+ * requests under request_rate, and counts towards max_connections_per_ip
+ * until it's passed to limit_release(). slot is set to what to pass there.
+ *
+ * Return: true if the connection may go ahead, false if it should be closed
+ */
+bool limit_accept(const struct sockaddr_storage *address, int *slot);
+
+/**
+ * Takes one of a client's requests under request_rate, for each request
+ * after the first on a connection (the first was taken by limit_accept()).
+ *
+ * Return: true if the request may be served, false if the client is over
+ * its rate
+ */
+bool limit_request(int slot);
+
+/**
+ * Stops counting a connection towards its client's open connections.
+ * Passing LIMIT_NONE does nothing.
+ */
+void limit_release(int slot);
+
+#endif
@@ -6,11 +6,29 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <stdbool.h>
+
 /**
  * Maximum length of log message, longer messages are automatically truncated.
  */
 #define LOG_MSG_MAX 1024
 
+/**
+ * Size of each buffer that log lines are collected in before being written,
+ * enough for a few hundred request lines.
+ */
+#define LOG_BUFFER_SIZE 65536
+
+/**
+ * Longest a buffered log line waits to be written, in seconds.
+ */
+#define LOG_FLUSH_INTERVAL 1
+
+/**
+ * Buffer size for the timestamp at the start of each line.
+ */
+#define LOG_TIMESTAMP_MAX 80
+
 /**
  * Used in buffer size calculations to reserve space for '\0'.
  */
@@ -45,13 +63,44 @@ enum levels { DEBUG, INFO, WARN, ERROR, FATAL };
 void log_event(int log_level, const char *msg);
 
 /**
- * Log HTTP request in Common Log Format
+ * Switches from writing each line as it's logged to collecting lines and
+ * writing them out in batches. Workers call this once they start serving
+ * clients, after which they must call log_flush_if_due() regularly.
+ */
+void log_start_batching(void);
+
+/**
+ * Writes out every buffered line. Only uses async-signal-safe calls, so that
+ * it can be called from a signal handler on the way out.
+ */
+void log_flush(void);
+
+/**
+ * Writes out buffered lines if the oldest has been waiting at least
+ * LOG_FLUSH_INTERVAL seconds.
+ */
+void log_flush_if_due(void);
+
+/**
+ * Return: true if there are buffered lines yet to be written
+ */
+bool log_has_pending(void);
+
+#include <stddef.h>
+
+#include "request.h"
+
+/**
+ * Log HTTP request in our own format, or the Combined Log Format if
+ * log_format is set to combined. Works straight from the request, without
+ * allocating or copying it.
  *
  * USAGE:
  * Called after successfully sending response to client.
  * Provides access log for traffic analysis.
  */
-void log_request(const char *request_buffer, int response_code,
-                 int response_size);
+void log_request(const struct http_request *request,
+                 const char *client_address, int response_code,
+                 size_t response_size);
 
 #endif
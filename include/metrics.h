@@ -0,0 +1,109 @@
+/**
+ * metrics.h
+ *
+ * Counters and latency histograms shared between worker processes.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Number of buckets in each latency histogram. Bucket i counts durations
+ * under 2^(i + 8) nanoseconds, so they run from 256ns to about 34 seconds,
+ * and the last one takes everything longer.
+ */
+#define METRICS_BUCKETS 28
+
+/**
+ * Span of status codes counted, from 100 to 599.
+ */
+#define METRICS_STATUS_CODES 500
+
+/**
+ * Largest response metrics_render() builds.
+ */
+#define METRICS_BODY_MAX 32768
+
+/**
+ * The latencies we keep histograms of.
+ *
+ * METRICS_HANDSHAKE: From accepting a connection to its TLS handshake
+ *                    finishing, which includes the round trips to the client
+ * METRICS_PARSE: Time spent parsing a request head, summed over however many
+ *                reads it arrived in
+ * METRICS_RESOLVE: Turning a request's path into a file and a status code
+ * METRICS_SEND: From starting to send a response to the last of it being
+ *               written, which includes waiting for a slow client
+ */
+enum metrics_histogram {
+  METRICS_HANDSHAKE,
+  METRICS_PARSE,
+  METRICS_RESOLVE,
+  METRICS_SEND,
+  METRICS_NUM_HISTOGRAMS
+};
+
+/**
+ * Maps memory for every worker's metrics, if metrics_path is set. Must be
+ * called in the parent before the workers are forked, so that they inherit
+ * the mapping.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int metrics_init(void);
+
+/**
+ * Unmaps the metrics. Safe to call if metrics_init() was never called or
+ * failed.
+ */
+void metrics_cleanup(void);
+
+/**
+ * Makes this process record into the metrics of worker slot. Called once in
+ * each worker when it starts. A worker replacing one that exited carries on
+ * with its predecessor's counts.
+ */
+void metrics_set_slot(int slot);
+
+/**
+ * Reads the monotonic clock, for timing something that's recorded with
+ * metrics_record() later.
+ *
+ * Return: Nanoseconds since some fixed point, or 0 if metrics are disabled
+ */
+uint64_t metrics_clock(void);
+
+/**
+ * Adds a duration of nanoseconds to histogram. Does nothing if metrics are
+ * disabled.
+ */
+void metrics_record(enum metrics_histogram histogram, uint64_t nanoseconds);
+
+/**
+ * Counts a newly accepted connection.
+ */
+void metrics_count_connection(void);
+
+/**
+ * Counts a connection closed as soon as it was accepted, because its client
+ * was over max_connections_per_ip or request_rate.
+ */
+void metrics_count_rejection(void);
+
+/**
+ * Counts a response that has been sent in full, and its size in bytes.
+ */
+void metrics_count_response(int response_code, size_t bytes);
+
+/**
+ * Adds up every worker's metrics in the Prometheus text format.
+ *
+ * Return: Allocated text, which the caller frees, with its length in length,
+ * or NULL on error
+ */
+char *metrics_render(size_t *length);
+
+#endif
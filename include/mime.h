@@ -0,0 +1,67 @@
+/**
+ * mime.h
+ *
+ * MIME type detection based on file extension.
+ */
+
+#ifndef MIME_H
+#define MIME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Longest extension we map to a type, including the null terminator. Files
+ * with longer extensions get the default type.
+ */
+#define MIME_EXTENSION_MAX 16
+
+/**
+ * Longest MIME type we accept from a mime.types file.
+ */
+#define MIME_TYPE_MAX 128
+
+/**
+ * struct mime_type - A MIME type, ready to go in a header
+ * @header: The complete "Content-Type: ...\r\n" header line
+ * @header_length: Length of header
+ * @compressible: Whether files of this type are worth compressing, which is
+ *                text and the text-based formats like JSON, XML, and SVG
+ *
+ * Each type is stored once however many extensions map to it.
+ */
+struct mime_type {
+  const char *header;
+  size_t header_length;
+  bool compressible;
+};
+
+/**
+ * Builds the table of extensions to MIME types from the built-in types and,
+ * if the mime_types setting names one, a mime.types file, whose types win
+ * over the built-in ones. Called by the parent before the workers are
+ * forked, so that they share the table.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int mime_init(void);
+
+/**
+ * Looks up the MIME type for a file by its extension, which is compared
+ * case-insensitively. Files without an extension, or with one we don't know,
+ * are text/plain.
+ *
+ * Return: The file's type, never NULL
+ */
+const struct mime_type *mime_lookup(const char *file_path);
+
+/**
+ * Checks whether a file's MIME type is one that compresses well. Images,
+ * audio, and video are already compressed, so compressing them again only
+ * wastes time.
+ *
+ * Return: true if the file is worth compressing
+ */
+bool is_compressible_type(const char *file_path);
+
+#endif
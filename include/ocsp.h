@@ -0,0 +1,38 @@
+/**
+ * ocsp.h
+ *
+ * OCSP stapling of responses read from files.
+ */
+
+#ifndef OCSP_H
+#define OCSP_H
+
+#include <openssl/ssl.h>
+
+/**
+ * Seconds between checks of whether a response file has been replaced or
+ * the response in it has expired.
+ */
+#define OCSP_CHECK_INTERVAL 60
+
+/**
+ * Largest response file we'll read. Responses are usually a couple of
+ * kilobytes, a bit more if the responder includes its certificate.
+ */
+#define OCSP_RESPONSE_MAX 65536
+
+/**
+ * Loads the ocsp_response and ecdsa_ocsp_response files, matching each to
+ * whichever of ctx's certificates it's for, and staples them to handshakes
+ * from then on. Run at startup and again after the certificates are
+ * reloaded, since a response is for one certificate in particular. A file
+ * that can't be used is logged and not stapled, the server runs without it.
+ */
+void ocsp_load(SSL_CTX *ctx);
+
+/**
+ * Frees the loaded responses.
+ */
+void ocsp_cleanup(void);
+
+#endif
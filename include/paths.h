@@ -11,6 +11,24 @@
  */
 int prepend_program_data_path(char **path_buffer, const char *original_path);
 
+/**
+ * Constructs full path in user's config directory following XDG
+ * specification:
+ * $HOME/.config/cyllenian/<original_path>
+ *
+ * Return: 0 on success, -1 on error
+ */
+int prepend_program_config_path(char **path_buffer, const char *original_path);
+
+/**
+ * Gets the path of the website directory, $HOME/.local/share/cyllenian/website/
+ * with its trailing slash. The path is only built the first time, so this is
+ * cheap enough to call for every request.
+ *
+ * Return: Pointer to the path, DO NOT FREE, or NULL on error
+ */
+const char *get_website_path(void);
+
 /**
  * Checks that ~/.local/share/cyllenian/website/ exists before starting the
  * server. This is a sanity check - prevents starting server that can't serve
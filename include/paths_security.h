@@ -12,20 +12,37 @@
 #include <stddef.h>
 
 /**
- * Checks if path contains any common directory traversal patterns that could
- * allow accessing files outside the website directory.
+ * Outcomes of sanitizing a request path.
  *
- * Directory traversal attacks are an elementary tactic to try to move upwards
- * in the directory structure to access files outside of the website directory.
- *
- * Return: true if traversal pattern detected, false if safe
+ * PATH_OK: The path is safe to look up within the website directory
+ * PATH_TRAVERSAL: The path has a ".." segment, and gets 403
+ * PATH_BAD_ENCODING: The path has a malformed percent escape, or decodes to a
+ *                    control character, and gets 400
+ * PATH_TOO_LONG: The decoded path doesn't fit the output buffer
  */
-bool contains_traversal_patterns(const char *file_request);
+enum path_result {
+  PATH_OK,
+  PATH_TRAVERSAL,
+  PATH_BAD_ENCODING,
+  PATH_TOO_LONG
+};
 
 /**
- * Cleans up path for security checks by removing trailing slashes, consecutive
- * slashes, and null terminating.
+ * Percent-decodes and normalizes the length byte request path in src into
+ * dst, which holds dst_size bytes, and checks the decoded path for directory
+ * traversal. The result has no leading or trailing slash, no consecutive
+ * slashes and no "." segments, and is null terminated. dst_length is set to
+ * its length.
+ *
+ * Directory traversal attacks are an elementary tactic to try to move upwards
+ * in the directory structure to access files outside of the website directory.
+ * Checking the path once it has been decoded catches every way of encoding
+ * "..", rather than only the encodings we thought of.
+ *
+ * Return: PATH_OK if the path is safe, or why it isn't
  */
-void normalize_request_path(char *file_request);
+enum path_result sanitize_request_path(char *dst, size_t dst_size,
+                                       const char *src, size_t length,
+                                       size_t *dst_length);
 
 #endif
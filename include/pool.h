@@ -0,0 +1,52 @@
+/**
+ * pool.h
+ *
+ * Per-worker pool of reusable buffers.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/**
+ * Smallest buffer the pool hands out. Buffers come in power of two sizes from
+ * this up to POOL_MAX_SIZE, and a request for any size in between gets the
+ * next size up.
+ */
+#define POOL_MIN_SIZE 1024
+
+/**
+ * Largest buffer the pool hands out, which is enough for a request buffer
+ * that has grown as far as it may. Larger buffers are allocated and freed
+ * with malloc() and free() as usual.
+ */
+#define POOL_MAX_SIZE 32768
+
+/**
+ * Number of buffer sizes, from POOL_MIN_SIZE to POOL_MAX_SIZE.
+ */
+#define POOL_NUM_CLASSES 6
+
+/**
+ * Most free buffers of each size the pool keeps for reuse. Buffers returned
+ * past this are freed, so that a burst of connections doesn't leave the
+ * worker holding on to their memory for good.
+ */
+#define POOL_MAX_FREE 128
+
+/**
+ * Gets a buffer of at least size bytes, reusing one returned with pool_put()
+ * if there is one. Once the pool has warmed up, this doesn't allocate.
+ *
+ * Return: Pointer to the buffer, or NULL on allocation failure
+ */
+void *pool_get(size_t size);
+
+/**
+ * Returns a buffer from pool_get() for reuse. size must be the size it was
+ * got with. Does nothing if buffer is NULL.
+ */
+void pool_put(void *buffer, size_t size);
+
+#endif
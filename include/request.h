@@ -0,0 +1,170 @@
+/**
+ * request.h
+ *
+ * Incremental HTTP request parser.
+ */
+
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Longest request line we accept. Anything longer is almost certainly an
+ * attack or a mistake, and gets 431.
+ */
+#define REQUEST_LINE_MAX 8192
+
+/**
+ * Longest request target (path and query) we accept, which leaves plenty of
+ * room to turn the path into a filesystem path within PATH_MAX. Longer
+ * targets get 414.
+ */
+#define REQUEST_TARGET_MAX 2048
+
+/**
+ * Largest request head (request line and headers) we accept, which is also
+ * the most a connection's request buffer will grow to.
+ */
+#define REQUEST_HEAD_MAX 32768
+
+/**
+ * Most header lines we accept in one request.
+ */
+#define MAX_REQUEST_HEADERS 100
+
+/**
+ * struct string_view - A piece of a string that isn't null terminated
+ * @data: Start of the text, or NULL if there is none
+ * @length: Length of the text
+ *
+ * Views point into the connection's request buffer, so they're only valid
+ * until the request has been answered.
+ */
+struct string_view {
+  const char *data;
+  size_t length;
+};
+
+/**
+ * The methods we handle. Any other method parses fine and gets 405.
+ */
+enum http_method { METHOD_GET, METHOD_HEAD, METHOD_OTHER };
+
+/**
+ * Results of feeding data to request_parse().
+ *
+ * PARSE_INCOMPLETE: The request is fine so far but hasn't all arrived
+ * PARSE_COMPLETE: The whole request head has been parsed
+ * PARSE_BAD_REQUEST: The request isn't valid HTTP, and gets 400
+ * PARSE_URI_TOO_LONG: The request target is over REQUEST_TARGET_MAX, and
+ *                     gets 414
+ * PARSE_TOO_LARGE: The request line or headers are over our limits, and get
+ *                  431
+ */
+enum parse_result {
+  PARSE_INCOMPLETE,
+  PARSE_COMPLETE,
+  PARSE_BAD_REQUEST,
+  PARSE_URI_TOO_LONG,
+  PARSE_TOO_LARGE
+};
+
+/**
+ * Where the parser is within the request.
+ */
+enum parse_state { PARSE_REQUEST_LINE, PARSE_HEADERS, PARSE_DONE };
+
+/**
+ * struct http_request - A parsed request head
+ *
+ * Filled in by request_parse() as the request arrives, and consumed by
+ * everything that needs to know about the request, so that nothing has to
+ * search the request text again.
+ *
+ * Headers we act on are picked out as they're parsed. Views of headers the
+ * request didn't include have NULL data.
+ *
+ * We don't read request bodies, so a request that says it has one is
+ * rejected rather than parsed: whatever follows the head is always taken to
+ * be the next pipelined request.
+ */
+struct http_request {
+  enum http_method method;
+  int version_minor;
+
+  /*
+   * request_line is the whole first line without its line ending, for the
+   * access log. target is the request-target as sent, which is split into
+   * path and query (the part after '?', without it).
+   */
+  struct string_view request_line;
+  struct string_view method_name;
+  struct string_view target;
+  struct string_view path;
+  struct string_view query;
+
+  struct string_view host;
+  struct string_view connection;
+  struct string_view range;
+  struct string_view if_range;
+  struct string_view if_none_match;
+  struct string_view if_modified_since;
+  struct string_view accept_encoding;
+  struct string_view referer;
+  struct string_view user_agent;
+  struct string_view content_length;
+  struct string_view transfer_encoding;
+
+  /*
+   * Length of the request head including the blank line that ends it, once
+   * parsing is complete. Anything after it in the buffer is the next
+   * pipelined request.
+   */
+  size_t head_length;
+
+  /*
+   * Parser state. parsed is how far into the buffer we've got, which is
+   * always the start of a line we haven't seen the end of yet.
+   */
+  enum parse_state state;
+  size_t parsed;
+  int num_headers;
+};
+
+/**
+ * Resets request so that it is ready to parse a new request.
+ */
+void request_reset(struct http_request *request);
+
+/**
+ * Points every view in request at new_buffer instead of old_buffer, for when
+ * the request has been copied into a larger buffer partway through parsing.
+ */
+void request_relocate(struct http_request *request, const char *old_buffer,
+                      const char *new_buffer);
+
+/**
+ * Parses as much of the request in buffer as has arrived. Call it again with
+ * the same buffer (and request) each time more data has been read into it,
+ * and it carries on from where it left off, so each line is only looked at
+ * once it is complete.
+ *
+ * Return: Whether the request is complete, needs more data, or is invalid
+ */
+enum parse_result request_parse(struct http_request *request,
+                                const char *buffer, size_t length);
+
+/**
+ * Finds the hostname in the request's Host header, without the port if it
+ * has one. The hostname isn't null terminated, host_length is set to its
+ * length.
+ *
+ * Return: Pointer to the hostname within the request, or NULL if there's no
+ * Host header
+ */
+const char *request_get_host(const struct http_request *request,
+                             size_t *host_length);
+
+#endif
@@ -7,11 +7,12 @@
 #ifndef RESPONSE_H
 #define RESPONSE_H
 
-/**
- * Maximum size for request/response buffers, prevents large file requests from
- * consuming excessive memory.
- */
-#define BUFFER_SIZE 1048576
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "paths_security.h"
+#include "request.h"
 
 /**
  * Maximum HTTP response header size, you are unlikely to come across headers
@@ -20,44 +21,37 @@
 #define MAX_HEADER 1024
 
 /**
- * Maximum Content-Type line size, this is more than enough room for all
- * supported MIME types.
+ * Maximum Content-Length line size, enough for any 64-bit length.
  */
-#define MAX_CONTENT_TYPE 128
+#define MAX_CONTENT_LENGTH 64
 
 /**
- * Maximum response code line size
+ * Buffer size for an HTTP date such as "Sun, 06 Nov 1994 08:49:37 GMT". The
+ * date itself is 29 bytes, but the compiler can't tell that the year will
+ * only ever have four digits.
  */
-#define MAX_RESPONSE_CODE 128
+#define HTTP_DATE_MAX 64
 
 /**
- * Size to skip past HTTP method in request to reach the
- * requested file path.
- */
-#define METHOD_LENGTH 5
-
-/**
- * Number of MIME type mappings. Used for array bounds checking and binary
- * search of the mime_type_associations array, so it must be updated if
- * additional types are added later.
+ * Maximum response code line size
  */
-#define NUM_OF_MIME_TYPES 14
+#define MAX_RESPONSE_CODE 128
 
 /**
  * Number of supported HTTP status codes, must be updated if additional response
  * codes are added to response_code_associations array.
  */
-#define NUM_OF_RESPONSE_CODES 5
+#define NUM_OF_RESPONSE_CODES 11
 
-/*
- * Used to map file extensions to Content-Type headers.
- * Array of these structs must be kept sorted alphabetically by extension
- * for binary search to work.
+/**
+ * Outcomes of checking a request's Range header against the file being sent.
+ *
+ * RANGE_NONE: Send the whole file, either because no range was asked for or
+ *             because it's one we don't handle and are allowed to ignore
+ * RANGE_SATISFIABLE: Send the requested part of the file with 206
+ * RANGE_UNSATISFIABLE: The range lies outside the file, so send 416
  */
-struct mime_type {
-  char extension[6];
-  char mime_type[50];
-};
+enum range_result { RANGE_NONE, RANGE_SATISFIABLE, RANGE_UNSATISFIABLE };
 
 /**
  * Used to map numeric status codes to full HTTP status lines for response
@@ -69,39 +63,99 @@ struct response_code {
 };
 
 /**
- * Build complete HTTP response header.
+ * Writes a complete HTTP response header into header, the same header
+ * construct_header() would build. Used for headers that are only needed for
+ * one response, in a buffer the caller reuses.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int format_header(char header[MAX_HEADER], int response_code,
+                  const char *file_request, size_t content_length,
+                  bool keep_alive, const char *extra_headers);
+
+/**
+ * Build complete HTTP response header. extra_headers, if not NULL, holds
+ * further CRLF-terminated header lines to include, such as Content-Range.
  *
  * Return: Pointer to allocated header string, or NULL on error
  */
-char *construct_header(int response_code, const char *file_request);
+char *construct_header(int response_code, const char *file_request,
+                       size_t content_length, bool keep_alive,
+                       const char *extra_headers);
+
+/**
+ * Decides whether the client wants the connection kept open after this
+ * request. HTTP/1.1 connections are persistent unless the client sends
+ * "Connection: close", while HTTP/1.0 clients have to ask with
+ * "Connection: keep-alive".
+ *
+ * Return: true if the connection should be kept open
+ */
+bool request_wants_keep_alive(const struct http_request *request);
+
+/**
+ * Formats seconds since the epoch as an HTTP date, which is always in GMT.
+ */
+void format_http_date(char date[HTTP_DATE_MAX], time_t time);
 
 /**
- * Performs validation checks and determines the appropriate HTTP status code:
+ * Works out which part of a file_size byte file the Range header asks for.
+ * The file's Last-Modified date and ETag are checked against the If-Range
+ * header, if there is one, so that we don't send part of a file that has
+ * changed since the client got the rest of it.
  *
- * If validation fails, file_request is updated to point to appropriate
- * error page (403.html, 404.html, 405.html).
+ * Sets range_start and range_length for RANGE_SATISFIABLE.
  *
- * Return: 0 on success (even if returning error code), -1 on fatal error
+ * Return: How the request should be answered
  */
-int determine_response_code(const char *request_buffer, char **file_request,
-                            int *response_code);
+enum range_result get_request_range(const struct http_request *request,
+                                    size_t file_size, const char *last_modified,
+                                    const char *etag, size_t *range_start,
+                                    size_t *range_length);
 
 /**
- * Parses HTTP request to extract requested path, then constructs full
- * filesystem path by prepending website directory.
+ * Checks the request's If-None-Match and If-Modified-Since headers against
+ * the file's validators. If-Modified-Since is only used when there's no
+ * If-None-Match, as HTTP requires.
  *
- * Return: 0 on success, -1 on error
+ * Return: true if the client's copy is current and should get a 304
+ */
+bool request_is_not_modified(const struct http_request *request,
+                             const char *etag, const char *last_modified,
+                             time_t mtime);
+
+/**
+ * Reads the request's Accept-Encoding header to find out whether the client
+ * can take gzip and brotli compressed responses. An encoding listed with a
+ * q-value of 0 is one the client explicitly refuses.
  */
-int get_requested_file_path(char **path_buffer, char *request_buffer);
+void get_accepted_encodings(const struct http_request *request, bool *gzip,
+                            bool *brotli);
 
 /**
- * Determines MIME type based on file extension and constructs Content-Type
- * header with proper formatting.
+ * Performs validation checks and determines the appropriate HTTP status code
+ * for a request for file_request. parse_result is what request_parse() made
+ * of the request, which decides the response on its own if the request
+ * couldn't be parsed, and path_result is what get_requested_file_path() made
+ * of the path. Errors are sent with the responses from error_page.h, rather
+ * than by serving a file.
+ */
+void determine_response_code(const struct http_request *request,
+                             enum parse_result parse_result,
+                             enum path_result path_result,
+                             const char *file_request, int *response_code);
+
+/**
+ * Constructs full filesystem path for the path in the request by prepending
+ * website_path, the directory of the website the request is for (with its
+ * trailing slash). The path is percent-decoded and normalized on the way,
+ * and path_result is set to say whether it's safe to serve.
  *
- * The CRLF is added to the end of this line since Content-Type
- * is always our last header.
+ * Return: 0 on success, -1 on error
  */
-void get_content_type(char content_type[MAX_CONTENT_TYPE],
-                      const char *file_request);
+int get_requested_file_path(char **path_buffer,
+                            const struct http_request *request,
+                            const char *website_path,
+                            enum path_result *path_result);
 
 #endif
@@ -0,0 +1,99 @@
+/**
+ * route.h
+ *
+ * Index of the files in the website directory, kept up to date with inotify.
+ */
+
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * Number of hash table buckets the index starts with, this must be a power of
+ * two. The table doubles in size whenever it holds more files than buckets.
+ */
+#define ROUTE_INITIAL_BUCKETS 256
+
+/**
+ * Most files we index. A website directory with more than this is probably
+ * not one we should hold in memory in every worker, so we go back to checking
+ * the filesystem instead.
+ */
+#define ROUTE_MAX_FILES 100000
+
+/**
+ * How many directories deep we index. This also stops a symbolic link to a
+ * parent directory from having us index the same files forever.
+ */
+#define ROUTE_MAX_DEPTH 16
+
+/**
+ * struct route - A file in the website directory
+ * @path: Path relative to the website directory, e.g. "css/style.css"
+ * @hash: Hash of path
+ * @mtime: Modification time when the file was indexed
+ * @size: Size when the file was indexed
+ * @dev: Device the file is on
+ * @ino: Inode number of the file
+ * @watched: Whether changes to the file are reported by inotify
+ * @next: Next route in the same hash bucket
+ *
+ * Together, mtime, size, dev and ino tell whether a cached copy of the file is
+ * still current, the same way the cache would tell from stat().
+ *
+ * inotify reports changes to the files in the directories we watch, but a
+ * symbolic link to a file may point anywhere, and changes to the file it
+ * points to aren't reported. Such files aren't watched, and the filesystem
+ * has to be checked for them as usual.
+ */
+struct route {
+  char *path;
+  uint32_t hash;
+  struct timespec mtime;
+  off_t size;
+  dev_t dev;
+  ino_t ino;
+  bool watched;
+  struct route *next;
+};
+
+/**
+ * Indexes every regular file in the website directory and starts watching it
+ * for changes with inotify. Symbolic links are followed. Each worker builds its
+ * own index.
+ *
+ * Return: 0 on success, -1 if the index couldn't be built (lookups then
+ * report that the index doesn't cover anything)
+ */
+int route_index_init(void);
+
+/**
+ * Gets the inotify descriptor that becomes readable when the website
+ * directory changes, for the event loop to wait on.
+ *
+ * Return: The descriptor, or -1 if there's no index
+ */
+int route_index_fd(void);
+
+/**
+ * Reads the pending change notifications and rebuilds the index. Call this
+ * whenever route_index_fd() is readable. If the index can't be rebuilt, it's
+ * dropped and lookups go back to the filesystem.
+ */
+void route_index_refresh(void);
+
+/**
+ * Looks up a file by its full path. Only paths inside the website directory
+ * are covered by the index, so this may not be able to answer.
+ *
+ * Return: true if the index covers file_path, in which case route is set to
+ * the file's route, or to NULL if there's no such file. false if the caller
+ * has to check the filesystem itself.
+ */
+bool route_index_lookup(const char *file_path, const struct route **route);
+
+#endif
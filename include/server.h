@@ -9,35 +9,33 @@
 
 #include <openssl/ssl.h>
 
-/**
- * The maximum number of clients that can be waiting
- * in the accept queue while server processes current client. Production servers
- * might allow more than 1024 or more if they are receiving high traffic.
- */
-#define BACKLOG_SIZE 128
-
-/**
- * The maximum request/response buffer size. This is also defined in response.h,
- * but we redefine it here for the sake of convenience.
- */
-#define BUFFER_SIZE 1048576
+#include "worker.h"
 
 /**
- * Maximum length of the initial listening message.
+ * Environment variable a server started on SIGUSR2 finds its predecessor's
+ * listening sockets in, as a comma-separated list of descriptors.
  */
-#define LISTENING_MSG_MAX 50
+#define LISTEN_FDS_ENV "CYLLENIAN_LISTEN_FDS"
 
 /**
- * struct server_ctx - Server context holding connection state
+ * struct server_ctx - Server context holding shared server state
+ *
+ * This structure holds the state that every connection shares: the SSL
+ * context and the listening sockets. It is declared as file-static in server.c
+ * and accessed in other files through initialization/cleanup functions.
  *
- * This structure holds the server's connection state. It is declared as
- * file-static in server.c and accessed in other files through
- * initialization/cleanup functions.
+ * With reuseport there is a listening socket for each worker slot, otherwise
+ * there is one that every worker shares. The parent keeps them all open, so a
+ * worker's socket (and connections queued on it) survives the worker being
+ * replaced.
+ *
+ * Per-connection state (the SSL structure and client socket) is NOT kept here,
+ * since each worker handles many connections over its lifetime.
  */
 struct server_ctx {
-  SSL *ssl;
   SSL_CTX *ssl_ctx;
-  int sockfd;
+  int listen_fds[MAX_WORKERS];
+  int num_listen_fds;
 };
 
 /**
@@ -49,35 +47,52 @@ struct server_ctx {
 void server_ctx_init(void);
 
 /**
- * Frees SSL structure and context, then closes the file descriptor that was
- * opened for the socket connection.
+ * Frees the SSL context and the shared session cache, then closes the file
+ * descriptors that were opened for the listening sockets.
  */
 void server_cleanup(void);
 
+struct connection;
+
 /**
- * Establish SSL/TLS connection with the client.
+ * Create the SSL structure for a client connection. The handshake itself is
+ * performed by handle_client(), since on a non-blocking socket it may take
+ * several attempts.
  *
- * Return: 0 on success, -1 on failure
+ * Return: Pointer to the connection's SSL structure on success, which the
+ * caller must free with SSL_free(), or NULL on failure
  */
-int setup_ssl(int clientfd);
+SSL *setup_ssl(int clientfd);
 
 /**
- * Complete request-response cycle for one client
+ * Advance the request-response cycle for one client as far as possible
+ *
+ * Called by the event loop whenever the client's socket becomes ready. It does
+ * as much work as it can without blocking, and leaves the connection in a
+ * state it can resume from the next time it's called.
  *
- * This runs in the child process. When it returns, the child exits and the OS
- * cleans up remaining resources.
+ * Errors here only affect this client.
  *
- * Returns early on any error. Child exits after return, so errors here don't
- * affect other clients.
+ * Return: 1 if the connection is waiting on the client, 0 once it is finished
+ * (successfully or not) and should be freed with connection_free()
+ */
+int handle_client(struct connection *conn);
+
+/**
+ * Reloads the configuration, certificate and error pages after SIGHUP.
+ * Called by the parent, which then passes the signal on, and by each worker
+ * when it receives it.
  */
-void handle_client(struct server_ctx *server, int clientfd);
+void server_reload(void);
 
 /**
- * Initialize and run the HTTPS server. Blocks until a fatal error occurs or
- * SIGINT is received.
+ * Initialize and run the HTTPS server. Starts the worker pool and blocks until
+ * a fatal error occurs, SIGINT is received, or SIGQUIT is received and every
+ * worker has finished its connections. argv is what the server was started
+ * with, to start its replacement with on SIGUSR2.
  *
  * Return: 0 on clean shutdown, -1 on error
  */
-int server_init(void);
+int server_init(char *argv[]);
 
 #endif
@@ -0,0 +1,45 @@
+/**
+ * session.h
+ *
+ * TLS session resumption shared between worker processes.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <openssl/ssl.h>
+
+/**
+ * Largest encoded session we keep in the shared cache. A session without a
+ * client certificate is a few hundred bytes, so this leaves plenty of room for
+ * the SNI hostname and other extensions. Larger sessions just aren't cached.
+ */
+#define SESSION_DATA_MAX 1024
+
+/**
+ * Sizes of the parts of a session ticket key. Tickets are encrypted with
+ * AES-256-CBC and authenticated with HMAC-SHA256, and the name identifies
+ * which key a ticket was made with (its length is fixed by OpenSSL).
+ */
+#define TICKET_KEY_NAME_LENGTH 16
+#define TICKET_AES_KEY_LENGTH 32
+#define TICKET_HMAC_KEY_LENGTH 32
+
+/**
+ * Sets up session resumption on ctx: a session cache in shared memory that
+ * every worker reads and writes, and session ticket keys that every worker
+ * shares and that are replaced every session_timeout seconds. Must be called
+ * in the parent before the workers are forked, so that they inherit the
+ * mapping.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int session_init(SSL_CTX *ctx);
+
+/**
+ * Unmaps the shared session cache. Safe to call if session_init() was never
+ * called or failed.
+ */
+void session_cleanup(void);
+
+#endif
@@ -7,13 +7,42 @@
 #ifndef SIGNALS_H
 #define SIGNALS_H
 
+#include <stdbool.h>
+
 /**
- * Registers custom SIGINT handler to allow clean shutdown when user
- * presses Ctrl+C. SIGINT terminates the process immediately by default, which
- * would prevent proper cleanup if we didn't override it's behavior.
+ * Registers custom SIGINT and SIGTERM handler to allow clean shutdown when user
+ * presses Ctrl+C or the server is killed. Both terminate the process
+ * immediately by default, which would prevent proper cleanup (and lose
+ * buffered log lines) if we didn't override their behavior.
  *
  * Return: 0 on success, -1 on failure
  */
 int sig_handler_init(void);
 
+/**
+ * Checks whether SIGHUP has been received since the last call, which is the
+ * signal to reload the configuration, certificate and error pages. Signals
+ * received together are only reported once.
+ *
+ * Return: true if the server should reload
+ */
+bool sig_reload_pending(void);
+
+/**
+ * Checks whether SIGQUIT has been received since the last call, which is the
+ * signal to stop accepting connections and exit once the open ones are done.
+ *
+ * Return: true if the server should drain and exit
+ */
+bool sig_quit_pending(void);
+
+/**
+ * Checks whether SIGUSR2 has been received since the last call, which is the
+ * signal for the parent to start a new copy of the server that takes over
+ * its listening sockets.
+ *
+ * Return: true if the server should start its replacement
+ */
+bool sig_upgrade_pending(void);
+
 #endif
@@ -0,0 +1,108 @@
+/**
+ * uring.h
+ *
+ * Minimal io_uring submission and completion rings.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * struct uring - An io_uring instance and its shared rings
+ * @fd: The ring's file descriptor
+ * @enter_fd: What to pass io_uring_enter() for the ring, which is an index
+ *            into the registered ring descriptors if registering worked
+ * @enter_flags: Flags every io_uring_enter() call needs
+ * @sq_head: Kernel's position in the submission queue
+ * @sq_tail: Our position in the submission queue
+ * @sq_mask: Mask to turn a position into an index
+ * @sq_entries: Number of entries in the submission queue
+ * @sq_array: Indexes of the entries in sqes to submit, in order
+ * @sqes: Submission queue entries
+ * @sqe_tail: Position of the next entry we'll fill in, ahead of *sq_tail
+ *            until the entries are published
+ * @cq_head: Our position in the completion queue
+ * @cq_tail: Kernel's position in the completion queue
+ * @cq_mask: Mask to turn a position into an index
+ * @cqes: Completion queue entries
+ * @ring: Mapping of both rings
+ * @ring_size: Size of ring
+ * @sqes_size: Size of the sqes mapping
+ *
+ * The rings are shared with the kernel, so the heads and tails are read and
+ * written with atomic operations, and each side only writes its own end.
+ */
+struct uring {
+  int fd;
+  int enter_fd;
+  unsigned enter_flags;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sqe_tail;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *ring;
+  size_t ring_size;
+  size_t sqes_size;
+};
+
+/**
+ * Sets up ring with room for entries submissions at a time. Fails if the
+ * kernel doesn't support io_uring, or is too old for the features we rely
+ * on, in which case the caller should use epoll instead.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int uring_init(struct uring *ring, unsigned entries);
+
+/**
+ * Unmaps ring's memory and closes it. Safe to call on a ring that was never
+ * set up or whose setup failed.
+ */
+void uring_free(struct uring *ring);
+
+/**
+ * Gets a zeroed submission queue entry to fill in. Entries are submitted by
+ * the next uring_wait(), or straight away if the queue is full.
+ *
+ * Return: The entry, or NULL if the queue is full and can't be submitted
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/**
+ * Submits the entries filled in since the last call, then waits until at
+ * least one completion is ready or timeout_ms milliseconds have passed (-1
+ * waits for as long as it takes).
+ *
+ * Return: 0 on success (including timing out), -1 on failure with errno set,
+ * to EINTR if a signal arrived
+ */
+int uring_wait(struct uring *ring, int timeout_ms);
+
+/**
+ * Gets the oldest completion that hasn't been consumed.
+ *
+ * Return: The completion, or NULL if there are none
+ */
+struct io_uring_cqe *uring_peek(struct uring *ring);
+
+/**
+ * Consumes the completion returned by uring_peek(), so the kernel can reuse
+ * its slot.
+ */
+void uring_advance(struct uring *ring);
+
+#endif
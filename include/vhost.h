@@ -0,0 +1,103 @@
+/**
+ * vhost.h
+ *
+ * Websites served for server names other than the default one.
+ */
+
+#ifndef VHOST_H
+#define VHOST_H
+
+#include <openssl/ssl.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "request.h"
+
+/**
+ * struct vhost - A website served for one server name
+ * @name: Server name in lowercase, from the vhost directive
+ * @name_length: Length of name
+ * @root: Website directory with its trailing slash
+ * @root_length: Length of root
+ * @cert_path: Certificate chain to offer for the name, or NULL to offer the
+ *             default one
+ * @key_path: Private key for cert_path
+ * @ssl_ctx: Context holding the name's certificate, NULL if it doesn't have
+ *           one of its own
+ * @hash: Hash of name
+ * @next: Next vhost in the same hash bucket
+ *
+ * The strings belong to the configuration, which doesn't change them while
+ * we're running.
+ */
+struct vhost {
+  const char *name;
+  size_t name_length;
+  const char *root;
+  size_t root_length;
+  const char *cert_path;
+  const char *key_path;
+  SSL_CTX *ssl_ctx;
+  uint32_t hash;
+  struct vhost *next;
+};
+
+/**
+ * Builds the table of vhosts from the vhost directives, checking that each
+ * one's website directory exists. Called in the parent before the workers
+ * are forked, so every worker inherits the same table. The SSL contexts are
+ * left for the server to fill in.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int vhost_init(void);
+
+/**
+ * Frees the table and the vhosts' SSL contexts.
+ */
+void vhost_cleanup(void);
+
+/**
+ * Gets the number of vhosts, for going through them all with vhost_get().
+ *
+ * Return: Number of vhosts
+ */
+int vhost_count(void);
+
+/**
+ * Gets the vhost at index, which must be below vhost_count().
+ *
+ * Return: Pointer to the vhost
+ */
+struct vhost *vhost_get(int index);
+
+/**
+ * Looks up the vhost for a server name of length bytes, which needn't be
+ * null terminated. Case and a trailing dot make no difference.
+ *
+ * Return: Pointer to the vhost, or NULL if the name isn't one of ours
+ */
+const struct vhost *vhost_find(const char *name, size_t length);
+
+/**
+ * Gets the website directory to serve request from: the one for the name in
+ * its Host header, or for the name the client gave in its handshake (SNI) if
+ * it has no Host header, or the default website directory if neither is the
+ * name of a vhost.
+ *
+ * Return: Path of the website directory with its trailing slash, DO NOT
+ * FREE, or NULL on error
+ */
+const char *vhost_website_path(const struct http_request *request, SSL *ssl);
+
+/**
+ * Callback for SSL_CTX_set_client_hello_cb(), which switches the handshake
+ * to the certificate of the vhost the client named (with SNI), if it has one
+ * of its own.
+ *
+ * Return: SSL_CLIENT_HELLO_SUCCESS, since names that aren't ours get the
+ * default certificate
+ */
+int vhost_client_hello_callback(SSL *ssl, int *alert, void *arg);
+
+#endif
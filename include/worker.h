@@ -0,0 +1,65 @@
+/**
+ * worker.h
+ *
+ * Pre-forked worker pool interface.
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdbool.h>
+
+/**
+ * Upper bound on the number of worker processes. Anything past a few per core
+ * only adds scheduling overhead, so this is mostly a sanity limit for -w.
+ */
+#define MAX_WORKERS 256
+
+/**
+ * Determines how many workers to start when -w isn't given: one per online
+ * CPU, which keeps every core busy without workers fighting for time slices.
+ *
+ * Return: Number of online CPUs, or 1 if it can't be determined
+ */
+int default_worker_count(void);
+
+/**
+ * Forks num_workers processes that each run worker_main() with their slot
+ * number (0 to num_workers - 1), then supervises them from the parent,
+ * replacing any worker that exits unexpectedly with one in the same slot.
+ * Blocks until workers_stop() is called or a worker can't be forked.
+ *
+ * worker_main() should never return while the server is running; a worker
+ * that returns is treated the same as one that crashed.
+ *
+ * On SIGHUP, the parent calls reload() and then passes the signal on to every
+ * worker, so that workers started later get what was reloaded too. On
+ * SIGUSR2 it calls upgrade(). On SIGQUIT it passes the signal on and stops
+ * replacing workers, and returns once they've all exited.
+ *
+ * Return: 0 on clean shutdown, -1 on error
+ */
+int workers_run(int num_workers, void (*worker_main)(int slot),
+                void (*reload)(void), void (*upgrade)(void));
+
+/**
+ * Sends SIGTERM to every running worker. Only uses async-signal-safe calls so
+ * that it can be called from the SIGINT handler. This does nothing when
+ * called from inside a worker.
+ */
+void workers_stop(void);
+
+/**
+ * Return: true if the calling process is a worker rather than the parent
+ */
+bool is_worker_process(void);
+
+/**
+ * Ends a worker with _exit(status), which skips atexit() handlers and stdio
+ * buffers, since workers own nothing the OS doesn't reclaim. Safe to call
+ * from a signal handler. Builds profiling for PGO (-DPROFILING) write the
+ * worker's profile first, which would otherwise be lost.
+ */
+void worker_exit(int status) __attribute__((noreturn));
+
+#endif
@@ -18,6 +18,7 @@
 #include "args.h"
 #include "config.h"
 #include "log.h"
+#include "worker.h"
 
 /**
  * print_usage - Display program usage
@@ -35,6 +36,7 @@ static void print_usage(void) {
   printf("  -k               Specify path to private key file\n");
   printf("  -l               Save logs to file\n");
   printf("  -p               Specify port to listen on\n");
+  printf("  -w               Specify number of worker processes\n");
 }
 
 /**
@@ -85,6 +87,7 @@ static int handle_config_arg(char **config_var, char *optarg) {
  *  -k <path>  : Private key file path
  *  -l         : Enable logging to file
  *  -p <port>  : Port number (1024-49151)
+ *  -w <count> : Number of worker processes (1-MAX_WORKERS)
  *
  * PORT RANGES:
  * Ports 0-1023: Reserved for system services (require root)
@@ -111,7 +114,7 @@ int process_args(int argc, char *argv[]) {
    * that the option requires an argument (accessed through optarg).
    * getopt returns -1 when it has finished reading option characters.
    */
-  while ((c = getopt(argc, argv, "c:hk:lp:")) != -1) {
+  while ((c = getopt(argc, argv, "c:hk:lp:w:")) != -1) {
     switch (c) {
     case 'c':
       if (handle_config_arg(&config->cert_path, optarg) == -1) {
@@ -170,6 +173,23 @@ int process_args(int argc, char *argv[]) {
       }
       break;
 
+    case 'w':
+      /*
+       * Set how many worker processes to fork. Each worker runs its own event
+       * loop on one core at a time, so there's little to gain from having
+       * more workers than CPUs.
+       */
+      config->workers = atoi(optarg);
+      if (config->workers < 1 || config->workers > MAX_WORKERS) {
+        char workers_range_msg[LOG_MSG_MAX];
+        snprintf(workers_range_msg, LOG_MSG_MAX,
+                 "Number of workers must be between 1 and %d.", MAX_WORKERS);
+        log_event(ERROR, workers_range_msg);
+        config_cleanup();
+        return -1;
+      }
+      break;
+
     case '?':
       /*
        * getopt returns '?' if it encounters an unknown option (e.g, if we tried
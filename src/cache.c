@@ -0,0 +1,830 @@
+/**
+ * cache.c
+ *
+ * In-memory cache of the files we serve.
+ *
+ * OVERVIEW:
+ * Most sites are a handful of small files requested over and over, so rather
+ * than reading a file from disk for every request we keep it in memory along
+ * with the response headers for it. Serving a cache hit is then just a matter
+ * of writing those bytes to the connection.
+ *
+ * Each worker has its own cache. Sharing one between processes would mean
+ * locking around every lookup, and the files are small enough that keeping a
+ * copy per worker is the cheaper option.
+ *
+ * DATA STRUCTURES:
+ * Entries are kept in a hash table keyed by the resolved path and response
+ * code, so a lookup costs the same however many files are cached. They are
+ * also kept in a list ordered by when they were last used. When the cache
+ * grows past its memory limit, we evict from the least recently used end of
+ * that list until it fits again.
+ *
+ * COMPRESSION:
+ * Clients that accept compressed responses get the file's precompressed
+ * .br or .gz sibling if there is one, or else (if enabled) a gzipped copy
+ * that we compress once when the file is loaded. Each of these is a separate
+ * entry, so compressing costs CPU once per version of the file rather than
+ * once per request.
+ *
+ * INVALIDATION:
+ * We check that a cached file hasn't changed with stat() at most once every
+ * CACHE_REVALIDATE_INTERVAL seconds. If its modification time, size or inode
+ * differ from when we read it, the entry is dropped and the file read again.
+ * With the website index enabled (see route.c), that check is made against
+ * the index instead, so it doesn't cost a system call either.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "cache.h"
+#include "config.h"
+#include "fd_cache.h"
+#include "log.h"
+#include "mime.h"
+#include "response.h"
+#include "route.h"
+
+/*
+ * The hash table, and the most and least recently used ends of the LRU list.
+ */
+static struct cache_entry **buckets = NULL;
+static size_t num_buckets = 0;
+static size_t num_entries = 0;
+static struct cache_entry *lru_head = NULL;
+static struct cache_entry *lru_tail = NULL;
+
+/*
+ * Bytes used by the entries currently in the cache.
+ */
+static size_t memory_used = 0;
+
+/**
+ * current_time - Get the current time in seconds
+ *
+ * CLOCK_MONOTONIC_COARSE is read from memory the kernel shares with every
+ * process (the vDSO), so unlike stat() it doesn't cost us a system call.
+ *
+ * Return: Seconds on the monotonic clock
+ */
+static time_t current_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec;
+}
+
+/**
+ * hash_key - Hash a cache key
+ * @file_path: Resolved path of the file
+ * @response_code: Response code the file is served with
+ * @variant: Which version of the file
+ *
+ * This is FNV-1a, which is short and spreads similar strings (like paths in
+ * the same directory) well enough for a hash table.
+ *
+ * Return: Hash of the key
+ */
+static uint32_t hash_key(const char *file_path, int response_code,
+                         enum cache_variant variant) {
+  uint32_t hash = 2166136261u;
+
+  for (const unsigned char *c = (const unsigned char *)file_path; *c; c++) {
+    hash ^= *c;
+    hash *= 16777619u;
+  }
+
+  hash ^= (uint32_t)response_code;
+  hash *= 16777619u;
+  hash ^= (uint32_t)variant;
+  hash *= 16777619u;
+
+  return hash;
+}
+
+/**
+ * entry_memory - Work out how much memory an entry takes up
+ * @entry: Entry to measure
+ *
+ * Return: Size of the entry and everything it points to, in bytes
+ */
+static size_t entry_memory(const struct cache_entry *entry) {
+  size_t memory = sizeof(*entry) + strlen(entry->path) + 1 +
+                  strlen(entry->source_path) + 1 + entry->size;
+
+  for (int i = 0; i < 2; i++) {
+    memory += entry->headers[i].length + entry->not_modified[i].length;
+  }
+  if (entry->validator_lines) {
+    memory += strlen(entry->validator_lines) + 1;
+  }
+
+  return memory;
+}
+
+/**
+ * entry_free - Free an entry and everything it points to
+ * @entry: Entry that is no longer in the cache or in use
+ */
+static void entry_free(struct cache_entry *entry) {
+  fd_cache_release(entry->file);
+  free(entry->path);
+  free(entry->source_path);
+  free(entry->data);
+  for (int i = 0; i < 2; i++) {
+    free(entry->headers[i].text);
+    free(entry->not_modified[i].text);
+  }
+  free(entry->validator_lines);
+  free(entry);
+}
+
+/**
+ * find_entry - Look up an entry in the hash table
+ * @file_path: Resolved path of the file
+ * @response_code: Response code the file is served with
+ * @variant: Which version of the file
+ * @hash: hash_key() of the above
+ *
+ * Return: The entry, or NULL if it isn't cached
+ */
+static struct cache_entry *find_entry(const char *file_path,
+                                      int response_code,
+                                      enum cache_variant variant,
+                                      uint32_t hash) {
+  if (!buckets) {
+    return NULL;
+  }
+
+  /*
+   * num_buckets is a power of two, so masking off the low bits is the same as
+   * hash % num_buckets without the division.
+   */
+  struct cache_entry *entry = buckets[hash & (num_buckets - 1)];
+  while (entry) {
+    if (entry->hash == hash && entry->response_code == response_code &&
+        entry->variant == variant && strcmp(entry->path, file_path) == 0) {
+      return entry;
+    }
+    entry = entry->bucket_next;
+  }
+
+  return NULL;
+}
+
+/**
+ * lru_remove - Unlink an entry from the LRU list
+ * @entry: Entry to unlink
+ */
+static void lru_remove(struct cache_entry *entry) {
+  if (entry->lru_prev) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    lru_head = entry->lru_next;
+  }
+
+  if (entry->lru_next) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    lru_tail = entry->lru_prev;
+  }
+
+  entry->lru_prev = NULL;
+  entry->lru_next = NULL;
+}
+
+/**
+ * lru_push_front - Mark an entry as the most recently used
+ * @entry: Entry that isn't currently in the LRU list
+ */
+static void lru_push_front(struct cache_entry *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = lru_head;
+
+  if (lru_head) {
+    lru_head->lru_prev = entry;
+  } else {
+    lru_tail = entry;
+  }
+  lru_head = entry;
+}
+
+/**
+ * cache_remove - Take an entry out of the cache
+ * @entry: Cached entry to remove
+ *
+ * Connections that are still sending the entry keep their reference, and the
+ * last of them to release it frees it.
+ */
+static void cache_remove(struct cache_entry *entry) {
+  struct cache_entry **link = &buckets[entry->hash & (num_buckets - 1)];
+  while (*link != entry) {
+    link = &(*link)->bucket_next;
+  }
+  *link = entry->bucket_next;
+  entry->bucket_next = NULL;
+
+  lru_remove(entry);
+
+  memory_used -= entry_memory(entry);
+  num_entries--;
+  entry->cached = false;
+
+  if (entry->refs == 0) {
+    entry_free(entry);
+  }
+}
+
+/**
+ * grow_table - Make sure the hash table has room for another entry
+ *
+ * Keeping at least as many buckets as entries keeps the chains short. When
+ * the table grows, every entry has to move to the bucket for its hash in the
+ * larger table.
+ *
+ * Return: 0 on success, -1 if we couldn't allocate a larger table
+ */
+static int grow_table(void) {
+  if (buckets && num_entries < num_buckets) {
+    return 0;
+  }
+
+  size_t new_num_buckets = buckets ? num_buckets * 2 : CACHE_INITIAL_BUCKETS;
+  struct cache_entry **new_buckets =
+      calloc(new_num_buckets, sizeof(*new_buckets));
+  if (!new_buckets) {
+    log_event(WARN, "Failed to grow file cache.");
+    return -1;
+  }
+
+  for (size_t i = 0; i < num_buckets; i++) {
+    struct cache_entry *entry = buckets[i];
+    while (entry) {
+      struct cache_entry *next = entry->bucket_next;
+      size_t bucket = entry->hash & (new_num_buckets - 1);
+      entry->bucket_next = new_buckets[bucket];
+      new_buckets[bucket] = entry;
+      entry = next;
+    }
+  }
+
+  free(buckets);
+  buckets = new_buckets;
+  num_buckets = new_num_buckets;
+  return 0;
+}
+
+/**
+ * memory_limit - Get the most memory the cache may use
+ *
+ * Return: Limit in bytes
+ */
+static size_t memory_limit(void) {
+  return (size_t)config_get_ctx()->cache_size * 1024 * 1024;
+}
+
+/**
+ * is_cacheable - Check whether a file is small enough to cache
+ * @file_size: Size of the file in bytes
+ *
+ * Return: true if the file is within the configured limits
+ */
+static bool is_cacheable(size_t file_size) {
+  size_t file_size_limit =
+      (size_t)config_get_ctx()->cache_max_file_size * 1024;
+  return file_size <= file_size_limit && file_size < memory_limit();
+}
+
+/**
+ * cache_insert - Add a freshly loaded entry to the cache
+ * @entry: Entry that isn't in the cache yet
+ *
+ * Entries that are too large for the configured limits, or that are sent
+ * straight from the file, aren't cached. They're just freed once the response
+ * has been sent.
+ */
+static void cache_insert(struct cache_entry *entry) {
+  size_t memory = entry_memory(entry);
+  if (entry->fd != -1 || !is_cacheable(entry->size) ||
+      memory > memory_limit()) {
+    return;
+  }
+
+  if (grow_table() == -1) {
+    return;
+  }
+
+  size_t bucket = entry->hash & (num_buckets - 1);
+  entry->bucket_next = buckets[bucket];
+  buckets[bucket] = entry;
+  lru_push_front(entry);
+
+  entry->cached = true;
+  memory_used += memory;
+  num_entries++;
+
+  /*
+   * The new entry is at the head of the list, so it's the last thing we'd
+   * evict, and we already know it fits on its own.
+   */
+  while (memory_used > memory_limit()) {
+    cache_remove(lru_tail);
+  }
+}
+
+/**
+ * open_file - Open a file and remember its metadata
+ * @entry: Entry to fill in, entry->source_path must already be set
+ *
+ * The open file cache stats the file through the same descriptor we read it
+ * from, so the metadata we compare against later is guaranteed to belong to
+ * the contents we cached, even if the file is replaced while we're reading
+ * it.
+ *
+ * Return: Open file, which the caller releases, or NULL on failure
+ */
+static struct open_file *open_file(struct cache_entry *entry) {
+  struct open_file *file = fd_cache_open(entry->source_path);
+  if (!file) {
+    char open_fail_msg[LOG_MSG_MAX];
+    snprintf(open_fail_msg, LOG_MSG_MAX, "Failed to open file %s: %s",
+             entry->source_path, strerror(errno));
+    log_event(ERROR, open_fail_msg);
+    return NULL;
+  }
+
+  entry->size = (size_t)file->file_stat.st_size;
+  entry->file_size = file->file_stat.st_size;
+  entry->mtime = file->file_stat.st_mtim;
+  entry->dev = file->file_stat.st_dev;
+  entry->ino = file->file_stat.st_ino;
+
+  return file;
+}
+
+/**
+ * read_contents - Read a whole file into an entry
+ * @entry: Entry filled in by open_file()
+ * @fd: Descriptor of the file returned by open_file()
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int read_contents(struct cache_entry *entry, int fd) {
+  /*
+   * malloc(0) may return NULL, so empty files simply have no data.
+   */
+  if (entry->size > 0) {
+    entry->data = malloc(entry->size);
+    if (!entry->data) {
+      log_event(ERROR, "Failed to allocate memory for file contents.");
+      return -1;
+    }
+  }
+
+  /*
+   * pread() may return less than we asked for, so keep going until we have
+   * the whole file. Running out early means the file shrank while we were
+   * reading it, and we'd rather fail this request than cache half a file.
+   * The descriptor is shared through the open file cache, so we give the
+   * offset rather than relying on (and moving) the file position.
+   */
+  size_t bytes_read = 0;
+  while (bytes_read < entry->size) {
+    ssize_t result = pread(fd, entry->data + bytes_read,
+                           entry->size - bytes_read, (off_t)bytes_read);
+    if (result == -1 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      log_event(ERROR, "Error reading file into buffer.");
+      return -1;
+    }
+    bytes_read += (size_t)result;
+  }
+
+  return 0;
+}
+
+/**
+ * build_validators - Work out the validators for a file served with 200
+ * @entry: Entry filled in by open_file()
+ *
+ * Last-Modified is the file's modification time. It only has a resolution of
+ * one second, so a file changed twice in the same second would look
+ * unchanged to a client going by the date alone.
+ *
+ * The ETag is any string that changes whenever the file does. Like most
+ * servers we build it from the modification time (to the nanosecond, which
+ * covers the case above) and the size, so it costs nothing to work out.
+ * Compressed versions are different bytes, so they need ETags of their own,
+ * which we get by adding the encoding to the end.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int build_validators(struct cache_entry *entry) {
+  static const char *etag_suffixes[] = {"", "-br", "-gz", "-gzip"};
+  static const char *encoding_lines[] = {"", "Content-Encoding: br\r\n",
+                                         "Content-Encoding: gzip\r\n",
+                                         "Content-Encoding: gzip\r\n"};
+  struct server_config *config = config_get_ctx();
+
+  format_http_date(entry->last_modified, entry->mtime.tv_sec);
+  snprintf(entry->etag, MAX_ETAG, "\"%llx-%lx-%llx%s\"",
+           (unsigned long long)entry->mtime.tv_sec,
+           (unsigned long)entry->mtime.tv_nsec,
+           (unsigned long long)entry->file_size,
+           etag_suffixes[entry->variant]);
+
+  const char *cache_control = config_get_cache_control(entry->path);
+
+  /*
+   * When we might send a compressed version, Vary tells caches between us and
+   * the client that the response depends on Accept-Encoding, so they don't
+   * hand a gzipped response to a client that can't read it. That applies to
+   * the uncompressed version as much as the compressed ones.
+   */
+  const char *vary_line = config->precompressed || config->gzip
+                              ? "Vary: Accept-Encoding\r\n"
+                              : "";
+
+  char lines[MAX_HEADER];
+  int length = snprintf(lines, MAX_HEADER,
+                        "Last-Modified: %s\r\nETag: %s\r\n%s%s%s%s%s",
+                        entry->last_modified, entry->etag,
+                        cache_control ? "Cache-Control: " : "",
+                        cache_control ? cache_control : "",
+                        cache_control ? "\r\n" : "",
+                        encoding_lines[entry->variant], vary_line);
+  if (length < 0 || length >= MAX_HEADER) {
+    log_event(ERROR, "Header overflow.");
+    return -1;
+  }
+
+  entry->validator_lines = strdup(lines);
+  if (!entry->validator_lines) {
+    log_event(ERROR, "Failed to allocate memory for validator headers.");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * build_headers - Build every header an entry may be served with
+ * @entry: Entry filled in by open_file()
+ *
+ * Builds the headers based on the response_code and file path, the latter's
+ * extension determines what Content-Type will be set to.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int build_headers(struct cache_entry *entry) {
+  bool cacheable_response = entry->response_code == 200;
+
+  if (cacheable_response && build_validators(entry) == -1) {
+    return -1;
+  }
+
+  for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+    struct prebuilt_header *header = &entry->headers[keep_alive];
+    header->text =
+        construct_header(entry->response_code, entry->path, entry->size,
+                         keep_alive, entry->validator_lines);
+    if (!header->text) {
+      log_event(ERROR, "Failed to construct header.");
+      return -1;
+    }
+    header->length = strlen(header->text);
+
+    if (!cacheable_response) {
+      continue;
+    }
+
+    struct prebuilt_header *not_modified = &entry->not_modified[keep_alive];
+    not_modified->text = construct_header(304, entry->path, 0, keep_alive,
+                                          entry->validator_lines);
+    if (!not_modified->text) {
+      log_event(ERROR, "Failed to construct header.");
+      return -1;
+    }
+    not_modified->length = strlen(not_modified->text);
+  }
+
+  return 0;
+}
+
+/**
+ * compress_contents - Replace an entry's contents with a gzipped copy
+ * @entry: Entry whose contents have been read into memory
+ *
+ * deflateBound() gives the most the compressed data could take up, so we can
+ * compress the whole file in one call. Passing 16 + MAX_WBITS as the window
+ * size has zlib wrap the compressed data in a gzip header and trailer.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int compress_contents(struct cache_entry *entry) {
+  z_stream stream = {0};
+  if (deflateInit2(&stream, config_get_ctx()->gzip_level, Z_DEFLATED,
+                   16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    log_event(ERROR, "Failed to initialize gzip compression.");
+    return -1;
+  }
+
+  uLong bound = deflateBound(&stream, (uLong)entry->size);
+  unsigned char *compressed = malloc(bound);
+  if (!compressed) {
+    log_event(ERROR, "Failed to allocate memory for compressed file.");
+    deflateEnd(&stream);
+    return -1;
+  }
+
+  stream.next_in = entry->data;
+  stream.avail_in = (uInt)entry->size;
+  stream.next_out = compressed;
+  stream.avail_out = (uInt)bound;
+
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+    log_event(ERROR, "Failed to compress file.");
+    free(compressed);
+    deflateEnd(&stream);
+    return -1;
+  }
+
+  free(entry->data);
+  entry->data = compressed;
+  entry->size = stream.total_out;
+
+  deflateEnd(&stream);
+  return 0;
+}
+
+/**
+ * is_regular_file - Check whether a path names a regular file
+ * @file_path: Full path to check
+ *
+ * Return: true if it does
+ */
+static bool is_regular_file(const char *file_path) {
+  const struct route *route;
+  if (route_index_lookup(file_path, &route)) {
+    return route != NULL;
+  }
+
+  struct stat file_stat;
+  return stat(file_path, &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+}
+
+/**
+ * find_siblings - Check for precompressed versions of a file
+ * @entry: Identity entry of a file served with 200
+ *
+ * Precompressed files sit next to the original with .br or .gz added to the
+ * name, e.g. style.css.br. They're usually compressed at the highest level
+ * ahead of time, which is too slow to do while a client waits.
+ */
+static void find_siblings(struct cache_entry *entry) {
+  entry->has_brotli = false;
+  entry->has_gzip = false;
+  if (!config_get_ctx()->precompressed) {
+    return;
+  }
+
+  char sibling_path[PATH_MAX];
+
+  if (snprintf(sibling_path, PATH_MAX, "%s.br", entry->path) < PATH_MAX &&
+      is_regular_file(sibling_path)) {
+    entry->has_brotli = true;
+  }
+
+  if (snprintf(sibling_path, PATH_MAX, "%s.gz", entry->path) < PATH_MAX &&
+      is_regular_file(sibling_path)) {
+    entry->has_gzip = true;
+  }
+}
+
+/**
+ * get_source_path - Work out which file a variant is read from
+ * @file_path: Resolved path of the file
+ * @variant: Which version of the file
+ *
+ * Return: Allocated path, or NULL on failure
+ */
+static char *get_source_path(const char *file_path,
+                             enum cache_variant variant) {
+  static const char *extensions[] = {"", ".br", ".gz", ""};
+
+  size_t length = strlen(file_path) + strlen(extensions[variant]) + 1;
+  char *source_path = malloc(length);
+  if (!source_path) {
+    log_event(ERROR, "Failed to allocate memory for file path.");
+    return NULL;
+  }
+
+  snprintf(source_path, length, "%s%s", file_path, extensions[variant]);
+  return source_path;
+}
+
+/**
+ * load_entry - Read a file and build its response headers
+ * @file_path: Resolved path of the file
+ * @response_code: Response code the file is served with
+ * @variant: Which version of the file
+ * @hash: hash_key() of the above
+ *
+ * Return: New entry with no references, or NULL on failure
+ */
+static struct cache_entry *load_entry(const char *file_path, int response_code,
+                                      enum cache_variant variant,
+                                      uint32_t hash) {
+  struct cache_entry *entry = calloc(1, sizeof(*entry));
+  if (!entry) {
+    log_event(ERROR, "Failed to allocate memory for cache entry.");
+    return NULL;
+  }
+  entry->fd = -1;
+
+  entry->response_code = response_code;
+  entry->variant = variant;
+  entry->hash = hash;
+  entry->path = strdup(file_path);
+  entry->source_path = get_source_path(file_path, variant);
+  if (!entry->path || !entry->source_path) {
+    log_event(ERROR, "Failed to duplicate file path.");
+    entry_free(entry);
+    return NULL;
+  }
+
+  struct open_file *file = open_file(entry);
+  if (!file) {
+    entry_free(entry);
+    return NULL;
+  }
+
+  /*
+   * Reading a file we won't cache into memory would cost as much memory as the
+   * file is large, for every client downloading it. We hold on to the
+   * descriptor instead, and the body is read a chunk at a time as it's sent.
+   */
+  if (!is_cacheable(entry->size)) {
+    /*
+     * We only compress files ourselves if we can cache the result, otherwise
+     * we'd be compressing them for every request.
+     */
+    if (variant == VARIANT_GZIP_GENERATED) {
+      fd_cache_release(file);
+      entry_free(entry);
+      return NULL;
+    }
+    entry->file = file;
+    entry->fd = file->fd;
+  } else {
+    int result = read_contents(entry, file->fd);
+    fd_cache_release(file);
+    if (result == -1 || (variant == VARIANT_GZIP_GENERATED &&
+                         compress_contents(entry) == -1)) {
+      entry_free(entry);
+      return NULL;
+    }
+  }
+
+  if (variant == VARIANT_IDENTITY && response_code == 200) {
+    find_siblings(entry);
+    entry->compressible = entry->fd == -1 && is_compressible_type(file_path);
+  }
+
+  if (build_headers(entry) == -1) {
+    entry_free(entry);
+    return NULL;
+  }
+
+  return entry;
+}
+
+/**
+ * is_unchanged - Check a cached file against the filesystem
+ * @entry: Cached entry to check
+ *
+ * With the website index enabled, the index already knows what the file
+ * looks like now, as it's rebuilt whenever the file changes.
+ *
+ * Return: true if the file on disk is still the one we cached
+ */
+static bool is_unchanged(const struct cache_entry *entry) {
+  const struct route *route;
+  if (route_index_lookup(entry->source_path, &route)) {
+    return route && route->mtime.tv_sec == entry->mtime.tv_sec &&
+           route->mtime.tv_nsec == entry->mtime.tv_nsec &&
+           route->size == entry->file_size && route->dev == entry->dev &&
+           route->ino == entry->ino;
+  }
+
+  struct stat file_stat;
+  if (stat(entry->source_path, &file_stat) == -1) {
+    return false;
+  }
+
+  return file_stat.st_mtim.tv_sec == entry->mtime.tv_sec &&
+         file_stat.st_mtim.tv_nsec == entry->mtime.tv_nsec &&
+         file_stat.st_size == entry->file_size &&
+         file_stat.st_dev == entry->dev && file_stat.st_ino == entry->ino;
+}
+
+/**
+ * cache_get - Get the cache entry for a file, loading it if necessary
+ * @file_path: Resolved path of the file
+ * @response_code: Response code the file is served with
+ * @variant: Which version of the file
+ *
+ * Return: Entry with a reference held by the caller, or NULL on failure
+ */
+struct cache_entry *cache_get(const char *file_path, int response_code,
+                              enum cache_variant variant) {
+  time_t now = current_time();
+  uint32_t hash = hash_key(file_path, response_code, variant);
+
+  struct cache_entry *entry =
+      find_entry(file_path, response_code, variant, hash);
+  if (entry && now - entry->validated >= CACHE_REVALIDATE_INTERVAL) {
+    if (is_unchanged(entry)) {
+      entry->validated = now;
+
+      /*
+       * Precompressed siblings may have been added or removed without the
+       * file itself changing.
+       */
+      if (variant == VARIANT_IDENTITY && response_code == 200) {
+        find_siblings(entry);
+      }
+    } else {
+      cache_remove(entry);
+      entry = NULL;
+    }
+  }
+
+  if (entry) {
+    lru_remove(entry);
+    lru_push_front(entry);
+    entry->refs++;
+    return entry;
+  }
+
+  entry = load_entry(file_path, response_code, variant, hash);
+  if (!entry) {
+    return NULL;
+  }
+  entry->validated = now;
+  entry->refs = 1;
+
+  cache_insert(entry);
+  return entry;
+}
+
+/**
+ * cache_release - Drop a reference to a cache entry
+ * @entry: Entry returned by cache_get(), or NULL
+ */
+void cache_release(struct cache_entry *entry) {
+  if (!entry) {
+    return;
+  }
+
+  entry->refs--;
+  if (entry->refs == 0 && !entry->cached) {
+    entry_free(entry);
+  }
+}
+
+/**
+ * cache_clear - Drop every entry from the cache
+ *
+ * Used after a reload, since the configuration the headers were built with
+ * may have changed.
+ */
+void cache_clear(void) {
+  while (lru_tail) {
+    cache_remove(lru_tail);
+  }
+}
+
+/**
+ * cache_is_fresh - Check whether a file is cached and recently validated
+ * @file_path: Resolved path of the file
+ * @response_code: Response code the file is served with
+ *
+ * Return: true if the file was found on disk within the revalidation interval
+ */
+bool cache_is_fresh(const char *file_path, int response_code) {
+  struct cache_entry *entry =
+      find_entry(file_path, response_code, VARIANT_IDENTITY,
+                 hash_key(file_path, response_code, VARIANT_IDENTITY));
+
+  return entry && current_time() - entry->validated < CACHE_REVALIDATE_INTERVAL;
+}
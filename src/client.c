@@ -5,81 +5,242 @@
  *
  * OVERVIEW:
  * Responsible for the request-response cycle for each individual client.
- * Each function is responsible for one stage of processing:
+ * Each function is responsible for one stage of processing, and
+ * handle_client() moves the connection from one stage to the next.
+ *
+ * PERSISTENT CONNECTIONS:
+ * Unless the client asks us to close the connection, we go back to reading
+ * once we've sent a response, so that the client can send further requests
+ * without paying for a new TCP and TLS handshake each time. Clients are
+ * allowed to send several requests without waiting for the responses
+ * (pipelining). We answer them strictly in order, since HTTP/1.1 gives the
+ * client no other way to match responses to requests.
+ *
+ * NON-BLOCKING I/O:
+ * Client sockets are non-blocking, so any OpenSSL call can fail with
+ * SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE, meaning the client hasn't sent
+ * enough data yet or its receive window is full. That isn't an error: we
+ * leave the connection in its current state and the event loop calls us again
+ * when the socket is ready. Note that the handshake and even SSL_read() can
+ * need to WRITE (and SSL_write() can need to read), which is why we don't
+ * distinguish between the two.
+ *
+ * With tls_async on, a call can also fail with SSL_ERROR_WANT_ASYNC while a
+ * provider works on it elsewhere. We treat that the same way: the event loop
+ * calls us again when the work is done, and we make the same call again to
+ * pick up its result.
  *
  * ERROR HANDLING:
- * If any step fails, we call server_cleanup() and return early. This
- * ensures SSL structures and file descriptors are properly freed regardless of
- * when the error occurs.
+ * If any step fails, we return 0 from handle_client() and the event loop frees
+ * the connection's SSL structure, buffers and socket. Errors only affect the
+ * client they happened on.
  */
 
+#include <errno.h>
+#include <linux/limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#include "file.h"
+#include "cache.h"
+#include "config.h"
+#include "connection.h"
+#include "event.h"
+#include "limit.h"
 #include "log.h"
+#include "metrics.h"
+#include "pool.h"
 #include "response.h"
 #include "server.h"
+#include "vhost.h"
+
+/**
+ * ssl_should_retry - Check whether a failed OpenSSL call should be retried
+ * @ssl: SSL connection the call was made on
+ * @result: Return value of the failed call
+ *
+ * OpenSSL keeps a queue of errors per thread. If we leave errors from one
+ * connection in the queue, SSL_get_error() can misreport the next failure on
+ * a different connection, so we clear it whenever we give up on a connection.
+ *
+ * SSL_ERROR_WANT_ASYNC_JOB would mean OpenSSL had no job to run the call in,
+ * but our pool of jobs has no limit, so that only happens if it's out of
+ * memory, which we treat as a failure.
+ *
+ * Return: true if the call should be retried when the socket is ready (or
+ * its async job has finished), false if the connection has failed or been
+ * closed by the client
+ */
+static bool ssl_should_retry(SSL *ssl, int result) {
+  int ssl_error = SSL_get_error(ssl, result);
+  if (ssl_error == SSL_ERROR_WANT_READ || ssl_error == SSL_ERROR_WANT_WRITE ||
+      ssl_error == SSL_ERROR_WANT_ASYNC) {
+    return true;
+  }
+
+  ERR_clear_error();
+  return false;
+}
+
+/**
+ * grow_request_buffer - Double the size of a full request buffer
+ * @conn: Connection whose request doesn't fit its buffer
+ *
+ * Most requests fit the REQUEST_BUFFER_SIZE buffer every connection starts
+ * with, so only the odd request with lots of cookies or other large headers
+ * needs more. The parser has already rejected anything over
+ * REQUEST_HEAD_MAX, so the buffer never grows past that.
+ *
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int grow_request_buffer(struct connection *conn) {
+  size_t new_capacity = conn->request_capacity * 2;
+  char *new_buffer = pool_get(new_capacity);
+  if (!new_buffer) {
+    log_event(ERROR, "Failed to allocate memory for request_buffer.");
+    return -1;
+  }
+
+  memcpy(new_buffer, conn->request_buffer, conn->request_length);
+  request_relocate(&conn->request, conn->request_buffer, new_buffer);
+  pool_put(conn->request_buffer, conn->request_capacity);
+
+  conn->request_buffer = new_buffer;
+  conn->request_capacity = new_capacity;
+  return 0;
+}
 
 /**
  * read_from_client - Read HTTP request from client over SSL connection
- * @server: Server context containing SSL connection
- * @request_buffer: Buffer to store the incoming request
+ * @conn: Connection to read from
  *
- * Reads data from the encrypted SSL connection into our buffer.
+ * Reads data from the encrypted SSL connection into the connection's request
+ * buffer until the whole request head has arrived, parsing it as it comes.
  *
- * BUFFER_SIZE (1MB) is adequate for our purposes, as we do not support the POST
- * method which would allow the client to send a file in their request.
+ * The buffer only needs to hold one request head of up to REQUEST_HEAD_MAX
+ * bytes, as we do not support the POST method which would allow the client
+ * to send a file in their request. It starts out at REQUEST_BUFFER_SIZE and
+ * grows if the request turns out to be larger.
  *
- * Return: 0 on success, -1 on failure
+ * Return: 1 once the request is complete (or known to be invalid), 0 if we
+ * need to wait for more data, -1 on failure
  */
-static int read_from_client(struct server_ctx *server, char *request_buffer) {
+static int read_from_client(struct connection *conn) {
+  /*
+   * Connections only hold a request buffer while a request is arriving, so
+   * clients that never get past the handshake and persistent connections
+   * waiting for their next request don't tie one up. The buffer comes from
+   * the worker's pool, so getting one doesn't usually mean allocating.
+   */
+  if (!conn->request_buffer) {
+    conn->request_buffer = pool_get(REQUEST_BUFFER_SIZE);
+    if (!conn->request_buffer) {
+      log_event(ERROR, "Failed to allocate memory for request_buffer.");
+      return -1;
+    }
+    conn->request_capacity = REQUEST_BUFFER_SIZE;
+  }
+
   /*
-   * Read up to (BUFFER_SIZE - 1) bytes from the SSL connection so that we leave
-   * room for the null terminator since we'll be parsing the request as a
-   * string.
-   *
    * SSL_read() may return fewer bytes than requested:
    * - If request is smaller than buffer
    * - If network packet boundaries split the data
    * - If TLS record boundaries split the data
    *
-   * Most HTTP requests are < 8KB, so a single call is sufficient.
+   * So we keep reading until we have the whole request, or until OpenSSL
+   * tells us there's nothing more to read for now. Since the socket is
+   * edge-triggered, we MUST read until then or we won't be told about the
+   * rest of the request.
+   *
+   * A pipelined request may already be in the buffer in full, which is why we
+   * parse before reading.
    */
-  int bytes_read = SSL_read(server->ssl, request_buffer, BUFFER_SIZE - 1);
+  for (;;) {
+    uint64_t parse_start = metrics_clock();
+    conn->parse_result = request_parse(&conn->request, conn->request_buffer,
+                                       conn->request_length);
+    conn->parse_time += metrics_clock() - parse_start;
+    if (conn->parse_result != PARSE_INCOMPLETE) {
+      metrics_record(METRICS_PARSE, conn->parse_time);
+      conn->parse_time = 0;
+      return 1;
+    }
 
-  if (bytes_read <= 0) {
-    log_event(ERROR, "Failed to read from connection.");
-    server_cleanup();
-    return -1;
-  }
+    if (conn->request_length == conn->request_capacity &&
+        grow_request_buffer(conn) == -1) {
+      return -1;
+    }
 
-  request_buffer[bytes_read] = '\0';
+    int bytes_read =
+        SSL_read(conn->ssl, conn->request_buffer + conn->request_length,
+                 (int)(conn->request_capacity - conn->request_length));
 
-  return 0;
+    if (bytes_read <= 0) {
+      if (ssl_should_retry(conn->ssl, bytes_read)) {
+        if (conn->request_length == 0) {
+          pool_put(conn->request_buffer, conn->request_capacity);
+          conn->request_buffer = NULL;
+          conn->request_capacity = 0;
+        }
+        return 0;
+      }
+
+      /*
+       * Clients close idle persistent connections whenever they like, so
+       * that's only an error if it happens partway through a request.
+       */
+      if (conn->requests_served == 0 || conn->request_length > 0) {
+        log_event(ERROR, "Failed to read from connection.");
+      }
+      return -1;
+    }
+
+    conn->request_length += (size_t)bytes_read;
+  }
 }
 
 /**
- * process_request - Parse request and determine appropriate response
- * @path_buffer: Output parameter for path to response file
- * @request_buffer: The HTTP request from client
- * @response_code: Output parameter for HTTP status code (200, 404, etc.)
+ * ktls_send_enabled - Check whether the kernel is encrypting our writes
+ * @conn: Connection that has completed its handshake
+ *
+ * kTLS is only switched on once the handshake has settled which cipher to use,
+ * and only if the kernel supports that cipher, so this can differ from one
+ * connection to the next.
+ *
+ * Return: true if the body can be sent with SSL_sendfile()
+ */
+static bool ktls_send_enabled(struct connection *conn) {
+  return BIO_get_ktls_send(SSL_get_wbio(conn->ssl));
+}
+
+/**
+ * process_request - Determine appropriate response to a parsed request
+ * @path_buffer: Output parameter for path to the requested file
+ * @conn: Connection whose request has been parsed
  *
  * This function analyzes the HTTP request and decides what should be sent as a
- * response.
+ * response, setting the connection's response_code.
  *
  * Return: 0 on success, -1 on error
  */
-static int process_request(char **path_buffer, char *request_buffer,
-                           int *response_code) {
+static int process_request(char **path_buffer, struct connection *conn) {
   /*
    * Extract the requested file path from the HTTP request and prepend the
-   * website directory to it.
+   * directory of the website it's for to it.
    *
    * path_buffer is where we will look for the file to send.
    */
-  if (get_requested_file_path(path_buffer, request_buffer) == -1) {
+  const char *website_path = vhost_website_path(&conn->request, conn->ssl);
+  if (!website_path) {
+    return -1;
+  }
+  enum path_result path_result = PATH_OK;
+  if (get_requested_file_path(path_buffer, &conn->request, website_path,
+                              &path_result) == -1) {
     log_event(FATAL, "Failed to get requested file path.");
-    server_cleanup();
     return -1;
   }
 
@@ -87,39 +248,512 @@ static int process_request(char **path_buffer, char *request_buffer,
    * Analyze the request and path to determine HTTP status code.
    *
    * VALIDATION CHECKS PERFORMED:
-   * 1. Is the HTTP method supported? (405 Method Not Allowed)
-   * 2. Does path contain directory traversal attempts? (403 Forbidden)
-   * 3. Does the file exist? (404 Not Found)
-   *
-   * If validation fails, path_buffer is updated to point to the
-   * appropriate error page.
-   *
-   * ERROR PAGE LOCATIONS:
-   * Primary: ~/.local/share/cyllenian/website/404.html
-   * Fallback: /etc/cyllenian/website/404.html
-   *
-   * The fallback ensures error pages work even if user hasn't installed
-   * custom ones in their website directory.
+   * 1. Did the request parse? (400 Bad Request, 414 URI Too Long or 431
+   *    Request Header Fields Too Large)
+   * 2. Is the HTTP method supported? (405 Method Not Allowed)
+   * 3. Is the path's percent-encoding valid? (400 Bad Request)
+   * 4. Does path contain directory traversal attempts? (403 Forbidden)
+   * 5. Does the file exist? (404 Not Found)
+   */
+  determine_response_code(&conn->request, conn->parse_result, path_result,
+                          *path_buffer, &conn->response_code);
+  return 0;
+}
+
+/**
+ * prepare_range - Cut the response down to the range the client asked for
+ * @conn: Connection with a full response prepared from its cache entry
+ *
+ * Range requests let a video player seek without downloading everything up
+ * to the point it's seeking to, and let interrupted downloads pick up where
+ * they left off. The cached header is for the whole file, so partial
+ * responses get one of their own with a Content-Range header saying which
+ * part of the file this is.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int prepare_range(struct connection *conn) {
+  size_t file_size = conn->entry->size;
+  size_t range_start = 0;
+  size_t range_length = 0;
+
+  enum range_result range = get_request_range(
+      &conn->request, file_size, conn->entry->last_modified,
+      conn->entry->etag, &range_start, &range_length);
+  if (range == RANGE_NONE) {
+    return 0;
+  }
+
+  /*
+   * The part of the file still needs the validators from the full response,
+   * so the client can tell which version of the file it's part of.
+   */
+  char extra_headers[MAX_HEADER];
+  if (range == RANGE_SATISFIABLE) {
+    conn->response_code = 206;
+    snprintf(extra_headers, MAX_HEADER,
+             "%sContent-Range: bytes %zu-%zu/%zu\r\n",
+             conn->entry->validator_lines, range_start,
+             range_start + range_length - 1, file_size);
+  } else {
+    /*
+     * 416 tells the client how large the file actually is, so that it can
+     * ask again for a part that exists.
+     */
+    conn->response_code = 416;
+    snprintf(extra_headers, MAX_HEADER, "%sContent-Range: bytes */%zu\r\n",
+             conn->entry->validator_lines, file_size);
+  }
+
+  conn->header_buffer = pool_get(MAX_HEADER);
+  if (!conn->header_buffer) {
+    log_event(ERROR, "Failed to allocate memory for header_buffer.");
+    return -1;
+  }
+  if (format_header(conn->header_buffer, conn->response_code,
+                    conn->entry->path, range_length, conn->keep_alive,
+                    extra_headers) == -1) {
+    log_event(ERROR, "Failed to construct header.");
+    return -1;
+  }
+  conn->header = conn->header_buffer;
+  conn->header_length = strlen(conn->header_buffer);
+
+  conn->body_offset = range_start;
+  conn->body_length = range_length;
+  return 0;
+}
+
+/**
+ * get_encoded_entry - Get the cache entry to send, compressed if possible
+ * @request: Parsed request from client
+ * @file_path: Resolved path of the file
+ * @response_code: Response code the file is served with
+ *
+ * We always look up the file as it is first, since that entry knows whether
+ * the file has precompressed siblings and is worth compressing ourselves.
+ * Brotli makes smaller files than gzip, so a .br sibling wins if the client
+ * takes both. If the compressed version can't be loaded we fall back to the
+ * file as it is, which every client can read.
+ *
+ * Return: Entry with a reference held by the caller, or NULL on failure
+ */
+static struct cache_entry *get_encoded_entry(const struct http_request *request,
+                                             const char *file_path,
+                                             int response_code) {
+  struct cache_entry *identity =
+      cache_get(file_path, response_code, VARIANT_IDENTITY);
+  if (!identity || response_code != 200 ||
+      (!identity->has_brotli && !identity->has_gzip &&
+       !identity->compressible)) {
+    return identity;
+  }
+
+  bool accepts_gzip;
+  bool accepts_brotli;
+  get_accepted_encodings(request, &accepts_gzip, &accepts_brotli);
+
+  enum cache_variant variant;
+  if (accepts_brotli && identity->has_brotli) {
+    variant = VARIANT_BROTLI;
+  } else if (accepts_gzip && identity->has_gzip) {
+    variant = VARIANT_GZIP;
+  } else if (accepts_gzip && identity->compressible &&
+             config_get_ctx()->gzip) {
+    variant = VARIANT_GZIP_GENERATED;
+  } else {
+    return identity;
+  }
+
+  struct cache_entry *encoded = cache_get(file_path, response_code, variant);
+  if (!encoded) {
+    return identity;
+  }
+
+  cache_release(identity);
+  return encoded;
+}
+
+/**
+ * coalesce_response - Put the header and the start of the body together
+ * @conn: Connection with a prepared response
+ *
+ * Writing the header and body separately would send the header as a TLS
+ * record of its own, and likely a TCP segment of its own too. Instead we copy
+ * the header into the chunk buffer and fill the rest of it from the body, so
+ * they go out as one full record with a single SSL_write(). A small file is
+ * then one record and one write in all, and a large one is a run of full
+ * records with only the last one cut short.
+ *
+ * The copied part of the body is counted as sent, so whichever way the rest
+ * of the body is sent carries on from after it.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int coalesce_response(struct connection *conn) {
+  if (conn->body_length == 0 || conn->header_length >= TLS_RECORD_SIZE) {
+    return 0;
+  }
+
+  size_t room = TLS_RECORD_SIZE - conn->header_length;
+  size_t length = conn->body_length < room ? conn->body_length : room;
+
+  conn->chunk_buffer = pool_get(STREAM_CHUNK_SIZE);
+  if (!conn->chunk_buffer) {
+    log_event(ERROR, "Failed to allocate memory for chunk_buffer.");
+    return -1;
+  }
+  memcpy(conn->chunk_buffer, conn->header, conn->header_length);
+  unsigned char *body_start = conn->chunk_buffer + conn->header_length;
+
+  if (conn->entry->fd == -1) {
+    memcpy(body_start, conn->body + conn->body_offset, length);
+  } else {
+    size_t bytes_read = 0;
+    while (bytes_read < length) {
+      ssize_t result = pread(conn->entry->fd, body_start + bytes_read,
+                             length - bytes_read,
+                             (off_t)(conn->body_offset + bytes_read));
+      if (result == -1 && errno == EINTR) {
+        continue;
+      }
+      if (result <= 0) {
+        log_event(ERROR, "Failed to read file for streaming.");
+        return -1;
+      }
+      bytes_read += (size_t)result;
+    }
+  }
+
+  conn->header = (const char *)conn->chunk_buffer;
+  conn->header_length += length;
+  conn->body_sent = length;
+  return 0;
+}
+
+/**
+ * set_cork - Cork or uncork a connection's socket
+ * @conn: Connection to change
+ * @cork: Whether to cork it
+ *
+ * While a socket is corked, the kernel only sends full segments, so the
+ * record boundaries of a response sent over several writes don't each leave
+ * a small segment behind. Uncorking sends whatever is left straight away.
+ */
+static void set_cork(struct connection *conn, bool cork) {
+  int value = cork;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+  conn->corked = cork;
+}
+
+/**
+ * is_metrics_request - Check whether a request is for the metrics endpoint
+ * @conn: Connection whose request has been fully read
+ *
+ * Metrics say a lot about how the server is used, so they're only for
+ * clients on the same machine, which is where a Prometheus agent or an
+ * operator with curl would be. Anyone else asking for metrics_path gets
+ * whatever file is there, like any other request.
+ *
+ * Return: true if the metrics should be sent
+ */
+static bool is_metrics_request(const struct connection *conn) {
+  const char *metrics_path = config_get_ctx()->metrics_path;
+  const struct http_request *request = &conn->request;
+
+  return metrics_path && conn->loopback &&
+         conn->parse_result == PARSE_COMPLETE &&
+         (request->method == METHOD_GET || request->method == METHOD_HEAD) &&
+         request->path.length == strlen(metrics_path) &&
+         memcmp(request->path.data, metrics_path, request->path.length) == 0;
+}
+
+/**
+ * prepare_metrics_response - Send every worker's metrics
+ * @conn: Connection whose request is for the metrics endpoint
+ *
+ * The metrics change from one request to the next, so unlike files they're
+ * rendered afresh each time and never cached, by us or anyone else.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int prepare_metrics_response(struct connection *conn) {
+  size_t length = 0;
+  conn->metrics_body = metrics_render(&length);
+  if (!conn->metrics_body) {
+    return -1;
+  }
+
+  conn->header_buffer = pool_get(MAX_HEADER);
+  if (!conn->header_buffer) {
+    log_event(ERROR, "Failed to allocate memory for header_buffer.");
+    return -1;
+  }
+
+  /*
+   * Prometheus reads its text format from any text/plain response, which is
+   * the type a .txt file gets.
    */
-  if (determine_response_code(request_buffer, path_buffer, response_code) ==
-      -1) {
-    log_event(FATAL, "Failed to determine response code.");
-    server_cleanup();
+  conn->response_code = 200;
+  if (format_header(conn->header_buffer, conn->response_code, "metrics.txt",
+                    length, conn->keep_alive,
+                    "Cache-Control: no-store\r\n") == -1) {
+    log_event(ERROR, "Failed to construct header.");
     return -1;
   }
+  conn->header = conn->header_buffer;
+  conn->header_length = strlen(conn->header_buffer);
+  conn->header_sent = 0;
+
+  conn->body = (const unsigned char *)conn->metrics_body;
+  conn->body_offset = 0;
+  conn->body_length = conn->request.method == METHOD_HEAD ? 0 : length;
+  conn->body_sent = 0;
+  conn->response_size = conn->header_length + conn->body_length;
   return 0;
 }
 
 /**
- * write_to_client - Send HTTP response to client over SSL connection
- * @ssl: SSL connection to write to
- * @header: HTTP response header (status, content-type, etc.)
- * @path_buffer: Path to file to send in response body
- * @file_size: Output parameter for size of file sent (for logging)
+ * prepare_response - Build the complete response for the request
+ * @conn: Connection whose request has been fully read
+ *
+ * Works out which file to send and with what status, then points the
+ * connection at the cached header and file contents so that write_to_client()
+ * can send them as the socket allows.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int prepare_response(struct connection *conn) {
+  struct server_config *config = config_get_ctx();
+
+  /*
+   * If the request couldn't be parsed we can't tell where the next one would
+   * start, so this has to be the last one.
+   */
+  conn->keep_alive = conn->parse_result == PARSE_COMPLETE &&
+                     request_wants_keep_alive(&conn->request) &&
+                     conn->requests_served + 1 < config->keepalive_requests &&
+                     !event_loop_draining();
+
+  /*
+   * The first request on a connection was taken from the client's
+   * request_rate when it connected, and each one after it is taken here. A
+   * client over the rate is told so and the connection closed, so it has to
+   * get a new one past limit_accept() to carry on.
+   */
+  bool over_rate =
+      conn->requests_served > 0 && !limit_request(conn->limit_slot);
+  if (over_rate) {
+    conn->keep_alive = false;
+  }
+
+  /*
+   * PATH_MAX (4096 bytes) is the maximum path length on most Unix systems.
+   * This buffer will hold the full path to the requested file. The cache
+   * keeps its own copy, so the path is only needed until we've looked it up.
+   */
+  if (!over_rate && is_metrics_request(conn)) {
+    return prepare_metrics_response(conn);
+  }
+
+  char path_storage[PATH_MAX];
+  char *path_buffer = path_storage;
+
+  /*
+   * Determine what file was asked for and what HTTP status code to use.
+   */
+  if (over_rate) {
+    conn->response_code = 429;
+  } else {
+    uint64_t resolve_start = metrics_clock();
+    if (process_request(&path_buffer, conn) == -1) {
+      return -1;
+    }
+    metrics_record(METRICS_RESOLVE, metrics_clock() - resolve_start);
+  }
+
+  conn->header_sent = 0;
+  conn->body_offset = 0;
+  conn->body_sent = 0;
+
+  /*
+   * Errors have their whole response ready in memory, so there's no file to
+   * look up, and they're never conditional or cut down to part of the page.
+   * HEAD requests get the same response without the body.
+   */
+  if (conn->response_code != 200) {
+    conn->error_response =
+        error_response_get(conn->response_code, conn->keep_alive);
+    if (!conn->error_response) {
+      log_event(ERROR, "No error response for response code.");
+      return -1;
+    }
+    conn->header = conn->error_response->data;
+    conn->header_length = conn->request.method == METHOD_HEAD
+                              ? conn->error_response->header_length
+                              : conn->error_response->length;
+    conn->body = NULL;
+    conn->body_length = 0;
+    conn->response_size = conn->header_length;
+    return 0;
+  }
+
+  /*
+   * The cache hands us the file's contents along with a ready-made header, so
+   * for a file we've served recently this doesn't touch the disk at all.
+   * Files that aren't cached yet are read in whole here, whereas files too
+   * large to cache are left open to be streamed by write_to_client().
+   */
+  conn->entry =
+      get_encoded_entry(&conn->request, path_buffer, conn->response_code);
+  if (!conn->entry) {
+    return -1;
+  }
+
+  conn->header = conn->entry->headers[conn->keep_alive].text;
+  conn->header_length = conn->entry->headers[conn->keep_alive].length;
+
+  conn->body = conn->entry->data;
+  conn->body_length = conn->entry->size;
+
+  /*
+   * If the client's copy is current, which takes precedence over any Range,
+   * all it gets is a 304 header telling it so.
+   */
+  struct cache_entry *entry = conn->entry;
+  if (request_is_not_modified(&conn->request, entry->etag,
+                              entry->last_modified, entry->mtime.tv_sec)) {
+    conn->response_code = 304;
+    conn->header = entry->not_modified[conn->keep_alive].text;
+    conn->header_length = entry->not_modified[conn->keep_alive].length;
+    conn->body_length = 0;
+  } else if (prepare_range(conn) == -1) {
+    return -1;
+  }
+
+  /*
+   * HEAD responses carry the same Content-Length as GET would, but no body.
+   * Sending one anyway would have the client read it as the start of the next
+   * response on this connection.
+   */
+  if (conn->request.method == METHOD_HEAD) {
+    conn->body = NULL;
+    conn->body_length = 0;
+  }
+
+  conn->response_size = conn->header_length + conn->body_length;
+  return coalesce_response(conn);
+}
+
+/**
+ * sendfile_to_client - Send the response body straight from the file
+ * @conn: Connection using kTLS whose header has been sent
+ *
+ * SSL_sendfile() is a wrapper around sendfile(), which has the kernel copy
+ * the file from the page cache to the socket and encrypt it on the way. The
+ * file's contents never pass through our memory.
+ *
+ * We pass the offset rather than relying on the descriptor's file position,
+ * so several connections can send from the same file at once.
+ *
+ * Return: 1 once the body is sent, 0 if we need to wait for the client, -1 on
+ * failure
+ */
+static int sendfile_to_client(struct connection *conn) {
+  while (conn->body_sent < conn->body_length) {
+    ossl_ssize_t bytes_sent =
+        SSL_sendfile(conn->ssl, conn->entry->fd,
+                     (off_t)(conn->body_offset + conn->body_sent),
+                     conn->body_length - conn->body_sent, 0);
+    if (bytes_sent <= 0) {
+      if (ssl_should_retry(conn->ssl, (int)bytes_sent)) {
+        return 0;
+      }
+      log_event(ERROR, "Failed to send file to connection.");
+      return -1;
+    }
+    conn->body_sent += (size_t)bytes_sent;
+  }
+
+  return 1;
+}
+
+/**
+ * stream_to_client - Send the response body a chunk at a time
+ * @conn: Connection whose header has been sent
+ *
+ * Files too large to cache are read into the connection's chunk buffer and
+ * written from there, so a connection never holds more than STREAM_CHUNK_SIZE
+ * bytes of the file however large it is, and the first chunk goes out without
+ * waiting for the rest to be read.
+ *
+ * If SSL_write() only takes part of a chunk, the rest stays in the buffer
+ * until the socket is ready again. We only read the next chunk once the whole
+ * of the current one has been sent.
+ *
+ * Return: 1 once the body is sent, 0 if we need to wait for the client, -1 on
+ * failure
+ */
+static int stream_to_client(struct connection *conn) {
+  if (!conn->chunk_buffer) {
+    conn->chunk_buffer = pool_get(STREAM_CHUNK_SIZE);
+    if (!conn->chunk_buffer) {
+      log_event(ERROR, "Failed to allocate memory for chunk_buffer.");
+      return -1;
+    }
+  }
+
+  while (conn->body_sent < conn->body_length) {
+    if (conn->chunk_sent == conn->chunk_length) {
+      size_t remaining = conn->body_length - conn->body_sent;
+      size_t chunk_size =
+          remaining < STREAM_CHUNK_SIZE ? remaining : STREAM_CHUNK_SIZE;
+
+      /*
+       * pread() reads from the given offset without moving the descriptor's
+       * file position. At this point body_sent is exactly how far into the
+       * body we've got, and so how far past body_offset to read from.
+       */
+      ssize_t bytes_read =
+          pread(conn->entry->fd, conn->chunk_buffer, chunk_size,
+                (off_t)(conn->body_offset + conn->body_sent));
+      if (bytes_read == -1 && errno == EINTR) {
+        continue;
+      }
+      if (bytes_read <= 0) {
+        log_event(ERROR, "Failed to read file for streaming.");
+        return -1;
+      }
+      conn->chunk_length = (size_t)bytes_read;
+      conn->chunk_sent = 0;
+    }
+
+    int bytes_written =
+        SSL_write(conn->ssl, conn->chunk_buffer + conn->chunk_sent,
+                  (int)(conn->chunk_length - conn->chunk_sent));
+    if (bytes_written <= 0) {
+      if (ssl_should_retry(conn->ssl, bytes_written)) {
+        return 0;
+      }
+      log_event(ERROR, "Failed to write file to connection.");
+      return -1;
+    }
+    conn->chunk_sent += (size_t)bytes_written;
+    conn->body_sent += (size_t)bytes_written;
+  }
+
+  return 1;
+}
+
+/**
+ * send_response - Send HTTP response to client over SSL connection
+ * @conn: Connection with a prepared response
  *
  * Sends the complete HTTP response in two parts:
- * 1. Header (HTTP status, metadata)
- * 2. Body (file contents)
+ * 1. Header (HTTP status, metadata), along with as much of the body as fits
+ *    in the same TLS record (see coalesce_response())
+ * 2. The rest of the body (file contents), which SSL_write() and the kernel
+ *    split into full 16KB records
  *
  * HTTP RESPONSE FORMAT:
  *   HTTP/1.1 200 OK\r\n
@@ -133,42 +767,46 @@ static int process_request(char **path_buffer, char *request_buffer,
  * then down one line (\n). Use of CRLF is common among older network protocols
  * as they were optimizing for printing on teletypes.
  *
- * Return: 0 on success, -1 on failure
+ * Return: 1 once the whole response is sent, 0 if we need to wait for the
+ * client, -1 on failure
  */
-static int write_to_client(SSL *ssl, char **header, char **path_buffer,
-                           size_t *file_size) {
+static int send_response(struct connection *conn) {
   /*
    * Send the HTTP response header over SSL.
    *
    * RETURN VALUES:
-   * > 0 : Number of bytes written
-   * <= 0 : Error occurred
+   * > 0 : Number of bytes written, which may be less than we asked for since
+   *       we enabled SSL_MODE_ENABLE_PARTIAL_WRITE
+   * <= 0 : Error occurred, or the socket's send buffer is full
    *
    * COMMON ERRORS:
    * - Client closed connection before we could respond
    * - Network timeout
    * - SSL encryption error
    */
-  if (SSL_write(ssl, *header, strlen(*header)) <= 0) {
-    log_event(ERROR, "Failed to write header to connection.");
-    free(header);
-    server_cleanup();
-    return -1;
+  while (conn->header_sent < conn->header_length) {
+    int bytes_written =
+        SSL_write(conn->ssl, conn->header + conn->header_sent,
+                  (int)(conn->header_length - conn->header_sent));
+    if (bytes_written <= 0) {
+      if (ssl_should_retry(conn->ssl, bytes_written)) {
+        return 0;
+      }
+      log_event(ERROR, "Failed to write header to connection.");
+      return -1;
+    }
+    conn->header_sent += (size_t)bytes_written;
   }
 
   /*
-   * Read entire file into memory like caveman. For large files (videos,
-   * large downloads), a production server would use:
-   * - Chunked transfer encoding
-   * - Streaming (read and send in chunks)
-   * - sendfile() system call (zero-copy transfer)
-   *
-   * file_size is set to the number of bytes read, we'll need this to know how
-   * many bytes to write to the connection.
+   * Bodies of files too large to cache are sent straight from the file.
    */
-  unsigned char *response_file = read_file(*path_buffer, file_size);
-
-  free(*path_buffer);
+  if (conn->entry && conn->entry->fd != -1) {
+    if (ktls_send_enabled(conn)) {
+      return sendfile_to_client(conn);
+    }
+    return stream_to_client(conn);
+  }
 
   /*
    * Send the file contents as the HTTP response body.
@@ -176,165 +814,270 @@ static int write_to_client(SSL *ssl, char **header, char **path_buffer,
    * The Content-Type field we include in the header tells the browser how to
    * intrepret these bytes (e.g, as an HTML file or an image).
    */
-  if (SSL_write(ssl, response_file, *file_size) <= 0) {
-    log_event(ERROR, "Failed to write file to connection.");
-    free(response_file);
-    server_cleanup();
-    return -1;
+  while (conn->body_sent < conn->body_length) {
+    int bytes_written =
+        SSL_write(conn->ssl, conn->body + conn->body_offset + conn->body_sent,
+                  (int)(conn->body_length - conn->body_sent));
+    if (bytes_written <= 0) {
+      if (ssl_should_retry(conn->ssl, bytes_written)) {
+        return 0;
+      }
+      log_event(ERROR, "Failed to write file to connection.");
+      return -1;
+    }
+    conn->body_sent += (size_t)bytes_written;
   }
 
-  free(response_file);
-  return 0;
+  return 1;
 }
 
 /**
- * handle_client - Complete request-response cycle for one client
- * @server: Server context (SSL connection, socket)
- * @clientfd: File descriptor for client's TCP connection
- *
- * This is the main entry point for handling a client request.
- *
- * 1. SSL handshake (establish encrypted connection)
- * 2. Read HTTP request
- * 3. Process request (find file, validate, determine status)
- * 4. Send HTTP response
- * 5. Close connection and cleanup
- *
- * FORKING CONTEXT:
- * This function runs in a forked child process. When it returns, the child
- * process exits, which:
- * - Closes all open file descriptors
- * - Frees all allocated memory
- * - Removes process from system
+ * write_to_client - Send the response, corking the socket if it takes a while
+ * @conn: Connection with a prepared response
  *
- * Memory leaks here wouldn't be the end of the world, but we free explicitly
- * here anyway for clarity.
+ * A response that fits in the first record goes out in one write, which
+ * TCP_NODELAY sends straight away. Anything larger is written a record (or a
+ * sendfile() call) at a time, so we cork the socket until the last of it has
+ * been written.
  *
- * ERROR HANDLING:
- * If any step fails, we return immediately. The child process exits and
- * the parent continues accepting new connections. Failed requests DO NOT stop
- * the server from continuing.
+ * Return: 1 once the whole response is sent, 0 if we need to wait for the
+ * client, -1 on failure
  */
-void handle_client(struct server_ctx *server, int clientfd) {
-  /*
-   * Performs the TLS handshake with the client:
-   * - Client verifies our certificate
-   * - Both agree on encryption algorithm
-   * - Both derive shared encryption keys
-   *
-   * After this succeeds, all further communication is encrypted.
-   *
-   * If handshake fails, we return immediately. Common failure reasons:
-   * - Client doesn't support our TLS version
-   * - Certificate is invalid or expired
-   * - Client closed connection during handshake
-   */
-  if (setup_ssl(clientfd) == -1) {
-    return;
+static int write_to_client(struct connection *conn) {
+  if (!conn->corked && conn->header_sent == 0 &&
+      conn->body_sent < conn->body_length) {
+    set_cork(conn, true);
   }
 
-  /*
-   * Allocate a 1MB buffer for the incoming request. Most HTTP requests
-   * are small, but large cookie strings and requests with many headers are not
-   * unheard of.
-   *
-   * The buffer is stack-allocated (not malloc) because:
-   * - Faster allocation
-   * - Automatically freed when function returns
-   * - We know the size at compile time
-   */
-  char request_buffer[BUFFER_SIZE];
-  if (read_from_client(server, request_buffer) == -1) {
-    return;
+  int result = send_response(conn);
+  if (result == 1 && conn->corked) {
+    set_cork(conn, false);
   }
+  return result;
+}
 
-  /*
-   * PATH_MAX (4096 bytes) is the maximum path length on most Unix systems.
-   * This buffer will hold the full path to the requested file.
-   */
-  char *path_buffer = malloc(PATH_MAX);
-  if (!path_buffer) {
-    log_event(ERROR, "Failed to allocate memory for path_buffer.");
-    server_cleanup();
-    return;
-  }
+/**
+ * finish_request - Get ready for the next request on a persistent connection
+ * @conn: Connection whose response has been fully sent
+ *
+ * Frees the response, and moves any pipelined data the client sent after the
+ * previous request to the start of the request buffer so that it's parsed as
+ * the next request.
+ *
+ * The response's buffers go back to the pool, as does the request buffer if
+ * the client hasn't sent anything more yet, so a connection waiting for its
+ * next request only holds on to its SSL structure.
+ */
+static void finish_request(struct connection *conn) {
+  cache_release(conn->entry);
+  conn->entry = NULL;
+  error_response_release(conn->error_response);
+  conn->error_response = NULL;
 
-  /*
-   * Determine what file to send and what HTTP status code to use.
-   *
-   * This sets path_buffer to the path of the file to send and response_code to
-   * the appropriate value.
-   */
-  int response_code;
+  pool_put(conn->header_buffer, MAX_HEADER);
+  conn->header_buffer = NULL;
+  conn->header = NULL;
+  conn->header_length = 0;
+  conn->header_sent = 0;
 
-  if (process_request(&path_buffer, request_buffer, &response_code) == -1) {
-    free(path_buffer);
-    return;
-  }
+  conn->body = NULL;
+  conn->body_offset = 0;
+  conn->body_length = 0;
+  conn->body_sent = 0;
+  free(conn->metrics_body);
+  conn->metrics_body = NULL;
 
-  /*
-   * Builds the header based on the response_code and path_buffer, the latter's
-   * extension determines what Content-Type will be set to.
-   */
-  char *header = construct_header(response_code, path_buffer);
-  if (!header) {
-    log_event(ERROR, "Failed to construct header.");
-    server_cleanup();
+  pool_put(conn->chunk_buffer, STREAM_CHUNK_SIZE);
+  conn->chunk_buffer = NULL;
+  conn->chunk_length = 0;
+  conn->chunk_sent = 0;
+
+  conn->requests_served++;
+
+  size_t pipelined_length = conn->request_length - conn->request.head_length;
+  char *pipelined = conn->request_buffer + conn->request.head_length;
+  request_reset(&conn->request);
+  conn->request_length = pipelined_length;
+
+  if (pipelined_length == 0) {
+    pool_put(conn->request_buffer, conn->request_capacity);
+    conn->request_buffer = NULL;
+    conn->request_capacity = 0;
     return;
   }
 
   /*
-   * Writes both header and file contents to the SSL connection.
-   * file_size is set by write_to_client() for logging purposes.
+   * A buffer that grew for a large request goes back to the pool once what's
+   * left fits a normal sized one. If there isn't one to be had, we simply keep
+   * the large buffer.
    */
-  size_t file_size;
-  if (write_to_client(server->ssl, &header, &path_buffer, &file_size) == -1) {
-    server_cleanup();
-    free(header);
-    return;
+  if (conn->request_capacity > REQUEST_BUFFER_SIZE &&
+      pipelined_length <= REQUEST_BUFFER_SIZE) {
+    char *buffer = pool_get(REQUEST_BUFFER_SIZE);
+    if (buffer) {
+      memcpy(buffer, pipelined, pipelined_length);
+      pool_put(conn->request_buffer, conn->request_capacity);
+      conn->request_buffer = buffer;
+      conn->request_capacity = REQUEST_BUFFER_SIZE;
+      return;
+    }
   }
 
   /*
-   * Creates a log entry stating the date, time, log level, server hostname,
-   * request method, request path, response code, and response size in bytes.
+   * memmove() is the same as memcpy() but handles the source and destination
+   * overlapping.
    */
-  size_t response_size = strlen(header) + file_size;
-  log_request(request_buffer, response_code, response_size);
-
-  free(header);
+  memmove(conn->request_buffer, pipelined, pipelined_length);
+}
 
-  /*
-   * Gracefully close the SSL connection
-   *
-   * SSL_shutdown() sends a "close_notify" alert to the client, which:
-   * - Tells client we're done sending data
-   * - Allows client to verify all data received
-   * - Prevents truncation attacks
-   *
-   * RETURN VALUES:
-   * 0: Shutdown in progress (need to call again)
-   * 1: Shutdown complete
-   * < 0: Error occurred
-   *
-   * We ignore the return value and error here because:
-   * - Client might have already closed connection
-   * - We're about to close everything anyway
-   * - Failure to shutdown gracefully is not critical
-   *
-   * A production server might call SSL_shutdown() twice for complete
-   * bidirectional shutdown, but for this simple server, once is enough.
-   */
-  if (SSL_shutdown(server->ssl) < 0) {
+/**
+ * shutdown_connection - Gracefully close the SSL connection
+ * @conn: Connection that has finished sending its response
+ *
+ * SSL_shutdown() sends a "close_notify" alert to the client, which:
+ * - Tells client we're done sending data
+ * - Allows client to verify all data received
+ * - Prevents truncation attacks
+ *
+ * RETURN VALUES:
+ * 0: Shutdown in progress (need to call again)
+ * 1: Shutdown complete
+ * < 0: Error occurred, or the alert couldn't be sent yet
+ *
+ * We don't wait for the client's close_notify in return (a return value of 0)
+ * because:
+ * - Client might have already closed connection
+ * - We're about to close everything anyway
+ * - Failure to shutdown gracefully is not critical
+ *
+ * Return: 1 if we need to wait to send the alert, 0 when done
+ */
+static int shutdown_connection(struct connection *conn) {
+  int result = SSL_shutdown(conn->ssl);
+  if (result < 0) {
+    if (ssl_should_retry(conn->ssl, result)) {
+      return 1;
+    }
     log_event(ERROR, "Failed to shutdown connection.");
   }
+  return 0;
+}
 
-  server_cleanup();
+/**
+ * handle_client - Advance the request-response cycle for one client
+ * @conn: Connection whose socket has become ready
+ *
+ * This is the main entry point for handling a client request. Connections go
+ * through these stages in order:
+ *
+ * 1. CONN_HANDSHAKE: SSL handshake (establish encrypted connection)
+ * 2. CONN_READING: Read HTTP request, then process it (find file, validate,
+ *    determine status)
+ * 3. CONN_WRITING: Send HTTP response, then go back to CONN_READING if the
+ *    connection is being kept alive
+ * 4. CONN_SHUTDOWN: Close SSL connection
+ *
+ * Each stage runs until it completes or has to wait for the client, in which
+ * case we return and pick up from the same stage the next time the event loop
+ * calls us.
+ *
+ * WORKER CONTEXT:
+ * This function runs in a long-lived worker process that serves many other
+ * clients, so everything allocated for a connection MUST be owned by it and
+ * freed by connection_free(), including on error paths. A leak here would
+ * grow the worker's memory with every request it serves.
+ *
+ * ERROR HANDLING:
+ * If any step fails, we return 0 and the connection is closed. Failed requests
+ * DO NOT stop the server from continuing.
+ *
+ * Return: 1 if waiting on the client, 0 if the connection should be freed
+ */
+int handle_client(struct connection *conn) {
+  for (;;) {
+    switch (conn->state) {
+    case CONN_HANDSHAKE: {
+      /*
+       * Performs the TLS handshake with the client:
+       * - Client verifies our certificate
+       * - Both agree on encryption algorithm
+       * - Both derive shared encryption keys
+       *
+       * After this succeeds, all further communication is encrypted. The
+       * handshake takes several round trips, so this usually needs to be
+       * called more than once.
+       *
+       * Common failure reasons:
+       * - Client doesn't support our TLS version
+       * - Certificate is invalid or expired
+       * - Client closed connection during handshake
+       */
+      int result = SSL_accept(conn->ssl);
+      if (result <= 0) {
+        if (ssl_should_retry(conn->ssl, result)) {
+          return 1;
+        }
+        log_event(ERROR, "TLS/SSL handshake failed.");
+        return 0;
+      }
+      metrics_record(METRICS_HANDSHAKE,
+                     metrics_clock() - conn->handshake_start);
+      conn->state = CONN_READING;
+      break;
+    }
 
-  /*
-   * Closes the TCP connection to the client. After this:
-   * - Client can no longer send/receive data
-   * - File descriptor is released back to OS
-   * - Client's TCP connection enters TIME_WAIT state
-   */
-  close(clientfd);
+    case CONN_READING: {
+      int result = read_from_client(conn);
+      if (result == -1) {
+        return 0;
+      }
+      if (result == 0) {
+        return 1;
+      }
+
+      if (prepare_response(conn) == -1) {
+        return 0;
+      }
+      conn->send_start = metrics_clock();
+      conn->state = CONN_WRITING;
+      break;
+    }
+
+    case CONN_WRITING: {
+      int result = write_to_client(conn);
+      if (result == -1) {
+        return 0;
+      }
+      if (result == 0) {
+        return 1;
+      }
+
+      /*
+       * Creates a log entry stating the date, time, log level, server
+       * hostname, request method, request path, response code, and response
+       * size in bytes.
+       */
+      log_request(&conn->request, conn->client_address, conn->response_code,
+                  conn->response_size);
+      metrics_record(METRICS_SEND, metrics_clock() - conn->send_start);
+      metrics_count_response(conn->response_code, conn->response_size);
+
+      if (!conn->keep_alive) {
+        conn->state = CONN_SHUTDOWN;
+        break;
+      }
+
+      /*
+       * Go back to reading. If the client has already sent its next request,
+       * it's sitting in the buffer and we'll process it straight away.
+       */
+      finish_request(conn);
+      conn->state = CONN_READING;
+      break;
+    }
+
+    case CONN_SHUTDOWN:
+      return shutdown_connection(conn);
+    }
+  }
 }
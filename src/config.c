@@ -7,17 +7,32 @@
  * This file implements a simple configuration system using the Singleton
  * pattern. There's exactly one configuration instance for the entire program,
  * accessed through config_get_ctx().
+ *
+ * CONFIGURATION FILE:
+ * Settings that don't warrant their own command-line option are read from a
+ * plain text file, one directive per line:
+ *
+ *   # Comments start with a hash
+ *   workers 4
+ *   keepalive_timeout 15
+ *
+ * Each directive is described by an entry in the directives table below,
+ * which says what type of value it takes and where to store it.
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <linux/limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "config.h"
+#include "file.h"
 #include "log.h"
 #include "paths.h"
+#include "worker.h"
 
 /*
  * 'static' means this variable has file scope - only functions in this
@@ -35,6 +50,76 @@ static struct server_config config = {0};
  */
 struct server_config *config_get_ctx(void) { return &config; }
 
+/**
+ * free_vhost_config - Free the strings of a vhost
+ * @vhost: vhost to free the strings of
+ */
+static void free_vhost_config(struct vhost_config *vhost) {
+  free(vhost->name);
+  free(vhost->root);
+  free(vhost->cert_path);
+  free(vhost->key_path);
+}
+
+/**
+ * free_config - Free the memory a configuration has allocated
+ * @c: Configuration to free
+ */
+static void free_config(struct server_config *c) {
+  free(c->cert_path);
+  c->cert_path = NULL;
+
+  free(c->key_path);
+  c->key_path = NULL;
+
+  free(c->ecdsa_cert_path);
+  c->ecdsa_cert_path = NULL;
+
+  free(c->ecdsa_key_path);
+  c->ecdsa_key_path = NULL;
+
+  free(c->ocsp_response);
+  c->ocsp_response = NULL;
+
+  free(c->ecdsa_ocsp_response);
+  c->ecdsa_ocsp_response = NULL;
+
+  free(c->tls_ciphersuites);
+  c->tls_ciphersuites = NULL;
+
+  free(c->tls_ciphers);
+  c->tls_ciphers = NULL;
+
+  free(c->tls_groups);
+  c->tls_groups = NULL;
+
+  free(c->tls_provider);
+  c->tls_provider = NULL;
+
+  for (int i = 0; i < c->num_cache_control_rules; i++) {
+    free(c->cache_control_rules[i].value);
+  }
+  free(c->cache_control_rules);
+  c->cache_control_rules = NULL;
+  c->num_cache_control_rules = 0;
+
+  for (int i = 0; i < c->num_vhosts; i++) {
+    free_vhost_config(&c->vhosts[i]);
+  }
+  free(c->vhosts);
+  c->vhosts = NULL;
+  c->num_vhosts = 0;
+
+  free(c->mime_types);
+  c->mime_types = NULL;
+
+  free(c->listen_address);
+  c->listen_address = NULL;
+
+  free(c->metrics_path);
+  c->metrics_path = NULL;
+}
+
 /**
  * config_cleanup - Free all dynamically allocated configuration memory
  *
@@ -42,15 +127,7 @@ struct server_config *config_get_ctx(void) { return &config; }
  * process_args(). This should be called before program exit to prevent
  * memory leaks.
  */
-void config_cleanup(void) {
-  if (config.cert_path) {
-    free(config.cert_path);
-  }
-
-  if (config.key_path) {
-    free(config.key_path);
-  }
-}
+void config_cleanup(void) { free_config(&config); }
 
 /**
  * config_init - Initialize configuration with default values
@@ -60,6 +137,12 @@ void config_cleanup(void) {
  *
  * DEFAULT VALUES:
  * - Port: 8080 (common HTTP alternative, doesn't require root)
+ * - Workers: one per online CPU
+ * - Keep-alive: 15 second idle timeout, 1000 requests per connection
+ * - Deadlines: 10 seconds for the handshake, 20 for a request's headers
+ * - Per-client limits: off
+ * - File cache: 64MB per worker, files up to 1MB
+ * - kTLS: off
  * - Certificate: ~/.local/share/cyllenian/cert
  * - Private Key: ~/.local/share/cyllenian/key
  * - Log to file: false (log to stdout by default)
@@ -78,9 +161,125 @@ int config_init(void) {
    * Set logging to stdout by default as to not unnecessarily create log files.
    */
   config.log_to_file = false;
+  config.log_format = LOG_FORMAT_DEFAULT;
 
   config.port = 8080;
 
+  config.workers = default_worker_count();
+
+  /*
+   * The kernel caps the backlog at net.core.somaxconn (4096 on recent
+   * kernels), so 1024 gets us most of what we can have. TLS clients always
+   * speak first, so deferring the accept until the ClientHello arrives costs
+   * nothing but saves waking a worker for connections that never send
+   * anything. Fast Open needs enabling in the kernel too, so it's opt-in.
+   */
+  config.backlog = 1024;
+  config.reuseport = true;
+  config.cpu_affinity = false;
+  config.defer_accept = 5;
+  config.fastopen = 0;
+
+  /*
+   * io_uring is often disabled or blocked by seccomp (e.g., in containers),
+   * and epoll is what most deployments have been tested with, so it's opt-in.
+   */
+  config.io_uring = false;
+
+  /*
+   * Browsers typically keep idle connections around for a minute or two, but
+   * each one we hold open costs us memory, so we let them go sooner.
+   */
+  config.keepalive_timeout = 15;
+  config.keepalive_requests = 1000;
+
+  /*
+   * Long enough for a slow client to finish downloading a large file, short
+   * enough that a deploy doesn't hang around waiting for a stuck one.
+   */
+  config.drain_timeout = 30;
+
+  /*
+   * Generous enough for a client on a slow, lossy link, but a connection
+   * that's sent nothing useful in that long isn't going to.
+   */
+  config.handshake_timeout = 10;
+  config.header_timeout = 20;
+
+  /*
+   * Everyone behind a NAT or a proxy shares an address, so a limit that suits
+   * one client could shut out a whole office. They're off until set.
+   */
+  config.max_connections_per_ip = 0;
+  config.request_rate = 0;
+  config.request_burst = 50;
+
+  config.cache_size = 64;
+  config.cache_max_file_size = 1024;
+
+  /*
+   * kTLS needs the kernel's tls module, which isn't loaded everywhere, so it's
+   * opt-in.
+   */
+  config.ktls = false;
+
+  /*
+   * Precompressed files cost nothing to serve, so we use them whenever
+   * they're there. Compressing files ourselves costs CPU and memory for a
+   * second copy of each one, so that's opt-in. Level 6 is zlib's default, and
+   * gets most of the size reduction of level 9 in a fraction of the time.
+   */
+  config.precompressed = true;
+  config.gzip = false;
+  config.gzip_level = 6;
+
+  /*
+   * The index costs memory for every file in every worker and an inotify
+   * watch for every directory, so it's opt-in.
+   */
+  config.route_index = false;
+
+  /*
+   * Well under the usual limit of 1024 open files per process, leaving room
+   * for connections.
+   */
+  config.open_file_cache = 256;
+
+  /*
+   * Each cached session takes about a kilobyte of shared memory, so this is
+   * around 4MB. An hour is long enough to cover a typical browsing session
+   * without keeping any one ticket key in use for long.
+   */
+  config.session_cache = 4096;
+  config.session_timeout = 3600;
+  config.session_tickets = true;
+
+  /*
+   * Timing requests costs a few clock reads each, so metrics are only
+   * collected when there's somewhere to read them from.
+   */
+  config.metrics_path = NULL;
+
+  /*
+   * Without a second certificate or OCSP responses there's nothing to add,
+   * and the cipher and group lists are picked for the CPU when the SSL
+   * context is set up.
+   */
+  config.ecdsa_cert_path = NULL;
+  config.ecdsa_key_path = NULL;
+  config.ocsp_response = NULL;
+  config.ecdsa_ocsp_response = NULL;
+  config.tls_ciphersuites = NULL;
+  config.tls_ciphers = NULL;
+  config.tls_groups = NULL;
+
+  /*
+   * Async mode only helps when a provider does the work somewhere else, and
+   * costs a context switch per operation when it doesn't, so both are opt-in.
+   */
+  config.tls_provider = NULL;
+  config.tls_async = false;
+
   /*
    * PATH_MAX (4096 bytes) is the maximum path length on Linux.
    * We allocate the full amount because:
@@ -134,3 +333,593 @@ int config_init(void) {
   }
   return 0;
 }
+
+/**
+ * Types of value a configuration directive can take.
+ */
+enum directive_type {
+  DIRECTIVE_INT,
+  DIRECTIVE_BOOL,
+  DIRECTIVE_STRING,
+  DIRECTIVE_CUSTOM
+};
+
+/**
+ * struct config_directive - Describes one configuration file directive
+ * @name: Name of the directive as it appears in the file
+ * @type: Type of value it takes
+ * @value: Where to store the value, which must match the type (int *, bool *
+ *         or char ** respectively)
+ * @min: Smallest value accepted for DIRECTIVE_INT
+ * @max: Largest value accepted for DIRECTIVE_INT
+ * @handler: Parses and stores the value for DIRECTIVE_CUSTOM, returning 0 on
+ *           success and -1 if the value is invalid
+ */
+struct config_directive {
+  const char *name;
+  enum directive_type type;
+  void *value;
+  long min;
+  long max;
+  int (*handler)(const char *value);
+};
+
+/**
+ * add_cache_control_rule - Handle a cache_control directive
+ * @value: Extension and header value separated by whitespace, e.g.
+ *         "css max-age=86400"
+ *
+ * A later rule for the same extension replaces the earlier one.
+ *
+ * Return: 0 on success, -1 if the value is invalid
+ */
+static int add_cache_control_rule(const char *value) {
+  size_t extension_length = strcspn(value, " \t");
+  const char *header_value = value + extension_length;
+  header_value += strspn(header_value, " \t");
+
+  if (extension_length == 0 ||
+      extension_length >= MAX_CACHE_CONTROL_EXTENSION ||
+      *header_value == '\0') {
+    log_event(ERROR, "cache_control takes an extension and a value.");
+    return -1;
+  }
+
+  /*
+   * The header value ends up in every response for these files, so it can't
+   * be allowed to smuggle in extra header lines.
+   */
+  if (strpbrk(header_value, "\r\n")) {
+    log_event(ERROR, "cache_control value must be on one line.");
+    return -1;
+  }
+
+  char *copy = strdup(header_value);
+  if (!copy) {
+    log_event(ERROR, "Failed to duplicate configuration value.");
+    return -1;
+  }
+
+  for (int i = 0; i < config.num_cache_control_rules; i++) {
+    struct cache_control_rule *rule = &config.cache_control_rules[i];
+    if (strlen(rule->extension) == extension_length &&
+        strncasecmp(rule->extension, value, extension_length) == 0) {
+      free(rule->value);
+      rule->value = copy;
+      return 0;
+    }
+  }
+
+  struct cache_control_rule *rules =
+      realloc(config.cache_control_rules,
+              sizeof(*rules) * (size_t)(config.num_cache_control_rules + 1));
+  if (!rules) {
+    log_event(ERROR, "Failed to allocate memory for cache_control rule.");
+    free(copy);
+    return -1;
+  }
+  config.cache_control_rules = rules;
+
+  struct cache_control_rule *rule = &rules[config.num_cache_control_rules++];
+  memcpy(rule->extension, value, extension_length);
+  rule->extension[extension_length] = '\0';
+  rule->value = copy;
+  return 0;
+}
+
+/**
+ * next_word - Split the next whitespace separated word off a value
+ * @value: Where the rest of the value starts, moved past the word
+ *
+ * Return: Copy of the word, or NULL if there are no more words (or on
+ * allocation failure)
+ */
+static char *next_word(const char **value) {
+  *value += strspn(*value, " \t");
+  size_t length = strcspn(*value, " \t");
+  if (length == 0) {
+    return NULL;
+  }
+  char *word = strndup(*value, length);
+  *value += length;
+  return word;
+}
+
+/**
+ * is_valid_server_name - Check that a vhost name is a hostname
+ * @name: Name from a vhost directive, already in lowercase
+ *
+ * Return: true if it's made of letters, digits, hyphens and dots
+ */
+static bool is_valid_server_name(const char *name) {
+  size_t length = strlen(name);
+  if (length == 0 || length > MAX_VHOST_NAME || name[0] == '.') {
+    return false;
+  }
+  for (const char *p = name; *p; p++) {
+    if (!islower((unsigned char)*p) && !isdigit((unsigned char)*p) &&
+        *p != '-' && *p != '.') {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * parse_vhost - Split a vhost directive's value into its parts
+ * @value: Value of the directive
+ * @vhost: Output parameter for the parts, which must be freed with
+ *         free_vhost_config() whether or not this succeeds
+ *
+ * Return: 0 on success, -1 if the value is invalid
+ */
+static int parse_vhost(const char *value, struct vhost_config *vhost) {
+  vhost->name = next_word(&value);
+  vhost->root = next_word(&value);
+  vhost->cert_path = next_word(&value);
+  vhost->key_path = next_word(&value);
+  value += strspn(value, " \t");
+
+  if (!vhost->name || !vhost->root ||
+      (vhost->cert_path && !vhost->key_path) || *value != '\0') {
+    log_event(ERROR, "vhost takes a name, a directory, and optionally a "
+                     "certificate and key.");
+    return -1;
+  }
+
+  for (char *p = vhost->name; *p; p++) {
+    *p = (char)tolower((unsigned char)*p);
+  }
+  size_t name_length = strlen(vhost->name);
+  if (name_length > 1 && vhost->name[name_length - 1] == '.') {
+    vhost->name[name_length - 1] = '\0';
+  }
+  if (!is_valid_server_name(vhost->name)) {
+    log_event(ERROR, "vhost name must be a hostname.");
+    return -1;
+  }
+
+  /*
+   * A relative directory would be relative to wherever we were started
+   * from, which nobody means.
+   */
+  size_t root_length = strlen(vhost->root);
+  if (vhost->root[0] != '/' || root_length + 2 > PATH_MAX) {
+    log_event(ERROR, "vhost directory must be an absolute path.");
+    return -1;
+  }
+  if (vhost->root[root_length - 1] != '/') {
+    char *root = realloc(vhost->root, root_length + 2);
+    if (!root) {
+      log_event(ERROR, "Failed to duplicate configuration value.");
+      return -1;
+    }
+    root[root_length] = '/';
+    root[root_length + 1] = '\0';
+    vhost->root = root;
+  }
+  return 0;
+}
+
+/**
+ * add_vhost - Handle a vhost directive
+ * @value: Server name and website directory, optionally followed by a
+ *         certificate chain and key for the name, separated by whitespace,
+ *         e.g. "example.com /srv/example.com cert.pem key.pem"
+ *
+ * Names are compared case-insensitively, so they're kept in lowercase, and
+ * without the trailing dot of a fully qualified name. The website directory
+ * is kept with a trailing slash, the same as the default one.
+ *
+ * Return: 0 on success, -1 if the value is invalid
+ */
+static int add_vhost(const char *value) {
+  if (config.num_vhosts >= MAX_VHOSTS) {
+    log_event(ERROR, "Too many vhost directives.");
+    return -1;
+  }
+
+  struct vhost_config vhost = {NULL, NULL, NULL, NULL};
+  if (parse_vhost(value, &vhost) == -1) {
+    free_vhost_config(&vhost);
+    return -1;
+  }
+
+  for (int i = 0; i < config.num_vhosts; i++) {
+    if (strcmp(config.vhosts[i].name, vhost.name) == 0) {
+      char duplicate_msg[LOG_MSG_MAX];
+      snprintf(duplicate_msg, LOG_MSG_MAX, "vhost %s is given twice.",
+               vhost.name);
+      log_event(ERROR, duplicate_msg);
+      free_vhost_config(&vhost);
+      return -1;
+    }
+  }
+
+  struct vhost_config *vhosts =
+      realloc(config.vhosts, sizeof(*vhosts) * (size_t)(config.num_vhosts + 1));
+  if (!vhosts) {
+    log_event(ERROR, "Failed to allocate memory for vhost.");
+    free_vhost_config(&vhost);
+    return -1;
+  }
+  config.vhosts = vhosts;
+  config.vhosts[config.num_vhosts++] = vhost;
+  return 0;
+}
+
+/**
+ * set_log_format - Handle a log_format directive
+ * @value: "default" or "combined"
+ *
+ * Return: 0 on success, -1 if the value is invalid
+ */
+static int set_log_format(const char *value) {
+  if (strcmp(value, "default") == 0) {
+    config.log_format = LOG_FORMAT_DEFAULT;
+  } else if (strcmp(value, "combined") == 0) {
+    config.log_format = LOG_FORMAT_COMBINED;
+  } else {
+    log_event(ERROR, "log_format must be default or combined.");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * The addresses of config's fields are constant, so we can point straight at
+ * them from this table.
+ */
+static const struct config_directive directives[] = {
+    {"cert", DIRECTIVE_STRING, &config.cert_path, 0, 0, NULL},
+    {"key", DIRECTIVE_STRING, &config.key_path, 0, 0, NULL},
+    {"ecdsa_cert", DIRECTIVE_STRING, &config.ecdsa_cert_path, 0, 0, NULL},
+    {"ecdsa_key", DIRECTIVE_STRING, &config.ecdsa_key_path, 0, 0, NULL},
+    {"ocsp_response", DIRECTIVE_STRING, &config.ocsp_response, 0, 0, NULL},
+    {"ecdsa_ocsp_response", DIRECTIVE_STRING, &config.ecdsa_ocsp_response, 0,
+     0, NULL},
+    {"tls_ciphersuites", DIRECTIVE_STRING, &config.tls_ciphersuites, 0, 0,
+     NULL},
+    {"tls_ciphers", DIRECTIVE_STRING, &config.tls_ciphers, 0, 0, NULL},
+    {"tls_groups", DIRECTIVE_STRING, &config.tls_groups, 0, 0, NULL},
+    {"tls_provider", DIRECTIVE_STRING, &config.tls_provider, 0, 0, NULL},
+    {"tls_async", DIRECTIVE_BOOL, &config.tls_async, 0, 0, NULL},
+    {"port", DIRECTIVE_INT, &config.port, 1025, 49150, NULL},
+    {"log_to_file", DIRECTIVE_BOOL, &config.log_to_file, 0, 0, NULL},
+    {"log_format", DIRECTIVE_CUSTOM, NULL, 0, 0, set_log_format},
+    {"workers", DIRECTIVE_INT, &config.workers, 1, MAX_WORKERS, NULL},
+    {"listen_address", DIRECTIVE_STRING, &config.listen_address, 0, 0, NULL},
+    {"backlog", DIRECTIVE_INT, &config.backlog, 1, 65535, NULL},
+    {"reuseport", DIRECTIVE_BOOL, &config.reuseport, 0, 0, NULL},
+    {"cpu_affinity", DIRECTIVE_BOOL, &config.cpu_affinity, 0, 0, NULL},
+    {"defer_accept", DIRECTIVE_INT, &config.defer_accept, 0, 60, NULL},
+    {"fastopen", DIRECTIVE_INT, &config.fastopen, 0, 65535, NULL},
+    {"io_uring", DIRECTIVE_BOOL, &config.io_uring, 0, 0, NULL},
+    {"keepalive_timeout", DIRECTIVE_INT, &config.keepalive_timeout, 1, 3600,
+     NULL},
+    {"keepalive_requests", DIRECTIVE_INT, &config.keepalive_requests, 1,
+     1000000, NULL},
+    {"drain_timeout", DIRECTIVE_INT, &config.drain_timeout, 1, 3600, NULL},
+    {"handshake_timeout", DIRECTIVE_INT, &config.handshake_timeout, 1, 3600,
+     NULL},
+    {"header_timeout", DIRECTIVE_INT, &config.header_timeout, 1, 3600, NULL},
+    {"max_connections_per_ip", DIRECTIVE_INT, &config.max_connections_per_ip,
+     0, 65535, NULL},
+    {"request_rate", DIRECTIVE_INT, &config.request_rate, 0, 1000000, NULL},
+    {"request_burst", DIRECTIVE_INT, &config.request_burst, 1, 1000000, NULL},
+    {"cache_size", DIRECTIVE_INT, &config.cache_size, 0, 65536, NULL},
+    {"cache_max_file_size", DIRECTIVE_INT, &config.cache_max_file_size, 0,
+     1048576, NULL},
+    {"ktls", DIRECTIVE_BOOL, &config.ktls, 0, 0, NULL},
+    {"precompressed", DIRECTIVE_BOOL, &config.precompressed, 0, 0, NULL},
+    {"gzip", DIRECTIVE_BOOL, &config.gzip, 0, 0, NULL},
+    {"gzip_level", DIRECTIVE_INT, &config.gzip_level, 1, 9, NULL},
+    {"route_index", DIRECTIVE_BOOL, &config.route_index, 0, 0, NULL},
+    {"mime_types", DIRECTIVE_STRING, &config.mime_types, 0, 0, NULL},
+    {"open_file_cache", DIRECTIVE_INT, &config.open_file_cache, 0, 65536,
+     NULL},
+    {"session_cache", DIRECTIVE_INT, &config.session_cache, 0, 1048576, NULL},
+    {"session_timeout", DIRECTIVE_INT, &config.session_timeout, 60, 86400,
+     NULL},
+    {"session_tickets", DIRECTIVE_BOOL, &config.session_tickets, 0, 0, NULL},
+    {"metrics_path", DIRECTIVE_STRING, &config.metrics_path, 0, 0, NULL},
+    {"cache_control", DIRECTIVE_CUSTOM, NULL, 0, 0, add_cache_control_rule},
+    {"vhost", DIRECTIVE_CUSTOM, NULL, 0, 0, add_vhost},
+};
+
+/**
+ * set_directive - Parse a directive's value and store it in config
+ * @directive: Directive being set
+ * @value: Value text from the configuration file
+ *
+ * Return: 0 on success, -1 if the value is invalid
+ */
+static int set_directive(const struct config_directive *directive,
+                         const char *value) {
+  switch (directive->type) {
+  case DIRECTIVE_INT: {
+    /*
+     * strtol() tells us where it stopped parsing, so unlike atoi() we can
+     * reject values with trailing junk such as "15s".
+     */
+    char *end;
+    errno = 0;
+    long number = strtol(value, &end, 10);
+    if (errno != 0 || *end != '\0' || number < directive->min ||
+        number > directive->max) {
+      char range_msg[LOG_MSG_MAX];
+      snprintf(range_msg, LOG_MSG_MAX, "%s must be between %ld and %ld.",
+               directive->name, directive->min, directive->max);
+      log_event(ERROR, range_msg);
+      return -1;
+    }
+    *(int *)directive->value = (int)number;
+    return 0;
+  }
+
+  case DIRECTIVE_BOOL:
+    if (strcmp(value, "on") == 0 || strcmp(value, "yes") == 0 ||
+        strcmp(value, "true") == 0) {
+      *(bool *)directive->value = true;
+      return 0;
+    }
+    if (strcmp(value, "off") == 0 || strcmp(value, "no") == 0 ||
+        strcmp(value, "false") == 0) {
+      *(bool *)directive->value = false;
+      return 0;
+    }
+    {
+      char bool_msg[LOG_MSG_MAX];
+      snprintf(bool_msg, LOG_MSG_MAX, "%s must be on or off.",
+               directive->name);
+      log_event(ERROR, bool_msg);
+    }
+    return -1;
+
+  case DIRECTIVE_STRING: {
+    char *copy = strdup(value);
+    if (!copy) {
+      log_event(ERROR, "Failed to duplicate configuration value.");
+      return -1;
+    }
+    char **string = directive->value;
+    free(*string);
+    *string = copy;
+    return 0;
+  }
+
+  case DIRECTIVE_CUSTOM:
+    return directive->handler(value);
+  }
+
+  return -1;
+}
+
+/**
+ * parse_config_line - Apply a single line of the configuration file
+ * @line: Line to parse, modified in place
+ * @line_number: Line number for error messages
+ *
+ * Return: 0 on success (including blank and comment lines), -1 on error
+ */
+static int parse_config_line(char *line, int line_number) {
+  /*
+   * Skip leading whitespace, then ignore blank lines and comments.
+   */
+  while (isspace((unsigned char)*line)) {
+    line++;
+  }
+  if (*line == '\0' || *line == '#') {
+    return 0;
+  }
+
+  /*
+   * The directive name runs up to the first whitespace character, and the
+   * value is everything after the whitespace that follows it.
+   */
+  char *name = line;
+  while (*line && !isspace((unsigned char)*line)) {
+    line++;
+  }
+  if (*line) {
+    *line++ = '\0';
+  }
+  while (isspace((unsigned char)*line)) {
+    line++;
+  }
+  char *value = line;
+
+  /*
+   * Trim trailing whitespace (including the newline fgets() keeps) from the
+   * value.
+   */
+  char *end = value + strlen(value);
+  while (end > value && isspace((unsigned char)*(end - 1))) {
+    end--;
+  }
+  *end = '\0';
+
+  char msg[LOG_MSG_MAX];
+  if (*value == '\0') {
+    snprintf(msg, LOG_MSG_MAX, "Missing value for %.64s on line %d of config.",
+             name, line_number);
+    log_event(ERROR, msg);
+    return -1;
+  }
+
+  for (size_t i = 0; i < sizeof(directives) / sizeof(directives[0]); i++) {
+    if (strcmp(directives[i].name, name) == 0) {
+      if (set_directive(&directives[i], value) == -1) {
+        snprintf(msg, LOG_MSG_MAX, "Invalid value on line %d of config.",
+                 line_number);
+        log_event(ERROR, msg);
+        return -1;
+      }
+      return 0;
+    }
+  }
+
+  snprintf(msg, LOG_MSG_MAX, "Unknown directive %.64s on line %d of config.",
+           name, line_number);
+  log_event(ERROR, msg);
+  return -1;
+}
+
+/**
+ * open_config_file - Open the user's configuration file, or the system one
+ *
+ * Return: Open file, or NULL if neither exists
+ */
+static FILE *open_config_file(void) {
+  /*
+   * System-wide fallback location, this file is installed by make install.
+   */
+  static const char *fallback_config_path = "/etc/cyllenian/cyllenian.conf";
+
+  char *path_buffer = malloc(PATH_MAX);
+  if (!path_buffer) {
+    log_event(ERROR, "Failed to allocate memory for path_buffer.");
+    return NULL;
+  }
+
+  FILE *file = NULL;
+  if (prepend_program_config_path(&path_buffer, "cyllenian.conf") == 0) {
+    file = fopen(path_buffer, "r");
+  }
+  free(path_buffer);
+
+  if (!file) {
+    file = fopen(fallback_config_path, "r");
+  }
+
+  return file;
+}
+
+/**
+ * config_load_file - Apply settings from the configuration file
+ *
+ * Return: 0 on success or if there is no configuration file, -1 on error
+ */
+int config_load_file(void) {
+  FILE *file = open_config_file();
+  if (!file) {
+    return 0;
+  }
+
+  char line[CONFIG_LINE_MAX];
+  int line_number = 0;
+  int result = 0;
+
+  while (fgets(line, CONFIG_LINE_MAX, file)) {
+    line_number++;
+    if (parse_config_line(line, line_number) == -1) {
+      result = -1;
+      break;
+    }
+  }
+
+  fclose(file);
+  return result;
+}
+
+/**
+ * config_reload - Read the configuration file again
+ *
+ * The file is parsed into a fresh configuration (the directives table points
+ * at the singleton, so that's where it's parsed to, with the running
+ * configuration set aside). The settings that can change while we're running
+ * are then moved over to the running configuration, and the rest of the
+ * fresh one thrown away.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int config_reload(void) {
+  struct server_config running = config;
+  memset(&config, 0, sizeof(config));
+
+  if (config_init() == -1 || config_load_file() == -1) {
+    free_config(&config);
+    config = running;
+    log_event(ERROR, "Failed to reload configuration, keeping the old one.");
+    return -1;
+  }
+
+  struct server_config loaded = config;
+  config = running;
+
+  config.log_format = loaded.log_format;
+  config.keepalive_timeout = loaded.keepalive_timeout;
+  config.keepalive_requests = loaded.keepalive_requests;
+  config.drain_timeout = loaded.drain_timeout;
+  config.handshake_timeout = loaded.handshake_timeout;
+  config.header_timeout = loaded.header_timeout;
+  config.max_connections_per_ip = loaded.max_connections_per_ip;
+  config.request_rate = loaded.request_rate;
+  config.request_burst = loaded.request_burst;
+  config.cache_size = loaded.cache_size;
+  config.cache_max_file_size = loaded.cache_max_file_size;
+  config.precompressed = loaded.precompressed;
+  config.gzip = loaded.gzip;
+  config.gzip_level = loaded.gzip_level;
+  config.open_file_cache = loaded.open_file_cache;
+
+  /*
+   * Swapping the rules leaves the old ones in loaded, to be freed with the
+   * rest of it.
+   */
+  struct cache_control_rule *rules = config.cache_control_rules;
+  int num_rules = config.num_cache_control_rules;
+  config.cache_control_rules = loaded.cache_control_rules;
+  config.num_cache_control_rules = loaded.num_cache_control_rules;
+  loaded.cache_control_rules = rules;
+  loaded.num_cache_control_rules = num_rules;
+
+  free_config(&loaded);
+  return 0;
+}
+
+/**
+ * config_get_cache_control - Find the Cache-Control value for a file
+ * @file_path: Path to the file being served
+ *
+ * There are only ever a few rules, so a linear search is fine. This is only
+ * called when a file is loaded into the cache, not for every request.
+ *
+ * Return: Header value, or NULL if there's no rule for the file
+ */
+const char *config_get_cache_control(const char *file_path) {
+  const char *extension = get_file_extension(file_path);
+  const char *fallback = NULL;
+
+  for (int i = 0; i < config.num_cache_control_rules; i++) {
+    struct cache_control_rule *rule = &config.cache_control_rules[i];
+    if (extension && strcasecmp(rule->extension, extension) == 0) {
+      return rule->value;
+    }
+    if (strcmp(rule->extension, "*") == 0) {
+      fallback = rule->value;
+    }
+  }
+
+  return fallback;
+}
@@ -0,0 +1,142 @@
+/**
+ * connection.c
+ *
+ * Allocation and cleanup of per-connection state.
+ */
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "limit.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "server.h"
+
+/**
+ * connection_new - Set up state for a newly accepted client
+ * @clientfd: Non-blocking socket returned by accept4()
+ * @address: Client's address returned by accept4()
+ *
+ * The request buffer isn't allocated until the handshake is done, so clients
+ * that connect and never finish a handshake cost us as little as possible.
+ * Clients over their limits cost us even less, since they're checked before
+ * anything at all is allocated.
+ *
+ * Return: Pointer to the new connection, or NULL on error or if the client
+ * is over its limits
+ */
+struct connection *connection_new(int clientfd,
+                                  const struct sockaddr_storage *address) {
+  int limit_slot;
+  if (!limit_accept(address, &limit_slot)) {
+    metrics_count_rejection();
+    close(clientfd);
+    return NULL;
+  }
+
+  /*
+   * calloc() zeroes the structure, so every pointer starts out NULL and every
+   * length starts out at 0.
+   */
+  struct connection *conn = calloc(1, sizeof(*conn));
+  if (!conn) {
+    log_event(ERROR, "Failed to allocate memory for connection.");
+    limit_release(limit_slot);
+    close(clientfd);
+    return NULL;
+  }
+
+  conn->fd = clientfd;
+  conn->limit_slot = limit_slot;
+
+  /*
+   * Nagle's algorithm holds back a small segment while an earlier one is
+   * unacknowledged, and the client may be delaying its ACK. We send each
+   * response in as few writes as we can, so there's nothing to gain from
+   * waiting, and responses that do take several writes are corked instead.
+   */
+  int nodelay = 1;
+  setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  conn->state = CONN_HANDSHAKE;
+
+  /*
+   * Converting the address to text once here is cheaper than looking it up
+   * with getpeername() for every request we log.
+   */
+  const void *ip = NULL;
+  if (address->ss_family == AF_INET) {
+    ip = &((const struct sockaddr_in *)address)->sin_addr;
+  } else if (address->ss_family == AF_INET6) {
+    ip = &((const struct sockaddr_in6 *)address)->sin6_addr;
+  }
+  if (!ip || !inet_ntop(address->ss_family, ip, conn->client_address,
+                        sizeof(conn->client_address))) {
+    snprintf(conn->client_address, sizeof(conn->client_address), "-");
+  }
+
+  if (address->ss_family == AF_INET) {
+    const struct in_addr *ipv4 = ip;
+    conn->loopback = ntohl(ipv4->s_addr) >> 24 == 127;
+  } else if (address->ss_family == AF_INET6) {
+    const struct in6_addr *ipv6 = ip;
+    conn->loopback = IN6_IS_ADDR_LOOPBACK(ipv6) ||
+                     (IN6_IS_ADDR_V4MAPPED(ipv6) && ipv6->s6_addr[12] == 127);
+  }
+
+  metrics_count_connection();
+  conn->handshake_start = metrics_clock();
+
+  conn->ssl = setup_ssl(clientfd);
+  if (!conn->ssl) {
+    connection_free(conn);
+    return NULL;
+  }
+
+  return conn;
+}
+
+/**
+ * connection_free - Release everything allocated for a client connection
+ * @conn: Connection to free
+ *
+ * Closing the socket also removes it from the epoll instance, since no other
+ * file descriptor refers to it.
+ */
+void connection_free(struct connection *conn) {
+  if (conn->ssl) {
+    /*
+     * OpenSSL assumes a connection freed without a close_notify having been
+     * sent ended badly, and removes its session from the cache. Most of ours
+     * end with the client going away or going idle, which is no reason to stop
+     * it resuming, so we mark the connection as shut down first. Sessions of
+     * connections that fail with a real TLS error are removed by OpenSSL when
+     * the error happens.
+     */
+    if (SSL_is_init_finished(conn->ssl)) {
+      SSL_set_shutdown(conn->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    }
+    SSL_free(conn->ssl);
+  }
+
+  /*
+   * Closes the TCP connection to the client. After this:
+   * - Client can no longer send/receive data
+   * - File descriptor is released back to OS
+   * - Client's TCP connection enters TIME_WAIT state
+   */
+  close(conn->fd);
+  limit_release(conn->limit_slot);
+
+  pool_put(conn->request_buffer, conn->request_capacity);
+  pool_put(conn->chunk_buffer, STREAM_CHUNK_SIZE);
+  pool_put(conn->header_buffer, MAX_HEADER);
+  cache_release(conn->entry);
+  error_response_release(conn->error_response);
+  free(conn->metrics_body);
+  free(conn);
+}
@@ -0,0 +1,285 @@
+/**
+ * error_page.c
+ *
+ * Error responses rendered once and kept in memory.
+ *
+ * OVERVIEW:
+ * Vulnerability scanners and broken links mean a busy server sends a lot of
+ * 404s, and each one used to mean finding the error page on disk (trying the
+ * website directory, then the system-wide fallback) before sending it. The
+ * pages hardly ever change, so we find and read them once at startup and
+ * keep the complete response for each error, status line, headers and body
+ * in one buffer, so that sending one is a single write.
+ *
+ * Every error needs a version with "Connection: keep-alive" and one with
+ * "Connection: close", so each page is rendered twice.
+ *
+ * RELOADING:
+ * Error pages aren't revalidated like cached files are. Send SIGHUP after
+ * changing one, and every process renders them all again. A page the server
+ * can't read gets a short built-in body instead, so every error can always
+ * be answered.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "error_page.h"
+#include "file.h"
+#include "log.h"
+#include "paths.h"
+#include "response.h"
+
+/**
+ * struct error_page - An error we send and its current responses
+ * @code: Response code
+ * @file_name: File the page is read from
+ * @title: Status text, used for the built-in page
+ * @responses: Current response, indexed by whether to keep the connection
+ *             alive
+ */
+struct error_page {
+  int code;
+  const char *file_name;
+  const char *title;
+  struct error_response *responses[2];
+};
+
+static struct error_page error_pages[] = {
+    {400, "400.html", "Bad Request", {NULL, NULL}},
+    {403, "403.html", "Forbidden", {NULL, NULL}},
+    {404, "404.html", "Not Found", {NULL, NULL}},
+    {405, "405.html", "Method Not Allowed", {NULL, NULL}},
+    {414, "414.html", "URI Too Long", {NULL, NULL}},
+    {429, "429.html", "Too Many Requests", {NULL, NULL}},
+    {431, "431.html", "Request Header Fields Too Large", {NULL, NULL}},
+};
+
+#define NUM_ERROR_PAGES (sizeof(error_pages) / sizeof(error_pages[0]))
+
+/**
+ * find_error_page - Find the file to serve for an error
+ * @path: Buffer of PATH_MAX bytes for the page's path
+ * @file_name: File name of the page
+ *
+ * A page in the user's website directory wins over the one installed in the
+ * system-wide fallback location, this directory is created when running make
+ * install.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int find_error_page(char path[PATH_MAX], const char *file_name) {
+  static const char *fallback_website_path = "/etc/cyllenian/website";
+
+  const char *website_path = get_website_path();
+  if (!website_path) {
+    return -1;
+  }
+
+  snprintf(path, PATH_MAX, "%s%s", website_path, file_name);
+  if (!file_exists(path)) {
+    snprintf(path, PATH_MAX, "%s/%s", fallback_website_path, file_name);
+  }
+  return 0;
+}
+
+/**
+ * read_error_page - Read an error page into memory
+ * @path: Path of the page
+ * @size: Output parameter for the size of the page
+ *
+ * Return: Allocated page contents, or NULL on failure
+ */
+static char *read_error_page(const char *path, size_t *size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode) ||
+      file_stat.st_size > ERROR_PAGE_MAX_SIZE) {
+    close(fd);
+    return NULL;
+  }
+
+  /*
+   * One extra byte so that an empty page doesn't need malloc(0).
+   */
+  *size = (size_t)file_stat.st_size;
+  char *contents = malloc(*size + 1);
+  if (!contents) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t bytes_read = 0;
+  while (bytes_read < *size) {
+    ssize_t result = pread(fd, contents + bytes_read, *size - bytes_read,
+                           (off_t)bytes_read);
+    if (result == -1 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      free(contents);
+      close(fd);
+      return NULL;
+    }
+    bytes_read += (size_t)result;
+  }
+
+  close(fd);
+  return contents;
+}
+
+/**
+ * render_response - Build a complete response from a page
+ * @page: Error the response is for
+ * @body: Page contents
+ * @body_length: Length of body
+ * @keep_alive: Whether the connection is kept alive after the response
+ *
+ * Return: New response with one reference, or NULL on failure
+ */
+static struct error_response *render_response(const struct error_page *page,
+                                              const char *body,
+                                              size_t body_length,
+                                              bool keep_alive) {
+  char header[MAX_HEADER];
+  if (format_header(header, page->code, page->file_name, body_length,
+                    keep_alive, NULL) == -1) {
+    return NULL;
+  }
+  size_t header_length = strlen(header);
+
+  struct error_response *response =
+      malloc(sizeof(*response) + header_length + body_length);
+  if (!response) {
+    log_event(ERROR, "Failed to allocate memory for error response.");
+    return NULL;
+  }
+  response->refs = 1;
+  response->length = header_length + body_length;
+  response->header_length = header_length;
+  memcpy(response->data, header, header_length);
+  memcpy(response->data + header_length, body, body_length);
+  return response;
+}
+
+/**
+ * render_page - Build both responses for an error
+ * @page: Error to render
+ * @responses: Output parameter for the responses, indexed by keep-alive
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int render_page(const struct error_page *page,
+                       struct error_response *responses[2]) {
+  char path[PATH_MAX];
+  size_t body_length = 0;
+  char *body = NULL;
+  if (find_error_page(path, page->file_name) == 0) {
+    body = read_error_page(path, &body_length);
+  }
+
+  char builtin[MAX_HEADER];
+  const char *contents = body;
+  if (!body) {
+    char missing_msg[LOG_MSG_MAX];
+    snprintf(missing_msg, LOG_MSG_MAX,
+             "Failed to read error page %s, using a built-in page instead.",
+             page->file_name);
+    log_event(WARN, missing_msg);
+
+    snprintf(builtin, MAX_HEADER,
+             "<!DOCTYPE html>\n<title>%d %s</title>\n<h1>%d %s</h1>\n",
+             page->code, page->title, page->code, page->title);
+    contents = builtin;
+    body_length = strlen(builtin);
+  }
+
+  responses[0] = render_response(page, contents, body_length, false);
+  responses[1] = render_response(page, contents, body_length, true);
+  free(body);
+
+  if (!responses[0] || !responses[1]) {
+    error_response_release(responses[0]);
+    error_response_release(responses[1]);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * error_pages_load - Render the responses for every error page
+ *
+ * Everything is rendered before anything is replaced, so a failure partway
+ * through leaves every error with the responses it had.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int error_pages_load(void) {
+  struct error_response *loaded[NUM_ERROR_PAGES][2];
+
+  for (size_t i = 0; i < NUM_ERROR_PAGES; i++) {
+    if (render_page(&error_pages[i], loaded[i]) == -1) {
+      while (i-- > 0) {
+        error_response_release(loaded[i][0]);
+        error_response_release(loaded[i][1]);
+      }
+      log_event(ERROR, "Failed to load error pages.");
+      return -1;
+    }
+  }
+
+  for (size_t i = 0; i < NUM_ERROR_PAGES; i++) {
+    for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+      error_response_release(error_pages[i].responses[keep_alive]);
+      error_pages[i].responses[keep_alive] = loaded[i][keep_alive];
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * error_response_get - Get the response for an error
+ * @response_code: Error response code
+ * @keep_alive: Whether the connection is kept alive after the response
+ *
+ * Return: Response with a reference held by the caller, or NULL if there's
+ * no page for response_code
+ */
+struct error_response *error_response_get(int response_code, bool keep_alive) {
+  for (size_t i = 0; i < NUM_ERROR_PAGES; i++) {
+    if (error_pages[i].code == response_code) {
+      struct error_response *response = error_pages[i].responses[keep_alive];
+      if (response) {
+        response->refs++;
+      }
+      return response;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * error_response_release - Drop a reference to an error response
+ * @response: Response returned by error_response_get(), or NULL
+ */
+void error_response_release(struct error_response *response) {
+  if (!response) {
+    return;
+  }
+
+  response->refs--;
+  if (response->refs == 0) {
+    free(response);
+  }
+}
@@ -0,0 +1,1100 @@
+/**
+ * event.c
+ *
+ * Event loop for serving many clients from a single worker.
+ *
+ * OVERVIEW:
+ * Instead of blocking on one client at a time, each worker puts every socket
+ * it owns into non-blocking mode and registers it with epoll. epoll_wait()
+ * then tells us which sockets are ready, and we do as much work on each as we
+ * can without blocking before moving on to the next. A slow client therefore
+ * only costs us the memory for its struct connection, rather than a whole
+ * process sitting idle waiting for it.
+ *
+ * EDGE-TRIGGERED MODE:
+ * Client sockets are registered with EPOLLET, which means epoll only reports a
+ * socket when its state changes (e.g., new data arrives), not for as long as
+ * it stays ready. This saves us from being woken repeatedly for the same data,
+ * but it means handle_client() MUST keep reading or writing until OpenSSL
+ * reports SSL_ERROR_WANT_READ/WANT_WRITE, otherwise we'd never hear about that
+ * socket again.
+ *
+ * IO_URING:
+ * With the io_uring directive on, the loop waits on an io_uring instead of an
+ * epoll instance. New connections come from a single multishot accept, which
+ * goes on accepting until it's cancelled, and each client socket has a
+ * multishot poll that behaves like its edge-triggered epoll registration.
+ * Everything we ask of the kernel during an iteration (arming the polls of
+ * new connections, cancelling those of closed ones) is submitted in one go
+ * with the wait for the next iteration's events, so accepting a connection
+ * costs no system calls of its own. TLS is done by OpenSSL in our own process,
+ * so reading requests and writing responses still happens in handle_client().
+ *
+ * A poll that's still armed holds on to its socket even after we've closed
+ * it, and would complete for a connection we'd already freed. So a connection
+ * closed while its poll is armed is only freed once the poll's last
+ * completion, caused by cancelling it, has come in.
+ *
+ * ASYNC TLS:
+ * With tls_async on, an OpenSSL call can be left waiting for a provider to
+ * finish some work elsewhere (e.g., on an accelerator card). The provider
+ * gives us a descriptor that becomes readable when it's done, which we
+ * register with epoll for the connection alongside its socket. io_uring
+ * isn't used in this mode, since each connection would need a poll to be
+ * cancelled for every one of those descriptors.
+ *
+ * DRAINING:
+ * On SIGQUIT a worker stops accepting, closes the connections that are
+ * waiting for a request, and answers the requests already under way with
+ * "Connection: close". Once the last connection has gone, or drain_timeout
+ * has passed, the worker exits.
+ *
+ * IDLE TIMEOUTS:
+ * Every connection is kept in a list ordered by when it last made progress,
+ * with the least recently active connection at the head. Whenever a connection
+ * is handled it moves to the tail, so finding connections that have been idle
+ * for too long only means looking at the head of the list, however many
+ * connections there are.
+ *
+ * DEADLINES:
+ * The idle timeout only catches clients that stop sending altogether. One
+ * that sends a byte every few seconds keeps its connection active, and could
+ * take all day over a handshake or a request's headers, so those two stages
+ * also have to be finished within handshake_timeout and header_timeout of
+ * starting them. A connection under a deadline is kept in a list for that
+ * deadline as well, and since every connection on a list got the same
+ * timeout, the lists are in the order their deadlines pass, and again only
+ * their heads need looking at.
+ */
+
+/*
+ * accept4() is a Linux extension, so glibc only declares it when _GNU_SOURCE
+ * is defined before any system header is included.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <openssl/async.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "connection.h"
+#include "event.h"
+#include "log.h"
+#include "route.h"
+#include "server.h"
+#include "signals.h"
+#include "uring.h"
+#include "worker.h"
+
+/*
+ * Oldest and newest ends of the list of connections ordered by activity.
+ */
+static struct connection *idle_head = NULL;
+static struct connection *idle_tail = NULL;
+
+/*
+ * Oldest and newest ends of the lists of connections under each deadline,
+ * indexed by enum connection_deadline (DEADLINE_NONE's is never used).
+ */
+struct deadline_list {
+  struct connection *head;
+  struct connection *tail;
+};
+static struct deadline_list deadlines[DEADLINE_HEADER + 1];
+
+/*
+ * With io_uring, connections that have been closed but are waiting for their
+ * poll to be cancelled before they can be freed. They're no longer on the
+ * activity list, so they're linked through the same pointers.
+ */
+static struct connection *closing_head = NULL;
+
+/*
+ * Event data for the website index's inotify descriptor, and with io_uring
+ * for the listening socket. Only their addresses are used, to tell these
+ * events apart from those of connections.
+ */
+static char route_index_event;
+static char accept_event;
+static char listen_event;
+static char drain_event;
+static char stale_event;
+
+/*
+ * With io_uring, set in the event data of a cancellation, whose other bits
+ * are the address of the connection whose poll it cancels. Connections are
+ * allocated by calloc(), so that bit of their address is always clear. (The
+ * events above aren't aligned, so they're checked for first.)
+ */
+#define CANCEL_TAG 1
+
+/*
+ * Whether this worker's loop runs on io_uring, and the instance we wait on,
+ * whichever it is. Only one of epollfd and ring is in use.
+ */
+static bool use_uring = false;
+static int epollfd = -1;
+static struct uring ring;
+
+/*
+ * With epoll, the events of the current iteration and the next to handle.
+ * A connection closed while handling one may still have events further on,
+ * for the descriptors of its async jobs, which are then made stale_event.
+ */
+static struct epoll_event events[MAX_EVENTS];
+static int num_events = 0;
+static int next_event = 0;
+
+/*
+ * The time according to the monotonic clock, updated once per loop iteration.
+ * The monotonic clock can't jump backwards when the system time is changed,
+ * which makes it the right clock for measuring timeouts.
+ */
+static time_t now = 0;
+
+/*
+ * Set once we've been asked to drain, and when we give up on doing so.
+ */
+static bool draining = false;
+static time_t drain_deadline = 0;
+
+/**
+ * update_now - Refresh our idea of the current time
+ *
+ * CLOCK_MONOTONIC_COARSE is only as precise as the kernel's timer tick, but
+ * it's much cheaper to read than the precise clocks and we only need seconds.
+ */
+static void update_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  now = ts.tv_sec;
+}
+
+/**
+ * idle_list_remove - Unlink a connection from the activity list
+ * @conn: Connection to unlink
+ */
+static void idle_list_remove(struct connection *conn) {
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    idle_head = conn->next;
+  }
+
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  } else {
+    idle_tail = conn->prev;
+  }
+
+  conn->prev = NULL;
+  conn->next = NULL;
+}
+
+/**
+ * idle_list_append - Add a connection to the newest end of the activity list
+ * @conn: Connection that has just been active
+ */
+static void idle_list_append(struct connection *conn) {
+  conn->last_active = now;
+  conn->prev = idle_tail;
+  conn->next = NULL;
+
+  if (idle_tail) {
+    idle_tail->next = conn;
+  } else {
+    idle_head = conn;
+  }
+  idle_tail = conn;
+}
+
+/**
+ * deadline_list_remove - Take a connection off its deadline's list
+ * @conn: Connection to unlink, which may not be under a deadline
+ */
+static void deadline_list_remove(struct connection *conn) {
+  if (conn->deadline == DEADLINE_NONE) {
+    return;
+  }
+
+  struct deadline_list *list = &deadlines[conn->deadline];
+  if (conn->deadline_prev) {
+    conn->deadline_prev->deadline_next = conn->deadline_next;
+  } else {
+    list->head = conn->deadline_next;
+  }
+
+  if (conn->deadline_next) {
+    conn->deadline_next->deadline_prev = conn->deadline_prev;
+  } else {
+    list->tail = conn->deadline_prev;
+  }
+
+  conn->deadline = DEADLINE_NONE;
+  conn->deadline_prev = NULL;
+  conn->deadline_next = NULL;
+}
+
+/**
+ * deadline_list_append - Put a connection under a deadline
+ * @conn: Connection that isn't under a deadline
+ * @deadline: Deadline to put it under
+ * @timeout: Seconds from now until the deadline passes
+ */
+static void deadline_list_append(struct connection *conn,
+                                 enum connection_deadline deadline,
+                                 int timeout) {
+  struct deadline_list *list = &deadlines[deadline];
+  conn->deadline = deadline;
+  conn->deadline_at = now + timeout;
+  conn->deadline_request = conn->requests_served;
+  conn->deadline_prev = list->tail;
+  conn->deadline_next = NULL;
+
+  if (list->tail) {
+    list->tail->deadline_next = conn;
+  } else {
+    list->head = conn;
+  }
+  list->tail = conn;
+}
+
+/**
+ * update_deadline - Put a connection under the deadline for its stage
+ * @conn: Connection that has just been accepted or handled
+ *
+ * A connection is under the handshake deadline until its handshake is done,
+ * and under the header deadline from the first byte of a request until the
+ * whole head has arrived. A deadline that's already running carries on
+ * rather than starting again, unless it's for the headers of an earlier
+ * request.
+ */
+static void update_deadline(struct connection *conn) {
+  struct server_config *config = config_get_ctx();
+  enum connection_deadline deadline = DEADLINE_NONE;
+  int timeout = 0;
+
+  if (conn->state == CONN_HANDSHAKE) {
+    deadline = DEADLINE_HANDSHAKE;
+    timeout = config->handshake_timeout;
+  } else if (conn->state == CONN_READING && conn->request_length > 0) {
+    deadline = DEADLINE_HEADER;
+    timeout = config->header_timeout;
+  }
+
+  if (deadline == conn->deadline &&
+      (deadline != DEADLINE_HEADER ||
+       conn->deadline_request == conn->requests_served)) {
+    return;
+  }
+
+  deadline_list_remove(conn);
+  if (deadline != DEADLINE_NONE) {
+    deadline_list_append(conn, deadline, timeout);
+  }
+}
+
+/**
+ * uring_poll - Ask for a multishot poll of a descriptor
+ * @fd: Descriptor to poll
+ * @events: Events to poll for
+ * @tag: Event data to complete with
+ *
+ * Multishot polls are edge-triggered, completing for each change in the
+ * descriptor's readiness, much as an EPOLLET registration would.
+ *
+ * Return: 0 on success, -1 if the submission queue is full
+ */
+static int uring_poll(int fd, unsigned events, void *tag) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+  if (!sqe) {
+    return -1;
+  }
+
+  /*
+   * The kernel reads poll32_events as two 16-bit halves, which on big-endian
+   * systems means swapping them.
+   */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  events = (events << 16) | (events >> 16);
+#endif
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = (__u64)(uintptr_t)tag;
+  return 0;
+}
+
+/**
+ * uring_accept - Ask for a multishot accept on the listening socket
+ * @listenfd: Listening socket
+ *
+ * Return: 0 on success, -1 if the submission queue is full
+ */
+static int uring_accept(int listenfd) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+  if (!sqe) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listenfd;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = (__u64)(uintptr_t)&accept_event;
+  return 0;
+}
+
+/**
+ * uring_cancel_poll - Ask for a connection's poll to be cancelled
+ * @conn: Connection whose poll to cancel
+ */
+static void uring_cancel_poll(struct connection *conn) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+  if (!sqe) {
+    log_event(ERROR, "Failed to cancel poll of closed connection.");
+    return;
+  }
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = (__u64)(uintptr_t)conn;
+  sqe->user_data = (__u64)(uintptr_t)conn | CANCEL_TAG;
+}
+
+/**
+ * closing_list_remove - Unlink a connection from the closing list
+ * @conn: Connection to unlink
+ */
+static void closing_list_remove(struct connection *conn) {
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    closing_head = conn->next;
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  }
+  conn->prev = NULL;
+  conn->next = NULL;
+}
+
+/**
+ * is_closing - Check whether a connection is waiting for its poll to end
+ * @conn: Address of the connection, which may already have been freed
+ *
+ * Return: true if conn is on the closing list
+ */
+static bool is_closing(const struct connection *conn) {
+  for (struct connection *closing = closing_head; closing;
+       closing = closing->next) {
+    if (closing == conn) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * get_async_fds - Get the descriptors of a connection's async jobs
+ * @conn: Connection with async jobs
+ * @num_fds: Output parameter for the number of descriptors
+ *
+ * Return: Allocated array of descriptors, or NULL if there are none or on
+ * failure
+ */
+static OSSL_ASYNC_FD *get_async_fds(struct connection *conn, size_t *num_fds) {
+  *num_fds = 0;
+  if (!SSL_get_all_async_fds(conn->ssl, NULL, num_fds) || *num_fds == 0) {
+    return NULL;
+  }
+  OSSL_ASYNC_FD *fds = malloc(*num_fds * sizeof(*fds));
+  if (!fds || !SSL_get_all_async_fds(conn->ssl, fds, num_fds)) {
+    free(fds);
+    *num_fds = 0;
+    return NULL;
+  }
+  return fds;
+}
+
+/**
+ * watch_async_fds - Register the descriptors of a connection's async jobs
+ * @conn: Connection that has just been handled
+ *
+ * Which descriptors a connection's jobs have can change whenever a job
+ * starts, so this is called every time the connection has been handled.
+ * Descriptors we've already registered fail with EEXIST, and those that
+ * have gone were removed from epoll when they were closed. Like the socket
+ * they're edge-triggered, so one the provider doesn't reset straight away
+ * doesn't wake us over and over.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int watch_async_fds(struct connection *conn) {
+  size_t num_added = 0;
+  size_t num_deleted = 0;
+  if (!SSL_get_changed_async_fds(conn->ssl, NULL, &num_added, NULL,
+                                 &num_deleted) ||
+      num_added == 0) {
+    return 0;
+  }
+
+  size_t num_fds;
+  OSSL_ASYNC_FD *fds = get_async_fds(conn, &num_fds);
+  int result = 0;
+  for (size_t i = 0; i < num_fds; i++) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = conn;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fds[i], &event) == -1 &&
+        errno != EEXIST) {
+      log_event(ERROR, "Failed to register async TLS job with epoll.");
+      result = -1;
+      break;
+    }
+    conn->watching_async = true;
+  }
+  free(fds);
+  return result;
+}
+
+/**
+ * unwatch_async_fds - Deregister the descriptors of a connection's async jobs
+ * @conn: Connection being closed
+ *
+ * The provider may keep a descriptor open after the connection is freed, so
+ * it has to come out of epoll first, and so do any of its events that we
+ * haven't handled yet.
+ */
+static void unwatch_async_fds(struct connection *conn) {
+  size_t num_fds;
+  OSSL_ASYNC_FD *fds = get_async_fds(conn, &num_fds);
+  for (size_t i = 0; i < num_fds; i++) {
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fds[i], NULL);
+  }
+  free(fds);
+
+  for (int i = next_event; i < num_events; i++) {
+    if (events[i].data.ptr == conn) {
+      events[i].data.ptr = &stale_event;
+    }
+  }
+  conn->watching_async = false;
+}
+
+/**
+ * close_connection - Stop tracking a connection and free it
+ * @conn: Connection to close
+ *
+ * With io_uring, a connection whose poll is armed has the poll cancelled
+ * instead, and is freed when the cancellation completes.
+ */
+static void close_connection(struct connection *conn) {
+  idle_list_remove(conn);
+  deadline_list_remove(conn);
+  if (conn->watching_async) {
+    unwatch_async_fds(conn);
+  }
+
+  if (!conn->polling) {
+    connection_free(conn);
+    return;
+  }
+
+  conn->closing = true;
+  conn->next = closing_head;
+  if (closing_head) {
+    closing_head->prev = conn;
+  }
+  closing_head = conn;
+  uring_cancel_poll(conn);
+}
+
+/**
+ * close_idle_connections - Close connections that have been idle too long
+ *
+ * This covers connections waiting between requests on a persistent
+ * connection as well as clients that stop partway through a handshake or
+ * request, and those that are still going but have run out of time for it.
+ *
+ * If a reload shortens a deadline's timeout, connections put under it since
+ * wait behind those from before, until the last of those has gone.
+ */
+static void close_idle_connections(void) {
+  int timeout = config_get_ctx()->keepalive_timeout;
+
+  while (idle_head && now - idle_head->last_active >= timeout) {
+    close_connection(idle_head);
+  }
+
+  for (int deadline = DEADLINE_HANDSHAKE; deadline <= DEADLINE_HEADER;
+       deadline++) {
+    while (deadlines[deadline].head &&
+           now >= deadlines[deadline].head->deadline_at) {
+      close_connection(deadlines[deadline].head);
+    }
+  }
+}
+
+/**
+ * watch_connection - Start waiting for events on a new connection
+ * @conn: Connection that has just been accepted
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int watch_connection(struct connection *conn) {
+  /*
+   * We ask for both readability and writability up front. Since we're
+   * edge-triggered this doesn't cause repeated wakeups, and it means we
+   * never have to modify the registration when the connection switches
+   * between reading and writing. EPOLLRDHUP tells us when the client hangs
+   * up.
+   *
+   * If the client's ClientHello has already arrived, the socket is reported
+   * as ready on the next wait, so we don't need to try the handshake here.
+   */
+  if (use_uring) {
+    if (uring_poll(conn->fd, POLLIN | POLLOUT | POLLRDHUP, conn) == -1) {
+      log_event(ERROR, "Failed to poll connection with io_uring.");
+      return -1;
+    }
+    conn->polling = true;
+    return 0;
+  }
+
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = conn;
+  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+    log_event(ERROR, "Failed to register connection with epoll.");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * accept_clients - Accept every pending connection on the listening socket
+ * @listenfd: Non-blocking listening socket
+ *
+ * Without reuseport every worker waits on the same listening socket, so
+ * another worker may accept the connection we were woken for before we get to
+ * it. That just shows up as EAGAIN here, which is also how we know the queue
+ * is empty.
+ *
+ * Return: 0 on success, -1 if the listening socket is unusable
+ */
+static int accept_clients(int listenfd) {
+  for (;;) {
+    /*
+     * accept4() is accept() with flags, SOCK_NONBLOCK saves us a separate
+     * fcntl() call to make the client socket non-blocking.
+     */
+    struct sockaddr_storage address;
+    socklen_t address_length = sizeof(address);
+    int clientfd =
+        accept4(listenfd, (struct sockaddr *)&address, &address_length,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (clientfd == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+
+      /*
+       * These errors only affect the connection being accepted (or mean we've
+       * run out of descriptors for now), the listening socket is fine.
+       */
+      if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+        continue;
+      }
+      if (errno == EMFILE || errno == ENFILE) {
+        log_event(WARN, "Out of file descriptors, not accepting for now.");
+        return 0;
+      }
+
+      char accept_fail_msg[LOG_MSG_MAX];
+      snprintf(accept_fail_msg, LOG_MSG_MAX, "Failed to accept connection: %s",
+               strerror(errno));
+      log_event(FATAL, accept_fail_msg);
+      return -1;
+    }
+
+    struct connection *conn = connection_new(clientfd, &address);
+    if (!conn) {
+      continue;
+    }
+    if (watch_connection(conn) == -1) {
+      connection_free(conn);
+      continue;
+    }
+
+    idle_list_append(conn);
+    update_deadline(conn);
+  }
+}
+
+/**
+ * serve_client - Make whatever progress a connection can
+ * @conn: Connection that has had an event
+ *
+ * We don't need to look at which events fired. handle_client() works out
+ * what to do from the connection's state, and will find out about errors and
+ * hangups from OpenSSL when it tries to read or write.
+ *
+ * Return: true if the connection is still open, false if it was closed
+ */
+static bool serve_client(struct connection *conn) {
+  if (handle_client(conn) == 0 ||
+      (config_get_ctx()->tls_async && watch_async_fds(conn) == -1)) {
+    close_connection(conn);
+    return false;
+  }
+
+  idle_list_remove(conn);
+  idle_list_append(conn);
+  update_deadline(conn);
+  return true;
+}
+
+/**
+ * add_uring_client - Take on a connection accepted by the multishot accept
+ * @clientfd: The connection's socket
+ *
+ * The multishot accept doesn't give us the client's address, since there's
+ * only one place it could write it for all the connections it accepts, so
+ * we ask for it here instead.
+ */
+static void add_uring_client(int clientfd) {
+  struct sockaddr_storage address;
+  socklen_t address_length = sizeof(address);
+  if (getpeername(clientfd, (struct sockaddr *)&address, &address_length) ==
+      -1) {
+    address.ss_family = AF_UNSPEC;
+  }
+
+  struct connection *conn = connection_new(clientfd, &address);
+  if (!conn) {
+    return;
+  }
+  if (watch_connection(conn) == -1) {
+    connection_free(conn);
+    return;
+  }
+  idle_list_append(conn);
+  update_deadline(conn);
+}
+
+/**
+ * handle_accept_completion - Act on a completion of the multishot accept
+ * @res: The accepted socket, or a negative error number
+ * @multishot_accept: Set to false if the kernel doesn't support multishot
+ *                    accept
+ * @accept_resume: Set to when to start accepting again after running out of
+ *                 descriptors
+ *
+ * Return: 0 on success, -1 if the listening socket is unusable
+ */
+static int handle_accept_completion(int res, bool *multishot_accept,
+                                    time_t *accept_resume) {
+  if (res >= 0) {
+    add_uring_client(res);
+    return 0;
+  }
+
+  switch (-res) {
+  case EINVAL:
+    /*
+     * Multishot accept needs Linux 5.19. Before that we poll the listening
+     * socket and accept with accept4() as epoll does.
+     */
+    if (*multishot_accept) {
+      log_event(INFO, "No multishot accept, polling listening socket.");
+      *multishot_accept = false;
+      return 0;
+    }
+    break;
+  case EINTR:
+  case ECONNABORTED:
+  case EPROTO:
+  case ECANCELED:
+    return 0;
+  case EMFILE:
+  case ENFILE:
+    log_event(WARN, "Out of file descriptors, not accepting for now.");
+    *accept_resume = now + 1;
+    return 0;
+  }
+
+  char accept_fail_msg[LOG_MSG_MAX];
+  snprintf(accept_fail_msg, LOG_MSG_MAX, "Failed to accept connection: %s",
+           strerror(-res));
+  log_event(FATAL, accept_fail_msg);
+  return -1;
+}
+
+/**
+ * event_loop_draining - Check whether the worker is shutting down
+ *
+ * Return: true once the worker has been asked to drain
+ */
+bool event_loop_draining(void) { return draining; }
+
+/**
+ * is_between_requests - Check whether a connection is waiting for a request
+ * @conn: Connection to check
+ *
+ * Return: true if the connection has finished its handshake and has no
+ * request under way
+ */
+static bool is_between_requests(const struct connection *conn) {
+  return conn->state == CONN_READING && conn->request_length == 0;
+}
+
+/**
+ * start_draining - Stop taking on connections, and close idle ones
+ * @listenfd: Listening socket to stop accepting on
+ * @accepting: Whether an io_uring accept (or poll) is armed
+ *
+ * The listening socket stays open in the parent, so connections waiting on
+ * it are left for other workers, or for the server replacing us.
+ */
+static void start_draining(int listenfd, bool accepting) {
+  draining = true;
+  drain_deadline = now + config_get_ctx()->drain_timeout;
+
+  if (use_uring) {
+    struct io_uring_sqe *sqe = accepting ? uring_get_sqe(&ring) : NULL;
+    if (sqe) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = (__u64)(uintptr_t)&accept_event;
+      sqe->user_data = (__u64)(uintptr_t)&drain_event;
+      sqe = uring_get_sqe(&ring);
+    }
+    if (sqe) {
+      sqe->opcode = IORING_OP_POLL_REMOVE;
+      sqe->fd = -1;
+      sqe->addr = (__u64)(uintptr_t)&listen_event;
+      sqe->user_data = (__u64)(uintptr_t)&drain_event;
+    }
+  } else {
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, listenfd, NULL);
+  }
+
+  struct connection *conn = idle_head;
+  while (conn) {
+    struct connection *next = conn->next;
+    if (is_between_requests(conn)) {
+      close_connection(conn);
+    }
+    conn = next;
+  }
+}
+
+/**
+ * finish_draining - Exit the worker once its connections are done
+ *
+ * Connections still open when drain_timeout runs out are cut off. Those
+ * waiting for their poll to be cancelled are already done with, so they
+ * don't hold us up.
+ */
+static void finish_draining(void) {
+  if (idle_head && now < drain_deadline) {
+    return;
+  }
+
+  if (idle_head) {
+    log_event(WARN, "Drain timed out, closing remaining connections.");
+  }
+
+  /*
+   * Everything else is reclaimed by the OS when we exit.
+   */
+  log_flush();
+  worker_exit(EXIT_SUCCESS);
+}
+
+/**
+ * uring_loop - Serve connections from an io_uring
+ * @listenfd: Non-blocking listening socket
+ *
+ * Multishot operations end when they fail (and may end early for other
+ * reasons, such as the completion queue overflowing), which we see as a
+ * completion without IORING_CQE_F_MORE. Each is then submitted again.
+ */
+static void uring_loop(int listenfd) {
+  bool multishot_accept = true;
+  bool accepting = false;
+  bool watching_index = false;
+  time_t accept_resume = 0;
+
+  for (;;) {
+    if (sig_reload_pending()) {
+      server_reload();
+    }
+
+    update_now();
+    if (sig_quit_pending() && !draining) {
+      start_draining(listenfd, accepting);
+    }
+
+    if (!accepting && !draining && now >= accept_resume) {
+      int armed = multishot_accept
+                      ? uring_accept(listenfd)
+                      : uring_poll(listenfd, POLLIN, &listen_event);
+      if (armed == -1) {
+        log_event(FATAL, "Failed to accept connections with io_uring.");
+        return;
+      }
+      accepting = true;
+    }
+    if (!watching_index && route_index_fd() != -1) {
+      if (uring_poll(route_index_fd(), POLLIN, &route_index_event) == -1) {
+        log_event(FATAL, "Failed to poll website index with io_uring.");
+        return;
+      }
+      watching_index = true;
+    }
+
+    int wait_timeout =
+        idle_head || log_has_pending() || !accepting ? 1000 : -1;
+    if (draining) {
+      wait_timeout = 1000;
+    }
+    if (uring_wait(&ring, wait_timeout) == -1 && errno != EINTR) {
+      log_event(FATAL, "Failed to wait for events.");
+      return;
+    }
+
+    update_now();
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek(&ring))) {
+      __u64 cqe_data = cqe->user_data;
+      void *tag = (void *)(uintptr_t)cqe_data;
+      int res = cqe->res;
+      bool more = cqe->flags & IORING_CQE_F_MORE;
+      uring_advance(&ring);
+
+      if (tag == &drain_event) {
+        continue;
+      }
+
+      /*
+       * Connections the multishot accept had already taken when we started
+       * draining are ours to serve, but we don't go looking for more.
+       */
+      if (tag == &accept_event || tag == &listen_event) {
+        accepting = more;
+        int accepted = 0;
+        if (tag == &accept_event) {
+          accepted =
+              handle_accept_completion(res, &multishot_accept, &accept_resume);
+        } else if (!draining) {
+          accepted = accept_clients(listenfd);
+        }
+        if (accepted == -1) {
+          return;
+        }
+        continue;
+      }
+
+      if (tag == &route_index_event) {
+        watching_index = more;
+        route_index_refresh();
+        continue;
+      }
+
+      /*
+       * A poll that's completing just as we cancel it can't be cancelled
+       * there and then, and we're told EALREADY. The cancellation sometimes
+       * doesn't take effect after all, so we ask again, unless the poll's
+       * last completion has already come in and the connection been freed
+       * (its address may even belong to a new connection by now).
+       */
+      if (cqe_data & CANCEL_TAG) {
+        struct connection *conn = (void *)(uintptr_t)(cqe_data & ~CANCEL_TAG);
+        if (res == -EALREADY && is_closing(conn)) {
+          uring_cancel_poll(conn);
+        }
+        continue;
+      }
+
+      struct connection *conn = tag;
+      if (!more) {
+        conn->polling = false;
+      }
+      if (conn->closing) {
+        if (!conn->polling) {
+          closing_list_remove(conn);
+          connection_free(conn);
+        }
+        continue;
+      }
+
+      if (serve_client(conn) && !conn->polling &&
+          watch_connection(conn) == -1) {
+        close_connection(conn);
+      }
+    }
+
+    close_idle_connections();
+    log_flush_if_due();
+    if (draining) {
+      finish_draining();
+    }
+  }
+}
+
+/**
+ * epoll_loop - Serve connections from an epoll instance
+ * @listenfd: Non-blocking listening socket
+ */
+static void epoll_loop(int listenfd) {
+  /*
+   * The listening socket's event data is NULL, which is how we tell it apart
+   * from client connections below.
+   *
+   * EPOLLEXCLUSIVE stops the kernel from waking every worker for each new
+   * connection when only one of them can accept it (the "thundering herd").
+   * The listening socket is level-triggered, so a connection that the woken
+   * worker doesn't get to is reported again.
+   */
+  struct epoll_event listen_registration;
+  listen_registration.events = EPOLLIN | EPOLLEXCLUSIVE;
+  listen_registration.data.ptr = NULL;
+  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &listen_registration) ==
+      -1) {
+    log_event(FATAL, "Failed to register listening socket with epoll.");
+    return;
+  }
+
+  if (route_index_fd() != -1) {
+    struct epoll_event route_event;
+    route_event.events = EPOLLIN;
+    route_event.data.ptr = &route_index_event;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, route_index_fd(), &route_event) ==
+        -1) {
+      log_event(FATAL, "Failed to register website index with epoll.");
+      return;
+    }
+  }
+
+  for (;;) {
+    /*
+     * SIGHUP and SIGQUIT interrupt epoll_wait() below, so we get here
+     * straight after them.
+     */
+    if (sig_reload_pending()) {
+      server_reload();
+    }
+    if (sig_quit_pending() && !draining) {
+      update_now();
+      start_draining(listenfd, false);
+    }
+
+    /*
+     * With connections open (or log lines waiting to be written), wake up at
+     * least once a second to check for idle ones. Otherwise there's nothing to
+     * do until a client connects.
+     */
+    int wait_timeout = idle_head || log_has_pending() || draining ? 1000 : -1;
+
+    num_events = epoll_wait(epollfd, events, MAX_EVENTS, wait_timeout);
+    if (num_events == -1) {
+      num_events = 0;
+      if (errno == EINTR) {
+        continue;
+      }
+      log_event(FATAL, "Failed to wait for events.");
+      return;
+    }
+
+    update_now();
+
+    for (next_event = 0; next_event < num_events;) {
+      void *data = events[next_event++].data.ptr;
+      if (data == &stale_event) {
+        continue;
+      }
+      if (data == &route_index_event) {
+        route_index_refresh();
+        continue;
+      }
+
+      struct connection *conn = data;
+      if (!conn) {
+        if (accept_clients(listenfd) == -1) {
+          return;
+        }
+        continue;
+      }
+
+      serve_client(conn);
+    }
+
+    close_idle_connections();
+    log_flush_if_due();
+    if (draining) {
+      finish_draining();
+    }
+  }
+}
+
+/**
+ * event_loop_run - Serve connections until an unrecoverable error occurs
+ * @listenfd: Non-blocking listening socket, this worker's own with reuseport
+ *            or shared by every worker otherwise
+ */
+void event_loop_run(int listenfd) {
+  /*
+   * The index is per worker, so it's built here rather than before the
+   * workers are forked. If it can't be built we serve without it.
+   */
+  if (config_get_ctx()->route_index) {
+    route_index_init();
+  }
+
+  /*
+   * io_uring may be missing, too old, or blocked (e.g., by a container's
+   * seccomp profile), in which case we carry on with epoll.
+   */
+  if (config_get_ctx()->io_uring && config_get_ctx()->tls_async) {
+    log_event(WARN, "io_uring can't be used with tls_async, using epoll.");
+  } else if (config_get_ctx()->io_uring) {
+    use_uring = uring_init(&ring, MAX_EVENTS) == 0;
+    if (!use_uring) {
+      log_event(WARN, "Can't use io_uring, falling back to epoll.");
+    }
+  }
+
+  if (!use_uring) {
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd == -1) {
+      log_event(FATAL, "Failed to create epoll instance.");
+      return;
+    }
+  }
+
+  /*
+   * From here on, log lines are written out in batches by
+   * log_flush_if_due() below rather than one at a time.
+   */
+  log_start_batching();
+
+  if (use_uring) {
+    uring_loop(listenfd);
+    uring_free(&ring);
+  } else {
+    epoll_loop(listenfd);
+    close(epollfd);
+  }
+}
@@ -0,0 +1,514 @@
+/**
+ * fd_cache.c
+ *
+ * Cache of open file descriptors for the files we serve.
+ *
+ * OVERVIEW:
+ * Finding out whether a file exists and then opening it means the kernel
+ * resolves its path twice, a directory at a time from the root, and files too
+ * large for the content cache used to be opened again for every request. We
+ * keep recently used files open instead, along with their fstat() results, so
+ * checking that a file exists and sending it share the one open.
+ *
+ * Each worker has its own cache, as with the content cache, and the number of
+ * descriptors it keeps open is limited by the open_file_cache setting.
+ *
+ * CONFINEMENT:
+ * Each website directory (the default one and every vhost's) is held open as
+ * a directory descriptor, and files in it are opened relative to that with
+ * openat2() and RESOLVE_BENEATH. The kernel then refuses to resolve the path
+ * to anywhere outside the directory, whether through "..", an absolute
+ * symbolic link, or a symbolic link to a parent directory, which backs up the
+ * string checks in paths_security.c. Resolving relative to the directory also
+ * saves walking the directories above it on every open.
+ *
+ * openat2() needs Linux 5.6. On older kernels we fall back to openat(), which
+ * still saves the walk but doesn't confine symbolic links.
+ *
+ * INVALIDATION:
+ * At most once every FD_CACHE_REVALIDATE_INTERVAL seconds a cached file is
+ * checked against whatever its path names now, and reopened if that's a
+ * different file or the file has changed. The website directories are
+ * checked the same way, so that swapping in a new directory (e.g. by renaming
+ * it into place) is noticed.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "fd_cache.h"
+#include "log.h"
+#include "paths.h"
+#include "route.h"
+#include "vhost.h"
+
+/**
+ * Number of hash table buckets, this must be a power of two. Chains only get
+ * long if open_file_cache is set well above this.
+ */
+#define FD_CACHE_BUCKETS 1024
+
+/*
+ * The hash table, and the most and least recently used ends of the LRU list.
+ */
+static struct open_file *buckets[FD_CACHE_BUCKETS];
+static int num_files = 0;
+static struct open_file *lru_head = NULL;
+static struct open_file *lru_tail = NULL;
+
+/**
+ * struct website_dir - A website directory that files are opened beneath
+ * @path: Path of the directory, with its trailing slash
+ * @length: Length of path
+ * @fd: Open descriptor for the directory, -1 until first needed
+ * @dir_stat: What the directory looked like when we opened it
+ */
+struct website_dir {
+  const char *path;
+  size_t length;
+  int fd;
+  struct stat dir_stat;
+};
+
+/*
+ * The website directories, the default one first and then each vhost's
+ * (NULL until first needed), and when we last checked that their paths
+ * still name them.
+ */
+static struct website_dir *websites = NULL;
+static int num_websites = 0;
+static time_t websites_validated = 0;
+
+/*
+ * Set once openat2() turns out not to be supported, so we don't keep trying.
+ */
+static bool no_openat2 = false;
+
+/**
+ * current_time - Get the current time in seconds
+ *
+ * Return: Seconds on the monotonic clock
+ */
+static time_t current_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec;
+}
+
+/**
+ * hash_path - Hash a file path
+ * @path: Path to hash
+ *
+ * FNV-1a, the same hash the content cache uses.
+ *
+ * Return: 32-bit hash
+ */
+static uint32_t hash_path(const char *path) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * same_file - Check whether two stat results describe the same file contents
+ * @a: First stat result
+ * @b: Second stat result
+ *
+ * Return: true if they're the same file, unchanged
+ */
+static bool same_file(const struct stat *a, const struct stat *b) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+         a->st_size == b->st_size &&
+         a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+         a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/**
+ * file_free - Close and free a file nobody is using any more
+ * @file: File that is no longer cached or in use
+ */
+static void file_free(struct open_file *file) {
+  close(file->fd);
+  free(file->path);
+  free(file);
+}
+
+/**
+ * lru_remove - Unlink a file from the LRU list
+ * @file: Cached file
+ */
+static void lru_remove(struct open_file *file) {
+  if (file->lru_prev) {
+    file->lru_prev->lru_next = file->lru_next;
+  } else {
+    lru_head = file->lru_next;
+  }
+  if (file->lru_next) {
+    file->lru_next->lru_prev = file->lru_prev;
+  } else {
+    lru_tail = file->lru_prev;
+  }
+  file->lru_prev = NULL;
+  file->lru_next = NULL;
+}
+
+/**
+ * lru_push_front - Make a file the most recently used
+ * @file: Cached file that isn't in the LRU list
+ */
+static void lru_push_front(struct open_file *file) {
+  file->lru_prev = NULL;
+  file->lru_next = lru_head;
+  if (lru_head) {
+    lru_head->lru_prev = file;
+  } else {
+    lru_tail = file;
+  }
+  lru_head = file;
+}
+
+/**
+ * cache_remove - Take a file out of the cache
+ * @file: Cached file
+ *
+ * The file is closed straight away unless someone is still using it, in which
+ * case fd_cache_release() closes it when they're done.
+ */
+static void cache_remove(struct open_file *file) {
+  struct open_file **link = &buckets[file->hash & (FD_CACHE_BUCKETS - 1)];
+  while (*link != file) {
+    link = &(*link)->bucket_next;
+  }
+  *link = file->bucket_next;
+  file->bucket_next = NULL;
+
+  lru_remove(file);
+  file->cached = false;
+  num_files--;
+
+  if (file->refs == 0) {
+    file_free(file);
+  }
+}
+
+/**
+ * cache_clear - Take every file out of the cache
+ */
+static void cache_clear(void) {
+  while (lru_head) {
+    cache_remove(lru_head);
+  }
+}
+
+/**
+ * init_websites - List the website directories
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int init_websites(void) {
+  const char *website_path = get_website_path();
+  if (!website_path) {
+    return -1;
+  }
+
+  websites = calloc((size_t)vhost_count() + 1, sizeof(*websites));
+  if (!websites) {
+    log_event(ERROR, "Failed to allocate memory for website directories.");
+    return -1;
+  }
+
+  websites[0].path = website_path;
+  for (int i = 0; i < vhost_count(); i++) {
+    websites[i + 1].path = vhost_get(i)->root;
+  }
+  num_websites = vhost_count() + 1;
+  for (int i = 0; i < num_websites; i++) {
+    websites[i].length = strlen(websites[i].path);
+    websites[i].fd = -1;
+  }
+  return 0;
+}
+
+/**
+ * validate_websites - Check whether any website directory has been replaced
+ * @now: Current time
+ *
+ * A replaced directory closes everything we have open, since it may not be
+ * obvious which of it came from the old directory (one website's directory
+ * can be inside another's). The directory is reopened when next needed.
+ */
+static void validate_websites(time_t now) {
+  if (now - websites_validated < FD_CACHE_REVALIDATE_INTERVAL) {
+    return;
+  }
+  websites_validated = now;
+
+  for (int i = 0; i < num_websites; i++) {
+    struct website_dir *website = &websites[i];
+    struct stat current_stat;
+    if (website->fd == -1 ||
+        (stat(website->path, &current_stat) == 0 &&
+         current_stat.st_dev == website->dir_stat.st_dev &&
+         current_stat.st_ino == website->dir_stat.st_ino)) {
+      continue;
+    }
+
+    cache_clear();
+    close(website->fd);
+    website->fd = -1;
+  }
+}
+
+/**
+ * find_website - Find the website directory a file is in
+ * @file_path: Full path of the file
+ *
+ * A website directory inside another's is its own website, so the longest
+ * directory the path is in is the one it belongs to. This only happens when
+ * a file is opened, which costs far more than going through the list.
+ *
+ * Return: The directory, or NULL if the file isn't in any
+ */
+static struct website_dir *find_website(const char *file_path) {
+  struct website_dir *found = NULL;
+  for (int i = 0; i < num_websites; i++) {
+    struct website_dir *website = &websites[i];
+    if ((!found || website->length > found->length) &&
+        strncmp(file_path, website->path, website->length) == 0) {
+      found = website;
+    }
+  }
+  return found;
+}
+
+/**
+ * get_website_fd - Get the open descriptor of a website directory
+ * @website: Website directory
+ *
+ * O_PATH opens the directory only as somewhere to resolve paths from, which
+ * doesn't need read permission and can't be used to read it.
+ *
+ * Return: Directory descriptor, or -1 on failure
+ */
+static int get_website_fd(struct website_dir *website) {
+  if (website->fd != -1) {
+    return website->fd;
+  }
+
+  website->fd = open(website->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (website->fd == -1 || fstat(website->fd, &website->dir_stat) == -1) {
+    char open_fail_msg[LOG_MSG_MAX];
+    snprintf(open_fail_msg, LOG_MSG_MAX,
+             "Failed to open website directory: %s", strerror(errno));
+    log_event(ERROR, open_fail_msg);
+    if (website->fd != -1) {
+      close(website->fd);
+      website->fd = -1;
+    }
+    return -1;
+  }
+  return website->fd;
+}
+
+/**
+ * open_beneath - Open a file inside the website directory
+ * @dirfd: Descriptor for the website directory
+ * @relative_path: Path of the file relative to it
+ * @flags: Flags to open the file with
+ *
+ * glibc has no wrapper for openat2() yet, so we make the system call
+ * directly.
+ *
+ * Return: Open descriptor, or -1 with errno set
+ */
+static int open_beneath(int dirfd, const char *relative_path, int flags) {
+#ifdef SYS_openat2
+  if (!no_openat2) {
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = (uint64_t)flags;
+    how.resolve = RESOLVE_BENEATH;
+
+    int fd = (int)syscall(SYS_openat2, dirfd, relative_path, &how, sizeof(how));
+    if (fd != -1 || errno != ENOSYS) {
+      return fd;
+    }
+    no_openat2 = true;
+    log_event(WARN, "openat2() isn't supported, symbolic links out of the "
+                    "website directory won't be refused.");
+  }
+#endif
+
+  return openat(dirfd, relative_path, flags);
+}
+
+/**
+ * open_path - Open a file and stat it
+ * @file_path: Full path of the file
+ * @file_stat: Output parameter for the file's metadata
+ *
+ * O_NONBLOCK stops us from hanging on a FIFO someone has left in the website
+ * directory. It makes no difference to regular files, which are all we go on
+ * to use.
+ *
+ * Return: Open descriptor, or -1 with errno set
+ */
+static int open_path(const char *file_path, struct stat *file_stat) {
+  int flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK;
+
+  int fd;
+  struct website_dir *website = find_website(file_path);
+  int dirfd = website ? get_website_fd(website) : -1;
+  if (dirfd != -1) {
+    fd = open_beneath(dirfd, file_path + website->length, flags);
+  } else {
+    fd = open(file_path, flags);
+  }
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (fstat(fd, file_stat) == -1) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  if (!S_ISREG(file_stat->st_mode)) {
+    close(fd);
+    errno = EISDIR;
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * is_current - Check that a cached file is still what its path names
+ * @file: Cached file
+ *
+ * The website index knows what each file looks like now without a system
+ * call. Otherwise we stat the path, which costs one lookup rather than the
+ * open, fstat and close of reopening it.
+ *
+ * Return: true if the cached descriptor can still be used
+ */
+static bool is_current(const struct open_file *file) {
+  const struct route *route;
+  if (route_index_lookup(file->path, &route)) {
+    return route && route->dev == file->file_stat.st_dev &&
+           route->ino == file->file_stat.st_ino &&
+           route->size == file->file_stat.st_size &&
+           route->mtime.tv_sec == file->file_stat.st_mtim.tv_sec &&
+           route->mtime.tv_nsec == file->file_stat.st_mtim.tv_nsec;
+  }
+
+  struct stat current_stat;
+  return stat(file->path, &current_stat) == 0 &&
+         same_file(&current_stat, &file->file_stat);
+}
+
+/**
+ * fd_cache_open - Get an open descriptor for a file
+ * @file_path: Full path of the file
+ *
+ * Return: Open file with a reference held by the caller, or NULL with errno
+ * set on failure
+ */
+struct open_file *fd_cache_open(const char *file_path) {
+  time_t now = current_time();
+  uint32_t hash = hash_path(file_path);
+  int limit = config_get_ctx()->open_file_cache;
+
+  /*
+   * Checking the website directories first means a replaced directory
+   * empties the cache before we look anything up in it.
+   */
+  if (!websites && init_websites() == -1) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  validate_websites(now);
+
+  struct open_file *file = buckets[hash & (FD_CACHE_BUCKETS - 1)];
+  while (file && (file->hash != hash || strcmp(file->path, file_path) != 0)) {
+    file = file->bucket_next;
+  }
+
+  if (file && now - file->validated >= FD_CACHE_REVALIDATE_INTERVAL) {
+    if (is_current(file)) {
+      file->validated = now;
+    } else {
+      cache_remove(file);
+      file = NULL;
+    }
+  }
+
+  if (file) {
+    lru_remove(file);
+    lru_push_front(file);
+    file->refs++;
+    return file;
+  }
+
+  struct stat file_stat;
+  int fd = open_path(file_path, &file_stat);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  file = calloc(1, sizeof(*file));
+  if (!file || !(file->path = strdup(file_path))) {
+    log_event(ERROR, "Failed to allocate memory for open file.");
+    free(file);
+    close(fd);
+    errno = ENOMEM;
+    return NULL;
+  }
+  file->hash = hash;
+  file->fd = fd;
+  file->file_stat = file_stat;
+  file->validated = now;
+  file->refs = 1;
+
+  if (limit > 0) {
+    size_t bucket = hash & (FD_CACHE_BUCKETS - 1);
+    file->bucket_next = buckets[bucket];
+    buckets[bucket] = file;
+    lru_push_front(file);
+    file->cached = true;
+    num_files++;
+
+    while (num_files > limit) {
+      cache_remove(lru_tail);
+    }
+  }
+
+  return file;
+}
+
+/**
+ * fd_cache_release - Drop a reference to an open file
+ * @file: File returned by fd_cache_open(), or NULL
+ */
+void fd_cache_release(struct open_file *file) {
+  if (!file) {
+    return;
+  }
+
+  file->refs--;
+  if (file->refs == 0 && !file->cached) {
+    file_free(file);
+  }
+}
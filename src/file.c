@@ -7,18 +7,16 @@
  * This file provides low-level file operations needed by the web server:
  * - Check if file exists
  * - Extract file extension (for determining MIME type)
- * - Read entire file into memory
+ *
+ * Reading files is left to cache.c, which keeps them in memory between
+ * requests.
  */
 
-#include <errno.h>
 #include <stdbool.h>
-#include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 
 #include "file.h"
-#include "log.h"
 
 /**
  * file_exists - Check if a file exists on the filesystem
@@ -89,131 +87,3 @@ char *get_file_extension(const char *file_path) {
    */
   return file_extension;
 }
-
-/**
- * read_file - Read entire file into memory
- * @file_path: Full path to file to read
- * @file_size: Output parameter - set to number of bytes read
- *
- * Reads the complete contents of a file into a dynamically allocated buffer.
- *
- * Return: Pointer to allocated buffer containing file, or NULL on error
- */
-unsigned char *read_file(const char *file_path, size_t *file_size) {
-  /*
-   * Open file in binary read mode.
-   *
-   * MODE "rb":
-   * - 'r': Read only (we don't need to write)
-   * - 'b': Binary mode (no newline translation)
-   *
-   * WHY BINARY MODE?
-   * Text mode ('r' without 'b') on Windows converts \r\n to \n.
-   * This corrupts binary files (images, videos, PDFs).
-   * Binary mode reads exact bytes from disk.
-   *
-   * HTML/CSS/JS work fine in binary mode too (they're just text).
-   *
-   * RETURN VALUES:
-   * - Success: Valid FILE* pointer
-   * - Failure: NULL (errno set to ENOENT, EACCES, etc.)
-   */
-  FILE *file = fopen(file_path, "rb");
-  if (!file) {
-    fprintf(stderr, "Failed to open file %s:%s\n", file_path, strerror(errno));
-    return NULL;
-  }
-
-  /*
-   * Seek to end of file to determine size.
-   *
-   * WHY SEEK TO END?
-   * To find file size, we need to know how far end is from beginning.
-   * We seek to end, then use ftell() to get that position (= file size).
-   */
-  if (fseek(file, 0, SEEK_END) == -1) {
-    fprintf(stderr, "Failed to set file position indicator: %s\n",
-            strerror(errno));
-    fclose(file);
-    return NULL;
-  }
-
-  /*
-   * Get current file position (= file size in bytes).
-   *
-   * ftell() returns the current position in the file, which is now at
-   * the end because we just sought there.
-   *
-   * We store in 'int' first because ftell() returns long, but we need
-   * to check for -1 error before casting to size_t (which is unsigned).
-   */
-  int size = ftell(file);
-  if (size == -1) {
-    fprintf(stderr, "Failed to get file position indicator: %s\n",
-            strerror(errno));
-    if (fclose(file) == -1) {
-      fprintf(stderr, "Failed to close file %s:%s\n", file_path,
-              strerror(errno));
-      return NULL;
-    }
-  }
-
-  /*
-   * Cast to size_t for memory allocation.
-   *
-   * size_t is the proper type for memory sizes and array indices.
-   * ftell() returns long, so we cast.
-   *
-   * We already know that size != -1, so casting to unsigned is safe here.
-   */
-  *file_size = (size_t)size;
-
-  /*
-   * Seek back to beginning of file.
-   *
-   * rewind() is equivalent to: fseek(file, 0, SEEK_SET)
-   *
-   * WHY REWIND?
-   * We sought to end to get size, but now we need to read from
-   * beginning. rewind() moves position back to start.
-   *
-   * After this, next fread() will read from byte 0.
-   */
-  rewind(file);
-
-  unsigned char *buffer = (unsigned char *)malloc(*file_size);
-  if (!buffer) {
-    fprintf(stderr, "Failed to allocate memory for file buffer: %s\n",
-            strerror(errno));
-
-    if (fclose(file) == -1) {
-      fprintf(stderr, "Failed to close file %s:%s\n", file_path,
-              strerror(errno));
-    }
-    return NULL;
-  }
-
-  const size_t bytes_read = fread(buffer, 1, *file_size, file);
-
-  if (bytes_read != *file_size) {
-    log_event(ERROR, "Error reading file into buffer.");
-    free(buffer);
-
-    if (fclose(file) == -1) {
-      fprintf(stderr, "Failed to close file %s:%s\n", file_path,
-              strerror(errno));
-    }
-
-    return NULL;
-  }
-
-  /*
-   * fclose() flushes any buffers and releases the file descriptor.
-   */
-  if (fclose(file) == -1) {
-    fprintf(stderr, "Failed to close file %s:%s\n", file_path, strerror(errno));
-    return NULL;
-  }
-
-  return buffer;
-}
@@ -0,0 +1,455 @@
+/**
+ * limit.c
+ *
+ * Per-client connection and request rate limits shared between workers.
+ *
+ * OVERVIEW:
+ * A client opening connections by the thousand, or holding hundreds open
+ * and doing nothing with them, can use up a worker's descriptors and memory
+ * and its CPU time for handshakes. So each client address gets a slot in a
+ * table in shared memory, counting its open connections and how fast it's
+ * been making requests. The check happens as soon as a connection has been
+ * accepted, before we spend anything on a handshake, and a client over
+ * either limit just has the connection closed.
+ *
+ * Clients are counted by IPv4 address, or by IPv6 /64 network, since anyone
+ * with one IPv6 address usually has the rest of the /64 to pick from.
+ *
+ * LOCK-FREE UPDATES:
+ * Every worker checks every connection against the table, so instead of a
+ * lock each slot is updated with compare-and-swap:
+ *
+ * - OWNER: The hash of the client's address and its number of open
+ *   connections share one 64-bit word, so a slot changes hands and a
+ *   connection is counted in a single atomic step. A slot is only given to
+ *   another client once its connections are down to 0, which it can't be
+ *   while any of them is still open, so releasing a connection never needs
+ *   to check who owns the slot.
+ *
+ * - RATE: The token bucket is kept as one timestamp, the time at which the
+ *   bucket would be full again (the "generic cell rate algorithm"). Taking a
+ *   token moves it forward by one request's worth of time, and a request is
+ *   allowed as long as that doesn't put it more than a full bucket ahead of
+ *   now.
+ *
+ * SHARDS:
+ * The table is split into shards of LIMIT_SHARD_SLOTS slots, and an address
+ * only ever lives in the shard its hash picks. The hash is keyed with a
+ * secret made at startup, so clients can't choose addresses that crowd into
+ * one shard. A client with no slot free in its shard isn't limited (rather
+ * than being turned away for something other clients did).
+ *
+ * Two workers seeing a new client at the same moment can give it a slot
+ * each, which only means it's limited a little late until one of the slots
+ * empties.
+ *
+ * WORKERS THAT DIE:
+ * A worker that crashes or is killed never gets to release its connections,
+ * so each worker also keeps the number it holds in every slot, in a row of
+ * its own in the same mapping. When the parent reaps a worker it hands that
+ * worker's connections back with limit_reclaim(), before starting its
+ * replacement, so no client is left counted for connections that are gone.
+ * Only the worker writes its row, and the parent only reads it once the
+ * worker is dead, so the row needs no atomics.
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <openssl/rand.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "config.h"
+#include "limit.h"
+#include "log.h"
+
+/*
+ * The owner word is the address hash in the top 48 bits and the number of
+ * open connections in the bottom 16.
+ */
+#define OWNER_COUNT_BITS 16
+#define OWNER_COUNT_MASK ((1ULL << OWNER_COUNT_BITS) - 1)
+
+/**
+ * struct limit_slot - What we know about one client
+ * @owner: Which client the slot is for and its open connections, 0 if the
+ *         slot has never been used
+ * @full_at: When the client's token bucket will be full again, in
+ *           microseconds of the monotonic clock, so earlier than now when
+ *           it's already full
+ */
+struct limit_slot {
+  uint64_t owner;
+  uint64_t full_at;
+};
+
+/*
+ * Slots in the table, and the size of the mapping, which holds the slots
+ * followed by each worker's row of its connections in every slot.
+ */
+#define NUM_SLOTS ((size_t)LIMIT_SHARDS * LIMIT_SHARD_SLOTS)
+#define MAPPING_SIZE(workers)                                                  \
+  (NUM_SLOTS * sizeof(struct limit_slot) +                                     \
+   (size_t)(workers) * NUM_SLOTS * sizeof(uint16_t))
+
+/*
+ * The shared table and every worker's row of holdings, and the key the
+ * address hash is made with. All are set up by the parent and inherited.
+ * held is this worker's own row, NULL in the parent.
+ */
+static struct limit_slot *slots = NULL;
+static uint16_t *holdings = NULL;
+static int num_workers = 0;
+static uint16_t *held = NULL;
+static uint64_t hash_key = 0;
+
+/**
+ * now_us - Read the monotonic clock in microseconds
+ *
+ * Return: Microseconds since an arbitrary point in the past
+ */
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/**
+ * mix - Scramble the bits of a 64-bit value
+ * @x: Value to scramble
+ *
+ * The finalizer of splitmix64, which makes every bit of the result depend on
+ * every bit of x.
+ *
+ * Return: The scrambled value
+ */
+static uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/**
+ * hash_address - Hash the part of an address a client is counted by
+ * @address: Client's address as returned by accept4()
+ * @hash: Output parameter for the hash
+ *
+ * IPv4 clients connecting to an IPv6 socket have IPv4-mapped addresses,
+ * which are counted as the IPv4 address they are.
+ *
+ * Return: true on success, false if the address isn't IPv4 or IPv6
+ */
+static bool hash_address(const struct sockaddr_storage *address,
+                         uint64_t *hash) {
+  uint64_t family;
+  uint64_t bits = 0;
+
+  if (address->ss_family == AF_INET) {
+    const struct sockaddr_in *ipv4 = (const struct sockaddr_in *)address;
+    family = 4;
+    bits = ntohl(ipv4->sin_addr.s_addr);
+  } else if (address->ss_family == AF_INET6) {
+    const struct in6_addr *ipv6 =
+        &((const struct sockaddr_in6 *)address)->sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(ipv6)) {
+      family = 4;
+      for (int i = 12; i < 16; i++) {
+        bits = bits << 8 | ipv6->s6_addr[i];
+      }
+    } else {
+      family = 6;
+      for (int i = 0; i < 8; i++) {
+        bits = bits << 8 | ipv6->s6_addr[i];
+      }
+    }
+  } else {
+    return false;
+  }
+
+  *hash = mix(mix(hash_key ^ family) ^ bits);
+  return true;
+}
+
+/**
+ * find_slot - Find or claim a client's slot in its shard
+ * @shard: First slot of the client's shard
+ * @key: Owner word of the client with no connections
+ * @now: Current time in microseconds
+ *
+ * A slot can be claimed if it's never been used, or its client has no
+ * connections open and a full bucket, so that we'd know nothing about it
+ * that we wouldn't about a new client.
+ *
+ * Return: Index of the slot within the shard, or -1 if there's no room
+ */
+static int find_slot(struct limit_slot *shard, uint64_t key, uint64_t now) {
+  for (int i = 0; i < LIMIT_SHARD_SLOTS; i++) {
+    uint64_t owner = __atomic_load_n(&shard[i].owner, __ATOMIC_ACQUIRE);
+    if ((owner & ~OWNER_COUNT_MASK) == key) {
+      return i;
+    }
+  }
+
+  for (int i = 0; i < LIMIT_SHARD_SLOTS; i++) {
+    uint64_t owner = __atomic_load_n(&shard[i].owner, __ATOMIC_ACQUIRE);
+    bool unused = owner == 0;
+    bool reusable =
+        (owner & OWNER_COUNT_MASK) == 0 &&
+        __atomic_load_n(&shard[i].full_at, __ATOMIC_RELAXED) <= now;
+    if ((unused || reusable) &&
+        __atomic_compare_exchange_n(&shard[i].owner, &owner, key, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * take_token - Take a request from a client's token bucket
+ * @slot: The client's slot
+ * @now: Current time in microseconds
+ *
+ * request_rate tokens are added to the bucket every second, and it holds
+ * request_burst of them.
+ *
+ * Return: true if there was a token, false if the bucket is empty
+ */
+static bool take_token(struct limit_slot *slot, uint64_t now) {
+  struct server_config *config = config_get_ctx();
+  if (config->request_rate == 0) {
+    return true;
+  }
+
+  uint64_t interval = 1000000 / (uint64_t)config->request_rate;
+  uint64_t capacity = interval * (uint64_t)config->request_burst;
+
+  uint64_t full_at = __atomic_load_n(&slot->full_at, __ATOMIC_RELAXED);
+  for (;;) {
+    uint64_t taken = (full_at > now ? full_at : now) + interval;
+    if (taken - now > capacity) {
+      return false;
+    }
+    if (__atomic_compare_exchange_n(&slot->full_at, &full_at, taken, true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      return true;
+    }
+  }
+}
+
+/**
+ * add_connection - Count a connection towards a client's open connections
+ * @slot: The client's slot
+ * @key: Owner word of the client with no connections
+ *
+ * Return: 1 if the connection was counted, 0 if the client is at its limit,
+ * -1 if the slot has been given to another client since we found it
+ */
+static int add_connection(struct limit_slot *slot, uint64_t key) {
+  uint64_t limit = (uint64_t)config_get_ctx()->max_connections_per_ip;
+  if (limit == 0) {
+    limit = LIMIT_MAX_CONNECTIONS;
+  }
+
+  uint64_t owner = __atomic_load_n(&slot->owner, __ATOMIC_ACQUIRE);
+  for (;;) {
+    if ((owner & ~OWNER_COUNT_MASK) != key) {
+      return -1;
+    }
+    if ((owner & OWNER_COUNT_MASK) >= limit) {
+      return 0;
+    }
+    if (__atomic_compare_exchange_n(&slot->owner, &owner, owner + 1, true,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return 1;
+    }
+  }
+}
+
+/**
+ * limit_init - Map the shared table of clients
+ *
+ * The table is mapped whether or not limits are on, so that turning them on
+ * only takes a reload. It costs 256KB, and 32KB a worker for the holdings,
+ * that's never touched while they're off.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int limit_init(void) {
+  if (RAND_bytes((unsigned char *)&hash_key, sizeof(hash_key)) != 1) {
+    log_event(ERROR, "Failed to generate client limit hash key.");
+    return -1;
+  }
+
+  num_workers = config_get_ctx()->workers;
+  slots = mmap(NULL, MAPPING_SIZE(num_workers), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (slots == MAP_FAILED) {
+    char mmap_fail_msg[LOG_MSG_MAX];
+    snprintf(mmap_fail_msg, LOG_MSG_MAX,
+             "Failed to map shared client limits: %s", strerror(errno));
+    log_event(ERROR, mmap_fail_msg);
+    slots = NULL;
+    num_workers = 0;
+    return -1;
+  }
+  holdings = (uint16_t *)(slots + NUM_SLOTS);
+  return 0;
+}
+
+/**
+ * limit_cleanup - Unmap the shared table of clients
+ */
+void limit_cleanup(void) {
+  if (slots) {
+    munmap(slots, MAPPING_SIZE(num_workers));
+  }
+  slots = NULL;
+  holdings = NULL;
+  held = NULL;
+  num_workers = 0;
+}
+
+/**
+ * limit_set_worker - Pick the row this worker keeps its holdings in
+ * @worker: The worker's slot
+ */
+void limit_set_worker(int worker) {
+  if (holdings && worker >= 0 && worker < num_workers) {
+    held = &holdings[(size_t)worker * NUM_SLOTS];
+  }
+}
+
+/**
+ * remove_connections - Take connections off a client's open connections
+ * @slot: The client's slot
+ * @count: Number of connections to take off
+ *
+ * The count is never taken below 0, which could otherwise carry into the
+ * owner's hash.
+ */
+static void remove_connections(size_t slot, uint64_t count) {
+  uint64_t *owner_word = &slots[slot].owner;
+  uint64_t owner = __atomic_load_n(owner_word, __ATOMIC_ACQUIRE);
+  for (;;) {
+    uint64_t open = owner & OWNER_COUNT_MASK;
+    uint64_t removed = open < count ? open : count;
+    if (removed == 0 ||
+        __atomic_compare_exchange_n(owner_word, &owner, owner - removed, true,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return;
+    }
+  }
+}
+
+/**
+ * limit_reclaim - Release every connection a dead worker held
+ * @worker: Slot of the worker that has exited
+ */
+void limit_reclaim(int worker) {
+  if (!holdings || worker < 0 || worker >= num_workers) {
+    return;
+  }
+
+  uint16_t *row = &holdings[(size_t)worker * NUM_SLOTS];
+  for (size_t slot = 0; slot < NUM_SLOTS; slot++) {
+    if (row[slot] > 0) {
+      remove_connections(slot, row[slot]);
+      row[slot] = 0;
+    }
+  }
+}
+
+/**
+ * limit_accept - Check a new connection against its client's limits
+ * @address: Client's address
+ * @slot: Output parameter for the slot to release the connection from
+ *
+ * Return: true if the connection may go ahead, false if it should be closed
+ */
+bool limit_accept(const struct sockaddr_storage *address, int *slot) {
+  *slot = LIMIT_NONE;
+  struct server_config *config = config_get_ctx();
+  if (!slots ||
+      (config->max_connections_per_ip == 0 && config->request_rate == 0)) {
+    return true;
+  }
+
+  uint64_t hash;
+  if (!hash_address(address, &hash)) {
+    return true;
+  }
+
+  /*
+   * The low bit of the key is always set, so that no client's key is the 0
+   * of a slot that's never been used.
+   */
+  uint64_t key = ((hash >> OWNER_COUNT_BITS) | 1) << OWNER_COUNT_BITS;
+  size_t first = (size_t)(hash % LIMIT_SHARDS) * LIMIT_SHARD_SLOTS;
+  uint64_t now = now_us();
+
+  /*
+   * If the slot is given away between finding it and counting the
+   * connection, we look again, which will usually find another.
+   */
+  for (int attempt = 0; attempt < LIMIT_SHARD_SLOTS; attempt++) {
+    int index = find_slot(&slots[first], key, now);
+    if (index == -1) {
+      return true;
+    }
+
+    struct limit_slot *found = &slots[first + (size_t)index];
+    int added = add_connection(found, key);
+    if (added == -1) {
+      continue;
+    }
+    if (added == 0) {
+      return false;
+    }
+    if (held) {
+      held[first + (size_t)index]++;
+    }
+
+    if (!take_token(found, now)) {
+      limit_release((int)(first + (size_t)index));
+      return false;
+    }
+    *slot = (int)(first + (size_t)index);
+    return true;
+  }
+  return true;
+}
+
+/**
+ * limit_request - Take a request under the client's request rate
+ * @slot: Slot the connection's client was given by limit_accept()
+ *
+ * Return: true if the request may be served, false if it's over the rate
+ */
+bool limit_request(int slot) {
+  if (slot == LIMIT_NONE || !slots) {
+    return true;
+  }
+  return take_token(&slots[slot], now_us());
+}
+
+/**
+ * limit_release - Stop counting a connection towards its client's limit
+ * @slot: Slot the connection's client was given by limit_accept()
+ */
+void limit_release(int slot) {
+  if (slot == LIMIT_NONE || !slots) {
+    return;
+  }
+
+  if (held && held[slot] > 0) {
+    held[slot]--;
+  }
+  remove_connections((size_t)slot, 1);
+}
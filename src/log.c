@@ -11,19 +11,69 @@
  *
  * LOG FORMAT:
  * [MM/DD/YYYY HH:MM:SS] LEVEL  Message
+ *
+ * BATCHING:
+ * Writing each line out as it's logged would cost a system call per request,
+ * and opening the log file for every line cost several more. Instead each
+ * process keeps the day's log file open, and once a worker is serving
+ * clients its lines are collected in memory and written out together: when
+ * the buffer fills up, or once the oldest line in it has waited
+ * LOG_FLUSH_INTERVAL seconds. Logging a request then costs a memcpy().
+ *
+ * Every process has its own buffers and writes whole lines with a single
+ * write(), so lines from different workers never end up mixed together.
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <linux/limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "file.h"
 #include "log.h"
+#include "response.h"
+
+/**
+ * struct log_buffer - Log lines waiting to be written
+ * @data: The lines, each ending in a newline
+ * @length: Bytes of data in use
+ * @first_added: When the oldest line was added, by the monotonic clock
+ */
+struct log_buffer {
+  char data[LOG_BUFFER_SIZE];
+  size_t length;
+  time_t first_added;
+};
+
+/*
+ * Everything the logger keeps between calls. Each process has its own copy,
+ * and the buffers are only used by the process that fills them.
+ */
+static struct {
+  bool batching;
+  struct log_buffer console_buffer;
+  struct log_buffer file_buffer;
+
+  /*
+   * Log file for file_day (as YYYYMMDD), or -1 if it isn't open.
+   */
+  int file_fd;
+  int file_day;
+
+  /*
+   * Timestamps for the second timestamp_time, formatted ready to use: ours,
+   * and the one the Combined Log Format uses.
+   */
+  time_t timestamp_time;
+  char timestamp[LOG_TIMESTAMP_MAX];
+  char clf_timestamp[LOG_TIMESTAMP_MAX];
+} log_state = {.file_fd = -1, .timestamp_time = -1};
 
 /**
  * get_log_level_msg - Convert log level enum to string
@@ -71,7 +121,7 @@ static const char *get_log_level_msg(const int log_level) {
 
 /**
  * construct_log_path - Build path to log file directory
- * @path_buffer: Output buffer for path
+ * @path_buffer: Output buffer of PATH_MAX bytes
  *
  * Constructs path to directory where log files are stored:
  * $HOME/.local/state/cyllenian
@@ -81,65 +131,42 @@ static const char *get_log_level_msg(const int log_level) {
  * - Different from ~/.local/share (permanent data)
  * - Different from ~/.cache (disposable data)
  *
- * Return: 0 on success, -1 if $HOME not set or buffer is NULL
+ * Errors go straight to stderr, since reporting them with log_event() would
+ * just bring us back here.
+ *
+ * Return: 0 on success, -1 if $HOME not set
  */
-static int construct_log_path(char **path_buffer) {
+static int construct_log_path(char path_buffer[PATH_MAX]) {
   /*
    * Same as prepend_program_data_path(), we need $HOME to construct
    * user-specific paths.
    */
   const char *home = getenv("HOME");
   if (!home) {
-    log_event(ERROR, "Failed to get value of HOME environment variable.");
-    return -1;
-  }
-
-  /*
-   * Prevent NULL dereference if caller passes bad pointer.
-   */
-  if (!*path_buffer) {
-    log_event(ERROR, "NULL pointer was passed to construct_log_path.");
+    fprintf(stderr, "Failed to get value of HOME environment variable.\n");
     return -1;
   }
 
-  snprintf(*path_buffer, PATH_MAX, "%s/.local/state/cyllenian", home);
+  snprintf(path_buffer, PATH_MAX, "%s/.local/state/cyllenian", home);
 
   return 0;
 }
 
 /**
- * write_to_log_file - Append log message to daily log file
- * @formatted_msg: Complete formatted log message (with timestamp, level)
- * @tm: Time structure (used to determine log filename)
+ * open_log_file - Open the log file for a given day
+ * @tm: Any time on that day
  *
- * Writes log message to appropriate daily log file. Creates directory and
- * file if they don't exist.
+ * Creates the log directory if it doesn't exist. The file is opened with
+ * O_APPEND, which has the kernel move to the end of the file as part of
+ * every write(). That way every worker can have the file open at once
+ * without their lines overwriting each other, as long as each write() holds
+ * whole lines.
  *
- * Return: 0 on success, -1 on error
+ * Return: File descriptor, or -1 on error
  */
-static int write_to_log_file(const char *formatted_msg, struct tm *tm) {
-  char log_filename[NAME_MAX];
-
-  snprintf(log_filename, NAME_MAX, "log_%d%02d%02d.txt", tm->tm_year + 1900,
-           tm->tm_mon + 1, tm->tm_mday);
-
-  char *path_buffer = malloc(PATH_MAX);
-  if (!path_buffer) {
-    fprintf(stderr, "Failed to allocate memory for path_buffer: %s\n",
-            strerror(errno));
-    return -1;
-  }
-
-  if (construct_log_path(&path_buffer) == -1) {
-    free(path_buffer);
-    return -1;
-  }
-
-  char *log_path = malloc(PATH_MAX);
-  if (!log_path) {
-    fprintf(stderr, "Failed to allocate memory for log_path: %s\n",
-            strerror(errno));
-    free(path_buffer);
+static int open_log_file(const struct tm *tm) {
+  char path_buffer[PATH_MAX];
+  if (construct_log_path(path_buffer) == -1) {
     return -1;
   }
 
@@ -148,48 +175,230 @@ static int write_to_log_file(const char *formatted_msg, struct tm *tm) {
      * Create log directory with permissions 0700 (Owner has RWX, other users
      * have no access) as these logs contain sensitive data. mkdir doesn't
      * automatically create parent directories, but we can safely assume that
-     * ~/.local/state/ exists on Linux systems.
+     * ~/.local/state/ exists on Linux systems. Another worker may beat us to
+     * it, which is fine.
      */
-    if (mkdir(path_buffer, 0700) == -1) {
+    if (mkdir(path_buffer, 0700) == -1 && errno != EEXIST) {
       fprintf(stderr, "Failed to make log directory: %s\n", strerror(errno));
-      free(log_path);
-      free(path_buffer);
       return -1;
     }
   }
 
-  snprintf(log_path, PATH_MAX, "%s/%s", path_buffer, log_filename);
+  char log_path[PATH_MAX];
+  if (snprintf(log_path, PATH_MAX, "%s/log_%d%02d%02d.txt", path_buffer,
+               tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday) >= PATH_MAX) {
+    fprintf(stderr, "Log file path is too long.\n");
+    return -1;
+  }
+
+  int fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open file %s: %s\n", log_path, strerror(errno));
+  }
+  return fd;
+}
+
+/**
+ * write_all - Write a whole buffer to a file descriptor
+ * @fd: Where to write
+ * @data: What to write
+ * @length: Length of data
+ *
+ * Only uses async-signal-safe calls, so that the signal handler can flush
+ * the log on the way out.
+ */
+static void write_all(int fd, const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, data, length);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    data += written;
+    length -= (size_t)written;
+  }
+}
+
+/**
+ * flush_buffer - Write out a log buffer and empty it
+ * @buffer: Buffer to flush
+ * @fd: Where its contents go
+ *
+ * The length is reset before writing, so if a signal arrives partway through
+ * and the handler flushes too, each line is written at most twice rather
+ * than the handler going round in circles.
+ */
+static void flush_buffer(struct log_buffer *buffer, int fd) {
+  size_t length = buffer->length;
+  buffer->length = 0;
+  if (length > 0 && fd != -1) {
+    write_all(fd, buffer->data, length);
+  }
+}
+
+/**
+ * buffer_append - Add a line to a log buffer
+ * @buffer: Buffer to add to
+ * @fd: Where the buffer's contents go, in case it has to be flushed first
+ * @line: Complete line including its newline
+ * @length: Length of line
+ *
+ * Copying into the buffer is the only work a log line costs until the buffer
+ * is flushed. The length is only updated once the line is in place, so the
+ * signal handler never sees half a line.
+ */
+static void buffer_append(struct log_buffer *buffer, int fd, const char *line,
+                          size_t length) {
+  if (buffer->length + length > LOG_BUFFER_SIZE) {
+    flush_buffer(buffer, fd);
+  }
+
+  if (buffer->length == 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    buffer->first_added = ts.tv_sec;
+  }
+
+  memcpy(buffer->data + buffer->length, line, length);
+  buffer->length += length;
+}
+
+/**
+ * update_timestamp - Refresh the cached timestamp if the second has changed
+ *
+ * Formatting the time is the costliest part of a log line that isn't going
+ * anywhere yet, and many lines are logged within the same second, so we
+ * only do it once a second. time() is answered without entering the kernel
+ * (through the vDSO) on Linux, so checking costs next to nothing.
+ *
+ * localtime_r() doesn't check the timezone each time like localtime() does,
+ * which is why log_start_batching() does that once with tzset(). This is also
+ * where we notice that the day has changed and start a new log file.
+ *
+ * Return: 0 on success, -1 if the time couldn't be read
+ */
+static int update_timestamp(void) {
+  const time_t t = time(NULL);
+  if (t == (time_t)-1) {
+    fprintf(stderr, "Failed to get time: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (t == log_state.timestamp_time) {
+    return 0;
+  }
+
+  struct tm tm;
+  if (!localtime_r(&t, &tm)) {
+    fprintf(stderr, "Failed to get time: %s\n", strerror(errno));
+    return -1;
+  }
+
+  snprintf(log_state.timestamp, LOG_TIMESTAMP_MAX,
+           "[%d/%02d/%02d %02d:%02d:%02d]", tm.tm_mon + 1, tm.tm_mday,
+           tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+
   /*
-   * Open log file in append mode so that we don't overwrite previous logs if
-   * the file already exists.
+   * The month is spelled out in English whatever the locale, like in
+   * format_http_date(), and the timezone is given as an offset from GMT.
    */
-  FILE *file = fopen(log_path, "a");
-  if (!file) {
-    fprintf(stderr, "Failed to open file %s:%s\n", log_path, strerror(errno));
-    free(path_buffer);
-    return -1;
+  static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  long offset_minutes = tm.tm_gmtoff / 60;
+  char offset_sign = offset_minutes < 0 ? '-' : '+';
+  if (offset_minutes < 0) {
+    offset_minutes = -offset_minutes;
   }
+  snprintf(log_state.clf_timestamp, LOG_TIMESTAMP_MAX,
+           "%02d/%s/%d:%02d:%02d:%02d %c%02ld%02ld", tm.tm_mday,
+           months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min,
+           tm.tm_sec, offset_sign, offset_minutes / 60, offset_minutes % 60);
+  log_state.timestamp_time = t;
 
   /*
-   * Write log message to file.
-   *
-   * fprintf() is like printf() but outputs to file instead of stdout. fprintf()
-   * is buffered, so messages might not actually be written until fclose() is
-   * called.
+   * Midnight (or the first line of a run): finish off yesterday's file with
+   * whatever is buffered for it, then move on to today's. If the file can't
+   * be opened we try again on the next line logged in a later second.
    */
-  fprintf(file, "%s", formatted_msg);
+  int day = (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+  if (config_get_ctx()->log_to_file &&
+      (day != log_state.file_day || log_state.file_fd == -1)) {
+    flush_buffer(&log_state.file_buffer, log_state.file_fd);
+    if (log_state.file_fd != -1) {
+      close(log_state.file_fd);
+    }
+    log_state.file_fd = open_log_file(&tm);
+    log_state.file_day = day;
+  }
 
-  if (fclose(file) == -1) {
-    fprintf(stderr, "Failed to close file %s:%s\n", log_path, strerror(errno));
-    free(path_buffer);
-    free(log_path);
-    return -1;
+  return 0;
+}
+
+/**
+ * log_start_batching - Start collecting log lines to write in batches
+ */
+void log_start_batching(void) {
+  tzset();
+  log_state.batching = true;
+}
+
+/**
+ * log_flush - Write out every buffered log line
+ */
+void log_flush(void) {
+  flush_buffer(&log_state.console_buffer, STDOUT_FILENO);
+  flush_buffer(&log_state.file_buffer, log_state.file_fd);
+}
+
+/**
+ * log_flush_if_due - Write out buffered lines once they've waited long enough
+ */
+void log_flush_if_due(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+  if (log_state.console_buffer.length > 0 &&
+      ts.tv_sec - log_state.console_buffer.first_added >= LOG_FLUSH_INTERVAL) {
+    flush_buffer(&log_state.console_buffer, STDOUT_FILENO);
+  }
+  if (log_state.file_buffer.length > 0 &&
+      ts.tv_sec - log_state.file_buffer.first_added >= LOG_FLUSH_INTERVAL) {
+    flush_buffer(&log_state.file_buffer, log_state.file_fd);
   }
+}
 
-  free(path_buffer);
-  free(log_path);
+/**
+ * log_has_pending - Check whether any log lines are waiting to be written
+ *
+ * Return: true if either buffer holds lines
+ */
+bool log_has_pending(void) {
+  return log_state.console_buffer.length > 0 ||
+         log_state.file_buffer.length > 0;
+}
 
-  return 0;
+/**
+ * emit_line - Send a finished log line wherever it's going
+ * @log_level: Severity level, which decides between stdout and stderr
+ * @line: Complete line including its newline
+ * @length: Length of line
+ */
+static void emit_line(int log_level, const char *line, size_t length) {
+  if (log_level > INFO) {
+    write_all(STDERR_FILENO, line, length);
+  } else {
+    buffer_append(&log_state.console_buffer, STDOUT_FILENO, line, length);
+  }
+
+  if (config_get_ctx()->log_to_file) {
+    buffer_append(&log_state.file_buffer, log_state.file_fd, line, length);
+  }
+
+  if (!log_state.batching || log_level >= ERROR) {
+    log_flush();
+  }
 }
 
 /**
@@ -201,6 +410,11 @@ static int write_to_log_file(const char *formatted_msg, struct tm *tm) {
  * outputs to console and optionally to file. INFO and DEBUG are printed to
  * stdout, all other log levels print to stderr.
  *
+ * Once batching has started, stdout and file output are buffered and written
+ * in batches by log_flush_if_due(). Warnings and errors still go to stderr
+ * straight away, and an ERROR or FATAL flushes the file too, since those may
+ * be the last thing we log before something goes badly wrong.
+ *
  * TIMESTAMP FORMAT:
  * [MM/DD/YYYY HH:MM:SS] LEVEL  Message
  */
@@ -220,161 +434,183 @@ void log_event(int log_level, const char *msg) {
     return;
   }
 
-  /*
-   * time() gives us the number of seconds since Unix epoch (Jan 1, 1970
-   * 00:00:00 UTC).
-   */
-  const time_t t = time(NULL);
-  if (t == (time_t)-1) {
-    fprintf(stderr, "Failed to get time: %s", strerror(errno));
+  if (update_timestamp() == -1) {
     return;
   }
 
-  /*
-   * localtime() converts time_t (seconds since epoch) to broken-down time
-   * in local timezone.
-   */
-  struct tm *tm = localtime(&t);
-  if (tm == NULL) {
-    fprintf(stderr, "Failed to get time: %s", strerror(errno));
+  char formatted_msg[LOG_MSG_MAX];
+  int length = snprintf(formatted_msg, LOG_MSG_MAX, "%s %s  %s\n",
+                        log_state.timestamp, log_level_msg, msg);
+  if (length < 0) {
     return;
   }
 
-  char formatted_msg[LOG_MSG_MAX];
-  snprintf(formatted_msg, LOG_MSG_MAX, "[%d/%02d/%02d %02d:%02d:%02d] %s  %s\n",
-           tm->tm_mon + 1, tm->tm_mday, tm->tm_year + 1900, tm->tm_hour,
-           tm->tm_min, tm->tm_sec, log_level_msg, msg);
-
-  if (log_level > INFO) {
-    fprintf(stderr, "%s", formatted_msg);
-  } else {
-    printf("%s", formatted_msg);
+  /*
+   * Truncated messages still need to end with a newline.
+   */
+  if (length >= LOG_MSG_MAX) {
+    length = LOG_MSG_MAX - 1;
+    formatted_msg[length - 1] = '\n';
   }
 
-  if (config_get_ctx()->log_to_file) {
-    if (write_to_log_file(formatted_msg, tm) == -1) {
-      fprintf(stderr, "Failed to write to log file.\n");
-      return;
-    }
-  }
+  emit_line(log_level, formatted_msg, (size_t)length);
 }
 
 /**
- * get_host - Extract hostname from HTTP request
- * @host_buffer: Copy of request buffer to parse
+ * append_text - Add text to a log line being built
+ * @line: Line of LOG_MSG_MAX bytes
+ * @used: Bytes of line in use
+ * @text: Text to add
+ * @length: Length of text
  *
- * Extracts the Host header value from HTTP request for logging. This header is
- * mandatory in the HTTP/1.1 specification and logging it helps us in tracking
- * connections.
+ * Anything that doesn't fit is dropped, leaving room for the newline.
  *
- * Return: Pointer to hostname, or NULL if not found
+ * Return: Bytes of line in use afterwards
  */
-static char *get_host(char *host_buffer) {
-  char *substring = NULL;
-
-  /*
-   * Find first newline to skip to headers section.
-   */
-  char *first_line_end = strchr(host_buffer, '\n');
-  if (!first_line_end) {
-    log_event(ERROR, "Malformed request.");
-    return NULL;
+static size_t append_text(char *line, size_t used, const char *text,
+                          size_t length) {
+  size_t space = LOG_MSG_MAX - 1 - used;
+  if (length > space) {
+    length = space;
   }
+  memcpy(line + used, text, length);
+  return used + length;
+}
 
-  substring = first_line_end + 1; // Start of headers
+/**
+ * append_escaped - Add text from the request to a log line being built
+ * @line: Line of LOG_MSG_MAX bytes
+ * @used: Bytes of line in use
+ * @text: Text to add, or NULL for "-"
+ * @length: Length of text
+ *
+ * Request fields are whatever the client chose to send, so quotes,
+ * backslashes, and control characters are escaped the way other servers
+ * escape them (\" and \xHH). Otherwise a client could end a quoted field
+ * early or add lines of its own to the log.
+ *
+ * Return: Bytes of line in use afterwards
+ */
+static size_t append_escaped(char *line, size_t used, const char *text,
+                             size_t length) {
+  static const char hex_digits[] = "0123456789ABCDEF";
 
-  /*
-   * strstr() returns pointer to 'H' in "Host:".
-   */
-  char *host_position = strstr(substring, "Host:");
-  if (!host_position) {
-    log_event(ERROR, "No host found in request.");
-    return NULL;
+  if (!text || length == 0) {
+    return append_text(line, used, "-", 1);
   }
 
-  /*
-   * Skip past "Host: " to get hostname.
-   */
-  host_position += 6;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)text[i];
+    char escaped[4];
+    size_t escaped_length = 0;
+
+    if (c == '"' || c == '\\') {
+      escaped[escaped_length++] = '\\';
+      escaped[escaped_length++] = (char)c;
+    } else if (c < 0x20 || c >= 0x7f) {
+      escaped[escaped_length++] = '\\';
+      escaped[escaped_length++] = 'x';
+      escaped[escaped_length++] = hex_digits[c >> 4];
+      escaped[escaped_length++] = hex_digits[c & 0xf];
+    } else {
+      escaped[escaped_length++] = (char)c;
+    }
 
-  /*
-   * Sometimes the host is shown with a port appended, but we opt to ignore it
-   * since we already know it.
-   */
-  char *host_end = strchr(host_position, ':');
-  if (host_end) {
-    *host_end = '\0';
+    if (used + escaped_length > LOG_MSG_MAX - 1) {
+      break;
+    }
+    used = append_text(line, used, escaped, escaped_length);
   }
-
-  return host_position;
+  return used;
 }
 
 /**
- * get_header - Extract request line from HTTP request
- * @header_buffer: Copy of request buffer to parse
+ * append_number - Add a number to a log line being built
+ * @line: Line of LOG_MSG_MAX bytes
+ * @used: Bytes of line in use
+ * @number: Number to add
  *
- * Extracts the first line of HTTP request for logging.
- *
- * Return: Pointer to request line, or original buffer if \r not found
+ * Return: Bytes of line in use afterwards
  */
-static char *get_header(char *header_buffer) {
-  char *carriage_position = strchr(header_buffer, '\r');
-  if (carriage_position) {
-    *carriage_position = '\0';
-  }
-  return header_buffer;
+static size_t append_number(char *line, size_t used, size_t number) {
+  char digits[24];
+  size_t length = 0;
+  do {
+    digits[sizeof(digits) - 1 - length++] = (char)('0' + number % 10);
+    number /= 10;
+  } while (number > 0);
+  return append_text(line, used, digits + sizeof(digits) - length, length);
 }
 
 /**
- * log_request - Log HTTP request in standard format
- * @request_buffer: Complete HTTP request from client
+ * log_request - Log HTTP request in the configured format
+ * @request: Parsed request from client
+ * @client_address: Client's IP address
  * @response_code: HTTP status code we returned (200, 404, etc.)
  * @response_size: Total bytes sent (headers + body)
  *
- * Logs HTTP request in format similar to Common Log Format, which many web
- * servers use.
+ * Every field comes from the parsed request and is copied straight into the
+ * line, so logging a request doesn't allocate or search the request at all.
  *
- * [timestamp] INFO hostname "method path" status_code bytes_sent
+ * The default format is:
+ *
+ * [timestamp] INFO  hostname "method path version" status_code bytes_sent
+ *
+ * With log_format set to combined, lines are in the Combined Log Format that
+ * Apache and nginx use and most log analysers read:
+ *
+ * address - - [10/Oct/2000:13:55:36 -0700] "request line" status bytes
+ * "referer" "user agent"
  */
-void log_request(const char *request_buffer, int response_code,
-                 int response_size) {
-  /*
-   * Duplicate request buffer for parsing hostname, since we'll need the
-   * original for get_header.
-   */
-  char *host_buffer = strdup(request_buffer);
-  if (!host_buffer) {
-    log_event(ERROR, "Failed to duplicate request_buffer.");
-    return;
-  }
+void log_request(const struct http_request *request,
+                 const char *client_address, int response_code,
+                 size_t response_size) {
+  const char *request_line = request->request_line.data;
+  size_t request_line_length = request->request_line.length;
 
-  char *host = get_host(host_buffer);
-  if (!host) {
-    log_event(ERROR, "Failed to extract host from request.");
-    free(host_buffer);
-    return;
-  }
+  char line[LOG_MSG_MAX];
+  size_t used = 0;
 
-  char *header_buffer = strdup(request_buffer);
-  if (!header_buffer) {
-    log_event(ERROR, "Failed to duplicate request_buffer.");
-    free(host_buffer);
-    return;
-  }
+  if (config_get_ctx()->log_format == LOG_FORMAT_COMBINED) {
+    if (update_timestamp() == -1) {
+      return;
+    }
 
-  char *header = get_header(header_buffer);
-  if (!header) {
-    log_event(ERROR, "Failed to extract header from request.");
-    free(header);
-    free(host_buffer);
+    struct string_view referer = request->referer;
+    struct string_view user_agent = request->user_agent;
+
+    used = append_text(line, used, client_address, strlen(client_address));
+    used = append_text(line, used, " - - [", 6);
+    used = append_text(line, used, log_state.clf_timestamp,
+                       strlen(log_state.clf_timestamp));
+    used = append_text(line, used, "] \"", 3);
+    used = append_escaped(line, used, request_line, request_line_length);
+    used = append_text(line, used, "\" ", 2);
+    used = append_number(line, used, (size_t)response_code);
+    used = append_text(line, used, " ", 1);
+    used = append_number(line, used, response_size);
+    used = append_text(line, used, " \"", 2);
+    used = append_escaped(line, used, referer.data, referer.length);
+    used = append_text(line, used, "\" \"", 3);
+    used = append_escaped(line, used, user_agent.data, user_agent.length);
+    used = append_text(line, used, "\"", 1);
+
+    line[used++] = '\n';
+    emit_line(INFO, line, used);
     return;
   }
 
-  char msg[LOG_MSG_MAX];
-  snprintf(msg, LOG_MSG_MAX, "%s \"%s\" %d %d", host, header, response_code,
-           response_size);
-  log_event(INFO, msg);
+  size_t host_length = 0;
+  const char *host = request_get_host(request, &host_length);
+
+  used = append_escaped(line, used, host, host_length);
+  used = append_text(line, used, " \"", 2);
+  used = append_escaped(line, used, request_line, request_line_length);
+  used = append_text(line, used, "\" ", 2);
+  used = append_number(line, used, (size_t)response_code);
+  used = append_text(line, used, " ", 1);
+  used = append_number(line, used, response_size);
 
-  free(header);
-  free(host_buffer);
+  line[used] = '\0';
+  log_event(INFO, line);
 }
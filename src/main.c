@@ -8,6 +8,8 @@
  * all necessary components before entering the main server loop.
  */
 
+#include <stdio.h>
+
 #include "args.h"
 #include "config.h"
 #include "paths.h"
@@ -23,11 +25,21 @@
  *
  * The server runs indefinitely until SIGINT (Ctrl+C) is received or an error
  * occurs. The signal handler ensures graceful shutdown by closing sockets and
- * freeing SSL resources.
+ * freeing SSL resources. SIGQUIT shuts down more gently still, once every
+ * open request has been answered.
  *
  * Return: EXIT_SUCCESS on success, EXIT_FAILURE on failure
  */
 int main(int argc, char *argv[]) {
+  /*
+   * stdout is fully buffered when it isn't a terminal (e.g., when redirected
+   * to a file by a service manager). Workers never exit between requests to
+   * flush it, and anything still buffered when we fork would be copied into
+   * every worker and printed once per process. Line buffering writes each log
+   * line out as soon as it's complete, which avoids both problems.
+   */
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
   /*
    * Initialize signal handler for graceful shutdown.
    *
@@ -61,17 +73,29 @@ int main(int argc, char *argv[]) {
    *
    * Sets up default values:
    * - Port: 8080
+   * - Workers: one per online CPU
    * - Certificate path: ~/.local/share/cyllenian/cert
    * - Private key path: ~/.local/share/cyllenian/key
    * - Log to file: false
    *
-   * These defaults can be overridden by command-line arguments.
+   * These defaults can be overridden by the configuration file and
+   * command-line arguments.
    */
   if (config_init() == -1) {
     config_cleanup();
     exit(EXIT_FAILURE);
   }
 
+  /*
+   * Apply settings from ~/.config/cyllenian/cyllenian.conf (or the system-wide
+   * one in /etc/cyllenian). This comes before argument parsing so that options
+   * given on the command line win.
+   */
+  if (config_load_file() == -1) {
+    config_cleanup();
+    exit(EXIT_FAILURE);
+  }
+
   // Parse CLI arguments and modify the runtime configuration accordingly
   int arg_processing_result = process_args(argc, argv);
   if (arg_processing_result == -1) {
@@ -87,10 +111,11 @@ int main(int argc, char *argv[]) {
    * This is a blocking call that sets up OpenSSL, opens a socket, and listens
    * for connections until SIGINT or fatal error
    *
-   * We fork a new process for each client connection for the sake of
-   * simplicity, though production servers generally use multithreading.
+   * A fixed pool of worker processes is forked up front, and each worker
+   * runs an event loop that serves many client connections at once for as
+   * long as the server runs.
    */
-  int server_exit_status = server_init();
+  int server_exit_status = server_init(argv);
 
   /*
    * Frees allocated memory for configuration paths, frees resources allocated
@@ -0,0 +1,384 @@
+/**
+ * metrics.c
+ *
+ * Counters and latency histograms shared between worker processes.
+ *
+ * OVERVIEW:
+ * Every worker has a slot of its own in a shared memory mapping, which only
+ * it writes to. So recording is a plain load, add and store with no lock and
+ * no atomic read-modify-write, and workers never contend for a cache line.
+ * Whoever serves the metrics endpoint reads every slot and adds them up.
+ *
+ * CONSISTENCY:
+ * Each counter is written with a single aligned 64-bit store, so a reader
+ * never sees half of one. A reader can see one counter updated and another
+ * not yet (e.g., a histogram's count before its sum), which is fine for
+ * metrics scraped every few seconds.
+ *
+ * HISTOGRAMS:
+ * Latencies are counted in buckets that double in size, like an HDR
+ * histogram with no sub-buckets. Which bucket a duration belongs in is its
+ * highest set bit, so recording costs a couple of instructions whatever the
+ * duration, and the buckets cover a quarter of a microsecond to half a
+ * minute with the same relative precision throughout.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "config.h"
+#include "log.h"
+#include "metrics.h"
+
+/**
+ * struct histogram - Distribution of one kind of latency
+ * @buckets: Number of durations in each bucket, not cumulative
+ * @count: Number of durations recorded
+ * @sum: Total of the durations in nanoseconds
+ */
+struct histogram {
+  uint64_t buckets[METRICS_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+};
+
+/**
+ * struct worker_metrics - Everything one worker records
+ * @connections: Connections accepted
+ * @rejections: Connections closed straight away for the client's limits
+ * @responses: Responses sent, indexed by status code minus 100
+ * @bytes_sent: Bytes of responses sent, headers included
+ * @histograms: Latencies, indexed by enum metrics_histogram
+ *
+ * Aligned to a cache line so that neighbouring workers' slots don't share
+ * one.
+ */
+struct worker_metrics {
+  _Alignas(64) uint64_t connections;
+  uint64_t rejections;
+  uint64_t responses[METRICS_STATUS_CODES];
+  uint64_t bytes_sent;
+  struct histogram histograms[METRICS_NUM_HISTOGRAMS];
+};
+
+/**
+ * Names and help text of the histograms, in enum metrics_histogram order.
+ */
+static const struct {
+  const char *name;
+  const char *help;
+} histogram_info[METRICS_NUM_HISTOGRAMS] = {
+    {"cyllenian_tls_handshake_seconds",
+     "Time from accepting a connection to finishing its TLS handshake."},
+    {"cyllenian_request_parse_seconds", "Time spent parsing request heads."},
+    {"cyllenian_file_resolve_seconds",
+     "Time spent finding the file a request is for."},
+    {"cyllenian_response_send_seconds",
+     "Time from starting to send a response to finishing."}};
+
+/*
+ * The shared slots, one per worker, and the one this process writes to.
+ * metrics is NULL when metrics are disabled.
+ */
+static struct worker_metrics *metrics = NULL;
+static size_t num_slots = 0;
+static struct worker_metrics *own = NULL;
+
+/**
+ * metrics_init - Map the shared metrics
+ *
+ * Like the session cache, this is an anonymous MAP_SHARED mapping, which
+ * forked workers share with the parent.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int metrics_init(void) {
+  struct server_config *config = config_get_ctx();
+  if (!config->metrics_path) {
+    return 0;
+  }
+
+  num_slots = (size_t)config->workers;
+  metrics = mmap(NULL, num_slots * sizeof(*metrics), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (metrics == MAP_FAILED) {
+    char mmap_fail_msg[LOG_MSG_MAX];
+    snprintf(mmap_fail_msg, LOG_MSG_MAX, "Failed to map shared metrics: %s",
+             strerror(errno));
+    log_event(ERROR, mmap_fail_msg);
+    metrics = NULL;
+    num_slots = 0;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * metrics_cleanup - Unmap the shared metrics
+ */
+void metrics_cleanup(void) {
+  if (metrics) {
+    munmap(metrics, num_slots * sizeof(*metrics));
+  }
+  metrics = NULL;
+  num_slots = 0;
+  own = NULL;
+}
+
+/**
+ * metrics_set_slot - Pick the slot this worker records into
+ * @slot: The worker's slot
+ */
+void metrics_set_slot(int slot) {
+  if (metrics && (size_t)slot < num_slots) {
+    own = &metrics[slot];
+  }
+}
+
+/**
+ * metrics_clock - Read the clock for timing
+ *
+ * CLOCK_MONOTONIC is read from memory the kernel shares with every process
+ * (the vDSO), so this doesn't make a system call. The coarse clock the rest
+ * of the server uses only ticks every few milliseconds, which is longer than
+ * most of what we time takes.
+ *
+ * Return: Nanoseconds, or 0 if metrics are disabled
+ */
+uint64_t metrics_clock(void) {
+  if (!own) {
+    return 0;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * add - Add to a counter only this process writes
+ * @counter: Counter in our slot
+ * @amount: Amount to add
+ *
+ * The relaxed store keeps the compiler from tearing the write or keeping the
+ * counter in a register, without the cost of a locked instruction.
+ */
+static void add(uint64_t *counter, uint64_t amount) {
+  __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+/**
+ * load - Read a counter another process may be writing
+ * @counter: Counter in any slot
+ *
+ * Return: The counter's value
+ */
+static uint64_t load(const uint64_t *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * metrics_record - Record a duration in a histogram
+ * @histogram: Which latency it is
+ * @nanoseconds: How long it took
+ */
+void metrics_record(enum metrics_histogram histogram, uint64_t nanoseconds) {
+  if (!own) {
+    return;
+  }
+
+  uint64_t scaled = nanoseconds >> 8;
+  int bucket = scaled ? 64 - __builtin_clzll(scaled) : 0;
+  if (bucket >= METRICS_BUCKETS) {
+    bucket = METRICS_BUCKETS - 1;
+  }
+
+  struct histogram *h = &own->histograms[histogram];
+  add(&h->buckets[bucket], 1);
+  add(&h->count, 1);
+  add(&h->sum, nanoseconds);
+}
+
+/**
+ * metrics_count_connection - Count an accepted connection
+ */
+void metrics_count_connection(void) {
+  if (own) {
+    add(&own->connections, 1);
+  }
+}
+
+/**
+ * metrics_count_rejection - Count a connection rejected for client limits
+ */
+void metrics_count_rejection(void) {
+  if (own) {
+    add(&own->rejections, 1);
+  }
+}
+
+/**
+ * metrics_count_response - Count a sent response
+ * @response_code: Status code it was sent with
+ * @bytes: Size of the response
+ */
+void metrics_count_response(int response_code, size_t bytes) {
+  if (!own) {
+    return;
+  }
+  if (response_code >= 100 && response_code < 100 + METRICS_STATUS_CODES) {
+    add(&own->responses[response_code - 100], 1);
+  }
+  add(&own->bytes_sent, bytes);
+}
+
+/**
+ * struct output - Text being built by metrics_render()
+ * @text: Buffer of METRICS_BODY_MAX bytes
+ * @length: Length of the text so far
+ * @overflowed: Whether something didn't fit
+ */
+struct output {
+  char *text;
+  size_t length;
+  bool overflowed;
+};
+
+/**
+ * append - Add formatted text to the output
+ * @out: Output to add to
+ * @format: printf() format
+ */
+__attribute__((format(printf, 2, 3))) static void
+append(struct output *out, const char *format, ...) {
+  if (out->overflowed) {
+    return;
+  }
+
+  va_list args;
+  va_start(args, format);
+  size_t room = METRICS_BODY_MAX - out->length;
+  int written = vsnprintf(out->text + out->length, room, format, args);
+  va_end(args);
+
+  if (written < 0 || (size_t)written >= room) {
+    out->overflowed = true;
+    return;
+  }
+  out->length += (size_t)written;
+}
+
+/**
+ * append_histogram - Add one histogram, summed over every worker
+ * @out: Output to add to
+ * @histogram: Which histogram
+ *
+ * Prometheus buckets are cumulative, each counting everything up to its
+ * bound, so we keep a running total as we go.
+ */
+static void append_histogram(struct output *out,
+                             enum metrics_histogram histogram) {
+  const char *name = histogram_info[histogram].name;
+  append(out, "# HELP %s %s\n# TYPE %s histogram\n", name,
+         histogram_info[histogram].help, name);
+
+  uint64_t cumulative = 0;
+  for (int bucket = 0; bucket < METRICS_BUCKETS; bucket++) {
+    for (size_t slot = 0; slot < num_slots; slot++) {
+      cumulative += load(&metrics[slot].histograms[histogram].buckets[bucket]);
+    }
+    if (bucket == METRICS_BUCKETS - 1) {
+      append(out, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+             (unsigned long long)cumulative);
+    } else {
+      double bound = (double)(1ULL << (bucket + 8)) / 1e9;
+      append(out, "%s_bucket{le=\"%.9g\"} %llu\n", name, bound,
+             (unsigned long long)cumulative);
+    }
+  }
+
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  for (size_t slot = 0; slot < num_slots; slot++) {
+    count += load(&metrics[slot].histograms[histogram].count);
+    sum += load(&metrics[slot].histograms[histogram].sum);
+  }
+  append(out, "%s_sum %.9f\n%s_count %llu\n", name, (double)sum / 1e9, name,
+         (unsigned long long)count);
+}
+
+/**
+ * metrics_render - Format every worker's metrics for Prometheus
+ * @length: Output parameter for the length of the text
+ *
+ * Return: Allocated text, or NULL on error
+ */
+char *metrics_render(size_t *length) {
+  if (!metrics) {
+    return NULL;
+  }
+
+  struct output out = {malloc(METRICS_BODY_MAX), 0, false};
+  if (!out.text) {
+    log_event(ERROR, "Failed to allocate memory for metrics.");
+    return NULL;
+  }
+
+  uint64_t connections = 0;
+  uint64_t rejections = 0;
+  uint64_t bytes_sent = 0;
+  for (size_t slot = 0; slot < num_slots; slot++) {
+    connections += load(&metrics[slot].connections);
+    rejections += load(&metrics[slot].rejections);
+    bytes_sent += load(&metrics[slot].bytes_sent);
+  }
+
+  append(&out, "# HELP cyllenian_connections_total Connections accepted.\n"
+               "# TYPE cyllenian_connections_total counter\n"
+               "cyllenian_connections_total %llu\n",
+         (unsigned long long)connections);
+
+  append(&out,
+         "# HELP cyllenian_rejected_connections_total Connections closed for "
+         "the client's limits.\n"
+         "# TYPE cyllenian_rejected_connections_total counter\n"
+         "cyllenian_rejected_connections_total %llu\n",
+         (unsigned long long)rejections);
+
+  append(&out, "# HELP cyllenian_responses_total Responses sent.\n"
+               "# TYPE cyllenian_responses_total counter\n");
+  for (int code = 0; code < METRICS_STATUS_CODES; code++) {
+    uint64_t responses = 0;
+    for (size_t slot = 0; slot < num_slots; slot++) {
+      responses += load(&metrics[slot].responses[code]);
+    }
+    if (responses > 0) {
+      append(&out, "cyllenian_responses_total{code=\"%d\"} %llu\n",
+             code + 100, (unsigned long long)responses);
+    }
+  }
+
+  append(&out,
+         "# HELP cyllenian_response_bytes_total Bytes of responses sent.\n"
+         "# TYPE cyllenian_response_bytes_total counter\n"
+         "cyllenian_response_bytes_total %llu\n",
+         (unsigned long long)bytes_sent);
+
+  for (int histogram = 0; histogram < METRICS_NUM_HISTOGRAMS; histogram++) {
+    append_histogram(&out, (enum metrics_histogram)histogram);
+  }
+
+  if (out.overflowed) {
+    log_event(ERROR, "Metrics don't fit in METRICS_BODY_MAX.");
+    free(out.text);
+    return NULL;
+  }
+
+  *length = out.length;
+  return out.text;
+}
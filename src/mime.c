@@ -8,76 +8,632 @@
  * interpret response data. We could inspect the file's contents to determine
  * it's type, but we keep things simple by just using the file extension and
  * default to text/plain.
+ *
+ * The built-in table covers the formats websites commonly serve. Anything
+ * else can be added with a mime.types file, the format most Unix systems
+ * keep in /etc/mime.types: one type per line followed by its extensions.
+ *
+ * PERFECT HASHING:
+ * The set of extensions never changes once it's loaded, so we build a
+ * perfect hash table for it, one where every extension has a slot of its own
+ * and a lookup is always one probe however many types there are. We use the
+ * "hash, displace" scheme: extensions are first hashed into buckets, and for
+ * each bucket we search for a seed (the displacement) that hashes all of its
+ * extensions into slots nobody has taken yet. Looking an extension up then
+ * means hashing it once to find its bucket, and once more with that bucket's
+ * seed to find its slot. Buckets holding a single extension just store its
+ * slot directly.
+ *
+ * The extension in the slot is compared with the one we're looking up, since
+ * extensions that aren't in the table hash to some slot too.
+ *
+ * Each type has its "Content-Type" header line built once, when the table is
+ * built, so looking up a file's type hands back the finished line.
  */
+
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "config.h"
 #include "file.h"
-#include "response.h"
-
-/**
- * get_content_type - Determine Content-Type header for file
- * @content_type: Output buffer for Content-Type header
- * @file_request: Path to file (used to extract extension)
- *
- * Maps file extension to MIME type and constructs complete Content-Type
- * header. Uses binary search for efficiency, so the mime_type_associations
- * array MUST remain in alphabetical order if additional entries are added.
- * We end this line with a DOUBLE CRLF (\r\n\r\n) to indicate that the header
- * ends here.
- */
-void get_content_type(char content_type[MAX_CONTENT_TYPE],
-                      const char *file_request) {
-  static const struct mime_type mime_type_associations[NUM_OF_MIME_TYPES] = {
-      {"css", "text/css"},       {"gif", "image/gif"},
-      {"htm", "text/html"},      {"html", "text/html"},
-      {"jpeg", "image/jpeg"},    {"jpg", "image/jpeg"},
-      {"js", "text/javascript"}, {"json", "application/json"},
-      {"mp3", "audio/mpeg"},     {"mp4", "video/mp4"},
-      {"png", "image/png"},      {"svg", "image/svg+xml"},
-      {"ttf", "font/ttf"},       {"xml", "application/xml"}};
-
-  char *file_extension = get_file_extension(file_request);
-  if (!file_extension) {
-    snprintf(content_type, MAX_CONTENT_TYPE,
-             "Content-Type: text/plain\r\n\r\n");
-    return;
-  }
-
-  unsigned int lower_bound = 0;
-  unsigned int upper_bound = NUM_OF_MIME_TYPES - 1;
-  bool match_found = false;
-  int middle_value;
-
-  while (!match_found) {
-    if (lower_bound > upper_bound) {
-      middle_value = -1; // Sentinel for "not found"
-      break;
+#include "log.h"
+#include "mime.h"
+
+/**
+ * Most seeds we try for one bucket before starting again with a larger
+ * table. A seed that works is almost always found within a few dozen tries.
+ */
+#define MIME_MAX_DISPLACEMENT 65536
+
+/**
+ * The types we know without a mime.types file, in mime.types format.
+ */
+static const char *const builtin_types[] = {
+    "text/html html htm",
+    "text/css css",
+    "text/javascript js mjs",
+    "text/plain txt",
+    "text/csv csv",
+    "text/markdown md",
+    "text/calendar ics",
+    "text/vtt vtt",
+    "application/json json map",
+    "application/ld+json jsonld",
+    "application/manifest+json webmanifest",
+    "application/xml xml",
+    "application/xhtml+xml xhtml",
+    "application/atom+xml atom",
+    "application/rss+xml rss",
+    "application/wasm wasm",
+    "application/pdf pdf",
+    "application/rtf rtf",
+    "application/epub+zip epub",
+    "application/zip zip",
+    "application/gzip gz",
+    "application/x-tar tar",
+    "application/x-7z-compressed 7z",
+    "application/octet-stream bin exe dll iso img dmg",
+    "application/vnd.apple.mpegurl m3u8",
+    "application/dash+xml mpd",
+    "image/png png",
+    "image/apng apng",
+    "image/jpeg jpg jpeg",
+    "image/gif gif",
+    "image/webp webp",
+    "image/avif avif",
+    "image/jxl jxl",
+    "image/svg+xml svg",
+    "image/x-icon ico",
+    "image/bmp bmp",
+    "image/tiff tif tiff",
+    "font/woff woff",
+    "font/woff2 woff2",
+    "font/ttf ttf",
+    "font/otf otf",
+    "audio/mpeg mp3",
+    "audio/ogg ogg oga opus",
+    "audio/wav wav",
+    "audio/flac flac",
+    "audio/aac aac",
+    "audio/mp4 m4a",
+    "audio/webm weba",
+    "video/mp4 mp4 m4v",
+    "video/webm webm",
+    "video/ogg ogv",
+    "video/quicktime mov",
+};
+
+/**
+ * Type of files without an extension or with one we don't know.
+ */
+static const struct mime_type default_type = {
+    "Content-Type: text/plain\r\n", sizeof("Content-Type: text/plain\r\n") - 1,
+    true};
+
+/**
+ * struct mime_entry - An extension and the type it maps to
+ * @extension: Lower case extension without the dot
+ * @type: Its type, or NULL for an empty slot
+ * @order: When the mapping was added, later ones replacing earlier ones for
+ *         the same extension (only used while building the table)
+ */
+struct mime_entry {
+  char extension[MIME_EXTENSION_MAX];
+  const struct mime_type *type;
+  size_t order;
+};
+
+/**
+ * struct mime_builder - Mappings collected before the table is built
+ * @entries: Every mapping, in the order they were added
+ * @count: Number of entries
+ * @capacity: Number of entries there is room for
+ */
+struct mime_builder {
+  struct mime_entry *entries;
+  size_t count;
+  size_t capacity;
+};
+
+/*
+ * The perfect hash table. A bucket's displacement is 0 if it's empty, the
+ * seed to hash its extensions with if it's positive, or minus one less than
+ * the slot of its only extension if it's negative.
+ */
+static struct mime_entry *slots = NULL;
+static int32_t *displacements = NULL;
+static uint32_t table_mask = 0;
+
+/**
+ * hash_extension - Hash an extension with a seed
+ * @seed: Seed, so that each bucket can have its own hash function
+ * @extension: Lower case extension
+ * @length: Length of extension
+ *
+ * FNV-1a, with the seed mixed into its starting value, followed by the
+ * finalizer from MurmurHash3. Extensions are mostly three or four letters,
+ * and without the finalizer the low bits we take the slot from would only
+ * depend on a few of them.
+ *
+ * Return: 32-bit hash
+ */
+static uint32_t hash_extension(uint32_t seed, const char *extension,
+                               size_t length) {
+  uint32_t hash = 2166136261u ^ (seed * 0x9e3779b9u);
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)extension[i];
+    hash *= 16777619u;
+  }
+
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+/**
+ * lower_extension - Copy an extension in lower case
+ * @dst: Buffer of MIME_EXTENSION_MAX bytes
+ * @src: Extension to copy
+ * @length: Length of src
+ *
+ * Return: true on success, false if the extension is too long to be in the
+ * table
+ */
+static bool lower_extension(char dst[MIME_EXTENSION_MAX], const char *src,
+                            size_t length) {
+  if (length >= MIME_EXTENSION_MAX) {
+    return false;
+  }
+  for (size_t i = 0; i < length; i++) {
+    char c = src[i];
+    dst[i] = c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+  }
+  dst[length] = '\0';
+  return true;
+}
+
+/**
+ * new_type - Create a type and its header line
+ * @type: MIME type, e.g. "text/html"
+ *
+ * Return: New type, or NULL on failure
+ */
+static struct mime_type *new_type(const char *type) {
+  struct mime_type *mime_type = malloc(sizeof(*mime_type));
+  char *header = malloc(strlen("Content-Type: \r\n") + strlen(type) + 1);
+  if (!mime_type || !header) {
+    log_event(ERROR, "Failed to allocate memory for MIME type.");
+    free(mime_type);
+    free(header);
+    return NULL;
+  }
+
+  mime_type->header_length =
+      (size_t)sprintf(header, "Content-Type: %s\r\n", type);
+  mime_type->header = header;
+  mime_type->compressible = strncmp(type, "text/", strlen("text/")) == 0 ||
+                            strstr(type, "json") || strstr(type, "xml") ||
+                            strstr(type, "javascript") ||
+                            strcmp(type, "application/wasm") == 0;
+  return mime_type;
+}
+
+/**
+ * is_valid_type - Check that a MIME type can go in a header
+ * @type: Type read from a mime.types file
+ *
+ * Return: true if type looks like "type/subtype" and is printable ASCII
+ */
+static bool is_valid_type(const char *type) {
+  if (strlen(type) >= MIME_TYPE_MAX || !strchr(type, '/')) {
+    return false;
+  }
+  for (const char *c = type; *c; c++) {
+    if (*c <= ' ' || *c > '~') {
+      return false;
     }
+  }
+  return true;
+}
 
-    middle_value = (lower_bound + upper_bound) / 2;
+/**
+ * add_extension - Add a mapping to the builder
+ * @builder: Mappings so far
+ * @extension: Extension to map
+ * @type: Type to map it to
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int add_extension(struct mime_builder *builder, const char *extension,
+                         const struct mime_type *type) {
+  if (builder->count == builder->capacity) {
+    size_t capacity = builder->capacity ? builder->capacity * 2 : 128;
+    struct mime_entry *entries =
+        realloc(builder->entries, capacity * sizeof(*entries));
+    if (!entries) {
+      log_event(ERROR, "Failed to allocate memory for MIME types.");
+      return -1;
+    }
+    builder->entries = entries;
+    builder->capacity = capacity;
+  }
 
-    int comparison_result =
-        strcmp(mime_type_associations[middle_value].extension, file_extension);
+  struct mime_entry *entry = &builder->entries[builder->count];
+  if (!lower_extension(entry->extension, extension, strlen(extension))) {
+    return 0;
+  }
+  entry->type = type;
+  entry->order = builder->count;
+  builder->count++;
+  return 0;
+}
 
-    if (comparison_result < 0) {
-      lower_bound = middle_value + 1;
+/**
+ * add_line - Add the mappings from a line in mime.types format
+ * @builder: Mappings so far
+ * @line: Line to parse, which is modified
+ *
+ * A line is a type followed by its extensions, separated by whitespace.
+ * Anything after a '#' is a comment, and a type without extensions (which
+ * system mime.types files have plenty of) is skipped. So are extensions too
+ * long to be in the table, and ones with a dot in them, since we only ever
+ * look up what comes after the last dot.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int add_line(struct mime_builder *builder, char *line) {
+  char *comment = strchr(line, '#');
+  if (comment) {
+    *comment = '\0';
+  }
+
+  char *save;
+  const char *type = strtok_r(line, " \t\r\n", &save);
+  if (!type) {
+    return 0;
+  }
+  if (!is_valid_type(type)) {
+    char type_msg[LOG_MSG_MAX];
+    snprintf(type_msg, LOG_MSG_MAX, "Ignoring invalid MIME type %.64s.",
+             type);
+    log_event(WARN, type_msg);
+    return 0;
+  }
+
+  struct mime_type *mime_type = NULL;
+  const char *extension;
+  while ((extension = strtok_r(NULL, " \t\r\n", &save))) {
+    if (strlen(extension) >= MIME_EXTENSION_MAX || strchr(extension, '.')) {
       continue;
     }
+    if (!mime_type && !(mime_type = new_type(type))) {
+      return -1;
+    }
+    if (add_extension(builder, extension, mime_type) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
 
-    if (comparison_result == 0) {
-      match_found = true;
+/**
+ * load_types_file - Add the mappings from a mime.types file
+ * @builder: Mappings so far
+ * @path: Path of the file
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int load_types_file(struct mime_builder *builder, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    char open_fail_msg[LOG_MSG_MAX];
+    snprintf(open_fail_msg, LOG_MSG_MAX, "Failed to open %s: %s", path,
+             strerror(errno));
+    log_event(ERROR, open_fail_msg);
+    return -1;
+  }
+
+  char *line = NULL;
+  size_t line_capacity = 0;
+  int result = 0;
+  while (getline(&line, &line_capacity, file) != -1) {
+    if (add_line(builder, line) == -1) {
+      result = -1;
       break;
     }
+  }
 
-    if (comparison_result > 0) {
-      upper_bound = middle_value - 1;
+  free(line);
+  fclose(file);
+  return result;
+}
+
+/**
+ * compare_entries - Order mappings by extension, latest first
+ * @a: First mapping
+ * @b: Second mapping
+ *
+ * Return: Negative, zero, or positive, as for qsort()
+ */
+static int compare_entries(const void *a, const void *b) {
+  const struct mime_entry *entry_a = a;
+  const struct mime_entry *entry_b = b;
+  int comparison = strcmp(entry_a->extension, entry_b->extension);
+  if (comparison != 0) {
+    return comparison;
+  }
+  return entry_a->order < entry_b->order ? 1 : -1;
+}
+
+/**
+ * struct bucket - Extensions whose first hash lands in the same bucket
+ * @index: Bucket index
+ * @first: Index of its first extension in the sorted key list
+ * @count: Number of extensions in it
+ */
+struct bucket {
+  uint32_t index;
+  size_t first;
+  size_t count;
+};
+
+/**
+ * compare_buckets - Order buckets largest first
+ * @a: First bucket
+ * @b: Second bucket
+ *
+ * Return: Negative, zero, or positive, as for qsort()
+ */
+static int compare_buckets(const void *a, const void *b) {
+  const struct bucket *bucket_a = a;
+  const struct bucket *bucket_b = b;
+  if (bucket_a->count != bucket_b->count) {
+    return bucket_a->count < bucket_b->count ? 1 : -1;
+  }
+  return bucket_a->index < bucket_b->index ? -1 : 1;
+}
+
+/**
+ * bucket_of - Get the bucket an extension's first hash lands in
+ * @entry: Mapping to hash
+ * @mask: Table size minus one
+ *
+ * Return: Bucket index
+ */
+static uint32_t bucket_of(const struct mime_entry *entry, uint32_t mask) {
+  return hash_extension(0, entry->extension, strlen(entry->extension)) & mask;
+}
+
+/*
+ * Mask of the table being built, for compare_by_bucket(), as qsort() has no
+ * way of passing it in.
+ */
+static uint32_t sort_mask;
+
+/**
+ * compare_by_bucket - Order mappings by the bucket they land in
+ * @a: First mapping
+ * @b: Second mapping
+ *
+ * Return: Negative, zero, or positive, as for qsort()
+ */
+static int compare_by_bucket(const void *a, const void *b) {
+  uint32_t bucket_a = bucket_of(a, sort_mask);
+  uint32_t bucket_b = bucket_of(b, sort_mask);
+  return bucket_a < bucket_b ? -1 : bucket_a > bucket_b;
+}
+
+/**
+ * build_table - Build a perfect hash table for a set of mappings
+ * @keys: Mappings with distinct extensions, reordered by this function
+ * @count: Number of mappings
+ * @size: Number of slots and buckets, a power of two at least count
+ * @new_slots: Output parameter for the slots
+ * @new_displacements: Output parameter for the bucket displacements
+ *
+ * Buckets are placed largest first, while there are still plenty of free
+ * slots, since a bucket of many extensions is the hardest to find a seed for.
+ *
+ * Return: 0 on success, 1 if some bucket had no working seed, -1 on failure
+ */
+static int build_table(struct mime_entry *keys, size_t count, uint32_t size,
+                       struct mime_entry **new_slots,
+                       int32_t **new_displacements) {
+  uint32_t mask = size - 1;
+  struct mime_entry *table = calloc(size, sizeof(*table));
+  int32_t *seeds = calloc(size, sizeof(*seeds));
+  struct bucket *buckets = calloc(count, sizeof(*buckets));
+  uint32_t *placed = calloc(count, sizeof(*placed));
+  if (!table || !seeds || !buckets || !placed) {
+    log_event(ERROR, "Failed to allocate memory for MIME table.");
+    free(table);
+    free(seeds);
+    free(buckets);
+    free(placed);
+    return -1;
+  }
+
+  sort_mask = mask;
+  qsort(keys, count, sizeof(*keys), compare_by_bucket);
+
+  size_t num_buckets = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint32_t index = bucket_of(&keys[i], mask);
+    if (num_buckets == 0 || buckets[num_buckets - 1].index != index) {
+      buckets[num_buckets].index = index;
+      buckets[num_buckets].first = i;
+      num_buckets++;
+    }
+    buckets[num_buckets - 1].count++;
+  }
+  qsort(buckets, num_buckets, sizeof(*buckets), compare_buckets);
+
+  int result = 0;
+  uint32_t next_free = 0;
+  for (size_t b = 0; b < num_buckets && result == 0; b++) {
+    const struct bucket *bucket = &buckets[b];
+
+    if (bucket->count == 1) {
+      while (table[next_free].type) {
+        next_free++;
+      }
+      table[next_free] = keys[bucket->first];
+      seeds[bucket->index] = -(int32_t)next_free - 1;
       continue;
     }
+
+    result = 1;
+    for (uint32_t seed = 1; seed <= MIME_MAX_DISPLACEMENT; seed++) {
+      size_t i;
+      for (i = 0; i < bucket->count; i++) {
+        const struct mime_entry *key = &keys[bucket->first + i];
+        placed[i] =
+            hash_extension(seed, key->extension, strlen(key->extension)) &
+            mask;
+        if (table[placed[i]].type) {
+          break;
+        }
+        table[placed[i]].type = key->type;
+      }
+
+      if (i == bucket->count) {
+        for (i = 0; i < bucket->count; i++) {
+          table[placed[i]] = keys[bucket->first + i];
+        }
+        seeds[bucket->index] = (int32_t)seed;
+        result = 0;
+        break;
+      }
+
+      while (i-- > 0) {
+        table[placed[i]].type = NULL;
+      }
+    }
+  }
+
+  free(buckets);
+  free(placed);
+  if (result != 0) {
+    free(table);
+    free(seeds);
+    return result;
+  }
+
+  *new_slots = table;
+  *new_displacements = seeds;
+  return 0;
+}
+
+/**
+ * mime_init - Build the table of MIME types
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int mime_init(void) {
+  struct mime_builder builder = {NULL, 0, 0};
+
+  for (size_t i = 0; i < sizeof(builtin_types) / sizeof(builtin_types[0]);
+       i++) {
+    char line[MIME_TYPE_MAX];
+    snprintf(line, MIME_TYPE_MAX, "%s", builtin_types[i]);
+    if (add_line(&builder, line) == -1) {
+      free(builder.entries);
+      return -1;
+    }
+  }
+
+  const char *types_path = config_get_ctx()->mime_types;
+  if (types_path && load_types_file(&builder, types_path) == -1) {
+    free(builder.entries);
+    return -1;
+  }
+
+  /*
+   * Sorting puts each extension's mappings together with the latest first,
+   * so keeping the first of each leaves exactly the mappings that count.
+   */
+  qsort(builder.entries, builder.count, sizeof(*builder.entries),
+        compare_entries);
+  size_t count = 0;
+  for (size_t i = 0; i < builder.count; i++) {
+    if (count == 0 || strcmp(builder.entries[count - 1].extension,
+                             builder.entries[i].extension) != 0) {
+      builder.entries[count++] = builder.entries[i];
+    }
   }
 
-  if (match_found) {
-    snprintf(content_type, MAX_CONTENT_TYPE, "Content-Type: %s\r\n\r\n",
-             mime_type_associations[middle_value].mime_type);
+  /*
+   * A table with room to spare is quicker to build, and a seed is always
+   * found for every bucket long before we'd have to grow it more than once.
+   */
+  uint32_t size = 1;
+  while (size < count) {
+    size <<= 1;
   }
+
+  int result;
+  do {
+    result = build_table(builder.entries, count, size, &slots, &displacements);
+    if (result == 1) {
+      size <<= 1;
+    }
+  } while (result == 1);
+  free(builder.entries);
+  if (result == -1) {
+    return -1;
+  }
+  table_mask = size - 1;
+
+  char loaded_msg[LOG_MSG_MAX];
+  snprintf(loaded_msg, LOG_MSG_MAX, "Loaded %zu MIME type extensions.", count);
+  log_event(INFO, loaded_msg);
+  return 0;
+}
+
+/**
+ * mime_lookup - Look up the MIME type for a file
+ * @file_path: Path to file (used to extract extension)
+ *
+ * Return: The file's type
+ */
+const struct mime_type *mime_lookup(const char *file_path) {
+  const char *file_extension = get_file_extension(file_path);
+  char extension[MIME_EXTENSION_MAX];
+  if (!slots || !file_extension ||
+      !lower_extension(extension, file_extension, strlen(file_extension))) {
+    return &default_type;
+  }
+
+  size_t length = strlen(extension);
+  int32_t displacement =
+      displacements[hash_extension(0, extension, length) & table_mask];
+  if (displacement == 0) {
+    return &default_type;
+  }
+
+  uint32_t slot =
+      displacement < 0
+          ? (uint32_t)(-displacement - 1)
+          : hash_extension((uint32_t)displacement, extension, length) &
+                table_mask;
+  if (!slots[slot].type || strcmp(slots[slot].extension, extension) != 0) {
+    return &default_type;
+  }
+  return slots[slot].type;
+}
+
+/**
+ * is_compressible_type - Check whether a file is worth compressing
+ * @file_path: Path to file (used to extract extension)
+ *
+ * Return: true if the file is text or a text-based format
+ */
+bool is_compressible_type(const char *file_path) {
+  return mime_lookup(file_path)->compressible;
 }
@@ -0,0 +1,426 @@
+/**
+ * ocsp.c
+ *
+ * OCSP stapling of responses read from files.
+ *
+ * OVERVIEW:
+ * A client that wants to know whether our certificate has been revoked asks
+ * the CA's OCSP responder, which costs it another connection and round trip
+ * before it can use ours (and tells the CA which sites it visits). When we
+ * staple a recent response to the handshake instead, signed by the CA so we
+ * can't forge it, the client doesn't need to ask.
+ *
+ * Responses are fetched by something else, such as openssl ocsp run from
+ * cron, rather than by the server, so a worker never waits on a responder in
+ * the middle of a handshake. Each worker keeps the responses in memory, and
+ * every OCSP_CHECK_INTERVAL seconds checks whether a file has been replaced
+ * and whether the response in it has expired.
+ *
+ * MATCHING:
+ * A response we staple has to be for the certificate the handshake uses, or
+ * the client will reject the connection. So when a file is loaded we find
+ * which of the SSL context's certificates it's for, and only staple it to
+ * handshakes using that one.
+ */
+
+/*
+ * timegm() isn't part of standard C, so glibc only declares it when
+ * _DEFAULT_SOURCE is defined before any system header is included.
+ */
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/err.h>
+#include <openssl/ocsp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+#include "ocsp.h"
+
+/**
+ * Seconds a response's times may be off by and still be accepted, since our
+ * clock and the responder's won't agree exactly.
+ */
+#define OCSP_CLOCK_SKEW 300
+
+/**
+ * struct staple - A response we may staple
+ * @path: Configuration field holding the path of the file it's read from
+ * @cert: Certificate the response is for, NULL if none is loaded
+ * @der: The response as read from the file
+ * @length: Length of der
+ * @next_update: When the response expires, 0 if it doesn't say
+ * @device: Device of the file last read
+ * @inode: Inode of the file last read
+ * @mtime: Modification time of the file last read
+ *
+ * The file's identity is kept even if its response couldn't be used, so that
+ * we only look at it again once it's been replaced.
+ */
+struct staple {
+  char **path;
+  X509 *cert;
+  unsigned char *der;
+  long length;
+  time_t next_update;
+  dev_t device;
+  ino_t inode;
+  struct timespec mtime;
+};
+
+/*
+ * One response for each certificate we can have, and when the files were
+ * last checked.
+ */
+static struct staple staples[2];
+static time_t last_check = 0;
+
+/**
+ * clear_staple - Forget a staple's response
+ * @staple: Staple to clear
+ */
+static void clear_staple(struct staple *staple) {
+  X509_free(staple->cert);
+  staple->cert = NULL;
+  free(staple->der);
+  staple->der = NULL;
+  staple->length = 0;
+  staple->next_update = 0;
+}
+
+/**
+ * read_response - Read a response file into memory
+ * @path: Path of the file
+ * @file_stat: Output parameter for the file's status
+ * @length: Output parameter for the length of the response
+ *
+ * Return: Allocated file contents, or NULL on failure
+ */
+static unsigned char *read_response(const char *path, struct stat *file_stat,
+                                    long *length) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  if (fstat(fd, file_stat) == -1 || !S_ISREG(file_stat->st_mode) ||
+      file_stat->st_size == 0 || file_stat->st_size > OCSP_RESPONSE_MAX) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = (size_t)file_stat->st_size;
+  unsigned char *contents = malloc(size);
+  if (!contents) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t bytes_read = 0;
+  while (bytes_read < size) {
+    ssize_t result =
+        pread(fd, contents + bytes_read, size - bytes_read, (off_t)bytes_read);
+    if (result == -1 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      free(contents);
+      close(fd);
+      return NULL;
+    }
+    bytes_read += (size_t)result;
+  }
+
+  close(fd);
+  *length = (long)size;
+  return contents;
+}
+
+/**
+ * find_issuer - Find the certificate that issued cert in its chain
+ * @cert: A certificate of ours
+ * @chain: The intermediate certificates sent with it
+ *
+ * A response identifies the certificate it's for by the issuer's name and
+ * public key as well as the serial number, so we need the issuer to check.
+ *
+ * Return: The issuer, or NULL if it isn't in the chain
+ */
+static X509 *find_issuer(X509 *cert, STACK_OF(X509) * chain) {
+  for (int i = 0; i < sk_X509_num(chain); i++) {
+    X509 *candidate = sk_X509_value(chain, i);
+    if (X509_check_issued(candidate, cert) == X509_V_OK) {
+      return candidate;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * find_single_response - Find the part of a response about one certificate
+ * @basic: The response
+ * @cert: Certificate to look for
+ * @issuer: Its issuer
+ *
+ * A response can be about several certificates, each identified by hashes
+ * made with whichever digest the responder chose, so we make the same
+ * hashes of ours to compare.
+ *
+ * Return: The certificate's single response, or NULL if there's none
+ */
+static OCSP_SINGLERESP *find_single_response(OCSP_BASICRESP *basic,
+                                             X509 *cert, X509 *issuer) {
+  for (int i = 0; i < OCSP_resp_count(basic); i++) {
+    OCSP_SINGLERESP *single = OCSP_resp_get0(basic, i);
+    OCSP_CERTID *response_id = (OCSP_CERTID *)OCSP_SINGLERESP_get0_id(single);
+
+    ASN1_OBJECT *digest_name;
+    if (!OCSP_id_get0_info(NULL, &digest_name, NULL, NULL, response_id)) {
+      continue;
+    }
+    const EVP_MD *digest = EVP_get_digestbyobj(digest_name);
+    OCSP_CERTID *our_id = digest ? OCSP_cert_to_id(digest, cert, issuer) : NULL;
+    bool same = our_id && OCSP_id_cmp(our_id, response_id) == 0;
+    OCSP_CERTID_free(our_id);
+
+    if (same) {
+      return single;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * find_certificate - Find which of our certificates a response is for
+ * @ctx: SSL context holding our certificates
+ * @basic: The response
+ * @single: Output parameter for the part of the response about it
+ *
+ * Return: The certificate, or NULL if the response isn't for any of them
+ */
+static X509 *find_certificate(SSL_CTX *ctx, OCSP_BASICRESP *basic,
+                              OCSP_SINGLERESP **single) {
+  for (int more = SSL_CTX_set_current_cert(ctx, SSL_CERT_SET_FIRST); more;
+       more = SSL_CTX_set_current_cert(ctx, SSL_CERT_SET_NEXT)) {
+    X509 *cert = SSL_CTX_get0_certificate(ctx);
+    STACK_OF(X509) *chain = NULL;
+    SSL_CTX_get0_chain_certs(ctx, &chain);
+
+    X509 *issuer = cert ? find_issuer(cert, chain) : NULL;
+    if (issuer && (*single = find_single_response(basic, cert, issuer))) {
+      return cert;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * to_time_t - Convert an ASN.1 time to a time_t
+ * @asn1_time: Time to convert, or NULL
+ *
+ * Return: The time, or 0 if there isn't one
+ */
+static time_t to_time_t(const ASN1_GENERALIZEDTIME *asn1_time) {
+  struct tm tm;
+  if (!asn1_time || !ASN1_TIME_to_tm(asn1_time, &tm)) {
+    return 0;
+  }
+  return timegm(&tm);
+}
+
+/**
+ * load_staple - Read a staple's file and check its response can be used
+ * @ctx: SSL context holding our certificates
+ * @staple: Staple to load
+ */
+static void load_staple(SSL_CTX *ctx, struct staple *staple) {
+  clear_staple(staple);
+  const char *path = *staple->path;
+  if (!path) {
+    return;
+  }
+
+  char ocsp_msg[LOG_MSG_MAX];
+  struct stat file_stat;
+  long length;
+  unsigned char *der = read_response(path, &file_stat, &length);
+  if (!der) {
+    snprintf(ocsp_msg, LOG_MSG_MAX,
+             "Failed to read OCSP response %s, not stapling it.", path);
+    log_event(WARN, ocsp_msg);
+    return;
+  }
+  staple->device = file_stat.st_dev;
+  staple->inode = file_stat.st_ino;
+  staple->mtime = file_stat.st_mtim;
+
+  const unsigned char *cursor = der;
+  OCSP_RESPONSE *response = d2i_OCSP_RESPONSE(NULL, &cursor, length);
+  OCSP_BASICRESP *basic = NULL;
+  if (response &&
+      OCSP_response_status(response) == OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+    basic = OCSP_response_get1_basic(response);
+  }
+
+  OCSP_SINGLERESP *single = NULL;
+  X509 *cert = basic ? find_certificate(ctx, basic, &single) : NULL;
+  ASN1_GENERALIZEDTIME *this_update = NULL;
+  ASN1_GENERALIZEDTIME *next_update = NULL;
+
+  const char *problem = NULL;
+  if (!basic) {
+    problem = "isn't a successful OCSP response";
+  } else if (!cert) {
+    problem = "isn't for any of our certificates";
+  } else if (OCSP_single_get0_status(single, NULL, NULL, &this_update,
+                                     &next_update) != V_OCSP_CERTSTATUS_GOOD) {
+    problem = "doesn't say the certificate is good";
+  } else if (!OCSP_check_validity(this_update, next_update, OCSP_CLOCK_SKEW,
+                                  -1)) {
+    problem = "has expired";
+  }
+
+  if (problem) {
+    snprintf(ocsp_msg, LOG_MSG_MAX, "OCSP response %s %s, not stapling it.",
+             path, problem);
+    log_event(WARN, ocsp_msg);
+    free(der);
+  } else {
+    X509_up_ref(cert);
+    staple->cert = cert;
+    staple->der = der;
+    staple->length = length;
+    staple->next_update = to_time_t(next_update);
+    snprintf(ocsp_msg, LOG_MSG_MAX, "Stapling OCSP response %s.", path);
+    log_event(INFO, ocsp_msg);
+  }
+
+  OCSP_BASICRESP_free(basic);
+  OCSP_RESPONSE_free(response);
+
+  /*
+   * Whatever failed above left errors on this thread's OpenSSL error queue,
+   * which would otherwise be blamed on the next connection to fail.
+   */
+  ERR_clear_error();
+}
+
+/**
+ * check_staples - Reload replaced files and drop expired responses
+ * @ctx: SSL context holding our certificates
+ *
+ * Only does anything every OCSP_CHECK_INTERVAL seconds. A file that has
+ * disappeared keeps its response stapled until it expires.
+ */
+static void check_staples(SSL_CTX *ctx) {
+  time_t now = time(NULL);
+  if (now - last_check < OCSP_CHECK_INTERVAL) {
+    return;
+  }
+  last_check = now;
+
+  for (size_t i = 0; i < sizeof(staples) / sizeof(staples[0]); i++) {
+    struct staple *staple = &staples[i];
+    const char *path = staple->path ? *staple->path : NULL;
+    struct stat file_stat;
+    if (!path || stat(path, &file_stat) == -1) {
+      continue;
+    }
+
+    if (file_stat.st_dev != staple->device ||
+        file_stat.st_ino != staple->inode ||
+        file_stat.st_mtim.tv_sec != staple->mtime.tv_sec ||
+        file_stat.st_mtim.tv_nsec != staple->mtime.tv_nsec) {
+      load_staple(ctx, staple);
+    } else if (staple->cert && staple->next_update &&
+               now >= staple->next_update) {
+      char expired_msg[LOG_MSG_MAX];
+      snprintf(expired_msg, LOG_MSG_MAX,
+               "OCSP response %s has expired, not stapling it.", path);
+      log_event(WARN, expired_msg);
+      clear_staple(staple);
+    }
+  }
+}
+
+/**
+ * status_callback - Staple a response to a handshake
+ * @ssl: Connection whose client asked for the certificate's status
+ * @arg: Unused
+ *
+ * OpenSSL calls this once it has picked which of our certificates to use,
+ * and only if the client asked for a stapled response. It frees the
+ * response it's given when it's done with it, so each handshake gets a copy.
+ *
+ * Return: SSL_TLSEXT_ERR_OK if a response was stapled, SSL_TLSEXT_ERR_NOACK
+ * if there's none to staple
+ */
+static int status_callback(SSL *ssl, void *arg) {
+  (void)arg;
+  check_staples(SSL_get_SSL_CTX(ssl));
+
+  X509 *cert = SSL_get_certificate(ssl);
+  if (!cert) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+
+  for (size_t i = 0; i < sizeof(staples) / sizeof(staples[0]); i++) {
+    struct staple *staple = &staples[i];
+    if (!staple->cert ||
+        (staple->cert != cert && X509_cmp(staple->cert, cert) != 0)) {
+      continue;
+    }
+
+    unsigned char *copy = OPENSSL_memdup(staple->der, (size_t)staple->length);
+    if (!copy || !SSL_set_tlsext_status_ocsp_resp(ssl, copy, staple->length)) {
+      OPENSSL_free(copy);
+      return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+  }
+  return SSL_TLSEXT_ERR_NOACK;
+}
+
+/**
+ * ocsp_load - Load the OCSP responses to staple
+ * @ctx: SSL context holding our certificates
+ *
+ * Loaded in the parent at startup, so workers inherit the responses, and in
+ * every process on SIGHUP. The status callback is only set when there's a
+ * response file configured.
+ */
+void ocsp_load(SSL_CTX *ctx) {
+  struct server_config *config = config_get_ctx();
+  staples[0].path = &config->ocsp_response;
+  staples[1].path = &config->ecdsa_ocsp_response;
+
+  bool stapling = false;
+  for (size_t i = 0; i < sizeof(staples) / sizeof(staples[0]); i++) {
+    load_staple(ctx, &staples[i]);
+    stapling = stapling || *staples[i].path;
+  }
+  last_check = time(NULL);
+
+  if (stapling) {
+    SSL_CTX_set_tlsext_status_cb(ctx, status_callback);
+  } else {
+    SSL_CTX_set_tlsext_status_cb(ctx, NULL);
+  }
+}
+
+/**
+ * ocsp_cleanup - Free the loaded responses
+ */
+void ocsp_cleanup(void) {
+  for (size_t i = 0; i < sizeof(staples) / sizeof(staples[0]); i++) {
+    clear_staple(&staples[i]);
+  }
+}
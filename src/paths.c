@@ -12,12 +12,14 @@
 #include <errno.h>
 #include <linux/limits.h>
 #include <paths.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "file.h"
 #include "log.h"
+#include "paths.h"
 
 /**
  * prepend_program_data_path - Construct user data directory path
@@ -54,6 +56,57 @@ int prepend_program_data_path(char **path_buffer, const char *original_path) {
   return 0;
 }
 
+/**
+ * prepend_program_config_path - Construct user config directory path
+ * @path_buffer: Output buffer to write path into
+ * @original_path: Relative path to append (e.g., "cyllenian.conf")
+ *
+ * Same as prepend_program_data_path(), but for ~/.config/cyllenian, which is
+ * where the XDG specification says configuration files live.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int prepend_program_config_path(char **path_buffer, const char *original_path) {
+  const char *home = getenv("HOME");
+  if (!home) {
+    log_event(ERROR, "Failed to get value of HOME environment variable.");
+    return -1;
+  }
+
+  if (!*path_buffer) {
+    log_event(ERROR, "NULL pointer was passed to prepend_program_config_path.");
+    return -1;
+  }
+
+  snprintf(*path_buffer, PATH_MAX, "%s/.config/cyllenian/%s", home,
+           original_path);
+
+  return 0;
+}
+
+/**
+ * get_website_path - Get the website directory's path
+ *
+ * HOME doesn't change while we're running, so the path is built once and kept
+ * for the life of the process.
+ *
+ * Return: Pointer to the path, or NULL on error
+ */
+const char *get_website_path(void) {
+  static char website_path[PATH_MAX];
+  static bool built = false;
+
+  if (!built) {
+    char *path_buffer = website_path;
+    if (prepend_program_data_path(&path_buffer, "website/") == -1) {
+      return NULL;
+    }
+    built = true;
+  }
+
+  return website_path;
+}
+
 /**
  * website_dir_exists - Verify website directory is present
  *
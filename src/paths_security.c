@@ -7,93 +7,320 @@
  * This file provides security-critical path manipulation functions that
  * prevent directory traversal attacks and ensure safe file access.
  *
- * Normalization converts all variants to a standard form, making security
- * checks more reliable.
+ * The path from the request is percent-decoded, normalized and checked in a
+ * single pass as it's copied into the filesystem path, so the checks see
+ * exactly the bytes we'll open and can't be fooled by an encoding they don't
+ * know about. "%2e%2e%2f", "..%2f" and "../" all decode to the same thing, so
+ * all are caught by looking for a ".." segment in the result.
+ *
+ * Backslashes aren't separators on Linux, but they are to other systems a file
+ * might be copied to, so ".." next to a backslash is treated as traversal too.
+ * A percent sign is only decoded once, so a double encoded "%252e" is just a
+ * file name with "%2e" in it.
+ *
+ * VECTORIZATION:
+ * Most of a path is ordinary characters that are copied unchanged. Only '%',
+ * '/' and '\' need looking at, so we find the next of those 16 or 32 bytes at
+ * a time with SSE2 or AVX2 (NEON on ARM) and copy everything before it in one
+ * go. '.' doesn't need finding, since "." and ".." segments are recognized
+ * from what was copied when the segment ends. Without vector instructions we
+ * fall back to checking a byte at a time.
  */
 
+#include <stdint.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "paths_security.h"
 
 /**
- * contains_traversal_patterns - Detect directory traversal attack attempts
- * @file_request: Path from HTTP request to check
+ * is_special - Check whether a path character needs more than copying
+ * @c: Character to check
+ *
+ * Return: true for '%', '/' and '\'
+ */
+static bool is_special(char c) { return c == '%' || c == '/' || c == '\\'; }
+
+/*
+ * Size of the blocks compared at once, and how many bits of the match mask
+ * each byte of a block gets.
+ */
+#if defined(__AVX2__)
+#define BLOCK_SIZE 32
+#define MASK_BITS_PER_BYTE 1
+#elif defined(__SSE2__)
+#define BLOCK_SIZE 16
+#define MASK_BITS_PER_BYTE 1
+#elif defined(__ARM_NEON)
+#define BLOCK_SIZE 16
+#define MASK_BITS_PER_BYTE 4
+#endif
+
+#ifdef BLOCK_SIZE
+/**
+ * block_mask - Find the special characters in a block of the path
+ * @block: BLOCK_SIZE bytes of the path
  *
- * Checks if the path contains any known directory traversal patterns.
- * This is a critical security function that prevents attackers from
- * accessing files outside the website directory.
+ * Compares the whole block against each special character at once, and turns
+ * the matches into a bit mask with MASK_BITS_PER_BYTE bits per byte.
  *
- * Return: true if traversal pattern detected, false if path is safe
+ * Return: The match mask, with the first byte in the lowest bits
  */
-bool contains_traversal_patterns(const char *file_request) {
+static uint64_t block_mask(const char *block) {
+#if defined(__AVX2__)
+  __m256i data = _mm256_loadu_si256((const __m256i *)block);
+  __m256i matches = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(data, _mm256_set1_epi8('%')),
+                      _mm256_cmpeq_epi8(data, _mm256_set1_epi8('/'))),
+      _mm256_cmpeq_epi8(data, _mm256_set1_epi8('\\')));
+  return (uint32_t)_mm256_movemask_epi8(matches);
+#elif defined(__SSE2__)
+  __m128i data = _mm_loadu_si128((const __m128i *)block);
+  __m128i matches =
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(data, _mm_set1_epi8('%')),
+                                _mm_cmpeq_epi8(data, _mm_set1_epi8('/'))),
+                   _mm_cmpeq_epi8(data, _mm_set1_epi8('\\')));
+  return (uint32_t)_mm_movemask_epi8(matches);
+#else
+  uint8x16_t data = vld1q_u8((const uint8_t *)block);
+  uint8x16_t matches =
+      vorrq_u8(vorrq_u8(vceqq_u8(data, vdupq_n_u8('%')),
+                        vceqq_u8(data, vdupq_n_u8('/'))),
+               vceqq_u8(data, vdupq_n_u8('\\')));
   /*
-   * We set this array as static const so that it is allocated once and cannot
-   * be modified later in the function.
+   * NEON has no movemask, but narrowing each 16-bit lane by 4 bits leaves
+   * 4 bits per byte in a 64-bit mask.
    */
-  static const char *traversal_patterns[] = {
-      "../",             // Basic traversal
-      "%2e%2e%2f",       // Fully URL encoded
-      "%2e%2e/",         // Partially encoded (. encoded)
-      "..%2f",           // Partially encoded (/ encoded)
-      "%2e%2e%5c",       // Encoded with backslash
-      "%2e%2e\\",        // Mixed encoding with literal backslash
-      "..%5c",           // Windows style, partial encoding
-      "%252e%252e%255c", // Double encoded
-      "..%255c",         // Mixed double encoding
-      "..\\"             // Windows literal backslash
-  };
-  /*
-   * It is standard practice to divide the sizeof (the number of bytes) in an
-   * array by the sizeof a single entry to ascertain the number of entries in
-   * the array.
-   */
-  for (size_t i = 0;
-       i < sizeof(traversal_patterns) / sizeof(traversal_patterns[0]); ++i) {
-    /* Then we search for the substring within the file_request and return true
-     if we find it.*/
-    if (strstr(file_request, traversal_patterns[i])) {
-      return true;
+  return vget_lane_u64(
+      vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+#endif
+}
+#endif
+
+/**
+ * struct special_finder - Where the special characters in a path are
+ * @path: Path being sanitized
+ * @length: Length of path
+ * @block_start: Start of the block mask describes
+ * @block_end: End of that block, or 0 before the first block is loaded
+ * @mask: Match mask for the block
+ *
+ * Paths are sanitized front to back, so the mask for the current block is
+ * kept and every special character in the block is found from it. A path of
+ * many short segments therefore costs one comparison per block, rather than
+ * one per segment.
+ */
+struct special_finder {
+  const char *path;
+  size_t length;
+  size_t block_start;
+  size_t block_end;
+  uint64_t mask;
+};
+
+/**
+ * find_special - Find the next character that needs more than copying
+ * @finder: Finder for the path being sanitized
+ * @start: Index to search from, which never goes backwards between calls
+ *
+ * Blocks are only loaded while they lie entirely within the path, and the
+ * rest is checked a byte at a time, as is the whole path without vector
+ * instructions.
+ *
+ * Return: Index of the next special character, or the path's length if there
+ * is none
+ */
+static size_t find_special(struct special_finder *finder, size_t start) {
+#ifdef BLOCK_SIZE
+  for (;;) {
+    if (start < finder->block_end) {
+      uint64_t mask = finder->mask >> ((start - finder->block_start) *
+                                       MASK_BITS_PER_BYTE);
+      if (mask) {
+        return start + (size_t)__builtin_ctzll(mask) / MASK_BITS_PER_BYTE;
+      }
+      start = finder->block_end;
     }
+    if (finder->length - start < BLOCK_SIZE) {
+      break;
+    }
+    finder->block_start = start;
+    finder->block_end = start + BLOCK_SIZE;
+    finder->mask = block_mask(finder->path + start);
+  }
+#endif
+
+  while (start < finder->length && !is_special(finder->path[start])) {
+    start++;
   }
+  return start;
+}
 
-  return false;
+/**
+ * hex_value - Get the value of a hexadecimal digit
+ * @c: Character to convert
+ *
+ * Return: 0 to 15, or -1 if c isn't a hexadecimal digit
+ */
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
 }
 
 /**
- * normalize_request_path - Clean up path by removing redundant elements
- * @file_request: Path to normalize (modified in place)
+ * is_dot_segment - Check whether a segment is "." or ".."
+ * @segment: Start of the segment
+ * @length: Length of the segment
  *
- * Normalizes the path by removing consecutive slashes and trailing slashes,
- * then null terminating the string.
+ * Return: 1 for ".", 2 for "..", 0 for anything else
  */
-void normalize_request_path(char *file_request) {
-  char *src = file_request;
-  char *dst = file_request;
-
-  while (*src) {
-    if (*src == '/' && (*(src + 1) == '/')) {
-      /*
-       * By advancing src but not dst, we are ignoring the additional slash
-       */
-      src++;
+static int is_dot_segment(const char *segment, size_t length) {
+  if (length == 1 && segment[0] == '.') {
+    return 1;
+  }
+  if (length == 2 && segment[0] == '.' && segment[1] == '.') {
+    return 2;
+  }
+  return 0;
+}
+
+/**
+ * sanitize_request_path - Decode, normalize and check a request path
+ * @dst: Buffer for the filesystem path
+ * @dst_size: Size of dst
+ * @src: Path from the request, not null terminated
+ * @length: Length of src
+ * @dst_length: Output parameter for the length of the result
+ *
+ * Goes through the path once, copying runs of ordinary characters straight
+ * across and decoding each percent escape as it's found. Segments are checked
+ * in dst as each slash ends them, which is after they've been decoded:
+ * - Empty segments (consecutive slashes) are dropped
+ * - "." segments are dropped
+ * - ".." segments mean the path is rejected
+ *
+ * Return: PATH_OK if the path is safe, or why it isn't
+ */
+enum path_result sanitize_request_path(char *dst, size_t dst_size,
+                                       const char *src, size_t length,
+                                       size_t *dst_length) {
+  size_t in = 0;
+  size_t out = 0;
+
+  /*
+   * Where in dst the current segment started, and where the part of it after
+   * its last backslash started, which is what's checked for "..".
+   */
+  size_t segment_start = 0;
+  size_t part_start = 0;
+
+  /*
+   * One byte of dst is kept back for the null terminator.
+   */
+  if (dst_size == 0) {
+    return PATH_TOO_LONG;
+  }
+  size_t capacity = dst_size - 1;
+
+  struct special_finder finder = {src, length, 0, 0, 0};
+  for (;;) {
+    size_t next = find_special(&finder, in);
+    size_t run = next - in;
+    if (run > capacity - out) {
+      return PATH_TOO_LONG;
+    }
+    memcpy(dst + out, src + in, run);
+    out += run;
+    in = next;
+
+    if (in == length) {
+      break;
+    }
+
+    char c = src[in];
+    if (c == '%') {
+      int high = in + 2 < length ? hex_value(src[in + 1]) : -1;
+      int low = in + 2 < length ? hex_value(src[in + 2]) : -1;
+      if (high == -1 || low == -1) {
+        return PATH_BAD_ENCODING;
+      }
+      c = (char)(high << 4 | low);
+      in += 3;
+
+      unsigned char byte = (unsigned char)c;
+      if (byte < 0x20 || byte == 0x7f) {
+        return PATH_BAD_ENCODING;
+      }
+      if (c != '/' && c != '\\') {
+        if (out == capacity) {
+          return PATH_TOO_LONG;
+        }
+        dst[out++] = c;
+        continue;
+      }
     } else {
-      /*
-       * Copy character from src to dst
-       */
-      *dst++ = *src++;
+      in++;
+    }
+
+    /*
+     * c is now a slash or backslash, literal or decoded, which ends the part
+     * of the segment before it.
+     */
+    if (is_dot_segment(dst + part_start, out - part_start) == 2) {
+      return PATH_TRAVERSAL;
+    }
+
+    if (c == '\\') {
+      if (out == capacity) {
+        return PATH_TOO_LONG;
+      }
+      dst[out++] = c;
+      part_start = out;
+      continue;
+    }
+
+    if (is_dot_segment(dst + segment_start, out - segment_start) == 1) {
+      out = segment_start;
+    }
+    if (out == segment_start) {
+      continue;
     }
+    if (out == capacity) {
+      return PATH_TOO_LONG;
+    }
+    dst[out++] = '/';
+    segment_start = out;
+    part_start = out;
+  }
+
+  if (is_dot_segment(dst + part_start, out - part_start) == 2) {
+    return PATH_TRAVERSAL;
+  }
+  if (is_dot_segment(dst + segment_start, out - segment_start) == 1) {
+    out = segment_start;
   }
 
   /*
    * Remove trailing slash if present.
    */
-  if (dst != file_request && *(dst - 1) == '/') {
-    dst--;
+  if (out > 0 && dst[out - 1] == '/') {
+    out--;
   }
 
-  /*
-   * We null terminate the string at its new end because string functions expect
-   * null terminated strings.
-   */
-  *dst = '\0';
+  dst[out] = '\0';
+  *dst_length = out;
+  return PATH_OK;
 }
@@ -0,0 +1,104 @@
+/**
+ * pool.c
+ *
+ * Per-worker pool of reusable buffers.
+ *
+ * OVERVIEW:
+ * Every connection needs a buffer to read its request into, and some
+ * responses need a buffer for their header or for streaming a large file.
+ * Allocating these with malloc() and freeing them again for every request
+ * costs time, and leaves the heap fragmented after a few million requests.
+ *
+ * Instead, buffers that are no longer needed are kept on a free list for
+ * their size, and handed straight back out to the next connection that needs
+ * one. A worker serving a steady load soon has as many buffers as it needs,
+ * after which serving a request doesn't allocate at all.
+ *
+ * Each worker has its own pool, as with the cache, so there's no locking.
+ *
+ * SIZE CLASSES:
+ * Buffers are rounded up to a power of two between POOL_MIN_SIZE and
+ * POOL_MAX_SIZE, so a buffer returned by one user fits any other that asks
+ * for the same size class. The free lists are threaded through the free
+ * buffers themselves, so keeping them costs no extra memory.
+ */
+
+#include <stdlib.h>
+
+#include "pool.h"
+
+/**
+ * struct free_buffer - A buffer waiting to be reused
+ * @next: Next free buffer of the same size
+ */
+struct free_buffer {
+  struct free_buffer *next;
+};
+
+/*
+ * Free buffers of each size class, and how many there are of each.
+ */
+static struct free_buffer *free_lists[POOL_NUM_CLASSES];
+static size_t num_free[POOL_NUM_CLASSES];
+
+/**
+ * size_class - Find the size class for a buffer size
+ * @size: Size asked for
+ *
+ * Return: Index of the smallest class that fits size, or -1 if size is over
+ * POOL_MAX_SIZE
+ */
+static int size_class(size_t size) {
+  size_t class_size = POOL_MIN_SIZE;
+  for (int i = 0; i < POOL_NUM_CLASSES; i++) {
+    if (size <= class_size) {
+      return i;
+    }
+    class_size <<= 1;
+  }
+  return -1;
+}
+
+/**
+ * pool_get - Get a buffer, reusing a free one if possible
+ * @size: Size of buffer needed
+ *
+ * Return: Pointer to the buffer, or NULL on allocation failure
+ */
+void *pool_get(size_t size) {
+  int class = size_class(size);
+  if (class == -1) {
+    return malloc(size);
+  }
+
+  struct free_buffer *buffer = free_lists[class];
+  if (buffer) {
+    free_lists[class] = buffer->next;
+    num_free[class]--;
+    return buffer;
+  }
+
+  return malloc((size_t)POOL_MIN_SIZE << class);
+}
+
+/**
+ * pool_put - Return a buffer so that it can be reused
+ * @buffer: Buffer from pool_get(), or NULL
+ * @size: Size it was got with
+ */
+void pool_put(void *buffer, size_t size) {
+  if (!buffer) {
+    return;
+  }
+
+  int class = size_class(size);
+  if (class == -1 || num_free[class] >= POOL_MAX_FREE) {
+    free(buffer);
+    return;
+  }
+
+  struct free_buffer *free_buffer = buffer;
+  free_buffer->next = free_lists[class];
+  free_lists[class] = free_buffer;
+  num_free[class]++;
+}
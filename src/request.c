@@ -0,0 +1,442 @@
+/**
+ * request.c
+ *
+ * Incremental HTTP request parser.
+ *
+ * OVERVIEW:
+ * A request head looks like this, with every line ending in CRLF:
+ *
+ *   GET /index.html?lang=en HTTP/1.1
+ *   Host: example.com
+ *   Accept-Encoding: gzip, br
+ *
+ * followed by a blank line. The parser goes through it line by line as it
+ * arrives, splitting the request line into its three parts and each header
+ * into a name and a value. Nothing is copied: everything in struct
+ * http_request points into the connection's request buffer.
+ *
+ * INCREMENTAL PARSING:
+ * The head may arrive a few bytes at a time, so the parser remembers where
+ * the first line it hasn't finished is. Each call only looks at data from
+ * there on, which means a slow client sending a byte at a time doesn't cost
+ * us a rescan of everything it has sent so far on every read.
+ *
+ * STRICTNESS:
+ * We follow RFC 9112 where being lenient could lead to us and a proxy in
+ * front of us disagreeing about where a request starts and ends. Whitespace
+ * between a header name and its colon, and header values continued onto the
+ * next line (obs-fold), are rejected with 400. Bare LF line endings are
+ * accepted, as the RFC allows.
+ *
+ * For the same reason, a request must say where it ends in the one way a
+ * proxy can't read differently. We never read request bodies, so any
+ * Transfer-Encoding, and any Content-Length but 0, gets 400 and the
+ * connection is closed; otherwise a body a proxy forwarded would be taken
+ * for the next request. A second Host or Content-Length header, or an
+ * HTTP/1.1 request without a Host header, gets 400 as well, since a proxy
+ * may have routed the request by another Host than we'd pick, or read the
+ * other Content-Length.
+ */
+
+#include <string.h>
+#include <strings.h>
+
+#include "request.h"
+
+/**
+ * request_reset - Prepare a request struct for a new request
+ * @request: Request to reset
+ */
+void request_reset(struct http_request *request) {
+  memset(request, 0, sizeof(*request));
+  request->state = PARSE_REQUEST_LINE;
+}
+
+/**
+ * request_relocate - Move a request's views to a new buffer
+ * @request: Request whose views point into old_buffer
+ * @old_buffer: Buffer the request was parsed from
+ * @new_buffer: Buffer the request has been copied to
+ *
+ * Each view keeps its offset into the buffer, so the request carries on
+ * parsing from where it was.
+ */
+void request_relocate(struct http_request *request, const char *old_buffer,
+                      const char *new_buffer) {
+  struct string_view *views[] = {
+      &request->request_line,      &request->method_name,
+      &request->target,            &request->path,
+      &request->query,             &request->host,
+      &request->connection,        &request->range,
+      &request->if_range,          &request->if_none_match,
+      &request->if_modified_since, &request->accept_encoding,
+      &request->referer,           &request->user_agent,
+      &request->content_length,    &request->transfer_encoding};
+
+  for (size_t i = 0; i < sizeof(views) / sizeof(views[0]); i++) {
+    if (views[i]->data) {
+      views[i]->data = new_buffer + (views[i]->data - old_buffer);
+    }
+  }
+}
+
+/**
+ * is_token_char - Check whether a character may appear in a method or header
+ * name
+ * @c: Character to check
+ *
+ * These are the "tchar" characters from RFC 9110: letters, digits, and a few
+ * symbols, but no whitespace, separators, or control characters.
+ *
+ * Return: true if c is a token character
+ */
+static bool is_token_char(char c) {
+  if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+      (c >= '0' && c <= '9')) {
+    return true;
+  }
+  return c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+/**
+ * is_token - Check whether a view is a non-empty token
+ * @view: Text to check
+ *
+ * Return: true if every character is a token character
+ */
+static bool is_token(struct string_view view) {
+  if (view.length == 0) {
+    return false;
+  }
+  for (size_t i = 0; i < view.length; i++) {
+    if (!is_token_char(view.data[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * view_is - Compare a view with a string
+ * @view: Text to compare
+ * @text: String to compare it with
+ *
+ * Return: true if they're equal
+ */
+static bool view_is(struct string_view view, const char *text) {
+  return view.length == strlen(text) &&
+         memcmp(view.data, text, view.length) == 0;
+}
+
+/**
+ * parse_request_line - Parse the first line of the request
+ * @request: Request being parsed
+ * @line: The line without its line ending
+ *
+ * The request line is "METHOD target HTTP/1.x", with single spaces between
+ * the parts. The target must be a path (origin-form), since we aren't a
+ * proxy.
+ *
+ * Return: PARSE_INCOMPLETE to carry on with the headers, or an error
+ */
+static enum parse_result parse_request_line(struct http_request *request,
+                                            struct string_view line) {
+  const char *end = line.data + line.length;
+
+  const char *method_end = memchr(line.data, ' ', line.length);
+  if (!method_end) {
+    return PARSE_BAD_REQUEST;
+  }
+  const char *target = method_end + 1;
+  const char *target_end = memchr(target, ' ', (size_t)(end - target));
+  if (!target_end) {
+    return PARSE_BAD_REQUEST;
+  }
+  const char *version = target_end + 1;
+
+  request->request_line = line;
+  request->method_name.data = line.data;
+  request->method_name.length = (size_t)(method_end - line.data);
+  request->target.data = target;
+  request->target.length = (size_t)(target_end - target);
+  struct string_view version_view = {version, (size_t)(end - version)};
+
+  if (!is_token(request->method_name)) {
+    return PARSE_BAD_REQUEST;
+  }
+
+  if (view_is(request->method_name, "GET")) {
+    request->method = METHOD_GET;
+  } else if (view_is(request->method_name, "HEAD")) {
+    request->method = METHOD_HEAD;
+  } else {
+    request->method = METHOD_OTHER;
+  }
+
+  if (request->target.length == 0 || *target != '/') {
+    return PARSE_BAD_REQUEST;
+  }
+  if (request->target.length > REQUEST_TARGET_MAX) {
+    return PARSE_URI_TOO_LONG;
+  }
+  for (size_t i = 0; i < request->target.length; i++) {
+    unsigned char c = (unsigned char)target[i];
+    if (c <= 0x20 || c == 0x7f) {
+      return PARSE_BAD_REQUEST;
+    }
+  }
+
+  const char *query = memchr(target, '?', request->target.length);
+  request->path.data = target;
+  if (query) {
+    request->path.length = (size_t)(query - target);
+    request->query.data = query + 1;
+    request->query.length = (size_t)(target_end - query - 1);
+  } else {
+    request->path.length = request->target.length;
+  }
+
+  /*
+   * HTTP/1.x only. Minor versions past 1 are meant to be understood as 1.1.
+   */
+  if (version_view.length != 8 || memcmp(version, "HTTP/1.", 7) != 0 ||
+      version[7] < '0' || version[7] > '9') {
+    return PARSE_BAD_REQUEST;
+  }
+  request->version_minor = version[7] - '0';
+
+  return PARSE_INCOMPLETE;
+}
+
+/**
+ * parse_header_line - Parse one header line
+ * @request: Request being parsed
+ * @line: The line without its line ending
+ *
+ * A header is "Name: value", where the name is compared case-insensitively
+ * and whitespace around the value isn't part of it. The headers we act on
+ * are saved in request, and only the first of each is used, except for the
+ * ones that say which website the request is for and where it ends, which
+ * mustn't be repeated.
+ *
+ * Return: PARSE_INCOMPLETE to carry on, or an error
+ */
+static enum parse_result parse_header_line(struct http_request *request,
+                                           struct string_view line) {
+  static const struct {
+    const char *name;
+    size_t offset;
+    bool unique;
+  } known_headers[] = {
+      {"Host", offsetof(struct http_request, host), true},
+      {"Connection", offsetof(struct http_request, connection), false},
+      {"Range", offsetof(struct http_request, range), false},
+      {"If-Range", offsetof(struct http_request, if_range), false},
+      {"If-None-Match", offsetof(struct http_request, if_none_match), false},
+      {"If-Modified-Since", offsetof(struct http_request, if_modified_since),
+       false},
+      {"Accept-Encoding", offsetof(struct http_request, accept_encoding),
+       false},
+      {"Referer", offsetof(struct http_request, referer), false},
+      {"User-Agent", offsetof(struct http_request, user_agent), false},
+      {"Content-Length", offsetof(struct http_request, content_length), true},
+      {"Transfer-Encoding", offsetof(struct http_request, transfer_encoding),
+       false}};
+
+  if (++request->num_headers > MAX_REQUEST_HEADERS) {
+    return PARSE_TOO_LARGE;
+  }
+
+  /*
+   * A line starting with whitespace would continue the previous header's
+   * value (obs-fold), which the RFC lets servers reject.
+   */
+  if (*line.data == ' ' || *line.data == '\t') {
+    return PARSE_BAD_REQUEST;
+  }
+
+  const char *colon = memchr(line.data, ':', line.length);
+  if (!colon) {
+    return PARSE_BAD_REQUEST;
+  }
+  struct string_view name = {line.data, (size_t)(colon - line.data)};
+  if (!is_token(name)) {
+    return PARSE_BAD_REQUEST;
+  }
+
+  const char *value = colon + 1;
+  const char *value_end = line.data + line.length;
+  while (value < value_end && (*value == ' ' || *value == '\t')) {
+    value++;
+  }
+  while (value_end > value &&
+         (*(value_end - 1) == ' ' || *(value_end - 1) == '\t')) {
+    value_end--;
+  }
+
+  for (size_t i = 0; i < sizeof(known_headers) / sizeof(known_headers[0]);
+       i++) {
+    if (name.length == strlen(known_headers[i].name) &&
+        strncasecmp(name.data, known_headers[i].name, name.length) == 0) {
+      struct string_view *field =
+          (struct string_view *)((char *)request + known_headers[i].offset);
+      if (!field->data) {
+        field->data = value;
+        field->length = (size_t)(value_end - value);
+      } else if (known_headers[i].unique) {
+        return PARSE_BAD_REQUEST;
+      }
+      break;
+    }
+  }
+
+  return PARSE_INCOMPLETE;
+}
+
+/**
+ * check_head - Check a complete request head for what we can't serve safely
+ * @request: Request whose headers have all been parsed
+ *
+ * Return: PARSE_COMPLETE if the request can be answered, or PARSE_BAD_REQUEST
+ */
+static enum parse_result check_head(const struct http_request *request) {
+  if (request->transfer_encoding.data) {
+    return PARSE_BAD_REQUEST;
+  }
+
+  /*
+   * "Content-Length: 0" (or "00") means there's no body, which is the only
+   * length we can take without reading one.
+   */
+  if (request->content_length.data) {
+    if (request->content_length.length == 0) {
+      return PARSE_BAD_REQUEST;
+    }
+    for (size_t i = 0; i < request->content_length.length; i++) {
+      if (request->content_length.data[i] != '0') {
+        return PARSE_BAD_REQUEST;
+      }
+    }
+  }
+
+  /*
+   * HTTP/1.1 requires a Host header, and it decides which website the
+   * request is for.
+   */
+  if (request->version_minor >= 1 && !request->host.data) {
+    return PARSE_BAD_REQUEST;
+  }
+  return PARSE_COMPLETE;
+}
+
+/**
+ * request_parse - Parse as much of a request as has arrived
+ * @request: Request to fill in, reset with request_reset() before the first
+ *           call
+ * @buffer: Data received so far
+ * @length: Length of buffer
+ *
+ * Return: Whether the request is complete, needs more data, or is invalid
+ */
+enum parse_result request_parse(struct http_request *request,
+                                const char *buffer, size_t length) {
+  while (request->state != PARSE_DONE) {
+    const char *line_start = buffer + request->parsed;
+    size_t available = length - request->parsed;
+
+    const char *newline = memchr(line_start, '\n', available);
+    if (!newline) {
+      /*
+       * If the line so far is already too long, there's no point waiting for
+       * the rest of it.
+       */
+      if ((request->state == PARSE_REQUEST_LINE &&
+           available > REQUEST_LINE_MAX) ||
+          length >= REQUEST_HEAD_MAX) {
+        return PARSE_TOO_LARGE;
+      }
+      return PARSE_INCOMPLETE;
+    }
+
+    request->parsed = (size_t)(newline - buffer) + 1;
+    if (request->parsed > REQUEST_HEAD_MAX) {
+      return PARSE_TOO_LARGE;
+    }
+
+    struct string_view line = {line_start, (size_t)(newline - line_start)};
+    if (line.length > 0 && line.data[line.length - 1] == '\r') {
+      line.length--;
+    }
+
+    if (request->state == PARSE_REQUEST_LINE) {
+      /*
+       * Some clients send a stray CRLF after a request body, which the RFC
+       * says to ignore before a request line.
+       */
+      if (line.length == 0) {
+        continue;
+      }
+      if (line.length > REQUEST_LINE_MAX) {
+        return PARSE_TOO_LARGE;
+      }
+
+      enum parse_result result = parse_request_line(request, line);
+      if (result != PARSE_INCOMPLETE) {
+        return result;
+      }
+      request->state = PARSE_HEADERS;
+      continue;
+    }
+
+    if (line.length == 0) {
+      request->head_length = request->parsed;
+      request->state = PARSE_DONE;
+      return check_head(request);
+    }
+
+    enum parse_result result = parse_header_line(request, line);
+    if (result != PARSE_INCOMPLETE) {
+      return result;
+    }
+  }
+
+  return PARSE_COMPLETE;
+}
+
+/**
+ * request_get_host - Find the hostname the request was sent to
+ * @request: Parsed request from client
+ * @host_length: Output parameter for the length of the hostname
+ *
+ * The Host header is mandatory in HTTP/1.1, but HTTP/1.0 clients may leave
+ * it out. It sometimes has the port appended, which we leave off since we
+ * already know it, and it makes no difference to which virtual host the
+ * request is for. IPv6 addresses are written in brackets ("[::1]:8443")
+ * because they contain colons themselves.
+ *
+ * Return: Pointer to the hostname within the request, or NULL if there's no
+ * Host header
+ */
+const char *request_get_host(const struct http_request *request,
+                             size_t *host_length) {
+  const char *host = request->host.data;
+  *host_length = request->host.length;
+  if (!host || *host_length == 0) {
+    return NULL;
+  }
+
+  const char *port_search = host;
+  if (*host == '[') {
+    const char *bracket_end = memchr(host, ']', *host_length);
+    if (bracket_end) {
+      port_search = bracket_end;
+    }
+  }
+
+  const char *port =
+      memchr(port_search, ':', *host_length - (size_t)(port_search - host));
+  if (port) {
+    *host_length = (size_t)(port - host);
+  }
+  return host;
+}
@@ -4,22 +4,34 @@
  * Responsible for HTTP response generation and request validation.
  */
 
+/*
+ * timegm() isn't part of standard C, so glibc only declares it when
+ * _DEFAULT_SOURCE is defined before any system header is included.
+ */
+#define _DEFAULT_SOURCE
+
 #include <errno.h>
 #include <linux/limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
-#include "file.h"
+#include "cache.h"
+#include "fd_cache.h"
 #include "log.h"
-#include "paths.h"
+#include "mime.h"
 #include "paths_security.h"
+#include "request.h"
 #include "response.h"
+#include "route.h"
 
 /**
  * get_response_code_msg - Convert status code to HTTP status line
  * @response_code_msg: Buffer to store status line
- * @response_code: HTTP status code (200, 403, 404, 405)
+ * @response_code: HTTP status code (200, 206, 304, 400, 403, 404, 405, 414,
+ *                 416, 429, 431)
  *
  * Return: 0 on success, -1 on unsupported status code
  */
@@ -28,9 +40,16 @@ static int get_response_code_msg(char response_code_msg[MAX_RESPONSE_CODE],
   static const struct response_code
       response_code_associations[NUM_OF_RESPONSE_CODES] = {
           {200, "HTTP/1.1 200 OK"},
+          {206, "HTTP/1.1 206 Partial Content"},
+          {304, "HTTP/1.1 304 Not Modified"},
+          {400, "HTTP/1.1 400 Bad Request"},
           {403, "HTTP/1.1 403 Forbidden"},
           {404, "HTTP/1.1 404 Not Found"},
-          {405, "HTTP/1.1 405 Method Not Allowed"}};
+          {405, "HTTP/1.1 405 Method Not Allowed"},
+          {414, "HTTP/1.1 414 URI Too Long"},
+          {416, "HTTP/1.1 416 Range Not Satisfiable"},
+          {429, "HTTP/1.1 429 Too Many Requests"},
+          {431, "HTTP/1.1 431 Request Header Fields Too Large"}};
 
   /*
    * Since the array is very small, linear search is fine.
@@ -50,84 +69,143 @@ static int get_response_code_msg(char response_code_msg[MAX_RESPONSE_CODE],
 }
 
 /**
- * construct_header - Build complete HTTP response header
+ * append_to_header - Append a line to a header being built
+ * @header: Header buffer of MAX_HEADER bytes
+ * @remaining_header_space: Space left in header, updated as lines are added
+ * @line: Text to append
+ *
+ * Return: 0 on success, -1 if the line doesn't fit
+ */
+static int append_to_header(char *header, size_t *remaining_header_space,
+                            const char *line) {
+  size_t line_length = strlen(line);
+
+  /*
+   * Make sure we have room for the null terminator as well as the line.
+   */
+  if (line_length >= *remaining_header_space) {
+    log_event(ERROR, "Header overflow.");
+    return -1;
+  }
+
+  size_t header_length = MAX_HEADER - *remaining_header_space;
+  memcpy(header + header_length, line, line_length + NULL_TERMINATOR_LENGTH);
+  *remaining_header_space -= line_length;
+
+  return 0;
+}
+
+/**
+ * format_header - Write complete HTTP response header into a buffer
+ * @header: Buffer to write the header into
  * @response_code: HTTP status code (200, 403, 404, 405)
  * @file_request: Path to file being sent (for Content-Type)
+ * @content_length: Size of the response body in bytes
+ * @keep_alive: Whether we'll keep the connection open after this response
+ * @extra_headers: Further header lines to include, or NULL
  *
  * Constructs the complete HTTP response header including the status line,
- * server name, Content-Type, and a blank line that indicates the header has
- * ended.
+ * server name, Content-Type, Content-Length, Connection, and a blank line that
+ * indicates the header has ended. Successful responses also carry
+ * Accept-Ranges, which tells the client it may ask for part of the file.
  *
- * Return: Allocated string containing header, or NULL on error
+ * 304 responses have no body, and describe the copy of the file the client
+ * already has, so they leave out Content-Type and Content-Length.
+ *
+ * Content-Length is what makes keep-alive possible. Without it, the only way
+ * the client can tell where the body ends is by us closing the connection.
+ *
+ * Return: 0 on success, -1 if the header doesn't fit or the response code is
+ * unknown
  */
-char *construct_header(int response_code, const char *file_request) {
+int format_header(char header[MAX_HEADER], int response_code,
+                  const char *file_request, size_t content_length,
+                  bool keep_alive, const char *extra_headers) {
   static const char *server_name = "Server: Cyllenian\r\n";
 
-  /*
-   * Most headers are around 100 bytes, so we're being overly cautious in
-   * allocating 1KB.
-   */
-  char *header = malloc(MAX_HEADER);
-  if (!header) {
-    log_event(ERROR, "Failed to allocate memory for header.");
-    return NULL;
-  }
+  header[0] = '\0';
 
   char response_code_msg[MAX_RESPONSE_CODE];
   if (get_response_code_msg(response_code_msg, response_code) == -1) {
-    free(header);
-    return NULL;
+    return -1;
   };
 
   /*
-   * Track remaining space in header buffer.
-   *
-   * We decrement this as we add each header line to ensure that we're not
-   * overflowing the buffer.
+   * Determine Content-Type based on file extension.
    */
-  size_t remaining_header_space = MAX_HEADER;
-  size_t response_code_msg_length = strlen(response_code_msg);
-
-  if (response_code_msg_length < remaining_header_space) {
-    snprintf(header, MAX_HEADER, "%s", response_code_msg);
-    remaining_header_space -= response_code_msg_length;
-  } else {
-    log_event(ERROR, "Header overflow.");
-    free(header);
-    return NULL;
+  const char *content_type = "";
+  char content_length_line[MAX_CONTENT_LENGTH] = "";
+  if (response_code != 304) {
+    content_type = mime_lookup(file_request)->header;
+    snprintf(content_length_line, MAX_CONTENT_LENGTH,
+             "Content-Length: %zu\r\n", content_length);
   }
 
+  const char *connection_line =
+      keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+
+  const char *accept_ranges_line =
+      response_code == 200 || response_code == 206 ? "Accept-Ranges: bytes\r\n"
+                                                   : "";
+
   /*
-   * Append Server header.
+   * Track remaining space in header buffer.
    *
-   * strncat() appends server_name to header, ensuring we don't
-   * exceed MAX_HEADER total length.
+   * append_to_header() decrements this as we add each header line to ensure
+   * that we're not overflowing the buffer.
    */
-  strncat(header, server_name, strlen(server_name));
+  size_t remaining_header_space = MAX_HEADER;
 
   /*
-   * Determine Content-Type based on file extension.
-   *
-   * Note: get_content_type() includes the final \r\n\r\n that marks
-   * the end of headers in its output.
+   * The final CRLF on its own is the blank line that ends the header.
    */
-  char content_type[MAX_CONTENT_TYPE];
-  get_content_type(content_type, file_request);
+  if (append_to_header(header, &remaining_header_space, response_code_msg) ==
+          -1 ||
+      append_to_header(header, &remaining_header_space, server_name) == -1 ||
+      append_to_header(header, &remaining_header_space, content_type) == -1 ||
+      append_to_header(header, &remaining_header_space, content_length_line) ==
+          -1 ||
+      append_to_header(header, &remaining_header_space, accept_ranges_line) ==
+          -1 ||
+      append_to_header(header, &remaining_header_space,
+                       extra_headers ? extra_headers : "") == -1 ||
+      append_to_header(header, &remaining_header_space, connection_line) ==
+          -1 ||
+      append_to_header(header, &remaining_header_space, "\r\n") == -1) {
+    return -1;
+  }
 
-  const size_t content_type_length = strlen(content_type);
+  return 0;
+}
 
+/**
+ * construct_header - Build complete HTTP response header
+ * @response_code: HTTP status code (200, 403, 404, 405)
+ * @file_request: Path to file being sent (for Content-Type)
+ * @content_length: Size of the response body in bytes
+ * @keep_alive: Whether we'll keep the connection open after this response
+ * @extra_headers: Further header lines to include, or NULL
+ *
+ * The same as format_header(), but allocates the header, for headers that
+ * are kept for as long as the file is cached.
+ *
+ * Return: Allocated string containing header, or NULL on error
+ */
+char *construct_header(int response_code, const char *file_request,
+                       size_t content_length, bool keep_alive,
+                       const char *extra_headers) {
   /*
-   * Append Content-Type header if there's space, making sure we have room for
-   * the null terminator that strncat appends.
+   * Most headers are around 100 bytes, so we're being overly cautious in
+   * allocating 1KB.
    */
-  if (content_type_length < remaining_header_space) {
-    if (content_type[0] != '\0') {
-      strncat(header, content_type,
-              remaining_header_space - NULL_TERMINATOR_LENGTH);
-    }
-    remaining_header_space -= content_type_length;
-  } else {
-    log_event(ERROR, "Header overflow.");
+  char *header = malloc(MAX_HEADER);
+  if (!header) {
+    log_event(ERROR, "Failed to allocate memory for header.");
+    return NULL;
+  }
+
+  if (format_header(header, response_code, file_request, content_length,
+                    keep_alive, extra_headers) == -1) {
     free(header);
     return NULL;
   }
@@ -136,244 +214,661 @@ char *construct_header(int response_code, const char *file_request) {
 }
 
 /**
- * isolate_file_request - Extract file path from HTTP request
- * @request_buffer: Complete HTTP request from client
+ * has_connection_option - Check the Connection header for an option
+ * @value: Value of the Connection header
+ * @value_length: Length of value
+ * @option: Option to look for (e.g., "close")
  *
- * Parses the HTTP request line to extract the requested file path.
+ * The Connection header holds a comma-separated list of options, which are
+ * case-insensitive like header names.
  *
- * Return: Pointer to extracted path, or NULL if invalid format
+ * Return: true if the option is in the list
  */
-static char *isolate_file_request(char *request_buffer) {
-  if (!request_buffer) {
-    log_event(ERROR, "NULL request_buffer was passed to isolate_file_request.");
-    return NULL;
+static bool has_connection_option(const char *value, size_t value_length,
+                                  const char *option) {
+  size_t option_length = strlen(option);
+  const char *end = value + value_length;
+
+  while (value < end) {
+    while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+      value++;
+    }
+
+    const char *token = value;
+    while (value < end && *value != ',' && *value != ' ' && *value != '\t') {
+      value++;
+    }
+
+    if ((size_t)(value - token) == option_length &&
+        strncasecmp(token, option, option_length) == 0) {
+      return true;
+    }
   }
 
-  /*
-   * We advance the pointer by METHOD_LENGTH, which is set to five because that
-   * is the length of the longest method we support, to reach the path to the
-   * requested file.
-   */
-  char *file_request = request_buffer + METHOD_LENGTH;
+  return false;
+}
 
+/**
+ * request_wants_keep_alive - Decide whether to keep the connection open
+ * @request: Parsed request from client
+ *
+ * Return: true if the connection should be kept open after responding
+ */
+bool request_wants_keep_alive(const struct http_request *request) {
   /*
-   * The next space is where the file path ends, so we terminate the string
-   * there.
+   * Anything older than HTTP/1.1 defaults to closing.
    */
-  char *space_position = strchr(file_request, ' ');
-  if (space_position) {
-    *space_position = '\0';
+  bool is_http_1_0 = request->version_minor == 0;
+
+  size_t value_length = request->connection.length;
+  const char *value = request->connection.data;
+
+  if (!value) {
+    return !is_http_1_0;
   }
 
-  /*
-   * We don't allow a trailing slash to avoid ambiguity over whether the user is
-   * requesting a file or a directory (which we don't support).
-   */
-  if (file_request[strlen(file_request) - 1] == '/') {
-    return NULL;
+  if (has_connection_option(value, value_length, "close")) {
+    return false;
+  }
+
+  if (is_http_1_0) {
+    return has_connection_option(value, value_length, "keep-alive");
   }
 
-  return file_request;
+  return true;
 }
 
 /**
- * get_method - Extract and validate HTTP method from request
- * @request_buffer: Complete HTTP request from client
+ * format_http_date - Format a time the way HTTP headers expect
+ * @date: Output buffer of HTTP_DATE_MAX bytes
+ * @time: Seconds since the epoch
  *
- * Return: Pointer to method string ("GET" or "HEAD"), or NULL if unsupported
+ * HTTP dates always look like "Sun, 06 Nov 1994 08:49:37 GMT". gmtime_r()
+ * converts to GMT whatever the server's timezone is, and is safe to call
+ * concurrently unlike gmtime().
  */
-static const char *get_method(const char *request_buffer) {
+void format_http_date(char date[HTTP_DATE_MAX], time_t time) {
+  static const char *days[] = {"Sun", "Mon", "Tue", "Wed",
+                               "Thu", "Fri", "Sat"};
+  static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
   /*
-   * Check if the request begins with GET
+   * We spell out the day and month names ourselves rather than using
+   * strftime()'s %a and %b, since those follow the locale and HTTP dates must
+   * be in English.
    */
-  if (strncmp(request_buffer, "GET", 3) == 0) {
-    return "GET";
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  snprintf(date, HTTP_DATE_MAX, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+           days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900,
+           tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/**
+ * parse_byte_position - Parse one end of a byte range
+ * @start: Start of the number
+ * @end: End of the number
+ * @position: Output parameter for the number
+ *
+ * Unlike strtoull(), this rejects signs, whitespace and empty numbers, none of
+ * which are allowed in a Range header.
+ *
+ * Return: 0 on success, -1 if the text isn't a number or is too large
+ */
+static int parse_byte_position(const char *start, const char *end,
+                               size_t *position) {
+  if (start == end) {
+    return -1;
   }
 
-  /*
-   * HEAD is like GET but we only send the headers, not the file body.
-   */
-  if (strncmp(request_buffer, "HEAD", 4) == 0) {
-    return "HEAD";
+  size_t value = 0;
+  for (const char *c = start; c < end; c++) {
+    if (*c < '0' || *c > '9') {
+      return -1;
+    }
+
+    size_t digit = (size_t)(*c - '0');
+    if (value > (SIZE_MAX - digit) / 10) {
+      return -1;
+    }
+    value = value * 10 + digit;
   }
 
-  /*
-   * Unsupported method, we'll be sending 405.
-   */
-  return NULL;
+  *position = value;
+  return 0;
 }
 
 /**
- * handle_error_case - Replace requested path with error page
- * @file_request: Path buffer to update
- * @error_page: Error page filename (403.html, 404.html, 405.html)
+ * get_request_range - Work out which part of the file the client wants
+ * @request: Parsed request from client
+ * @file_size: Size of the file being requested
+ * @last_modified: When the file was last modified
+ * @range_start: Output parameter for the first byte to send
+ * @range_length: Output parameter for the number of bytes to send
  *
- * When a request fails validation, we serve an error page instead of the
- * requested file. This function updates the path to point to the appropriate
- * error page.
+ * A Range header looks like "Range: bytes=500-999", where both ends are
+ * inclusive. Either end may be left out: "bytes=500-" means from byte 500 to
+ * the end, and "bytes=-500" means the last 500 bytes.
  *
- * ERROR PAGE LOCATIONS:
- * Primary: ~/.local/share/cyllenian/website/404.html
- * Fallback: /etc/cyllenian/website/404.html
+ * Clients may ask for several ranges at once ("bytes=0-99,200-299"), but
+ * answering those takes a multipart response. Servers are allowed to ignore
+ * Range altogether, so we just send the whole file instead, as we do for
+ * anything we can't parse.
  *
- * Return: 0 on success, -1 on memory allocation failure
+ * If-Range holds the ETag or Last-Modified date the client got with the part
+ * of the file it already has. If the file has changed since, the part it
+ * wants no longer lines up with what it has, so we send the whole file. Weak
+ * ETags (W/"...") never match here, since they don't promise the bytes are
+ * the same.
+ *
+ * Return: How the request should be answered
  */
-static int handle_error_case(char **file_request, char *error_page) {
-  /*
-   * System-wide fallback location, this directory is created when running make
-   * install.
-   */
-  static const char *fallback_website_path = "/etc/cyllenian/website";
+enum range_result get_request_range(const struct http_request *request,
+                                    size_t file_size, const char *last_modified,
+                                    const char *etag, size_t *range_start,
+                                    size_t *range_length) {
+  size_t value_length = request->range.length;
+  const char *value = request->range.data;
+  if (!value) {
+    return RANGE_NONE;
+  }
+
+  size_t if_range_length = request->if_range.length;
+  const char *if_range = request->if_range.data;
+  if (if_range) {
+    const char *validator = *if_range == '"' ? etag : last_modified;
+    if (if_range_length != strlen(validator) ||
+        strncmp(if_range, validator, if_range_length) != 0) {
+      return RANGE_NONE;
+    }
+  }
+
+  static const char *unit = "bytes=";
+  size_t unit_length = strlen(unit);
+  if (value_length <= unit_length ||
+      strncasecmp(value, unit, unit_length) != 0) {
+    return RANGE_NONE;
+  }
+
+  const char *spec = value + unit_length;
+  const char *spec_end = value + value_length;
+  if (memchr(spec, ',', (size_t)(spec_end - spec))) {
+    return RANGE_NONE;
+  }
+
+  const char *dash = memchr(spec, '-', (size_t)(spec_end - spec));
+  if (!dash) {
+    return RANGE_NONE;
+  }
+
+  size_t first;
+  size_t last;
+
+  if (dash == spec) {
+    /*
+     * A suffix range, asking for the last so many bytes.
+     */
+    size_t suffix_length;
+    if (parse_byte_position(dash + 1, spec_end, &suffix_length) == -1) {
+      return RANGE_NONE;
+    }
+    if (suffix_length == 0 || file_size == 0) {
+      return RANGE_UNSATISFIABLE;
+    }
+
+    first = suffix_length < file_size ? file_size - suffix_length : 0;
+    last = file_size - 1;
+  } else {
+    if (parse_byte_position(spec, dash, &first) == -1) {
+      return RANGE_NONE;
+    }
+
+    if (dash + 1 == spec_end) {
+      last = file_size - 1;
+    } else if (parse_byte_position(dash + 1, spec_end, &last) == -1 ||
+               last < first) {
+      return RANGE_NONE;
+    }
+
+    if (first >= file_size) {
+      return RANGE_UNSATISFIABLE;
+    }
+
+    /*
+     * Asking for more than there is is fine, we just send up to the end.
+     */
+    if (last >= file_size) {
+      last = file_size - 1;
+    }
+  }
+
+  *range_start = first;
+  *range_length = last - first + 1;
+  return RANGE_SATISFIABLE;
+}
+
+/**
+ * parse_http_date - Parse an HTTP date
+ * @value: Date such as "Sun, 06 Nov 1994 08:49:37 GMT"
+ * @value_length: Length of value
+ * @time: Output parameter for seconds since the epoch
+ *
+ * HTTP also allows two obsolete date formats, but every client in use today
+ * sends this one. A date we can't parse just means we send the whole file.
+ *
+ * Return: 0 on success, -1 if the date isn't in the expected format
+ */
+static int parse_http_date(const char *value, size_t value_length,
+                           time_t *time) {
+  static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
 
   /*
-   * Since we are sending an error page, we no longer need the original request.
+   * Copy the value so that sscanf() can't read past the end of the header.
    */
-  free(*file_request);
-
-  *file_request = malloc(PATH_MAX);
-  if (!*file_request) {
-    char malloc_fail_msg[LOG_MSG_MAX];
-    snprintf(malloc_fail_msg, LOG_MSG_MAX,
-             "Memory allocation failed for file request: %s", strerror(errno));
-    log_event(ERROR, malloc_fail_msg);
+  char date[HTTP_DATE_MAX];
+  if (value_length >= HTTP_DATE_MAX) {
+    return -1;
+  }
+  memcpy(date, value, value_length);
+  date[value_length] = '\0';
+
+  struct tm tm = {0};
+  char month[4];
+  int consumed = 0;
+  if (sscanf(date, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT%n", &tm.tm_mday, month,
+             &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec,
+             &consumed) != 6 ||
+      (size_t)consumed != value_length) {
+    return -1;
+  }
+
+  tm.tm_mon = -1;
+  for (int i = 0; i < 12; i++) {
+    if (strcmp(month, months[i]) == 0) {
+      tm.tm_mon = i;
+      break;
+    }
+  }
+  if (tm.tm_mon == -1) {
     return -1;
   }
+  tm.tm_year -= 1900;
 
   /*
-   * This sets file_request to be ~/.local/share/cyllenian/website/, which we
-   * then append the error page to.
+   * timegm() is mktime() for GMT, which HTTP dates are always in.
    */
-  if (prepend_program_data_path(file_request, "website/") == -1) {
-    return -1;
+  *time = timegm(&tm);
+  return *time == -1 ? -1 : 0;
+}
+
+/**
+ * etag_list_matches - Check an If-None-Match list for an ETag
+ * @value: Value of the If-None-Match header
+ * @value_length: Length of value
+ * @etag: The file's current ETag
+ *
+ * If-None-Match holds a comma-separated list of ETags the client has copies
+ * for, or "*" meaning any version at all. The comparison is weak, so W/"x"
+ * matches "x": either way the client's copy will do.
+ *
+ * Return: true if the client has a copy of the current version
+ */
+static bool etag_list_matches(const char *value, size_t value_length,
+                              const char *etag) {
+  size_t etag_length = strlen(etag);
+  const char *end = value + value_length;
+
+  while (value < end) {
+    while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+      value++;
+    }
+
+    const char *token = value;
+    while (value < end && *value != ',' && *value != ' ' && *value != '\t') {
+      value++;
+    }
+    size_t token_length = (size_t)(value - token);
+
+    if (token_length == 1 && *token == '*') {
+      return true;
+    }
+
+    if (token_length > 2 && strncmp(token, "W/", 2) == 0) {
+      token += 2;
+      token_length -= 2;
+    }
+
+    if (token_length == etag_length &&
+        strncmp(token, etag, etag_length) == 0) {
+      return true;
+    }
   }
 
-  strcat(*file_request, error_page);
+  return false;
+}
+
+/**
+ * request_is_not_modified - Check whether the client's copy is current
+ * @request: Parsed request from client
+ * @etag: The file's current ETag
+ * @last_modified: The file's Last-Modified date
+ * @mtime: The file's modification time in seconds since the epoch
+ *
+ * Browsers and caches that have a copy of a file send its validators back
+ * with their next request for it. If the file hasn't changed we answer with
+ * 304 Not Modified and no body, which saves sending the whole file again.
+ *
+ * Return: true if the client should get a 304
+ */
+bool request_is_not_modified(const struct http_request *request,
+                             const char *etag, const char *last_modified,
+                             time_t mtime) {
+  size_t value_length = request->if_none_match.length;
+  const char *value = request->if_none_match.data;
+  if (value) {
+    return etag_list_matches(value, value_length, etag);
+  }
+
+  value_length = request->if_modified_since.length;
+  value = request->if_modified_since.data;
+  if (!value) {
+    return false;
+  }
 
   /*
-   * Check if the user has put a custom error page in their website directory
-   * for this particular error. If not, use the one in the etc dir.
+   * Clients almost always send back exactly the date we gave them, which
+   * saves us parsing it.
    */
-  if (!file_exists(*file_request)) {
-    free(*file_request);
-    *file_request = malloc(PATH_MAX);
-    if (!*file_request) {
-      char malloc_fail_msg[LOG_MSG_MAX];
-      snprintf(malloc_fail_msg, LOG_MSG_MAX,
-               "Memory allocation failed for file request: %s",
-               strerror(errno));
-      log_event(ERROR, malloc_fail_msg);
-      return -1;
+  if (value_length == strlen(last_modified) &&
+      strncmp(value, last_modified, value_length) == 0) {
+    return true;
+  }
+
+  time_t since;
+  if (parse_http_date(value, value_length, &since) == -1) {
+    return false;
+  }
+  return mtime <= since;
+}
+
+/**
+ * is_zero_quality - Check whether an Accept-Encoding entry refuses its coding
+ * @params: Text after the coding's name, up to the next comma
+ * @params_length: Length of params
+ *
+ * Parameters look like ";q=0.5". Any q-value will do for us except zero
+ * (written as "0", "0.0", "0.000" and so on), which means "not acceptable".
+ *
+ * Return: true if the entry has a q-value of zero
+ */
+static bool is_zero_quality(const char *params, size_t params_length) {
+  const char *end = params + params_length;
+  const char *q = params;
+
+  while (q < end && *q != 'q' && *q != 'Q') {
+    q++;
+  }
+  if (end - q < 2 || q[1] != '=') {
+    return false;
+  }
+
+  for (q += 2; q < end && *q != ' ' && *q != '\t' && *q != ';'; q++) {
+    if (*q != '0' && *q != '.') {
+      return false;
     }
+  }
+  return true;
+}
 
-    /*
-     * We zero out the buffer entirely before saving the path to it to ensure
-     * that no data from previous writes remains.
-     */
-    memset(*file_request, 0, PATH_MAX);
+/**
+ * get_accepted_encodings - Find which compressed encodings a client accepts
+ * @request: Parsed request from client
+ * @gzip: Output parameter, whether gzip is acceptable
+ * @brotli: Output parameter, whether br is acceptable
+ *
+ * Accept-Encoding is a comma-separated list such as "gzip, deflate, br",
+ * where each coding may carry a q-value giving the client's preference. We
+ * send whichever encoding makes the smaller file rather than going by the
+ * client's preference, so all we need to know is whether each is refused.
+ * "*" stands for every coding not listed by name, and "x-gzip" is an old name
+ * for gzip.
+ */
+void get_accepted_encodings(const struct http_request *request, bool *gzip,
+                            bool *brotli) {
+  *gzip = false;
+  *brotli = false;
+
+  size_t value_length = request->accept_encoding.length;
+  const char *value = request->accept_encoding.data;
+  if (!value) {
+    return;
+  }
+
+  bool gzip_listed = false;
+  bool brotli_listed = false;
+  bool wildcard = false;
+  const char *end = value + value_length;
+
+  while (value < end) {
+    while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+      value++;
+    }
+
+    const char *coding = value;
+    while (value < end && *value != ',' && *value != ';' && *value != ' ' &&
+           *value != '\t') {
+      value++;
+    }
+    size_t coding_length = (size_t)(value - coding);
+
+    const char *params = value;
+    while (value < end && *value != ',') {
+      value++;
+    }
+    bool accepted = !is_zero_quality(params, (size_t)(value - params));
+
+    if ((coding_length == 4 && strncasecmp(coding, "gzip", 4) == 0) ||
+        (coding_length == 6 && strncasecmp(coding, "x-gzip", 6) == 0)) {
+      gzip_listed = true;
+      *gzip = accepted;
+    } else if (coding_length == 2 && strncasecmp(coding, "br", 2) == 0) {
+      brotli_listed = true;
+      *brotli = accepted;
+    } else if (coding_length == 1 && *coding == '*') {
+      wildcard = accepted;
+    }
+  }
+
+  if (!gzip_listed) {
+    *gzip = wildcard;
+  }
+  if (!brotli_listed) {
+    *brotli = wildcard;
+  }
+}
+
+/**
+ * check_website_file - Check whether a file to be served can be served
+ * @file_path: Full path to the file
+ *
+ * With the website index enabled, regular files in the website directory are
+ * looked up in the index. Anything else is opened through the open file
+ * cache, which both checks that it's a regular file we're allowed to serve
+ * and leaves it open for loading it into the content cache straight after.
+ *
+ * Return: 0 if the file can be served, otherwise the errno saying why not
+ */
+static int check_website_file(const char *file_path) {
+  const struct route *route;
+  if (route_index_lookup(file_path, &route)) {
+    return route ? 0 : ENOENT;
+  }
 
-    snprintf(*file_request, PATH_MAX, "%s/%s", fallback_website_path,
-             error_page);
+  struct open_file *file = fd_cache_open(file_path);
+  if (!file) {
+    return errno;
   }
+  fd_cache_release(file);
   return 0;
 }
 
 /**
  * determine_response_code - Validate request and determine HTTP status
- * @request_buffer: Complete HTTP request from client
- * @file_request: Path to requested file (may be modified to error page)
+ * @request: Parsed request from client
+ * @parse_result: How parsing the request went
+ * @path_result: How sanitizing the requested path went
+ * @file_request: Path to requested file
  * @response_code: Output parameter for HTTP status code
  *
  * This is the core validation function. It performs several security checks
- * and determines what to send back to the client:
- *
- * Return: 0 on success (even if returning error code), -1 on fatal error
+ * and determines what to send back to the client. Errors are answered with
+ * the responses error_page.c has ready, so only 200 needs the file.
  */
-int determine_response_code(const char *request_buffer, char **file_request,
-                            int *response_code) {
-  const char *method = get_method(request_buffer);
-  if (!method) {
+void determine_response_code(const struct http_request *request,
+                             enum parse_result parse_result,
+                             enum path_result path_result,
+                             const char *file_request, int *response_code) {
+  /*
+   * 400 Bad Request for anything that isn't valid HTTP, 414 URI Too Long for
+   * overlong paths, and 431 Request Header Fields Too Large for requests over
+   * our other size limits.
+   */
+  if (parse_result == PARSE_BAD_REQUEST) {
+    *response_code = 400;
+    return;
+  }
+  if (parse_result == PARSE_URI_TOO_LONG) {
+    *response_code = 414;
+    return;
+  }
+  if (parse_result == PARSE_TOO_LARGE) {
+    *response_code = 431;
+    return;
+  }
+
+  if (request->method == METHOD_OTHER) {
     /*
      * 405 Method Not Allowed.
      */
     *response_code = 405;
-    return handle_error_case(file_request, "405.html");
+    return;
   }
 
   /*
-   * Remove consecutive slashes, trailing slash, and ensure null termination of
-   * request string.
+   * A percent sign in the path that isn't followed by two hexadecimal digits
+   * makes the path meaningless, so that's a bad request too.
    */
-  normalize_request_path(*file_request);
+  if (path_result == PATH_BAD_ENCODING) {
+    *response_code = 400;
+    return;
+  }
 
   /*
    * Directory traversal attacks attempt to access files outside the
-   * website directory by using ../ in the path.
+   * website directory by using ../ in the path. The path was checked once it
+   * had been decoded, so this catches however the ".." was encoded.
    *
    * If detected, return 403 Forbidden instead of allowing the request.
    */
-  if (contains_traversal_patterns(*file_request)) {
+  if (path_result == PATH_TRAVERSAL) {
     *response_code = 403;
-    return handle_error_case(file_request, "403.html");
+    return;
   }
 
-  if (!file_exists(*file_request)) {
+  /*
+   * If we've recently served this file from the cache we already know it
+   * exists, which saves a lookup on every cache hit.
+   */
+  int file_error = 0;
+  if (!cache_is_fresh(file_request, 200)) {
+    file_error = check_website_file(file_request);
+  }
+
+  /*
+   * A symbolic link leading out of the website directory (EXDEV from
+   * openat2()) is as much an attempt to read a file we don't serve as "..",
+   * and so is a file we aren't permitted to read.
+   */
+  if (file_error == EXDEV || file_error == EACCES) {
+    *response_code = 403;
+    return;
+  }
+
+  if (file_error != 0) {
     /*
      * File not found, return 404. This is the most common error to see due to
      * mistyping or the user having bookmarked a page that has been moved.
      */
     *response_code = 404;
-    return handle_error_case(file_request, "404.html");
+    return;
   }
 
   /*
    * All good, 200 OK
    */
   *response_code = 200;
-
-  return 0;
 }
 
 /**
  * get_requested_file_path - Build full filesystem path from HTTP request
  * @path_buffer: Output buffer for full path
- * @request_buffer: Complete HTTP request from client
+ * @request: Parsed request from client
+ * @website_path: Directory of the website the request is for
+ * @path_result: Output parameter, whether the path is safe to serve
+ *
+ * Converts the path from the request into a full filesystem path by
+ * prepending the website directory to it. The query string isn't part of the
+ * path, so it plays no part in which file we send.
  *
- * Converts the HTTP request path into a full filesystem path by extracting the
- * path from the request and prepending the website directory to it.
+ * The path is percent-decoded and checked for directory traversal on the way
+ * into path_buffer, and path_result says how that went. Unless it's PATH_OK,
+ * path_buffer is left holding something other than the requested file.
  *
  * Return: 0 on success, -1 on failure
  */
-int get_requested_file_path(char **path_buffer, char *request_buffer) {
+int get_requested_file_path(char **path_buffer,
+                            const struct http_request *request,
+                            const char *website_path,
+                            enum path_result *path_result) {
+  const char *file_request = request->path.data;
+  size_t file_request_length = request->path.length;
+
   /*
-   * Duplicate request buffer so we can modify it without affecting the
-   * original. strdup() allocates new memory, so we'll need to free it when
-   * we're done using it.
+   * We don't allow a trailing slash to avoid ambiguity over whether the user is
+   * requesting a file or a directory (which we don't support). Requests we
+   * couldn't parse have no path at all. Either way we look for 404.html.
    */
-  char *file_request_buffer = strdup(request_buffer);
-  if (!file_request_buffer) {
-    log_event(ERROR, "Failed to duplicate file_request");
-    return -1;
-  }
-
-  char *file_request = isolate_file_request(file_request_buffer);
-  if (!file_request) {
-    /*
-     * Malformed requests result in 404 rather than a crash.
-     */
+  if (!file_request || file_request[file_request_length - 1] == '/') {
     file_request = "404.html";
+    file_request_length = strlen(file_request);
   }
 
   /*
-   * This gives ~/.local/share/cyllenian/website/, which we'll then append the
-   * requested path to.
+   * This is ~/.local/share/cyllenian/website/ for the default website, which
+   * we'll then append the requested path to.
    */
-  if (prepend_program_data_path(path_buffer, "website/") == -1) {
+  size_t prefix_length = strlen(website_path);
+  memcpy(*path_buffer, website_path, prefix_length);
+
+  size_t sanitized_length = 0;
+  *path_result = sanitize_request_path(
+      *path_buffer + prefix_length, PATH_MAX - prefix_length, file_request,
+      file_request_length, &sanitized_length);
+  if (*path_result == PATH_TOO_LONG) {
+    log_event(ERROR, "Requested path is too long.");
     return -1;
   }
 
-  strcat(*path_buffer, file_request);
-
-  free(file_request_buffer);
+  /*
+   * A path that normalizes to nothing at all, such as "/.", names the website
+   * directory itself, which we treat the same as "/".
+   */
+  if (*path_result == PATH_OK && sanitized_length == 0) {
+    snprintf(*path_buffer + prefix_length, PATH_MAX - prefix_length,
+             "404.html");
+  }
 
   return 0;
 }
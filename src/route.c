@@ -0,0 +1,444 @@
+/**
+ * route.c
+ *
+ * Index of the files in the website directory.
+ *
+ * OVERVIEW:
+ * Without the index, every request that misses the cache costs a stat() to
+ * find out whether the file exists, and every 404 costs two, one for the file
+ * and one for the error page. The cache also stat()s each file it holds once a
+ * second to see whether it has changed.
+ *
+ * With the index enabled, each worker walks the website directory once when
+ * it starts, and records every file it finds in a hash table keyed by the
+ * file's path. Whether a file exists, and whether a cached copy of it is
+ * current, are then answered from memory.
+ *
+ * KEEPING UP TO DATE:
+ * Every directory we index is watched with inotify, which makes the inotify
+ * descriptor readable whenever a file in one of them is created, removed,
+ * renamed or written. The event loop waits on the descriptor along with the
+ * client sockets, and when it's readable we walk the directory again and
+ * replace the index. Websites change rarely and are small enough to walk in
+ * a few milliseconds, so rebuilding the whole index is simpler and safer than
+ * working out what each notification changed.
+ *
+ * If the index can't be kept up to date, for instance because the system's
+ * limit on inotify watches has been reached, it's dropped and we go back to
+ * checking the filesystem as usual.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "paths.h"
+#include "route.h"
+
+/**
+ * The changes we want to hear about in each watched directory: anything that
+ * changes which files exist or what's in them.
+ */
+#define ROUTE_WATCH_EVENTS                                                     \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY |          \
+   IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/**
+ * struct route_table - A hash table of routes
+ * @buckets: Chains of routes, indexed by hash
+ * @num_buckets: Number of buckets, always a power of two
+ * @num_routes: Number of routes in the table
+ */
+struct route_table {
+  struct route **buckets;
+  size_t num_buckets;
+  size_t num_routes;
+};
+
+/*
+ * The current index, and the inotify descriptor that keeps it current. The
+ * index is only in use while the descriptor is open.
+ */
+static struct route_table routes = {NULL, 0, 0};
+static int inotify_fd = -1;
+
+/*
+ * The website directory, with its trailing slash, which every indexed path
+ * is relative to.
+ */
+static const char *website_path = NULL;
+static size_t website_length = 0;
+
+/**
+ * hash_path - Hash a path relative to the website directory
+ * @path: Path to hash
+ *
+ * FNV-1a, the same hash the cache uses.
+ *
+ * Return: 32-bit hash
+ */
+static uint32_t hash_path(const char *path) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * table_free - Free a table and every route in it
+ * @table: Table to free
+ */
+static void table_free(struct route_table *table) {
+  for (size_t i = 0; i < table->num_buckets; i++) {
+    struct route *route = table->buckets[i];
+    while (route) {
+      struct route *next = route->next;
+      free(route->path);
+      free(route);
+      route = next;
+    }
+  }
+  free(table->buckets);
+  table->buckets = NULL;
+  table->num_buckets = 0;
+  table->num_routes = 0;
+}
+
+/**
+ * table_grow - Double the number of buckets in a table
+ * @table: Table that has more routes than buckets
+ *
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int table_grow(struct route_table *table) {
+  size_t new_num_buckets = table->num_buckets * 2;
+  struct route **new_buckets = calloc(new_num_buckets, sizeof(*new_buckets));
+  if (!new_buckets) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < table->num_buckets; i++) {
+    struct route *route = table->buckets[i];
+    while (route) {
+      struct route *next = route->next;
+      size_t bucket = route->hash & (new_num_buckets - 1);
+      route->next = new_buckets[bucket];
+      new_buckets[bucket] = route;
+      route = next;
+    }
+  }
+
+  free(table->buckets);
+  table->buckets = new_buckets;
+  table->num_buckets = new_num_buckets;
+  return 0;
+}
+
+/**
+ * table_add - Add a file to a table
+ * @table: Table being built
+ * @path: Path of the file relative to the website directory
+ * @file_stat: The file's metadata
+ * @watched: Whether changes to the file are reported by inotify
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int table_add(struct route_table *table, const char *path,
+                     const struct stat *file_stat, bool watched) {
+  if (table->num_routes >= ROUTE_MAX_FILES) {
+    log_event(WARN, "Too many files in the website directory to index.");
+    return -1;
+  }
+  if (table->num_routes >= table->num_buckets && table_grow(table) == -1) {
+    log_event(ERROR, "Failed to allocate memory for the website index.");
+    return -1;
+  }
+
+  struct route *route = malloc(sizeof(*route));
+  if (!route || !(route->path = strdup(path))) {
+    free(route);
+    log_event(ERROR, "Failed to allocate memory for the website index.");
+    return -1;
+  }
+
+  route->hash = hash_path(path);
+  route->mtime = file_stat->st_mtim;
+  route->size = file_stat->st_size;
+  route->dev = file_stat->st_dev;
+  route->ino = file_stat->st_ino;
+  route->watched = watched;
+
+  size_t bucket = route->hash & (table->num_buckets - 1);
+  route->next = table->buckets[bucket];
+  table->buckets[bucket] = route;
+  table->num_routes++;
+  return 0;
+}
+
+/**
+ * index_directory - Watch a directory and add the files in it to a table
+ * @table: Table being built
+ * @path: Buffer holding the directory's full path with a trailing slash,
+ *        PATH_MAX bytes long
+ * @length: Length of the path in the buffer
+ * @depth: How many directories below the website directory this is
+ *
+ * Subdirectories are indexed recursively, with their paths built onto the end
+ * of the same buffer. A subdirectory that disappears or can't be read while
+ * we're walking it is skipped, since we couldn't serve anything from it
+ * anyway, and if it comes back we'll be told.
+ *
+ * Return: 0 on success, -1 if the index can't be built
+ */
+static int index_directory(struct route_table *table, char *path,
+                           size_t length, int depth) {
+  if (inotify_add_watch(inotify_fd, path, ROUTE_WATCH_EVENTS) == -1) {
+    if (depth > 0 && (errno == ENOENT || errno == EACCES)) {
+      return 0;
+    }
+    char watch_fail_msg[LOG_MSG_MAX];
+    snprintf(watch_fail_msg, LOG_MSG_MAX,
+             "Failed to watch website directory for changes: %s",
+             strerror(errno));
+    log_event(WARN, watch_fail_msg);
+    return -1;
+  }
+
+  DIR *dir = opendir(path);
+  if (!dir) {
+    if (depth > 0 && (errno == ENOENT || errno == EACCES)) {
+      return 0;
+    }
+    log_event(WARN, "Failed to open website directory for indexing.");
+    return -1;
+  }
+
+  int result = 0;
+  struct dirent *dirent;
+  while ((dirent = readdir(dir))) {
+    const char *name = dirent->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      continue;
+    }
+
+    /*
+     * Leave room for the slash after a directory name and the null
+     * terminator. A path too long to fit is too long to be requested anyway.
+     */
+    size_t name_length = strlen(name);
+    if (length + name_length + 2 > PATH_MAX) {
+      continue;
+    }
+    memcpy(path + length, name, name_length + 1);
+
+    /*
+     * fstatat() looks the name up relative to the directory we already have
+     * open, and without AT_SYMLINK_NOFOLLOW it follows symbolic links like
+     * any other lookup would.
+     */
+    struct stat link_stat;
+    struct stat file_stat;
+    if (fstatat(dirfd(dir), name, &link_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+      continue;
+    }
+    if (fstatat(dirfd(dir), name, &file_stat, 0) == -1) {
+      /*
+       * A link to a file that doesn't exist (yet) still goes in the index, as
+       * a file that isn't watched, so that lookups check whether it has
+       * appeared since.
+       */
+      if (S_ISLNK(link_stat.st_mode) &&
+          table_add(table, path + website_length, &link_stat, false) == -1) {
+        result = -1;
+        break;
+      }
+      continue;
+    }
+
+    if (S_ISDIR(file_stat.st_mode)) {
+      if (depth + 1 >= ROUTE_MAX_DEPTH) {
+        continue;
+      }
+      path[length + name_length] = '/';
+      path[length + name_length + 1] = '\0';
+      if (index_directory(table, path, length + name_length + 1, depth + 1) ==
+          -1) {
+        result = -1;
+        break;
+      }
+    } else if (S_ISREG(file_stat.st_mode)) {
+      if (table_add(table, path + website_length, &file_stat,
+                    !S_ISLNK(link_stat.st_mode)) == -1) {
+        result = -1;
+        break;
+      }
+    }
+  }
+
+  closedir(dir);
+  path[length] = '\0';
+  return result;
+}
+
+/**
+ * build_table - Index the whole website directory
+ * @table: Table to fill in
+ *
+ * Return: 0 on success, -1 on failure (table is left empty)
+ */
+static int build_table(struct route_table *table) {
+  table->buckets = calloc(ROUTE_INITIAL_BUCKETS, sizeof(*table->buckets));
+  if (!table->buckets) {
+    log_event(ERROR, "Failed to allocate memory for the website index.");
+    return -1;
+  }
+  table->num_buckets = ROUTE_INITIAL_BUCKETS;
+  table->num_routes = 0;
+
+  char path[PATH_MAX];
+  memcpy(path, website_path, website_length + 1);
+  if (index_directory(table, path, website_length, 0) == -1) {
+    table_free(table);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * drop_index - Stop using the index
+ *
+ * Closing the inotify descriptor removes its watches, and removes it from the
+ * event loop's epoll instance.
+ */
+static void drop_index(void) {
+  table_free(&routes);
+  if (inotify_fd != -1) {
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+}
+
+/**
+ * route_index_init - Build the index of the website directory
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int route_index_init(void) {
+  website_path = get_website_path();
+  if (!website_path) {
+    return -1;
+  }
+  website_length = strlen(website_path);
+
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd == -1) {
+    log_event(WARN, "Failed to create inotify instance for website index.");
+    return -1;
+  }
+
+  if (build_table(&routes) == -1) {
+    drop_index();
+    log_event(WARN, "Not indexing the website directory.");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * route_index_fd - Get the descriptor to wait on for changes
+ *
+ * Return: The inotify descriptor, or -1 if there's no index
+ */
+int route_index_fd(void) { return inotify_fd; }
+
+/**
+ * route_index_refresh - Rebuild the index after the website has changed
+ *
+ * All pending notifications are read first, so that a batch of changes (such
+ * as a deploy copying in a new version of the site) only costs one rebuild
+ * per event loop iteration.
+ */
+void route_index_refresh(void) {
+  if (inotify_fd == -1) {
+    return;
+  }
+
+  /*
+   * inotify_event has a variable length name on the end, and the kernel
+   * writes events into the buffer one after another, so it has to be aligned
+   * for the struct.
+   */
+  _Alignas(struct inotify_event) char buffer[4096];
+  for (;;) {
+    ssize_t bytes_read = read(inotify_fd, buffer, sizeof(buffer));
+    if (bytes_read <= 0) {
+      break;
+    }
+
+    /*
+     * A watched directory that's been moved is now somewhere else, which is
+     * no longer anything to do with us. It's watched again under its new
+     * path if it's still inside the website directory.
+     */
+    for (char *p = buffer; p < buffer + bytes_read;) {
+      struct inotify_event *event = (struct inotify_event *)p;
+      if (event->mask & IN_MOVE_SELF) {
+        inotify_rm_watch(inotify_fd, event->wd);
+      }
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+
+  struct route_table table;
+  if (build_table(&table) == -1) {
+    drop_index();
+    log_event(WARN, "Website index could not be rebuilt, no longer using it.");
+    return;
+  }
+
+  table_free(&routes);
+  routes = table;
+}
+
+/**
+ * route_index_lookup - Look up a file in the index
+ * @file_path: Full path of the file
+ * @route: Output parameter for the file's route
+ *
+ * Return: true if the index has the answer for file_path, false if the
+ * filesystem has to be checked
+ */
+bool route_index_lookup(const char *file_path, const struct route **route) {
+  if (inotify_fd == -1 ||
+      strncmp(file_path, website_path, website_length) != 0 ||
+      file_path[website_length] == '\0') {
+    return false;
+  }
+
+  const char *relative_path = file_path + website_length;
+  uint32_t hash = hash_path(relative_path);
+
+  struct route *found = routes.buckets[hash & (routes.num_buckets - 1)];
+  while (found &&
+         (found->hash != hash || strcmp(found->path, relative_path) != 0)) {
+    found = found->next;
+  }
+
+  if (found && !found->watched) {
+    return false;
+  }
+
+  *route = found;
+  return true;
+}
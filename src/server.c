@@ -5,18 +5,49 @@
  * and client connection management.
  *
  * OVERVIEW:
- * This file implements a forking HTTPS server. Each incoming connection
- * spawns a new process to handle the client independently. This approach
- * provides process isolation - if one client causes a crash, other clients
- * continue unaffected.
+ * This file implements a pre-forking HTTPS server. A fixed pool of worker
+ * processes is forked at startup, and each worker runs an event loop that
+ * accepts and serves many connections at once. With reuseport each worker has
+ * a listening socket of its own, so the kernel deals connections out between
+ * them instead of every worker contending for one accept queue.
+ * This keeps the process isolation of forking - if one worker crashes, the
+ * others continue unaffected - without paying for a fork on every connection
+ * or tying up a whole process with each slow client.
  */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/evp.h>
+#include <openssl/provider.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#if defined(__aarch64__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
 
+#include "cache.h"
 #include "config.h"
+#include "error_page.h"
+#include "event.h"
+#include "limit.h"
 #include "log.h"
+#include "metrics.h"
+#include "mime.h"
+#include "ocsp.h"
 #include "server.h"
+#include "session.h"
+#include "vhost.h"
+#include "worker.h"
 
 /*
  * This is where we store the server variables that may need freed (or closed in
@@ -24,63 +55,72 @@
  */
 static struct server_ctx server = {0};
 
+/*
+ * What the server was started with, and the path of the executable as it was
+ * at startup, for starting a replacement on SIGUSR2. The path is looked up
+ * while we start because once a new version has been installed over it,
+ * /proc/self/exe refers to the old, deleted file.
+ */
+static char **server_argv = NULL;
+static char executable_path[PATH_MAX] = "";
+
 /**
  * server_ctx_init - Initialize server context with sentinel values
  *
- * Sets sockfd to -2 (not -1, because socket() returns that on error)
- * and SSL pointers to NULL. These sentinels allow server_cleanup() to
- * determine which resources have been initialized.
+ * Sets the number of listening sockets to 0 and the SSL context pointer to
+ * NULL. These sentinels allow server_cleanup() to determine which resources
+ * have been initialized.
  */
 void server_ctx_init(void) {
-  server.sockfd = -2;
-  server.ssl = NULL;
+  server.num_listen_fds = 0;
   server.ssl_ctx = NULL;
 }
 
 /**
  * server_cleanup - Free all server resources
  *
- * Cleans up SSL structures and closes socket.
- *
- * The order matters in this case. We free the connection before freeing the
- * context because the former depends on the latter.
+ * Frees the SSL contexts, the shared session cache, the OCSP responses, the
+ * vhosts and the shared tables, and closes the listening sockets.
+ * Connections hold a reference to the contexts, so they must be freed before
+ * this is called.
  */
 void server_cleanup(void) {
-  if (server.ssl) {
-    SSL_free(server.ssl);
-  }
-
   if (server.ssl_ctx) {
     SSL_CTX_free(server.ssl_ctx);
+    server.ssl_ctx = NULL;
   }
 
-  if (server.sockfd != -2) {
-    close(server.sockfd);
+  session_cleanup();
+  ocsp_cleanup();
+  vhost_cleanup();
+  metrics_cleanup();
+  limit_cleanup();
+
+  for (int i = 0; i < server.num_listen_fds; i++) {
+    close(server.listen_fds[i]);
   }
+  server.num_listen_fds = 0;
 }
 
 /**
- * setup_ssl - Establish SSL/TLS connection with client
+ * setup_ssl - Prepare SSL/TLS connection with client
  * @clientfd: File descriptor for client's TCP connection
  *
- * Creates a new SSL structure for this connection and performs the
- * TLS handshake.
- *
- * After successful handshake, all further communication is encrypted.
+ * Creates a new SSL structure for this connection and puts it in server mode,
+ * ready for handle_client() to perform the TLS handshake.
  *
- * Return: 0 on success, -1 on failure
+ * Return: SSL structure for the connection on success, NULL on failure
  */
-int setup_ssl(int clientfd) {
+SSL *setup_ssl(int clientfd) {
   /*
    * Each connection gets its own SSL structure because each needs unique
    * encryption keys, separate connection state, and independent read/write
    * buffers.
    */
-  server.ssl = SSL_new(server.ssl_ctx);
-  if (!server.ssl) {
+  SSL *ssl = SSL_new(server.ssl_ctx);
+  if (!ssl) {
     log_event(ERROR, "Failed to create SSL structure.");
-    server_cleanup();
-    return -1;
+    return NULL;
   }
 
   /*
@@ -88,101 +128,655 @@ int setup_ssl(int clientfd) {
    * then use when we call SSL_read() and SSL_write(): these functions use the
    * sycalls recv and send for reading and writing to sockets respectively.
    */
-  if (!SSL_set_fd(server.ssl, clientfd)) {
+  if (!SSL_set_fd(ssl, clientfd)) {
     log_event(ERROR, "Failed to set file descriptor for SSL object.");
-    server_cleanup();
-    return -1;
+    SSL_free(ssl);
+    return NULL;
   }
 
   /*
-   * Perform the TLS handshake. All communication after this point will be
-   * encrypted.
+   * Tell OpenSSL that we're the server side of the handshake. The handshake
+   * itself happens in handle_client(), since the client's messages may not
+   * have arrived yet.
    */
-  if (SSL_accept(server.ssl) <= 0) {
-    log_event(ERROR, "TLS/SSL handshake failed.");
-    server_cleanup();
+  SSL_set_accept_state(ssl);
+
+  return ssl;
+}
+
+/**
+ * get_listen_address - Work out the address to listen on
+ * @address: Output parameter for the address, with the port filled in
+ * @length: Output parameter for the length of address
+ * @family: Address family to use when no address is configured
+ *
+ * Without a listen_address we listen on every address of the given family.
+ *
+ * Return: 0 on success, -1 if the configured address is invalid
+ */
+static int get_listen_address(struct sockaddr_storage *address,
+                              socklen_t *length, int family) {
+  struct server_config *config = config_get_ctx();
+  memset(address, 0, sizeof(*address));
+
+  /*
+   * Network protocols use big-endian byte order. Some CPUs (like x86)
+   * use little-endian, so we convert ot big-endian if needed.
+   */
+  in_port_t port = htons((uint16_t)config->port);
+
+  struct sockaddr_in6 *ipv6 = (struct sockaddr_in6 *)address;
+  struct sockaddr_in *ipv4 = (struct sockaddr_in *)address;
+  const char *text = config->listen_address;
+
+  if (text ? inet_pton(AF_INET6, text, &ipv6->sin6_addr) == 1
+           : family == AF_INET6) {
+    if (!text) {
+      ipv6->sin6_addr = in6addr_any;
+    }
+    ipv6->sin6_family = AF_INET6;
+    ipv6->sin6_port = port;
+    *length = sizeof(*ipv6);
+    return 0;
+  }
+
+  if (text ? inet_pton(AF_INET, text, &ipv4->sin_addr) == 1 : true) {
+    if (!text) {
+      ipv4->sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+    ipv4->sin_family = AF_INET;
+    ipv4->sin_port = port;
+    *length = sizeof(*ipv4);
+    return 0;
+  }
+
+  char address_msg[LOG_MSG_MAX];
+  snprintf(address_msg, LOG_MSG_MAX, "Invalid listen_address %.64s.", text);
+  log_event(ERROR, address_msg);
+  return -1;
+}
+
+/**
+ * set_socket_option - Set an integer socket option
+ * @sockfd: Socket to set it on
+ * @level: Protocol level, e.g. SOL_SOCKET
+ * @option: Option to set
+ * @value: Value to set it to
+ * @name: Name of the option, for the error message
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int set_socket_option(int sockfd, int level, int option, int value,
+                             const char *name) {
+  if (setsockopt(sockfd, level, option, &value, sizeof(value)) == -1) {
+    char option_msg[LOG_MSG_MAX];
+    snprintf(option_msg, LOG_MSG_MAX, "Failed to set %s on socket: %s", name,
+             strerror(errno));
+    log_event(ERROR, option_msg);
     return -1;
   }
   return 0;
 }
 
 /**
- * init_socket - Create and configure TCP listening socket
+ * open_listener - Create a TCP listening socket
+ * @family: Address family to listen with when no address is configured
  *
- * Sets up the server's main socket that listens for incoming connections.
- * This socket doesn't handle client data directly - it only accepts new
- * connections and creates new sockets for them.
+ * Sets up a socket that listens for incoming connections. This socket doesn't
+ * handle client data directly - it only accepts new connections and creates
+ * new sockets for them.
  *
- * Return: 0 on success, -1 on failure
+ * Return: Listening socket on success, -1 on failure (with errno set to
+ * EAFNOSUPPORT if the family isn't supported)
  */
-static int init_socket(void) {
+static int open_listener(int family) {
+  struct server_config *config = config_get_ctx();
+
+  struct sockaddr_storage address;
+  socklen_t address_length;
+  if (get_listen_address(&address, &address_length, family) == -1) {
+    errno = EINVAL;
+    return -1;
+  }
+
   /*
-   * The AF_INET address family corresponds to IPv4, whereas other applications
-   * may use AF_INET6 (IPv6) or AF_UNIX (for Inter-process Communication).
-   *
    * The SOCK_STREAM socket type corresponds to TCP, whereas we would use
-   * SOCK_DGRAM for UDP.
+   * SOCK_DGRAM for UDP. Setting 0 for protocol tells the OS to use the default
+   * protocol for the address family and socket type, which is TCP here.
    *
-   * Setting 0 for protocol tells the OS to use the default protocol for the
-   * address family and socket type, which is TCP in this case.
+   * SOCK_NONBLOCK makes accept() return EAGAIN instead of blocking when there
+   * are no pending connections, which the event loop relies on since a worker
+   * may be woken for a connection another worker has already taken.
    */
-  server.sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server.sockfd == -1) {
-    log_event(ERROR, "Failed to create socket.");
+  int sockfd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (sockfd == -1) {
+    int saved_errno = errno;
+    if (errno != EAFNOSUPPORT) {
+      log_event(ERROR, "Failed to create socket.");
+    }
+    errno = saved_errno;
     return -1;
   }
 
   /*
-   * Configure the socket's address information.
+   * We close idle persistent connections ourselves, which leaves them in
+   * TIME_WAIT on our side for a while afterwards. Without SO_REUSEADDR, bind()
+   * refuses the port until they've all expired, so restarting the server would
+   * fail for a minute or so.
+   *
+   * SO_REUSEPORT lets each worker's socket bind the same port, and the kernel
+   * spreads incoming connections between them.
+   *
+   * Listening on "::" takes IPv4 connections too (as IPv4-mapped addresses)
+   * unless IPV6_V6ONLY is set, which some systems do by default.
+   *
+   * TCP_DEFER_ACCEPT has the kernel hold on to a connection until the client
+   * has sent something, which for TLS is the ClientHello, so workers aren't
+   * woken for connections that have nothing to say yet. TCP_FASTOPEN lets
+   * returning clients send the ClientHello with their SYN, saving a round
+   * trip.
    */
-  struct sockaddr_in socket_address;
+  if (set_socket_option(sockfd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR") ==
+          -1 ||
+      (config->reuseport &&
+       set_socket_option(sockfd, SOL_SOCKET, SO_REUSEPORT, 1,
+                         "SO_REUSEPORT") == -1) ||
+      (address.ss_family == AF_INET6 &&
+       set_socket_option(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, 0,
+                         "IPV6_V6ONLY") == -1) ||
+      (config->defer_accept > 0 &&
+       set_socket_option(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                         config->defer_accept, "TCP_DEFER_ACCEPT") == -1) ||
+      (config->fastopen > 0 &&
+       set_socket_option(sockfd, IPPROTO_TCP, TCP_FASTOPEN, config->fastopen,
+                         "TCP_FASTOPEN") == -1)) {
+    close(sockfd);
+    errno = EINVAL;
+    return -1;
+  }
 
-  socket_address.sin_family = AF_INET;
+  /*
+   * Bind socket to the address and port, this routes incoming connections to
+   * this socket and prevents other processes from using this port.
+   */
+  if (bind(sockfd, (struct sockaddr *)&address, address_length) == -1) {
+    char bind_fail_msg[LOG_MSG_MAX];
+    snprintf(bind_fail_msg, LOG_MSG_MAX, "Failed to bind socket: %s",
+             strerror(errno));
+    log_event(ERROR, bind_fail_msg);
+    close(sockfd);
+    errno = EINVAL;
+    return -1;
+  }
 
   /*
-   * Network protocols use big-endian byte order. Some CPUs (like x86)
-   * use little-endian, so we convert ot big-endian if needed.
+   * Mark socket as passive (listening for connections).
+   *
+   * When clients connect, they enter a queue. If we're busy handling
+   * other clients and haven't called accept() yet, new connections wait
+   * in this queue. If the queue fills up, further connection attempts are
+   * dropped until there's room again.
    */
-  socket_address.sin_port = htons(config_get_ctx()->port);
+  if (listen(sockfd, config->backlog) == -1) {
+    log_event(ERROR, "Failed to start listening.");
+    close(sockfd);
+    errno = EINVAL;
+    return -1;
+  }
+  return sockfd;
+}
+
+/**
+ * attach_cpu_steering - Hand each connection to the worker on its CPU
+ * @sockfd: Any socket in the SO_REUSEPORT group
+ * @num_sockets: Number of sockets in the group
+ *
+ * The kernel normally picks a socket in a SO_REUSEPORT group by hashing the
+ * connection's addresses. A classic BPF program attached to the group can
+ * pick instead, and ours picks the socket whose index is the number of the
+ * CPU that received the connection. With worker N pinned to the Nth CPU,
+ * the connection is then handled on the CPU whose caches its packets are
+ * already in, and never bounces between cores. This assumes the CPUs are
+ * numbered from 0 without gaps, which they almost always are.
+ *
+ * This is only an optimization, so if it can't be attached we carry on with
+ * the kernel's hashing.
+ */
+static void attach_cpu_steering(int sockfd, int num_sockets) {
+  struct sock_filter code[] = {
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)},
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)num_sockets},
+      {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  struct sock_fprog program = {sizeof(code) / sizeof(code[0]), code};
+
+  if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program,
+                 sizeof(program)) == -1) {
+    char steering_msg[LOG_MSG_MAX];
+    snprintf(steering_msg, LOG_MSG_MAX,
+             "Failed to attach CPU steering program: %s", strerror(errno));
+    log_event(WARN, steering_msg);
+  }
+}
+
+/**
+ * is_listener_for - Check an inherited descriptor is a socket we can use
+ * @fd: Descriptor to check
+ * @port: Port it should be listening on
+ *
+ * Return: true if fd is a TCP socket listening on port
+ */
+static bool is_listener_for(int fd, int port) {
+  int listening = 0;
+  socklen_t length = sizeof(listening);
+  if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) == -1 ||
+      !listening) {
+    return false;
+  }
+
+  struct sockaddr_storage address;
+  length = sizeof(address);
+  if (getsockname(fd, (struct sockaddr *)&address, &length) == -1) {
+    return false;
+  }
+  in_port_t bound_port = 0;
+  if (address.ss_family == AF_INET6) {
+    bound_port = ((struct sockaddr_in6 *)&address)->sin6_port;
+  } else if (address.ss_family == AF_INET) {
+    bound_port = ((struct sockaddr_in *)&address)->sin_port;
+  }
+  return ntohs(bound_port) == port;
+}
+
+/**
+ * adopt_sockets - Take over the listening sockets of the server we replace
+ * @max_sockets: Most sockets we need
+ *
+ * A server started on SIGUSR2 inherits its predecessor's listening sockets,
+ * so it can accept on them straight away, and connections waiting in their
+ * queues are served by whichever of the two servers gets to them first. No
+ * connection is refused while the old server drains.
+ *
+ * Sockets that aren't listening on our port (because the port was changed
+ * in the configuration), or that we have too many of, are closed, and
+ * predecessor's copies of them are closed when it exits.
+ *
+ * Return: Number of sockets adopted
+ */
+static int adopt_sockets(int max_sockets) {
+  const char *inherited = getenv(LISTEN_FDS_ENV);
+  if (!inherited) {
+    return 0;
+  }
+
+  int port = config_get_ctx()->port;
+  const char *p = inherited;
+  while (*p) {
+    char *end;
+    long fd = strtol(p, &end, 10);
+    if (end == p || fd < 0 || fd > INT_MAX) {
+      break;
+    }
+    p = *end == ',' ? end + 1 : end;
+
+    if (server.num_listen_fds < max_sockets && is_listener_for((int)fd, port)) {
+      server.listen_fds[server.num_listen_fds++] = (int)fd;
+    } else {
+      close((int)fd);
+    }
+  }
+  unsetenv(LISTEN_FDS_ENV);
+
+  char adopted_msg[LOG_MSG_MAX];
+  snprintf(adopted_msg, LOG_MSG_MAX,
+           "Took over %d listening socket%s from the previous server.",
+           server.num_listen_fds, server.num_listen_fds == 1 ? "" : "s");
+  log_event(INFO, adopted_msg);
+  return server.num_listen_fds;
+}
+
+/**
+ * init_sockets - Create the listening sockets
+ *
+ * With reuseport, every worker slot gets a socket of its own, otherwise one
+ * socket is shared by all of them. Sockets handed down by the server we're
+ * replacing are used first.
+ *
+ * Without a listen_address we try IPv6 first, which covers IPv4 too, and
+ * fall back to IPv4 on systems without IPv6.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int init_sockets(void) {
+  struct server_config *config = config_get_ctx();
+  int num_sockets = config->reuseport ? config->workers : 1;
+
+  int family = AF_INET6;
+  int adopted = adopt_sockets(num_sockets);
+  if (adopted > 0) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if (getsockname(server.listen_fds[0], (struct sockaddr *)&address,
+                    &length) == 0) {
+      family = address.ss_family;
+    }
+  }
+
+  for (int i = adopted; i < num_sockets; i++) {
+    int sockfd = open_listener(family);
+    if (sockfd == -1 && errno == EAFNOSUPPORT && server.num_listen_fds == 0 &&
+        !config->listen_address) {
+      family = AF_INET;
+      sockfd = open_listener(family);
+    }
+    if (sockfd == -1) {
+      return -1;
+    }
+    server.listen_fds[server.num_listen_fds++] = sockfd;
+  }
 
   /*
-   * Listen on all available network interfaces.
+   * With more sockets than CPUs, steering would leave the extra sockets (and
+   * their workers) without any connections at all.
    */
-  socket_address.sin_addr.s_addr = INADDR_ANY;
+  if (config->reuseport && config->cpu_affinity && num_sockets > 1 &&
+      num_sockets <= default_worker_count()) {
+    attach_cpu_steering(server.listen_fds[0], num_sockets);
+  }
 
+  char listening_msg[LOG_MSG_MAX];
+  snprintf(listening_msg, LOG_MSG_MAX,
+           "Started listening on port %d (%s, %d socket%s).", config->port,
+           config->listen_address ? config->listen_address
+           : family == AF_INET6   ? "IPv6 and IPv4"
+                                  : "IPv4",
+           num_sockets, num_sockets == 1 ? "" : "s");
+  log_event(INFO, listening_msg);
+  return 0;
+}
+
+/**
+ * load_certificate_pair - Load a certificate chain and its private key
+ * @ctx: SSL context to load them into
+ * @cert_path: Path of the certificate chain
+ * @key_path: Path of the private key
+ *
+ * OpenSSL keeps one certificate for each type of key, so loading an ECDSA
+ * pair after an RSA one adds to it rather than replacing it, and each
+ * handshake uses whichever the client supports (preferring ECDSA).
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int load_certificate_pair(SSL_CTX *ctx, const char *cert_path,
+                                 const char *key_path) {
   /*
-   * Bind socket to the specified address and port, this routes incoming
-   * connections to this socket and prevents other processes from using this
-   * port.
-   *
-   * The cast to (struct sockaddr *) is necessary because bind() uses a
-   * generic sockaddr, but we're using the IPv4-specific sockaddr_in.
+   * Load the server's certificate chain.
    */
-  if (bind(server.sockfd, (struct sockaddr *)&socket_address,
-           sizeof(socket_address)) == -1) {
-    log_event(ERROR, "Failed to bind socket.");
+  if (!SSL_CTX_use_certificate_chain_file(ctx, cert_path)) {
+    log_event(ERROR, "Failed to set certificate.");
     return -1;
   }
 
   /*
-   * Mark socket as passive (listening for connections).
-   *
-   * BACKLOG_SIZE (128) is the maximum number of pending connections.
-   *
-   * When clients connect, they enter a queue. If we're busy handling
-   * other clients and haven't called accept() yet, new connections wait
-   * in this queue. If the queue fills up (128 connections waiting),
-   * additional connections are refused.
+   * Load the server's private key. This key is used for decrypting messages
+   * encrypted with the public key from the certificate, signing handshake
+   * messages to verify the server's identity, and deriving shared encryption
+   * keys during the TLS handshake.
    *
-   * High-traffic servers are likely to use higher values like 1024.
+   * This file should have permissions 600 (RW for owner, none for others) for
+   * the sake of security. SSL_FILETYPE_PEM means the key is in PEM format.
    */
-  if (listen(server.sockfd, BACKLOG_SIZE) == -1) {
-    log_event(ERROR, "Failed to start listening.");
+  if (!SSL_CTX_use_PrivateKey_file(ctx, key_path, SSL_FILETYPE_PEM)) {
+    log_event(ERROR, "Failed to set private key.");
+    return -1;
+  }
+
+  if (!SSL_CTX_check_private_key(ctx)) {
+    log_event(ERROR, "Private key doesn't match certificate.");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * load_certificates - Load every configured certificate and key
+ * @ctx: SSL context to load them into
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int load_certificates(SSL_CTX *ctx) {
+  struct server_config *config = config_get_ctx();
+  if (load_certificate_pair(ctx, config->cert_path, config->key_path) == -1) {
+    return -1;
+  }
+
+  if (!config->ecdsa_cert_path) {
+    return 0;
+  }
+  if (!config->ecdsa_key_path) {
+    log_event(ERROR, "ecdsa_cert needs an ecdsa_key.");
+    return -1;
+  }
+
+  /*
+   * If either certificate were of the wrong type, the second would quietly
+   * replace the first rather than being offered alongside it.
+   */
+  if (EVP_PKEY_get_base_id(SSL_CTX_get0_privatekey(ctx)) == EVP_PKEY_EC) {
+    log_event(ERROR, "cert is already ECDSA, ecdsa_cert would replace it.");
+    return -1;
+  }
+  if (load_certificate_pair(ctx, config->ecdsa_cert_path,
+                            config->ecdsa_key_path) == -1) {
+    return -1;
+  }
+  if (EVP_PKEY_get_base_id(SSL_CTX_get0_privatekey(ctx)) != EVP_PKEY_EC) {
+    log_event(ERROR, "ecdsa_cert isn't an ECDSA certificate.");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * load_vhost_certificate - Load a vhost's certificate and key
+ * @ctx: SSL context to load them into
+ * @vhost: vhost with a certificate of its own
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int load_vhost_certificate(SSL_CTX *ctx, const struct vhost *vhost) {
+  if (load_certificate_pair(ctx, vhost->cert_path, vhost->key_path) == -1) {
+    char vhost_fail_msg[LOG_MSG_MAX];
+    snprintf(vhost_fail_msg, LOG_MSG_MAX,
+             "Failed to load certificate for vhost %s.", vhost->name);
+    log_event(ERROR, vhost_fail_msg);
     return -1;
   }
   return 0;
 }
 
+/**
+ * init_vhost_ctxs - Create the SSL contexts of vhosts with certificates
+ *
+ * These contexts are only where the certificates are kept. A connection
+ * switched to one in the ClientHello callback keeps the settings of the
+ * context it was created with (server.ssl_ctx), including the session
+ * cache, apart from the session ID context. That's set from the vhost's
+ * name, so that sessions stay with the certificate they were made with.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int init_vhost_ctxs(void) {
+  for (int i = 0; i < vhost_count(); i++) {
+    struct vhost *vhost = vhost_get(i);
+    if (!vhost->cert_path) {
+      continue;
+    }
+
+    vhost->ssl_ctx = SSL_CTX_new(TLS_server_method());
+    if (!vhost->ssl_ctx) {
+      log_event(ERROR, "Failed to create SSL context for vhost.");
+      return -1;
+    }
+    if (load_vhost_certificate(vhost->ssl_ctx, vhost) == -1) {
+      return -1;
+    }
+
+    /*
+     * Names can be longer than a session ID context, so it's the name's
+     * digest, which is exactly as long as one.
+     */
+    unsigned char id_context[EVP_MAX_MD_SIZE];
+    unsigned int id_length = 0;
+    if (!EVP_Digest(vhost->name, vhost->name_length, id_context, &id_length,
+                    EVP_sha256(), NULL) ||
+        !SSL_CTX_set_session_id_context(vhost->ssl_ctx, id_context,
+                                        id_length)) {
+      log_event(ERROR, "Failed to set session ID context for vhost.");
+      return -1;
+    }
+  }
+
+  if (vhost_count() > 0) {
+    SSL_CTX_set_client_hello_cb(server.ssl_ctx, vhost_client_hello_callback,
+                                NULL);
+  }
+  return 0;
+}
+
+/**
+ * has_hardware_aes - Check whether the CPU has AES instructions
+ *
+ * With them (AES-NI on x86, the crypto extensions on ARM) AES-GCM is the
+ * fastest cipher TLS has. Without them ChaCha20-Poly1305, which only needs
+ * simple arithmetic, is several times faster than AES done in software.
+ *
+ * Return: true if it does
+ */
+static bool has_hardware_aes(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_cpu_supports("aes");
+#elif defined(__aarch64__)
+  return getauxval(AT_HWCAP) & HWCAP_AES;
+#else
+  return false;
+#endif
+}
+
+/*
+ * The TLS 1.3 ciphersuites and TLS 1.2 ciphers we offer by default, fastest
+ * first for CPUs with and without AES instructions. They're all AEAD ciphers
+ * with forward secrecy.
+ */
+#define TLS13_AES_FIRST                                                       \
+  "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:"                            \
+  "TLS_CHACHA20_POLY1305_SHA256"
+#define TLS13_CHACHA_FIRST                                                    \
+  "TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256:"                      \
+  "TLS_AES_256_GCM_SHA384"
+#define TLS12_AES_FIRST                                                       \
+  "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"                \
+  "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"                \
+  "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305"
+#define TLS12_CHACHA_FIRST                                                    \
+  "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:"                \
+  "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"                \
+  "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+
+/*
+ * X25519 is the cheapest key exchange for both sides, the NIST curves are
+ * for clients that don't support it.
+ */
+#define TLS_DEFAULT_GROUPS "X25519:P-256:P-384"
+
+/**
+ * set_tls_policy - Choose the protocol versions, ciphers and groups to offer
+ * @ctx: SSL context to set them on
+ *
+ * We pick from the lists in our order of preference rather than the
+ * client's, so that clients get the cipher that's fastest on our CPU. The
+ * exception is a client that puts ChaCha20 first, which usually means it has
+ * no AES instructions of its own, so it gets ChaCha20 even if we'd prefer
+ * AES (SSL_OP_PRIORITIZE_CHACHA).
+ *
+ * A list that OpenSSL rejects leaves the one in use unchanged.
+ *
+ * Return: 0 on success, -1 if a list was rejected
+ */
+static int set_tls_policy(SSL_CTX *ctx) {
+  struct server_config *config = config_get_ctx();
+  bool aes = has_hardware_aes();
+  const char *ciphersuites = config->tls_ciphersuites;
+  const char *ciphers = config->tls_ciphers;
+  const char *groups = config->tls_groups;
+  if (!ciphersuites) {
+    ciphersuites = aes ? TLS13_AES_FIRST : TLS13_CHACHA_FIRST;
+  }
+  if (!ciphers) {
+    ciphers = aes ? TLS12_AES_FIRST : TLS12_CHACHA_FIRST;
+  }
+  if (!groups) {
+    groups = TLS_DEFAULT_GROUPS;
+  }
+
+  /*
+   * TLS 1.0 and 1.1 have no AEAD ciphers, so none of ours would work with
+   * them anyway.
+   */
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE |
+                               SSL_OP_PRIORITIZE_CHACHA);
+
+  int result = 0;
+  if (!SSL_CTX_set_ciphersuites(ctx, ciphersuites)) {
+    log_event(ERROR, "Invalid tls_ciphersuites.");
+    result = -1;
+  }
+  if (!SSL_CTX_set_cipher_list(ctx, ciphers)) {
+    log_event(ERROR, "Invalid tls_ciphers.");
+    result = -1;
+  }
+  if (!SSL_CTX_set1_groups_list(ctx, groups)) {
+    log_event(ERROR, "Invalid tls_groups.");
+    result = -1;
+  }
+  return result;
+}
+
+/**
+ * load_tls_provider - Load the OpenSSL provider given by tls_provider
+ *
+ * Providers are where OpenSSL 3 gets its implementations of algorithms
+ * from, and one that drives an accelerator card can take the RSA and ECDHE
+ * work of handshakes off our CPU. Loading any provider ourselves stops
+ * OpenSSL loading its default one automatically, so we load that too for
+ * whatever the tls_provider doesn't implement, and then say to prefer the
+ * tls_provider's implementations where it has one.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int load_tls_provider(void) {
+  const char *name = config_get_ctx()->tls_provider;
+  if (!name) {
+    return 0;
+  }
+
+  char provider_msg[LOG_MSG_MAX];
+  char properties[LOG_MSG_MAX];
+  snprintf(properties, sizeof(properties), "?provider=%s", name);
+  if (!OSSL_PROVIDER_load(NULL, name) || !OSSL_PROVIDER_load(NULL, "default") ||
+      !EVP_set_default_properties(NULL, properties)) {
+    snprintf(provider_msg, LOG_MSG_MAX, "Failed to load OpenSSL provider %s.",
+             name);
+    log_event(ERROR, provider_msg);
+    return -1;
+  }
+
+  snprintf(provider_msg, LOG_MSG_MAX, "Loaded OpenSSL provider %s.", name);
+  log_event(INFO, provider_msg);
+  return 0;
+}
+
 /**
  * init_ssl_ctx - Initialize SSL context with certificate and private key
  *
@@ -210,28 +804,68 @@ static int init_ssl_ctx(void) {
     return -1;
   }
 
-  /*
-   * Load the server's certificate chain.
-   */
-  if (!SSL_CTX_use_certificate_chain_file(server.ssl_ctx,
-                                          config_get_ctx()->cert_path)) {
-    log_event(ERROR, "Failed to set certificate.");
+  if (load_certificates(server.ssl_ctx) == -1 ||
+      set_tls_policy(server.ssl_ctx) == -1) {
     server_cleanup();
     return -1;
   }
 
   /*
-   * Load the server's private key. This key is used for decrypting messages
-   * encrypted with the public key from the certificate, signing handshake
-   * messages to verify the server's identity, and deriving shared encryption
-   * keys during the TLS handshake.
+   * Staple OCSP responses to handshakes, if we've been given any. Unlike a
+   * missing certificate, a missing response isn't a reason not to start.
+   */
+  ocsp_load(server.ssl_ctx);
+
+  /*
+   * SSL_write() normally only reports success once the whole buffer has been
+   * sent, and insists on being retried with the exact same buffer pointer
+   * after SSL_ERROR_WANT_WRITE. On a non-blocking socket we'd rather know how
+   * much went out and carry on from there, which these two modes allow.
    *
-   * This file should have permissions 600 (RW for owner, none for others) for
-   * the sake of security. SSL_FILETYPE_PEM means the key is in PEM format.
+   * SSL_MODE_RELEASE_BUFFERS frees OpenSSL's read and write buffers while a
+   * connection is idle, so connections waiting on slow clients cost less
+   * memory.
    */
-  if (!SSL_CTX_use_PrivateKey_file(server.ssl_ctx, config_get_ctx()->key_path,
-                                   SSL_FILETYPE_PEM)) {
-    log_event(ERROR, "Failed to set private key.");
+  SSL_CTX_set_mode(server.ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                       SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                       SSL_MODE_RELEASE_BUFFERS);
+
+  /*
+   * In async mode, OpenSSL runs each operation as a job that a provider can
+   * pause while an accelerator does the work, rather than blocking the
+   * worker until it's done. The call then fails with SSL_ERROR_WANT_ASYNC,
+   * and the event loop waits for the job's file descriptor to become
+   * readable before calling it again.
+   */
+  if (config_get_ctx()->tls_async) {
+    SSL_CTX_set_mode(server.ssl_ctx, SSL_MODE_ASYNC);
+  }
+
+  /*
+   * With kernel TLS (kTLS), OpenSSL hands the session keys to the kernel once
+   * the handshake is done, and the kernel encrypts whatever we write to the
+   * socket. That lets us send files with sendfile(), which copies them
+   * straight from the page cache to the socket without them ever passing
+   * through our memory.
+   *
+   * If the kernel or the negotiated cipher doesn't support kTLS, OpenSSL
+   * quietly carries on encrypting in userspace, so we check per connection
+   * whether it's in use before relying on it.
+   */
+  if (config_get_ctx()->ktls) {
+#ifndef OPENSSL_NO_KTLS
+    SSL_CTX_set_options(server.ssl_ctx, SSL_OP_ENABLE_KTLS);
+#else
+    log_event(WARN, "OpenSSL was built without kTLS support, ignoring ktls.");
+#endif
+  }
+
+  /*
+   * Let returning clients resume their previous session rather than going
+   * through a full handshake. This has to happen here in the parent so that
+   * every worker shares the same session cache and ticket keys.
+   */
+  if (session_init(server.ssl_ctx) == -1 || init_vhost_ctxs() == -1) {
     server_cleanup();
     return -1;
   }
@@ -239,81 +873,219 @@ static int init_ssl_ctx(void) {
 }
 
 /**
- * client_loop - Accept and handle a single client connection
+ * pin_to_cpu - Pin the calling worker to a CPU of its own
+ * @slot: The worker's slot
+ *
+ * Workers are spread over the CPUs we're allowed to run on, in order, so
+ * worker N runs on the Nth of them. Keeping a worker on one CPU keeps its
+ * caches warm, and with reuseport the steering program sends it the
+ * connections that CPU received.
+ */
+static void pin_to_cpu(int slot) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+    log_event(WARN, "Failed to get CPU affinity, not pinning worker.");
+    return;
+  }
+
+  int num_allowed = CPU_COUNT(&allowed);
+  if (num_allowed == 0) {
+    return;
+  }
+  int target = slot % num_allowed;
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed) || target-- > 0) {
+      continue;
+    }
+
+    cpu_set_t pinned;
+    CPU_ZERO(&pinned);
+    CPU_SET(cpu, &pinned);
+    if (sched_setaffinity(0, sizeof(pinned), &pinned) == -1) {
+      log_event(WARN, "Failed to pin worker to CPU.");
+    }
+    return;
+  }
+}
+
+/**
+ * client_loop - Serve client connections in a worker
+ * @slot: The worker's slot
  *
- * This function is called repeatedly by server_init(). Each call blocks while
- * waiting for a connection, accepts the connection, and forks a child process
- * to handle it while the parent continues accepting. Most servers use
- * multithreading or event loops these days rather than forking, but this
- * approach is sufficient for a simple low-traffic server.
+ * This is the main function of each worker process. Every worker runs its own
+ * event loop, on the listening socket for its slot with reuseport or the
+ * shared one otherwise, and the kernel hands each incoming connection to one
+ * of them. The sockets of other slots are closed, they're not ours to accept
+ * from.
  *
- * Return: 0 to cease accepting connections, 1 to continue accepting
- * connections, -1 on unrecoverable error
+ * This only returns on an unrecoverable error, at which point the worker exits
+ * and the parent starts a replacement.
  */
-static int client_loop(void) {
-  /*
-   * We remove a client from the listening queue and create a new socket for
-   * them. accept returns the new socket file descriptor on success, or -1 on
-   * error.
-   */
-  int clientfd = accept(server.sockfd, NULL, NULL);
-  if (clientfd == -1) {
-    log_event(ERROR, "Failed to accept connection.");
+static void client_loop(int slot) {
+  if (config_get_ctx()->cpu_affinity) {
+    pin_to_cpu(slot);
+  }
+  metrics_set_slot(slot);
+  limit_set_worker(slot);
+
+  int own = server.num_listen_fds > 1 ? slot : 0;
+  int listenfd = server.listen_fds[own];
+  for (int i = 0; i < server.num_listen_fds; i++) {
+    if (i != own) {
+      close(server.listen_fds[i]);
+    }
+  }
+  server.listen_fds[0] = listenfd;
+  server.num_listen_fds = 1;
+
+  event_loop_run(listenfd);
+}
+
+/**
+ * reload_certificate - Load the certificates and private keys again
+ *
+ * Renewing a certificate usually means replacing both files, and we may be
+ * signalled after only one of them has been written. So the pairs are first
+ * loaded into a scratch context to check that they're complete and match,
+ * and only then into the real one. Connections that are already open keep
+ * the certificate they were set up with.
+ *
+ * The OCSP responses are loaded again afterwards, since a renewed
+ * certificate needs a response of its own.
+ *
+ * Each vhost's certificate is reloaded the same way, independently of the
+ * others, so one that's only half replaced doesn't hold the rest back.
+ *
+ * Return: 0 on success, -1 if any of the files couldn't be used (the
+ * certificates they're for are kept)
+ */
+static int reload_certificate(void) {
+  int result = 0;
+  for (int i = 0; i < vhost_count(); i++) {
+    struct vhost *vhost = vhost_get(i);
+    if (!vhost->ssl_ctx) {
+      continue;
+    }
+
+    SSL_CTX *scratch = SSL_CTX_new(TLS_server_method());
+    bool usable = scratch && load_vhost_certificate(scratch, vhost) == 0;
+    SSL_CTX_free(scratch);
+    if (!usable || load_vhost_certificate(vhost->ssl_ctx, vhost) == -1) {
+      char vhost_fail_msg[LOG_MSG_MAX];
+      snprintf(vhost_fail_msg, LOG_MSG_MAX,
+               "Failed to reload certificate for vhost %s, keeping the old "
+               "one.",
+               vhost->name);
+      log_event(ERROR, vhost_fail_msg);
+      result = -1;
+    }
+  }
+
+  SSL_CTX *scratch = SSL_CTX_new(TLS_server_method());
+  bool usable = scratch && load_certificates(scratch) == 0;
+  SSL_CTX_free(scratch);
+
+  if (!usable) {
+    log_event(ERROR, "Failed to reload certificate, keeping the old one.");
     return -1;
   }
 
-  /*
-   * Fork a new process to handle this client. Child processes:
-   * - Continue from the next line
-   * - Copy all variables
-   * - Copy open file descriptors
-   * - Have a seperate memory space from each other and the parent
-   *
-   * Both processes can close their own copy of a file
-   * descriptor without affecting the other.
-   */
+  if (load_certificates(server.ssl_ctx) == -1) {
+    log_event(ERROR, "Failed to set reloaded certificate.");
+    return -1;
+  }
+  ocsp_load(server.ssl_ctx);
+  return result;
+}
+
+/**
+ * server_reload - Reload what the server only reads at startup
+ *
+ * Run by the parent and then by every worker on SIGHUP. If reloading any of
+ * it fails, we carry on with what we had for that part. The file cache is
+ * emptied, since the headers of cached files depend on the configuration
+ * (the parent has nothing cached, so this only costs the workers anything).
+ *
+ * The shared session cache and ticket keys are untouched, so clients can
+ * still resume their sessions afterwards.
+ */
+void server_reload(void) {
+  log_event(INFO, "Reloading configuration, certificate and error pages.");
+  config_reload();
+  reload_certificate();
+  set_tls_policy(server.ssl_ctx);
+  error_pages_load();
+  cache_clear();
+}
+
+/**
+ * server_upgrade - Start a new copy of the server on our listening sockets
+ *
+ * Run by the parent on SIGUSR2. The new server is started from the
+ * executable's path with the arguments we were started with, so it runs
+ * whatever version is installed there now and reads the configuration file
+ * afresh. It inherits our listening sockets (they aren't close-on-exec) and
+ * finds out which they are from LISTEN_FDS_ENV.
+ *
+ * We carry on serving until we're told to drain with SIGQUIT, which should
+ * wait until the new server has logged that it's started. If the new server
+ * fails to start, we're still here.
+ */
+static void server_upgrade(void) {
+  if (!server_argv || executable_path[0] == '\0') {
+    log_event(ERROR, "Don't know how to start a new server.");
+    return;
+  }
+
   pid_t pid = fork();
   if (pid == -1) {
-    log_event(ERROR, "Failed to fork process.");
-    close(clientfd);
-    return -1;
+    log_event(ERROR, "Failed to fork new server.");
+    return;
   }
 
-  /*CHILD PROCESS*/
   if (pid == 0) {
     /*
-     * Close the listening socket since we don't need it here and the the port
-     * would remain bound if the parent crashed while the child still had the
-     * socket open.
+     * Up to 11 characters for each descriptor and its comma.
      */
-    close(server.sockfd);
-
-    handle_client(&server, clientfd);
+    char fds[MAX_WORKERS * 12] = "";
+    size_t length = 0;
+    for (int i = 0; i < server.num_listen_fds; i++) {
+      length += (size_t)snprintf(fds + length, sizeof(fds) - length, "%s%d",
+                                 i ? "," : "", server.listen_fds[i]);
+    }
 
-    return 0; // Exit child process after handling client
-  } else {
-    /*
-     * PARENT PROCESS
-     *
-     * The parent continues accepting connections. We can close the client
-     * socket because the client has its own copy and the parent doesn't need
-     * it.
-     */
-    close(clientfd);
+    if (setenv(LISTEN_FDS_ENV, fds, 1) == 0) {
+      execv(executable_path, server_argv);
+    }
+    log_flush();
+    _exit(EXIT_FAILURE);
   }
-  return 1; // Continue accepting more connections
+
+  char upgrade_msg[LOG_MSG_MAX];
+  snprintf(upgrade_msg, LOG_MSG_MAX,
+           "Started new server %d, send SIGQUIT to %d to drain this one.",
+           (int)pid, (int)getpid());
+  log_event(INFO, upgrade_msg);
 }
 
 /**
  * server_init - Initialize and run the HTTPS server
  *
+ * @argv: Arguments the server was started with
+ *
  * This initializes OpenSSL, creates the SSL context, opens the listening
  * socket, and enters a client handling loop until a fatal error occurs or
  * SIGINT is received.
  *
  * Return: 0 on success, -1 on error
  */
-int server_init(void) {
+int server_init(char *argv[]) {
+  server_argv = argv;
+  ssize_t path_length =
+      readlink("/proc/self/exe", executable_path, sizeof(executable_path) - 1);
+  executable_path[path_length > 0 ? path_length : 0] = '\0';
+
   /*
    * OpenSSL is humungo so it doesn't initialize everything by
    * default. This call sets up the error message systems and prepares
@@ -329,6 +1101,22 @@ int server_init(void) {
     return -1;
   }
 
+  /*
+   * Providers have to be loaded before the SSL context is created, since it
+   * looks up the algorithms it'll use then.
+   */
+  if (load_tls_provider() == -1) {
+    return -1;
+  }
+
+  /*
+   * The vhosts go first, since their certificates are loaded along with the
+   * default one.
+   */
+  if (vhost_init() == -1) {
+    return -1;
+  }
+
   /*
    * Create and configure SSL context.
    * Loads certificate and private key files.
@@ -338,34 +1126,38 @@ int server_init(void) {
   }
 
   /*
-   * Create listening socket and bind to port.
+   * Build the MIME table and render the error responses (which need it)
+   * before forking, so that every worker starts with them.
    */
-  if (init_socket() == -1) {
-    log_event(ERROR, "Failed to create socket.");
+  if (mime_init() == -1 || error_pages_load() == -1) {
     return -1;
   }
 
-  char listening_msg[LISTENING_MSG_MAX];
-  snprintf(listening_msg, LISTENING_MSG_MAX, "Started listening on port %d.",
-           config_get_ctx()->port);
-  log_event(INFO, listening_msg);
+  /*
+   * The workers' metrics are shared with whichever worker serves them, and
+   * the per-client limits have to be counted across all of them, so both are
+   * mapped before forking too.
+   */
+  if (metrics_init() == -1 || limit_init() == -1) {
+    return -1;
+  }
 
   /*
-   * Accept connections forever (until SIGINT is received) or fatal error
-   * occurs.
+   * Create the listening sockets and bind them to the port.
    */
-  int serving_clients = 1;
-  while (serving_clients == 1) {
-    serving_clients = client_loop();
-    if (serving_clients == -1) {
-      char unrec_err_msg[LOG_MSG_MAX];
-      snprintf(unrec_err_msg, LOG_MSG_MAX,
-               "Unrecoverable error in client handling, exiting...\n");
-      log_event(FATAL, unrec_err_msg);
-    }
+  if (init_sockets() == -1) {
+    log_event(ERROR, "Failed to create socket.");
+    return -1;
   }
 
-  close(server.sockfd);
+  /*
+   * Fork the workers, which accept connections until SIGINT is received. The
+   * parent stays in workers_run() supervising them until then.
+   */
+  int workers_status = workers_run(config_get_ctx()->workers, client_loop,
+                                   server_reload, server_upgrade);
 
-  return 0;
+  server_cleanup();
+
+  return workers_status;
 }
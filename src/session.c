@@ -0,0 +1,489 @@
+/**
+ * session.c
+ *
+ * TLS session resumption shared between worker processes.
+ *
+ * OVERVIEW:
+ * A full TLS handshake has the server sign with its private key, which is by
+ * far the most expensive thing we do for a new connection. A returning client
+ * can skip that by resuming the session it had before, as long as we still
+ * know the session's keys. There are two ways for us to know them:
+ *
+ * - SESSION CACHE: We keep the session and give the client its ID, which it
+ *   sends back next time. OpenSSL's built-in cache lives in the memory of the
+ *   process that made the session, so with several workers a client would
+ *   only resume if it happened to reach the same worker again. Instead we
+ *   keep sessions in a table in shared memory that every worker uses.
+ *
+ * - SESSION TICKETS: We encrypt the session and hand it to the client to keep,
+ *   which sends the ticket back next time. Any worker can decrypt a ticket as
+ *   long as they all use the same key, so the keys live in shared memory too.
+ *   It's the ticket key that protects every session made with it, so we
+ *   replace it regularly: a new key is made every session_timeout seconds,
+ *   and the previous one is still accepted (with the client getting a fresh
+ *   ticket) until the next replacement.
+ *
+ * Most clients use tickets, the cache is for those that don't and for when
+ * tickets are turned off.
+ *
+ * LOCKING:
+ * The shared memory is protected by a single process-shared mutex. It's held
+ * only long enough to copy a session or key in or out, so workers rarely wait
+ * on each other. The mutex is robust, which means that if a worker dies while
+ * holding it the next worker to lock it is told so rather than waiting
+ * forever. The worst a half-finished update can leave behind is an entry that
+ * fails to decode, which is just a cache miss.
+ */
+#include <errno.h>
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "config.h"
+#include "log.h"
+#include "session.h"
+
+/**
+ * struct session_slot - A cached session
+ * @id: Session ID the client will send to resume it
+ * @id_length: Length of id, 0 if the slot is empty
+ * @expires: When OpenSSL would stop accepting the session, in system time
+ * @data_length: Length of data
+ * @data: The session encoded with i2d_SSL_SESSION()
+ */
+struct session_slot {
+  unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+  unsigned int id_length;
+  time_t expires;
+  unsigned int data_length;
+  unsigned char data[SESSION_DATA_MAX];
+};
+
+/**
+ * struct ticket_key - A key that session tickets are encrypted with
+ * @name: Random name sent at the start of every ticket made with this key
+ * @aes_key: Key the ticket is encrypted with
+ * @hmac_key: Key the ticket is authenticated with
+ * @created: When the key was made, according to the monotonic clock
+ */
+struct ticket_key {
+  unsigned char name[TICKET_KEY_NAME_LENGTH];
+  unsigned char aes_key[TICKET_AES_KEY_LENGTH];
+  unsigned char hmac_key[TICKET_HMAC_KEY_LENGTH];
+  time_t created;
+};
+
+/**
+ * struct session_shared - Everything the workers share, in one mapping
+ * @lock: Protects everything below
+ * @ticket_keys: The key new tickets are made with, then the previous one
+ * @num_slots: Number of entries in slots
+ * @slots: Direct-mapped session cache
+ */
+struct session_shared {
+  pthread_mutex_t lock;
+  struct ticket_key ticket_keys[2];
+  size_t num_slots;
+  struct session_slot slots[];
+};
+
+/*
+ * The shared mapping and its size, so that it can be unmapped.
+ */
+static struct session_shared *shared = NULL;
+static size_t shared_size = 0;
+
+/**
+ * monotonic_now - Read the monotonic clock in seconds
+ *
+ * The monotonic clock is system-wide, so times read in different workers can
+ * be compared with each other.
+ *
+ * Return: Seconds since an arbitrary point in the past
+ */
+static time_t monotonic_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec;
+}
+
+/**
+ * shared_lock - Lock the shared memory
+ *
+ * EOWNERDEAD means a worker died holding the lock. We now hold it, and
+ * pthread_mutex_consistent() tells the mutex to carry on being usable.
+ */
+static void shared_lock(void) {
+  if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD) {
+    pthread_mutex_consistent(&shared->lock);
+  }
+}
+
+/**
+ * shared_unlock - Unlock the shared memory
+ */
+static void shared_unlock(void) { pthread_mutex_unlock(&shared->lock); }
+
+/**
+ * make_ticket_key - Fill in a new ticket key
+ * @key: Key to fill in
+ *
+ * Return: 0 on success, -1 if no random bytes were available
+ */
+static int make_ticket_key(struct ticket_key *key) {
+  if (RAND_bytes(key->name, sizeof(key->name)) != 1 ||
+      RAND_bytes(key->aes_key, sizeof(key->aes_key)) != 1 ||
+      RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) != 1) {
+    log_event(ERROR, "Failed to generate session ticket key.");
+    return -1;
+  }
+  key->created = monotonic_now();
+  return 0;
+}
+
+/**
+ * rotate_ticket_keys - Replace the current ticket key if it's too old
+ *
+ * Whichever worker first needs a ticket after the key has expired makes the
+ * new one. The old key becomes the previous key, and the one before that is
+ * forgotten, so tickets it made can no longer be decrypted. Must be called
+ * with the lock held.
+ */
+static void rotate_ticket_keys(void) {
+  struct ticket_key *current = &shared->ticket_keys[0];
+  if (monotonic_now() - current->created < config_get_ctx()->session_timeout) {
+    return;
+  }
+
+  struct ticket_key new_key;
+  if (make_ticket_key(&new_key) == -1) {
+    return;
+  }
+
+  shared->ticket_keys[1] = *current;
+  *current = new_key;
+}
+
+/**
+ * set_hmac_key - Give OpenSSL the key to authenticate a ticket with
+ * @hmac_ctx: MAC context from OpenSSL
+ * @key: Ticket key to use
+ *
+ * Return: 1 on success, 0 on failure
+ */
+static int set_hmac_key(EVP_MAC_CTX *hmac_ctx, struct ticket_key *key) {
+  OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->hmac_key,
+                                        sizeof(key->hmac_key)),
+      OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+      OSSL_PARAM_construct_end()};
+  return EVP_MAC_CTX_set_params(hmac_ctx, params);
+}
+
+/**
+ * ticket_key_callback - Encrypt or decrypt a session ticket
+ * @ssl: Connection the ticket is for
+ * @key_name: Name of the key, set by us when encrypting and read by us when
+ * decrypting
+ * @iv: Initialization vector, set by us when encrypting
+ * @cipher_ctx: Cipher context to set up with the key
+ * @hmac_ctx: MAC context to set up with the key
+ * @encrypt: 1 when making a ticket, 0 when reading one
+ *
+ * OpenSSL does the actual encryption, all we do is pick the key. We copy it
+ * out of shared memory under the lock, since another worker may replace it
+ * while we're using it.
+ *
+ * Return: When encrypting, 1 on success or -1 on failure. When decrypting, 0
+ * if we don't know the key (a full handshake follows), 1 if the ticket was
+ * made with the current key, or 2 if it was made with the previous one and
+ * the client should be given a new ticket.
+ */
+static int ticket_key_callback(SSL *ssl, unsigned char *key_name,
+                               unsigned char *iv, EVP_CIPHER_CTX *cipher_ctx,
+                               EVP_MAC_CTX *hmac_ctx, int encrypt) {
+  (void)ssl;
+  struct ticket_key key;
+
+  if (encrypt) {
+    shared_lock();
+    rotate_ticket_keys();
+    key = shared->ticket_keys[0];
+    shared_unlock();
+
+    if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1) {
+      return -1;
+    }
+    memcpy(key_name, key.name, TICKET_KEY_NAME_LENGTH);
+
+    if (!EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes_key,
+                            iv) ||
+        !set_hmac_key(hmac_ctx, &key)) {
+      return -1;
+    }
+    return 1;
+  }
+
+  int key_index = -1;
+  shared_lock();
+  for (int i = 0; i < 2; i++) {
+    if (memcmp(key_name, shared->ticket_keys[i].name,
+               TICKET_KEY_NAME_LENGTH) == 0) {
+      key = shared->ticket_keys[i];
+      key_index = i;
+      break;
+    }
+  }
+  shared_unlock();
+
+  if (key_index == -1) {
+    return 0;
+  }
+
+  if (!EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes_key,
+                          iv) ||
+      !set_hmac_key(hmac_ctx, &key)) {
+    return -1;
+  }
+  return key_index == 0 ? 1 : 2;
+}
+
+/**
+ * find_slot - Find the slot a session ID belongs in
+ * @id: Session ID
+ * @id_length: Length of id
+ *
+ * Each ID has exactly one slot, chosen by hashing it (FNV-1a, as in the file
+ * cache), and a new session simply replaces whatever was in its slot. That
+ * occasionally throws away a session that's still in use, but means a lookup
+ * is a single comparison and there's nothing to evict.
+ *
+ * Return: The slot, which may hold a different session or none
+ */
+static struct session_slot *find_slot(const unsigned char *id,
+                                      unsigned int id_length) {
+  uint32_t hash = 2166136261u;
+  for (unsigned int i = 0; i < id_length; i++) {
+    hash ^= id[i];
+    hash *= 16777619u;
+  }
+  return &shared->slots[hash % shared->num_slots];
+}
+
+/**
+ * new_session_callback - Store a session OpenSSL has just made
+ * @ssl: Connection the session belongs to
+ * @session: The new session
+ *
+ * Return: 0, telling OpenSSL we haven't kept a reference to session
+ */
+static int new_session_callback(SSL *ssl, SSL_SESSION *session) {
+  (void)ssl;
+
+  int data_length = i2d_SSL_SESSION(session, NULL);
+  if (data_length <= 0 || data_length > SESSION_DATA_MAX) {
+    return 0;
+  }
+
+  unsigned char data[SESSION_DATA_MAX];
+  unsigned char *data_end = data;
+  i2d_SSL_SESSION(session, &data_end);
+
+  unsigned int id_length;
+  const unsigned char *id = SSL_SESSION_get_id(session, &id_length);
+
+  shared_lock();
+  struct session_slot *slot = find_slot(id, id_length);
+  memcpy(slot->id, id, id_length);
+  slot->id_length = id_length;
+  slot->expires = SSL_SESSION_get_time(session) +
+                  SSL_SESSION_get_timeout(session);
+  slot->data_length = (unsigned int)data_length;
+  memcpy(slot->data, data, (size_t)data_length);
+  shared_unlock();
+
+  return 0;
+}
+
+/**
+ * get_session_callback - Look up a session a client wants to resume
+ * @ssl: Connection trying to resume
+ * @id: Session ID the client sent
+ * @id_length: Length of id
+ * @copy: Set to 0, since the session we return is a new one for OpenSSL to
+ * keep
+ *
+ * The session is copied out under the lock and decoded after releasing it,
+ * so that other workers aren't kept waiting while we decode.
+ *
+ * Return: The session, or NULL if we don't have it
+ */
+static SSL_SESSION *get_session_callback(SSL *ssl, const unsigned char *id,
+                                         int id_length, int *copy) {
+  (void)ssl;
+  *copy = 0;
+
+  if (id_length <= 0 || id_length > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+    return NULL;
+  }
+
+  unsigned char data[SESSION_DATA_MAX];
+  unsigned int data_length = 0;
+
+  shared_lock();
+  struct session_slot *slot = find_slot(id, (unsigned int)id_length);
+  if (slot->id_length == (unsigned int)id_length &&
+      memcmp(slot->id, id, (size_t)id_length) == 0 &&
+      slot->expires > time(NULL)) {
+    data_length = slot->data_length;
+    memcpy(data, slot->data, data_length);
+  }
+  shared_unlock();
+
+  if (data_length == 0) {
+    return NULL;
+  }
+
+  const unsigned char *data_start = data;
+  return d2i_SSL_SESSION(NULL, &data_start, (long)data_length);
+}
+
+/**
+ * remove_session_callback - Forget a session OpenSSL no longer wants resumed
+ * @ctx: SSL context the session belongs to
+ * @session: Session to forget
+ *
+ * OpenSSL calls this when a session has expired or its connection failed.
+ */
+static void remove_session_callback(SSL_CTX *ctx, SSL_SESSION *session) {
+  (void)ctx;
+
+  unsigned int id_length;
+  const unsigned char *id = SSL_SESSION_get_id(session, &id_length);
+
+  shared_lock();
+  struct session_slot *slot = find_slot(id, id_length);
+  if (slot->id_length == id_length && memcmp(slot->id, id, id_length) == 0) {
+    slot->id_length = 0;
+  }
+  shared_unlock();
+}
+
+/**
+ * init_shared_lock - Set up the mutex in shared memory
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int init_shared_lock(void) {
+  pthread_mutexattr_t attr;
+  if (pthread_mutexattr_init(&attr) != 0) {
+    return -1;
+  }
+
+  int result = -1;
+  if (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+      pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0 &&
+      pthread_mutex_init(&shared->lock, &attr) == 0) {
+    result = 0;
+  }
+
+  pthread_mutexattr_destroy(&attr);
+  return result;
+}
+
+/**
+ * session_init - Set up session resumption shared between workers
+ * @ctx: SSL context the workers will use
+ *
+ * The shared memory is an anonymous MAP_SHARED mapping, which forked children
+ * share with the parent without needing a name in the filesystem.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int session_init(SSL_CTX *ctx) {
+  struct server_config *config = config_get_ctx();
+  size_t num_slots = (size_t)config->session_cache;
+
+  shared_size =
+      sizeof(struct session_shared) + num_slots * sizeof(struct session_slot);
+  shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    char mmap_fail_msg[LOG_MSG_MAX];
+    snprintf(mmap_fail_msg, LOG_MSG_MAX,
+             "Failed to map shared session cache: %s", strerror(errno));
+    log_event(ERROR, mmap_fail_msg);
+    shared = NULL;
+    return -1;
+  }
+  shared->num_slots = num_slots;
+
+  if (init_shared_lock() == -1) {
+    log_event(ERROR, "Failed to initialize session cache lock.");
+    session_cleanup();
+    return -1;
+  }
+
+  /*
+   * The ID context is mixed into every session, so sessions from some other
+   * program sharing our certificate can't be resumed here.
+   */
+  static const unsigned char id_context[] = "cyllenian";
+  SSL_CTX_set_session_id_context(ctx, id_context, sizeof(id_context) - 1);
+
+  /*
+   * This sets both how long a cached session lasts and the lifetime we tell
+   * clients their tickets have.
+   */
+  SSL_CTX_set_timeout(ctx, config->session_timeout);
+
+  if (num_slots > 0) {
+    /*
+     * NO_INTERNAL turns off OpenSSL's own per-process cache, which would only
+     * duplicate ours.
+     */
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER |
+                                            SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(ctx, new_session_callback);
+    SSL_CTX_sess_set_get_cb(ctx, get_session_callback);
+    SSL_CTX_sess_set_remove_cb(ctx, remove_session_callback);
+  } else {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+  }
+
+  if (!config->session_tickets) {
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    return 0;
+  }
+
+  if (make_ticket_key(&shared->ticket_keys[0]) == -1 ||
+      make_ticket_key(&shared->ticket_keys[1]) == -1) {
+    session_cleanup();
+    return -1;
+  }
+
+  if (!SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_callback)) {
+    log_event(ERROR, "Failed to set session ticket key callback.");
+    session_cleanup();
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * session_cleanup - Unmap the shared session cache
+ */
+void session_cleanup(void) {
+  if (shared) {
+    munmap(shared, shared_size);
+    shared = NULL;
+  }
+}
@@ -4,33 +4,133 @@
  * Signal handling for graceful server shutdown.
  *
  * OVERVIEW:
- * This file sets up a signal handler for SIGINT (Ctrl+C) to allow clean
- * shutdown of the server.
+ * This file sets up a signal handler for SIGINT (Ctrl+C) and SIGTERM to allow
+ * clean shutdown of the server, and handlers that only make a note of the
+ * signal for the main loops to act on:
+ *
+ * - SIGHUP reloads the configuration, certificate and error pages in place
+ * - SIGQUIT shuts down gracefully, letting every open request finish first
+ * - SIGUSR2 starts a new copy of the server on the same listening sockets,
+ *   after which the old one can be drained with SIGQUIT
  */
 
 #include <signal.h>
+#include <stdbool.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "log.h"
 #include "server.h"
 #include "signals.h"
+#include "worker.h"
+
+/*
+ * Set by the SIGHUP handler and cleared by sig_reload_pending(). Reloading
+ * allocates memory and reads files, none of which is safe in a signal handler,
+ * so the handler only makes a note for the main loop to act on.
+ */
+static volatile sig_atomic_t reload_pending = 0;
+
+/*
+ * Set by the SIGQUIT and SIGUSR2 handlers, for the same reason.
+ */
+static volatile sig_atomic_t quit_pending = 0;
+static volatile sig_atomic_t upgrade_pending = 0;
+
+static void reload_handler(int signal_num) {
+  (void)signal_num;
+  reload_pending = 1;
+}
+
+static void quit_handler(int signal_num) {
+  (void)signal_num;
+  quit_pending = 1;
+}
+
+static void upgrade_handler(int signal_num) {
+  (void)signal_num;
+  upgrade_pending = 1;
+}
+
+/**
+ * sig_reload_pending - Check whether SIGHUP has been received
+ *
+ * Return: true once for each time SIGHUP has been received since the last
+ * call (signals that arrive together count once)
+ */
+bool sig_reload_pending(void) {
+  if (!reload_pending) {
+    return false;
+  }
+  reload_pending = 0;
+  return true;
+}
+
+/**
+ * sig_quit_pending - Check whether SIGQUIT has been received
+ *
+ * Return: true once after SIGQUIT has been received
+ */
+bool sig_quit_pending(void) {
+  if (!quit_pending) {
+    return false;
+  }
+  quit_pending = 0;
+  return true;
+}
+
+/**
+ * sig_upgrade_pending - Check whether SIGUSR2 has been received
+ *
+ * Return: true once for each time SIGUSR2 has been received since the last
+ * call
+ */
+bool sig_upgrade_pending(void) {
+  if (!upgrade_pending) {
+    return false;
+  }
+  upgrade_pending = 0;
+  return true;
+}
 
 static void handler(int signal_num) {
   /*
    * sigaction requires the signal_num parameter for handler functions, but we
-   * don't actually need to use it here since we only handle SIGINT. Casting to
-   * void prevents the compiler from whining.
+   * don't actually need to use it here since SIGINT and SIGTERM are handled
+   * the same way. Casting to void prevents the compiler from whining.
    */
   (void)signal_num;
 
+  /*
+   * Workers receive SIGINT too when Ctrl+C is pressed in the terminal, since
+   * they're in the same process group, and the parent sends them SIGTERM when
+   * it shuts down. Apart from the log lines they haven't written yet, they
+   * don't own anything that needs cleaning up beyond what the OS reclaims on
+   * exit, so they just leave quietly and let the parent do the talking.
+   */
+  if (is_worker_process()) {
+    log_flush();
+    worker_exit(EXIT_SUCCESS);
+  }
+
   /*
    * We use the write syscall instead of printf as the latter is not
    * async-signal-safe for a few reasons (uses internal buffering, may allocate
    * memory when large strings are passed to it). strlen is also not
-   * async-siginal-safe, so we hardcode the length of the string.
+   * async-siginal-safe, so we take the length from sizeof instead, less one
+   * for the terminating null byte, which isn't ours to print. If the write
+   * fails there's nobody to tell, so we carry on shutting down regardless.
    */
-  write(STDOUT_FILENO, "\nInterrupt given, closing socket..\n", 36);
+  static const char interrupt_msg[] = "\nInterrupt given, closing socket..\n";
+  if (write(STDOUT_FILENO, interrupt_msg, sizeof(interrupt_msg) - 1) == -1) {
+    /* Nothing to be done. */
+  }
+
+  /*
+   * Tell the workers to exit as well, in case SIGINT was only sent to the
+   * parent (e.g., with kill).
+   */
+  workers_stop();
 
   config_cleanup();
 
@@ -40,7 +140,8 @@ static void handler(int signal_num) {
 }
 
 /**
- * sig_handler_init - Initialize signal handling for SIGINT
+ * sig_handler_init - Initialize signal handling for SIGINT, SIGTERM, SIGHUP,
+ * SIGQUIT and SIGUSR2, and ignore SIGPIPE
  *
  * Registers a custom handler for SIGINT (Ctrl+C). After this, when the
  * user presses Ctrl+C, our handler() function runs instead of the default
@@ -66,7 +167,41 @@ int sig_handler_init(void) {
   /*
    * sigaction is what we use to actually register the signal handler.
    */
-  if (sigaction(SIGINT, &sa, NULL) == -1) {
+  if (sigaction(SIGINT, &sa, NULL) == -1 ||
+      sigaction(SIGTERM, &sa, NULL) == -1) {
+    log_event(FATAL, "Failed to configure signal handling");
+    return -1;
+  }
+
+  /*
+   * Without SA_RESTART, these interrupt epoll_wait() and waitpid() with
+   * EINTR, so the main loops get to act on them straight away.
+   */
+  sa.sa_handler = reload_handler;
+  if (sigaction(SIGHUP, &sa, NULL) == -1) {
+    log_event(FATAL, "Failed to configure signal handling");
+    return -1;
+  }
+
+  sa.sa_handler = quit_handler;
+  if (sigaction(SIGQUIT, &sa, NULL) == -1) {
+    log_event(FATAL, "Failed to configure signal handling");
+    return -1;
+  }
+
+  sa.sa_handler = upgrade_handler;
+  if (sigaction(SIGUSR2, &sa, NULL) == -1) {
+    log_event(FATAL, "Failed to configure signal handling");
+    return -1;
+  }
+
+  /*
+   * Writing to a client that has gone away raises SIGPIPE, which would kill
+   * the worker along with every other connection it has open. Ignored, the
+   * write just fails with EPIPE and we close that one connection.
+   */
+  sa.sa_handler = SIG_IGN;
+  if (sigaction(SIGPIPE, &sa, NULL) == -1) {
     log_event(FATAL, "Failed to configure signal handling");
     return -1;
   }
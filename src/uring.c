@@ -0,0 +1,315 @@
+/**
+ * uring.c
+ *
+ * Minimal io_uring submission and completion rings.
+ *
+ * OVERVIEW:
+ * io_uring is a pair of queues in memory shared with the kernel. We describe
+ * operations (accept, poll, read, ...) in the submission queue, and the
+ * kernel tells us how each one went in the completion queue. Any number of
+ * operations can be submitted, and any number of completions collected, with
+ * a single io_uring_enter() call, which is where the saving over making one
+ * system call per operation comes from.
+ *
+ * Some operations are "multishot": submitted once, they go on completing
+ * (e.g., once for every connection accepted) until they fail or are
+ * cancelled. Each completion of a multishot operation has IORING_CQE_F_MORE
+ * set, except the last.
+ *
+ * We only need a handful of operations, so rather than depend on liburing we
+ * make the three system calls ourselves. glibc has no wrappers for them, so
+ * they're made with syscall().
+ *
+ * MEMORY ORDERING:
+ * Each side only ever writes its own end of a queue: we write the submission
+ * queue's tail and the completion queue's head, and the kernel the other two.
+ * Reading the other side's end with acquire ordering, and writing ours with
+ * release ordering, makes sure we never see an index move before the entry
+ * it covers has been written, and the kernel never sees one before we've
+ * filled the entry in.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "uring.h"
+
+/**
+ * Flags to try setting the ring up with, best first. Kernels reject flags
+ * they don't know, so we work down the list until one is accepted.
+ *
+ * SINGLE_ISSUER and DEFER_TASKRUN tell the kernel only this process uses the
+ * ring, and to only do the work of completing operations when we ask for
+ * completions, instead of interrupting us to do it as soon as they're ready.
+ * COOP_TASKRUN is the older, weaker form of the latter. SUBMIT_ALL carries on
+ * submitting the rest of a batch when one entry in it is invalid.
+ */
+static const unsigned setup_flags[] = {
+    IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+    IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+    IORING_SETUP_CQSIZE};
+
+/**
+ * Features the kernel must have for us to use the ring: the queues in one
+ * mapping, completions never dropped when the completion queue is full, and a
+ * timeout on waiting for completions.
+ */
+#define URING_REQUIRED_FEATURES                                                \
+  (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)
+
+/**
+ * uring_enter - Submit entries and optionally wait for completions
+ * @ring: Ring to enter
+ * @to_submit: Number of entries to submit
+ * @min_complete: Number of completions to wait for
+ * @flags: io_uring_enter() flags on top of the ring's own
+ * @arg: Extra argument, or NULL
+ * @arg_size: Size of arg
+ *
+ * Return: Number of entries submitted, or -1 on failure with errno set
+ */
+static int uring_enter(struct uring *ring, unsigned to_submit,
+                       unsigned min_complete, unsigned flags, const void *arg,
+                       size_t arg_size) {
+  return (int)syscall(__NR_io_uring_enter, ring->enter_fd, to_submit,
+                      min_complete, flags | ring->enter_flags, arg, arg_size);
+}
+
+/**
+ * publish_entries - Make the entries we've filled in visible to the kernel
+ * @ring: Ring whose entries to publish
+ *
+ * Return: Number of entries the kernel hasn't consumed yet
+ */
+static unsigned publish_entries(struct uring *ring) {
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  return ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * register_ring - Register the ring's descriptor with itself
+ * @ring: Ring to register
+ *
+ * Every io_uring_enter() has to look the ring's file descriptor up, and take
+ * and drop a reference to it. Registering the descriptor lets the kernel skip
+ * that. It's only an optimization (and needs Linux 5.18), so failing is fine.
+ */
+static void register_ring(struct uring *ring) {
+  struct io_uring_rsrc_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = -1U;
+  update.data = (__u64)ring->fd;
+
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_RING_FDS,
+              &update, 1) == 1) {
+    ring->enter_fd = (int)update.offset;
+    ring->enter_flags = IORING_ENTER_REGISTERED_RING;
+  }
+}
+
+/**
+ * uring_init - Set up an io_uring instance
+ * @ring: Ring to set up
+ * @entries: Number of submission queue entries, rounded up by the kernel to a
+ *           power of two
+ *
+ * The completion queue is made four times the size of the submission queue,
+ * since each multishot operation can complete many times for one submission.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int uring_init(struct uring *ring, unsigned entries) {
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+
+  struct io_uring_params params;
+  for (size_t i = 0; i < sizeof(setup_flags) / sizeof(setup_flags[0]); i++) {
+    memset(&params, 0, sizeof(params));
+    params.flags = setup_flags[i];
+    params.cq_entries = entries * 4;
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd != -1 || errno != EINVAL) {
+      break;
+    }
+  }
+
+  if (ring->fd == -1) {
+    char setup_fail_msg[LOG_MSG_MAX];
+    snprintf(setup_fail_msg, LOG_MSG_MAX, "Failed to set up io_uring: %s",
+             strerror(errno));
+    log_event(WARN, setup_fail_msg);
+    return -1;
+  }
+  ring->enter_fd = ring->fd;
+
+  if ((params.features & URING_REQUIRED_FEATURES) != URING_REQUIRED_FEATURES) {
+    log_event(WARN, "This kernel's io_uring is too old to use.");
+    uring_free(ring);
+    return -1;
+  }
+
+  /*
+   * With IORING_FEAT_SINGLE_MMAP, both queues' indexes and the completion
+   * queue entries live in one mapping, which has to be big enough for
+   * whichever queue reaches further into it. The submission queue entries
+   * have a mapping of their own.
+   */
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->ring == MAP_FAILED) {
+    ring->ring = NULL;
+    log_event(WARN, "Failed to map io_uring queues.");
+    uring_free(ring);
+    return -1;
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    log_event(WARN, "Failed to map io_uring submission entries.");
+    uring_free(ring);
+    return -1;
+  }
+
+  char *base = ring->ring;
+  ring->sq_head = (unsigned *)(base + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(base + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(base + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_array = (unsigned *)(base + params.sq_off.array);
+  ring->sqe_tail = *ring->sq_tail;
+
+  ring->cq_head = (unsigned *)(base + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(base + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(base + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+  /*
+   * The array lets entries be submitted in a different order to the one
+   * they're laid out in. We always fill them in order, so each slot just
+   * points at the entry of the same index.
+   */
+  for (unsigned i = 0; i < ring->sq_entries; i++) {
+    ring->sq_array[i] = i;
+  }
+
+  register_ring(ring);
+  return 0;
+}
+
+/**
+ * uring_free - Tear down an io_uring instance
+ * @ring: Ring to tear down
+ *
+ * Closing the ring cancels every operation still in flight.
+ */
+void uring_free(struct uring *ring) {
+  if (ring->sqes) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->ring) {
+    munmap(ring->ring, ring->ring_size);
+  }
+  if (ring->fd != -1) {
+    close(ring->fd);
+  }
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+/**
+ * uring_get_sqe - Get a submission queue entry to fill in
+ * @ring: Ring to get the entry from
+ *
+ * Return: Zeroed entry, or NULL if the queue is full and submitting what's in
+ * it failed
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sqe_tail - head >= ring->sq_entries) {
+    unsigned to_submit = publish_entries(ring);
+    if (uring_enter(ring, to_submit, 0, 0, NULL, 0) == -1) {
+      return NULL;
+    }
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+      return NULL;
+    }
+  }
+
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+  ring->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+/**
+ * uring_wait - Submit queued entries and wait for completions
+ * @ring: Ring to wait on
+ * @timeout_ms: Longest to wait in milliseconds, or -1 to wait indefinitely
+ *
+ * Return: 0 on success or timeout, -1 on failure with errno set
+ */
+int uring_wait(struct uring *ring, int timeout_ms) {
+  unsigned to_submit = publish_entries(ring);
+
+  struct __kernel_timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (timeout_ms >= 0) {
+    arg.ts = (__u64)(uintptr_t)&timeout;
+  }
+
+  if (uring_enter(ring, to_submit, 1,
+                  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                  sizeof(arg)) == -1) {
+    /*
+     * ETIME is the timeout running out. EBUSY means completions overflowed
+     * the completion queue and have to be consumed before more can be
+     * posted, which is what our caller is about to do anyway.
+     */
+    if (errno == ETIME || errno == EBUSY) {
+      return 0;
+    }
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * uring_peek - Get the oldest unconsumed completion
+ * @ring: Ring to look in
+ *
+ * Return: The completion, or NULL if there are none
+ */
+struct io_uring_cqe *uring_peek(struct uring *ring) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+/**
+ * uring_advance - Consume the oldest completion
+ * @ring: Ring to consume it from
+ */
+void uring_advance(struct uring *ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
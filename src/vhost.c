@@ -0,0 +1,289 @@
+/**
+ * vhost.c
+ *
+ * Websites served for server names other than the default one.
+ *
+ * OVERVIEW:
+ * Each vhost directive names a website, says which directory it's served
+ * from, and optionally gives it a certificate of its own. One server can
+ * then serve any number of websites from the same workers, rather than
+ * needing a process (and a set of workers, and a file cache) per website.
+ * Requests for names that aren't a vhost's, or that don't name the server at
+ * all, get the default website and certificate as before.
+ *
+ * CHOOSING A CERTIFICATE:
+ * The client sends the name it's connecting to in its ClientHello (Server
+ * Name Indication), before we have to pick a certificate. OpenSSL calls
+ * vhost_client_hello_callback() as soon as the ClientHello has arrived, and
+ * if the name is a vhost's with a certificate of its own, the handshake is
+ * switched over to the SSL context holding it. Everything else about the
+ * handshake (protocols, ciphers, the session cache and ticket keys) still
+ * comes from the default context the connection was created with.
+ *
+ * Each vhost's context has its own session ID context, so a session made
+ * for one name can't be resumed for another with a different certificate.
+ * That's why we switch in the ClientHello callback rather than the
+ * servername callback: for TLS 1.2, OpenSSL has already picked the session
+ * to resume by the time it calls the servername callback.
+ *
+ * CHOOSING A WEBSITE:
+ * Which website a request is for is decided by its Host header, the same
+ * way a client without SNI or a proxy in front of us would expect. Only
+ * requests without one (HTTP/1.0) fall back to the name from the handshake.
+ *
+ * Names are looked up in a hash table, so the lookup costs the same however
+ * many vhosts there are. Files from each vhost's directory are cached under
+ * their own full paths, so the content and open file caches keep every
+ * website's files apart without needing a cache each.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "config.h"
+#include "file.h"
+#include "log.h"
+#include "paths.h"
+#include "vhost.h"
+
+/**
+ * Fewest hash table buckets. There are at least twice as many buckets as
+ * vhosts, and always a power of two.
+ */
+#define VHOST_MIN_BUCKETS 16
+
+/*
+ * Every vhost, in the order they were given, and the hash table of them.
+ */
+static struct vhost *vhosts = NULL;
+static int num_vhosts = 0;
+static struct vhost **buckets = NULL;
+static size_t num_buckets = 0;
+
+/**
+ * hash_name - Hash a server name, ignoring case
+ * @name: Name to hash
+ * @length: Length of name
+ *
+ * FNV-1a, the same hash the caches use, over the name in lowercase.
+ *
+ * Return: 32-bit hash
+ */
+static uint32_t hash_name(const char *name, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)tolower((unsigned char)name[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * vhost_init - Build the table of vhosts
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int vhost_init(void) {
+  struct server_config *config = config_get_ctx();
+  if (config->num_vhosts == 0) {
+    return 0;
+  }
+
+  num_buckets = VHOST_MIN_BUCKETS;
+  while (num_buckets < (size_t)config->num_vhosts * 2) {
+    num_buckets *= 2;
+  }
+
+  vhosts = calloc((size_t)config->num_vhosts, sizeof(*vhosts));
+  buckets = calloc(num_buckets, sizeof(*buckets));
+  if (!vhosts || !buckets) {
+    log_event(ERROR, "Failed to allocate memory for vhosts.");
+    vhost_cleanup();
+    return -1;
+  }
+
+  for (int i = 0; i < config->num_vhosts; i++) {
+    const struct vhost_config *vhost_config = &config->vhosts[i];
+
+    /*
+     * As with the default website, there's no point starting if we can't
+     * serve anything from it.
+     */
+    if (!file_exists(vhost_config->root)) {
+      char missing_msg[LOG_MSG_MAX];
+      snprintf(missing_msg, LOG_MSG_MAX,
+               "Website directory for vhost %s not found.", vhost_config->name);
+      log_event(FATAL, missing_msg);
+      vhost_cleanup();
+      return -1;
+    }
+
+    struct vhost *vhost = &vhosts[num_vhosts++];
+    vhost->name = vhost_config->name;
+    vhost->name_length = strlen(vhost->name);
+    vhost->root = vhost_config->root;
+    vhost->root_length = strlen(vhost->root);
+    vhost->cert_path = vhost_config->cert_path;
+    vhost->key_path = vhost_config->key_path;
+    vhost->hash = hash_name(vhost->name, vhost->name_length);
+
+    size_t bucket = vhost->hash & (num_buckets - 1);
+    vhost->next = buckets[bucket];
+    buckets[bucket] = vhost;
+  }
+
+  char loaded_msg[LOG_MSG_MAX];
+  snprintf(loaded_msg, LOG_MSG_MAX, "Serving %d vhost%s.", num_vhosts,
+           num_vhosts == 1 ? "" : "s");
+  log_event(INFO, loaded_msg);
+  return 0;
+}
+
+/**
+ * vhost_cleanup - Free the table of vhosts
+ */
+void vhost_cleanup(void) {
+  for (int i = 0; i < num_vhosts; i++) {
+    SSL_CTX_free(vhosts[i].ssl_ctx);
+  }
+  free(vhosts);
+  vhosts = NULL;
+  num_vhosts = 0;
+  free(buckets);
+  buckets = NULL;
+  num_buckets = 0;
+}
+
+/**
+ * vhost_count - Get the number of vhosts
+ *
+ * Return: Number of vhosts
+ */
+int vhost_count(void) { return num_vhosts; }
+
+/**
+ * vhost_get - Get a vhost by its position in the configuration
+ * @index: Position of the vhost
+ *
+ * Return: Pointer to the vhost
+ */
+struct vhost *vhost_get(int index) { return &vhosts[index]; }
+
+/**
+ * vhost_find - Look up the vhost for a server name
+ * @name: Name the client asked for
+ * @length: Length of name
+ *
+ * Return: Pointer to the vhost, or NULL if there isn't one for the name
+ */
+const struct vhost *vhost_find(const char *name, size_t length) {
+  if (num_vhosts == 0 || !name) {
+    return NULL;
+  }
+
+  /*
+   * "example.com." is the fully qualified form of "example.com", and means
+   * the same website.
+   */
+  if (length > 1 && name[length - 1] == '.') {
+    length--;
+  }
+
+  uint32_t hash = hash_name(name, length);
+  for (const struct vhost *vhost = buckets[hash & (num_buckets - 1)]; vhost;
+       vhost = vhost->next) {
+    if (vhost->hash == hash && vhost->name_length == length &&
+        strncasecmp(vhost->name, name, length) == 0) {
+      return vhost;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * vhost_website_path - Get the website directory a request is for
+ * @request: Parsed request from client
+ * @ssl: The request's connection
+ *
+ * Return: Path of the website directory, or NULL on error
+ */
+const char *vhost_website_path(const struct http_request *request, SSL *ssl) {
+  if (num_vhosts == 0) {
+    return get_website_path();
+  }
+
+  const struct vhost *vhost;
+  size_t host_length;
+  const char *host = request_get_host(request, &host_length);
+  if (host) {
+    vhost = vhost_find(host, host_length);
+  } else {
+    const char *server_name =
+        SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    vhost = server_name ? vhost_find(server_name, strlen(server_name)) : NULL;
+  }
+
+  return vhost ? vhost->root : get_website_path();
+}
+
+/**
+ * get_client_hello_name - Find the server name in a ClientHello
+ * @ssl: Connection whose ClientHello has arrived
+ * @length: Output parameter for the length of the name
+ *
+ * The server_name extension is a list of names, each with its type and
+ * length, of which only one host name is allowed (RFC 6066).
+ *
+ * Return: Pointer to the name within the ClientHello, not null terminated,
+ * or NULL if the client didn't send one
+ */
+static const char *get_client_hello_name(SSL *ssl, size_t *length) {
+  const unsigned char *ext;
+  size_t ext_length;
+  if (!SSL_client_hello_get0_ext(ssl, TLSEXT_TYPE_server_name, &ext,
+                                 &ext_length) ||
+      ext_length < 2) {
+    return NULL;
+  }
+
+  size_t list_length = (size_t)ext[0] << 8 | ext[1];
+  if (list_length != ext_length - 2 || list_length < 3 ||
+      ext[2] != TLSEXT_NAMETYPE_host_name) {
+    return NULL;
+  }
+
+  size_t name_length = (size_t)ext[3] << 8 | ext[4];
+  if (name_length == 0 || name_length > list_length - 3) {
+    return NULL;
+  }
+  *length = name_length;
+  return (const char *)ext + 5;
+}
+
+/**
+ * vhost_client_hello_callback - Switch to the certificate for the client's SNI
+ * @ssl: Connection whose ClientHello has arrived
+ * @alert: Alert to send if we refused the ClientHello, unused
+ * @arg: Argument given with the callback, unused
+ *
+ * Return: SSL_CLIENT_HELLO_SUCCESS
+ */
+int vhost_client_hello_callback(SSL *ssl, int *alert, void *arg) {
+  (void)alert;
+  (void)arg;
+
+  size_t length;
+  const char *name = get_client_hello_name(ssl, &length);
+  if (!name) {
+    return SSL_CLIENT_HELLO_SUCCESS;
+  }
+
+  const struct vhost *vhost = vhost_find(name, length);
+  if (vhost && vhost->ssl_ctx && !SSL_set_SSL_CTX(ssl, vhost->ssl_ctx)) {
+    log_event(ERROR, "Failed to switch to vhost certificate.");
+  }
+  return SSL_CLIENT_HELLO_SUCCESS;
+}
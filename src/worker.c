@@ -0,0 +1,329 @@
+/**
+ * worker.c
+ *
+ * Pre-forked worker pool.
+ *
+ * OVERVIEW:
+ * Rather than forking a new process for every connection, we fork a fixed
+ * number of workers once at startup. Each worker inherits the listening
+ * socket and accepts connections from it, so the kernel hands each new
+ * connection to one of the workers. This means we pay the cost of
+ * fork() (copying page tables, tearing the process down again) once per
+ * worker instead of once per request.
+ *
+ * The parent process doesn't handle any connections itself. It just waits
+ * for workers to exit and replaces them, so a crash in one worker only costs
+ * us the connections that worker was handling at the time.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "limit.h"
+#include "log.h"
+#include "signals.h"
+#include "worker.h"
+
+/*
+ * PIDs of the running workers, indexed by worker slot. A slot holds 0 when no
+ * worker is running in it.
+ */
+static pid_t worker_pids[MAX_WORKERS];
+
+static int worker_count = 0;
+
+/*
+ * Set once we've been asked to shut down, so that the supervisor loop doesn't
+ * replace workers as they exit. sig_atomic_t guarantees that reads and writes
+ * of this variable can't be interrupted halfway through by a signal.
+ */
+static volatile sig_atomic_t stopping = 0;
+
+/*
+ * Set once we've been asked to shut down gracefully. The workers are left to
+ * finish their connections, and aren't replaced as they exit.
+ */
+static bool draining = false;
+
+static bool in_worker = false;
+
+/**
+ * default_worker_count - Get the default number of workers
+ *
+ * sysconf(_SC_NPROCESSORS_ONLN) gives the number of CPUs that are currently
+ * online, which can be lower than the number installed.
+ *
+ * Return: Number of online CPUs, or 1 if it can't be determined
+ */
+int default_worker_count(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1) {
+    return 1;
+  }
+
+  if (cpus > MAX_WORKERS) {
+    return MAX_WORKERS;
+  }
+
+  return (int)cpus;
+}
+
+/**
+ * is_worker_process - Check whether we are running inside a worker
+ *
+ * Return: true in a worker, false in the parent
+ */
+bool is_worker_process(void) { return in_worker; }
+
+#ifdef PROFILING
+/*
+ * Provided by libgcov in builds with -fprofile-generate. It's weak so that
+ * the -fprofile-use build, which has no libgcov, compiles the same code and
+ * its control flow still matches the profile; there it's just NULL.
+ */
+void __gcov_dump(void) __attribute__((weak));
+#endif
+
+/**
+ * worker_exit - Exit a worker without cleaning up after it
+ * @status: Exit status
+ *
+ * __gcov_dump() isn't async-signal-safe, but profiling builds are only run
+ * to gather a profile, and never serve anyone for real.
+ */
+void worker_exit(int status) {
+#ifdef PROFILING
+  if (__gcov_dump) {
+    __gcov_dump();
+  }
+#endif
+  _exit(status);
+}
+
+/**
+ * spawn_worker - Fork a worker into the given slot
+ * @slot: Index into worker_pids to store the new worker's PID in
+ * @worker_main: Function the worker runs
+ *
+ * Return: 0 on success (in the parent), -1 if fork() failed. The child never
+ * returns from this function.
+ */
+static int spawn_worker(int slot, void (*worker_main)(int slot)) {
+  pid_t pid = fork();
+  if (pid == -1) {
+    char fork_fail_msg[LOG_MSG_MAX];
+    snprintf(fork_fail_msg, LOG_MSG_MAX, "Failed to fork worker: %s",
+             strerror(errno));
+    log_event(ERROR, fork_fail_msg);
+    return -1;
+  }
+
+  /*CHILD PROCESS*/
+  if (pid == 0) {
+    /*
+     * The child gets a copy of worker_pids, but it has no business signalling
+     * its siblings, so we forget about them here. This also makes
+     * workers_stop() a no-op inside workers.
+     */
+    memset(worker_pids, 0, sizeof(worker_pids));
+    worker_count = 0;
+    in_worker = true;
+
+    worker_main(slot);
+
+    /*
+     * worker_main() only returns on an unrecoverable error, the parent will
+     * start a replacement.
+     */
+    exit(EXIT_FAILURE);
+  }
+
+  worker_pids[slot] = pid;
+  return 0;
+}
+
+/**
+ * find_worker_slot - Find which slot a worker PID belongs to
+ * @pid: PID returned by waitpid()
+ *
+ * Return: Slot index, or -1 if the PID isn't one of our workers
+ */
+static int find_worker_slot(pid_t pid) {
+  for (int i = 0; i < worker_count; i++) {
+    if (worker_pids[i] == pid) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * signal_workers - Send a signal to every running worker
+ * @signal_num: Signal to send
+ *
+ * kill() is async-signal-safe, so this can be called from a signal handler.
+ */
+static void signal_workers(int signal_num) {
+  for (int i = 0; i < worker_count; i++) {
+    if (worker_pids[i] > 0) {
+      kill(worker_pids[i], signal_num);
+    }
+  }
+}
+
+/**
+ * num_running_workers - Count the workers that haven't exited yet
+ *
+ * Return: Number of occupied slots
+ */
+static int num_running_workers(void) {
+  int running = 0;
+  for (int i = 0; i < worker_count; i++) {
+    if (worker_pids[i] > 0) {
+      running++;
+    }
+  }
+  return running;
+}
+
+/**
+ * handle_signals - Act on the signals the supervisor loop was woken for
+ * @reload: Function the parent runs on SIGHUP
+ * @upgrade: Function the parent runs on SIGUSR2
+ */
+static void handle_signals(void (*reload)(void), void (*upgrade)(void)) {
+  if (stopping) {
+    return;
+  }
+
+  if (sig_reload_pending() && !draining) {
+    reload();
+    signal_workers(SIGHUP);
+  }
+
+  if (sig_upgrade_pending() && !draining) {
+    upgrade();
+  }
+
+  if (sig_quit_pending() && !draining) {
+    log_event(INFO, "Draining connections before shutting down.");
+    draining = true;
+    signal_workers(SIGQUIT);
+  }
+}
+
+/**
+ * workers_run - Start the worker pool and supervise it
+ * @num_workers: Number of worker processes to keep running
+ * @worker_main: Function each worker runs
+ * @reload: Function the parent runs on SIGHUP
+ * @upgrade: Function the parent runs on SIGUSR2
+ *
+ * Return: 0 on clean shutdown, -1 on error
+ */
+int workers_run(int num_workers, void (*worker_main)(int slot),
+                void (*reload)(void), void (*upgrade)(void)) {
+  if (num_workers < 1 || num_workers > MAX_WORKERS) {
+    log_event(ERROR, "Invalid number of workers.");
+    return -1;
+  }
+
+  worker_count = num_workers;
+
+  for (int i = 0; i < worker_count; i++) {
+    if (spawn_worker(i, worker_main) == -1) {
+      workers_stop();
+      return -1;
+    }
+  }
+
+  char started_msg[LOG_MSG_MAX];
+  snprintf(started_msg, LOG_MSG_MAX, "Started %d worker processes.",
+           worker_count);
+  log_event(INFO, started_msg);
+
+  /*
+   * waitpid() blocks until any child exits and reaps it, so finished workers
+   * never linger as zombies. It returns -1 with errno set to EINTR when a
+   * signal interrupts the wait, in which case we check what we've been asked
+   * to do and go back to waiting.
+   *
+   * Copies of the server started on SIGUSR2 are our children too, so not
+   * every PID we reap is one of our workers.
+   */
+  while (!stopping) {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid == -1) {
+      if (errno == EINTR) {
+        handle_signals(reload, upgrade);
+        continue;
+      }
+      log_event(ERROR, "Failed to wait for workers.");
+      return -1;
+    }
+
+    int slot = find_worker_slot(pid);
+    if (slot == -1) {
+      continue;
+    }
+    worker_pids[slot] = 0;
+
+    /*
+     * A worker that died without closing its connections leaves them
+     * counted against their clients.
+     */
+    limit_reclaim(slot);
+
+    if (stopping) {
+      break;
+    }
+
+    if (draining) {
+      if (num_running_workers() == 0) {
+        log_event(INFO, "All connections drained, shutting down.");
+        break;
+      }
+      continue;
+    }
+
+    char exit_msg[LOG_MSG_MAX];
+    if (WIFSIGNALED(status)) {
+      snprintf(exit_msg, LOG_MSG_MAX,
+               "Worker %d was killed by signal %d, restarting it.", (int)pid,
+               WTERMSIG(status));
+    } else {
+      snprintf(exit_msg, LOG_MSG_MAX,
+               "Worker %d exited with status %d, restarting it.", (int)pid,
+               WEXITSTATUS(status));
+    }
+    log_event(WARN, exit_msg);
+
+    /*
+     * Wait a moment before replacing the worker. If something is making
+     * workers die as soon as they start, this keeps us from forking in a
+     * tight loop.
+     */
+    sleep(1);
+
+    if (spawn_worker(slot, worker_main) == -1) {
+      workers_stop();
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * workers_stop - Signal all workers to exit
+ */
+void workers_stop(void) {
+  stopping = 1;
+  signal_workers(SIGTERM);
+}